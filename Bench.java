@@ -0,0 +1,304 @@
+import java.io.BufferedReader;
+import java.io.ByteArrayOutputStream;
+import java.io.File;
+import java.io.FileWriter;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.InputStreamReader;
+import java.io.OutputStream;
+import java.io.PrintWriter;
+import java.net.Socket;
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+import java.util.concurrent.locks.LockSupport;
+import java.util.regex.Matcher;
+import java.util.regex.Pattern;
+
+/**
+ * Benchmark for the agent.  Builds a heap of the shape given on the command line, times the heap
+ * commands through the shell's JSON protocol, then runs out of memory to time the dump.  Each
+ * measurement is appended to a CSV file.
+ *
+ * Shapes, which can be combined as separate arguments or separated by commas:
+ *
+ *   objects=N            N small objects
+ *   chains=COUNTxLENGTH  COUNT linked lists of LENGTH nodes
+ *   maps=COUNTxWIDTH     COUNT hash maps of WIDTH entries
+ *   arrays=COUNTxLENGTH  COUNT long arrays of LENGTH elements
+ *   classes=N            N distinct classes, each with one instance
+ *   threads=N            N parked threads
+ *
+ * Other arguments: out=FILE (default bench.csv), port=N (default 8787), and oom=false to skip the
+ * out of memory dump.
+ */
+public class Bench {
+  static final String NODE_SIGNATURE = "LBench$Node;";
+  static final String[] COMMANDS = { "histogram", "stats", "referrers", "threads" };
+  static final String HEADER = "shape,command,wall_ms,agent_ms,pause_ms,status";
+
+  static class Node {
+    Node next;
+    long payload;
+
+    Node(Node next, long payload) {
+      this.next = next;
+      this.payload = payload;
+    }
+  }
+
+  /** Loaded once per ClassLoader to make distinct classes. */
+  public static class Leaf {
+    public long payload;
+
+    public Leaf() {
+    }
+  }
+
+  static class LeafLoader extends ClassLoader {
+    LeafLoader() {
+      super(Bench.class.getClassLoader());
+    }
+
+    Class<?> define(byte[] bytes) {
+      return defineClass("Bench$Leaf", bytes, 0, bytes.length);
+    }
+  }
+
+  /** Sleeps a millisecond at a time and remembers the longest it was kept from running. */
+  static class Heartbeat extends Thread {
+    volatile long longestGap;
+
+    Heartbeat() {
+      super("bench-heartbeat");
+      setDaemon(true);
+    }
+
+    public void run() {
+      long last = System.nanoTime();
+      while (true) {
+        try {
+          Thread.sleep(1);
+        } catch (InterruptedException e) {
+          return;
+        }
+        long now = System.nanoTime();
+        if (now - last > longestGap) {
+          longestGap = now - last;
+        }
+        last = now;
+      }
+    }
+
+    long takeLongestGapMillis() {
+      long gap = longestGap;
+      longestGap = 0;
+      return gap / 1000000;
+    }
+  }
+
+  static final List<Object> retained = new ArrayList<Object>();
+
+  static void buildObjects(int count) {
+    Object[] objects = new Object[count];
+    for (int i = 0; i < count; i++) {
+      objects[i] = new Node(null, i);
+    }
+    retained.add(objects);
+  }
+
+  static void buildChains(int count, int length) {
+    for (int c = 0; c < count; c++) {
+      Node head = null;
+      for (int i = 0; i < length; i++) {
+        head = new Node(head, i);
+      }
+      retained.add(head);
+    }
+  }
+
+  static void buildMaps(int count, int width) {
+    for (int c = 0; c < count; c++) {
+      Map<Integer, Node> map = new HashMap<Integer, Node>();
+      for (int i = 0; i < width; i++) {
+        map.put(i, new Node(null, i));
+      }
+      retained.add(map);
+    }
+  }
+
+  static void buildArrays(int count, int length) {
+    for (int c = 0; c < count; c++) {
+      retained.add(new long[length]);
+    }
+  }
+
+  static void buildClasses(int count) throws Exception {
+    InputStream in = Bench.class.getResourceAsStream("Bench$Leaf.class");
+    ByteArrayOutputStream bytes = new ByteArrayOutputStream();
+    byte[] buffer = new byte[4096];
+    for (int n; (n = in.read(buffer)) > 0; ) {
+      bytes.write(buffer, 0, n);
+    }
+    in.close();
+
+    for (int i = 0; i < count; i++) {
+      Class<?> leaf = new LeafLoader().define(bytes.toByteArray());
+      retained.add(leaf.getConstructor().newInstance());
+    }
+  }
+
+  static void buildThreads(int count) {
+    for (int i = 0; i < count; i++) {
+      Thread thread = new Thread(null, new Runnable() {
+        public void run() {
+          while (true) {
+            LockSupport.park();
+          }
+        }
+      }, "bench-parked-" + i, 256 * 1024);
+      thread.setDaemon(true);
+      thread.start();
+    }
+  }
+
+  static int[] pair(String value) {
+    String[] parts = value.split("x");
+    return new int[] { Integer.parseInt(parts[0]), Integer.parseInt(parts[1]) };
+  }
+
+  /** Connects to the shell, which starts with the VM but may not be listening yet. */
+  static Socket connect(int port) throws Exception {
+    for (int attempt = 0; ; attempt++) {
+      try {
+        return new Socket("127.0.0.1", port);
+      } catch (IOException e) {
+        if (attempt == 50) {
+          throw e;
+        }
+        Thread.sleep(100);
+      }
+    }
+  }
+
+  static final Pattern END = Pattern.compile("\"type\":\"end\",\"status\":\"([a-z]+)\".*\"ms\":([0-9]+)");
+
+  /** Runs one command and returns its status and the time the agent reports for it. */
+  static String[] run(Socket socket, BufferedReader in, int id, String command, String args) throws IOException {
+    String request = "{\"id\": " + id + ", \"command\": \"" + command + "\""
+        + (args != null ? ", \"args\": \"" + args + "\"" : "") + "}\n";
+    OutputStream out = socket.getOutputStream();
+    out.write(request.getBytes("UTF-8"));
+    out.flush();
+
+    String prefix = "{\"id\":" + id + ",";
+    for (String line; (line = in.readLine()) != null; ) {
+      if (line.startsWith(prefix)) {
+        Matcher m = END.matcher(line);
+        if (m.find()) {
+          return new String[] { m.group(1), m.group(2) };
+        }
+      }
+    }
+    throw new IOException("The shell closed the connection.");
+  }
+
+  static void record(String path, List<String> rows) throws IOException {
+    boolean fresh = !new File(path).exists();
+    PrintWriter writer = new PrintWriter(new FileWriter(path, true));
+    if (fresh) {
+      writer.println(HEADER);
+    }
+    for (String row : rows) {
+      writer.println(row);
+      System.out.println(row);
+    }
+    writer.close();
+  }
+
+  public static void main(String[] args) throws Exception {
+    String path = "bench.csv";
+    int port = 8787;
+    boolean oom = true;
+    StringBuilder shape = new StringBuilder();
+
+    retained.add(new Node(null, 0));
+    List<String> settings = new ArrayList<String>();
+    for (String arg : args) {
+      for (String setting : arg.split(",")) {
+        settings.add(setting);
+      }
+    }
+    for (String arg : settings) {
+      String key = arg.substring(0, arg.indexOf('='));
+      String value = arg.substring(arg.indexOf('=') + 1);
+      if (key.equals("out")) {
+        path = value;
+        continue;
+      } else if (key.equals("port")) {
+        port = Integer.parseInt(value);
+        continue;
+      } else if (key.equals("oom")) {
+        oom = Boolean.parseBoolean(value);
+        continue;
+      } else if (key.equals("objects")) {
+        buildObjects(Integer.parseInt(value));
+      } else if (key.equals("chains")) {
+        buildChains(pair(value)[0], pair(value)[1]);
+      } else if (key.equals("maps")) {
+        buildMaps(pair(value)[0], pair(value)[1]);
+      } else if (key.equals("arrays")) {
+        buildArrays(pair(value)[0], pair(value)[1]);
+      } else if (key.equals("classes")) {
+        buildClasses(Integer.parseInt(value));
+      } else if (key.equals("threads")) {
+        buildThreads(Integer.parseInt(value));
+      } else {
+        throw new IllegalArgumentException("Unknown argument: " + arg);
+      }
+      shape.append(shape.length() > 0 ? " " : "").append(arg);
+    }
+    if (shape.length() == 0) {
+      shape.append("empty");
+    }
+
+    Heartbeat heartbeat = new Heartbeat();
+    heartbeat.start();
+    List<String> rows = new ArrayList<String>();
+
+    Socket socket = connect(port);
+    BufferedReader in = new BufferedReader(new InputStreamReader(socket.getInputStream(), "UTF-8"));
+    for (int i = 0; i < COMMANDS.length; i++) {
+      String command = COMMANDS[i];
+      String commandArgs = command.equals("stats") || command.equals("referrers") ? NODE_SIGNATURE : null;
+
+      heartbeat.takeLongestGapMillis();
+      long start = System.nanoTime();
+      String[] result = run(socket, in, i + 1, command, commandArgs);
+      long wall = (System.nanoTime() - start) / 1000000;
+      rows.add(shape + "," + command + "," + wall + "," + result[1] + "," + heartbeat.takeLongestGapMillis() + "," + result[0]);
+    }
+    socket.close();
+
+    if (oom) {
+      /* The dump runs inside the allocation that fails, before the error is thrown. */
+      List<byte[]> filler = new ArrayList<byte[]>();
+      heartbeat.takeLongestGapMillis();
+      long start = 0;
+      try {
+        while (true) {
+          start = System.nanoTime();
+          filler.add(new byte[1024 * 1024]);
+        }
+      } catch (OutOfMemoryError e) {
+        long wall = (System.nanoTime() - start) / 1000000;
+        filler = null;
+        rows.add(shape + ",oom," + wall + ",," + heartbeat.takeLongestGapMillis() + ",ok");
+      }
+    }
+
+    record(path, rows);
+    System.exit(0);
+  }
+}
@@ -32,6 +32,26 @@ static jthread allocateThread(JNIEnv *env) {
   return env->NewObject(thrClass, cid);
 }
 
+static jthread agentThreads[MAX_AGENT_THREADS];
+static volatile int agentThreadCount;
+
+
 void createAgentThread(jvmtiEnv* jvmti, JNIEnv* env, jvmtiStartFunction proc, void *pArg) {
-  CHECK(jvmti->RunAgentThread(allocateThread(env), proc, pArg, JVMTI_THREAD_NORM_PRIORITY));
+  jthread thread = allocateThread(env);
+  int index = __sync_fetch_and_add(&agentThreadCount, 1);
+  if (index < MAX_AGENT_THREADS) {
+    agentThreads[index] = (jthread) env->NewGlobalRef(thread);
+  }
+  CHECK(jvmti->RunAgentThread(thread, proc, pArg, JVMTI_THREAD_NORM_PRIORITY));
+}
+
+
+bool isAgentThread(JNIEnv *env, jthread thread) {
+  int count = agentThreadCount < MAX_AGENT_THREADS ? agentThreadCount : MAX_AGENT_THREADS;
+  for (int i = 0; i < count; i++) {
+    if (agentThreads[i] != NULL && env->IsSameObject(agentThreads[i], thread)) {
+      return true;
+    }
+  }
+  return false;
 }
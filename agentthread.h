@@ -23,7 +23,15 @@
 #include "jvmti.h"
 #include "jni.h"
 
+/* Most agent threads the agent keeps track of. */
+#define MAX_AGENT_THREADS 32
+
+
 void createAgentThread(jvmtiEnv* jvmti, JNIEnv* env, jvmtiStartFunction proc, void *pArg);
 
+/* Returns true if the thread was started by createAgentThread.  Agent threads never touch the
+ * Java heap, so commands leave them running when they suspend the application. */
+bool isAgentThread(JNIEnv *env, jthread thread);
+
 
 #endif
@@ -0,0 +1,398 @@
+/*
+ * allocations.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "allocations.h"
+#include "arena.h"
+#include "base.h"
+#include "classes.h"
+#include "symbols.h"
+
+
+#define SITE_LOCK_ATTEMPTS 1000
+
+
+/* One sampled allocation.  A sample stands for the bytes allocated since the last one, which is
+ * the sampling interval on average, or the object's own size if that is larger. */
+typedef struct {
+  ClassDetails *klass;
+  jint generation;
+  jint frameCount;
+  jlong weight;
+  jvmtiFrameInfo frames[ALLOC_STACK_DEPTH];
+} AllocSample;
+
+
+/* A thread's samples, waiting to be folded into the site table.  The owning thread is the only
+ * one to advance head, and whoever holds the site lock is the only one to advance tail, so the
+ * owner records without locking.  Buffers are never freed: one left behind by a thread that
+ * ended is taken over by the next thread that needs one. */
+typedef struct AllocBuffer {
+  struct AllocBuffer *next;
+  volatile jint owned;
+  volatile unsigned int head;
+  volatile unsigned int tail;
+  AllocSample samples[ALLOC_BUFFER_SAMPLES];
+} AllocBuffer;
+
+
+/* Allocations with the same class and stack.  bytes and samples count since startup, while
+ * windowBytes holds the bytes of the previous and the current rate window. */
+typedef struct {
+  unsigned int hash;
+  jint generation;
+  ClassDetails *klass;
+  jint frameCount;
+  jvmtiFrameInfo frames[ALLOC_STACK_DEPTH];
+  jlong bytes;
+  jlong samples;
+  jlong windowBytes[2];
+} AllocSite;
+
+
+/* The site table is an open addressed hash table that is allocated once and never grows, so
+ * folding samples into it never allocates and can be done by the out of memory dump. */
+static struct {
+  volatile int lock;
+  AllocSite *sites;
+  jint siteCount;
+  jlong totalBytes;
+  jlong totalSamples;
+  jlong otherBytes;
+  volatile jint dropped;
+  /* Samples of classes with no registry entry since the last takeUnregisteredSampleCount. */
+  volatile jint unregistered;
+  jlong windowStart;
+  bool havePrevious;
+
+  AllocBuffer * volatile buffers;
+  pthread_key_t bufferKey;
+} profiler;
+
+
+static jlong currentMillis() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (jlong) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+
+static bool tryLockSites(int attempts) {
+  for (int i = 0; i < attempts; i++) {
+    if (!__sync_lock_test_and_set(&profiler.lock, 1)) {
+      return true;
+    }
+    sched_yield();
+  }
+  return false;
+}
+
+
+static void unlockSites() {
+  __sync_lock_release(&profiler.lock);
+}
+
+
+/* Thread exit hook that hands the thread's buffer back. */
+static void releaseBuffer(void *p) {
+  __sync_lock_release(&((AllocBuffer *) p)->owned);
+}
+
+
+/* Returns the calling thread's buffer, taking over a released one or allocating a new one. */
+static AllocBuffer *threadBuffer() {
+  AllocBuffer *buffer = (AllocBuffer *) pthread_getspecific(profiler.bufferKey);
+  if (buffer != NULL) {
+    return buffer;
+  }
+
+  for (buffer = profiler.buffers; buffer != NULL; buffer = buffer->next) {
+    if (!buffer->owned && __sync_bool_compare_and_swap(&buffer->owned, 0, 1)) {
+      break;
+    }
+  }
+  if (buffer == NULL) {
+    buffer = (AllocBuffer *) calloc(1, sizeof(AllocBuffer));
+    if (buffer == NULL) {
+      return NULL;
+    }
+    buffer->owned = 1;
+    do {
+      buffer->next = profiler.buffers;
+    } while (!__sync_bool_compare_and_swap(&profiler.buffers, buffer->next, buffer));
+  }
+  pthread_setspecific(profiler.bufferKey, buffer);
+  return buffer;
+}
+
+
+static unsigned int hashSample(const AllocSample *sample) {
+  unsigned int hash = 2166136261u ^ (unsigned int) (ptrdiff_t) sample->klass;
+  for (jint i = 0; i < sample->frameCount; i++) {
+    hash = (hash ^ (unsigned int) (ptrdiff_t) sample->frames[i].method) * 16777619u;
+    hash = (hash ^ (unsigned int) sample->frames[i].location) * 16777619u;
+  }
+  return hash;
+}
+
+
+static bool sameSite(const AllocSite *site, unsigned int hash, const AllocSample *sample) {
+  if (site->hash != hash || site->klass != sample->klass || site->generation != sample->generation ||
+      site->frameCount != sample->frameCount) {
+    return false;
+  }
+  for (jint i = 0; i < sample->frameCount; i++) {
+    if (site->frames[i].method != sample->frames[i].method || site->frames[i].location != sample->frames[i].location) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+/* Starts a new rate window if the current one is over.  Must hold the site lock. */
+static void rotateWindows(jlong now) {
+  jlong elapsed = now - profiler.windowStart;
+  if (elapsed < ALLOC_WINDOW_SECONDS * 1000) {
+    return;
+  }
+  bool skipped = elapsed >= 2 * ALLOC_WINDOW_SECONDS * 1000;
+  for (jint i = 0; i < ALLOC_SITE_CAPACITY; i++) {
+    AllocSite *site = &profiler.sites[i];
+    site->windowBytes[0] = skipped ? 0 : site->windowBytes[1];
+    site->windowBytes[1] = 0;
+  }
+  profiler.windowStart = skipped ? now : profiler.windowStart + ALLOC_WINDOW_SECONDS * 1000;
+  profiler.havePrevious = true;
+}
+
+
+/* Adds a sample to its site.  Must hold the site lock. */
+static void addSample(const AllocSample *sample) {
+  profiler.totalBytes += sample->weight;
+  profiler.totalSamples++;
+
+  unsigned int hash = hashSample(sample);
+  jint slot = hash & (ALLOC_SITE_CAPACITY - 1);
+  while (profiler.sites[slot].samples != 0 && !sameSite(&profiler.sites[slot], hash, sample)) {
+    slot = (slot + 1) & (ALLOC_SITE_CAPACITY - 1);
+  }
+
+  AllocSite *site = &profiler.sites[slot];
+  if (site->samples == 0) {
+    /* Keep a quarter of the table empty, so probes stay short. */
+    if (profiler.siteCount >= ALLOC_SITE_CAPACITY / 4 * 3) {
+      profiler.otherBytes += sample->weight;
+      return;
+    }
+    site->hash = hash;
+    site->klass = sample->klass;
+    site->generation = sample->generation;
+    site->frameCount = sample->frameCount;
+    memcpy(site->frames, sample->frames, sizeof(jvmtiFrameInfo) * sample->frameCount);
+    profiler.siteCount++;
+  }
+  site->bytes += sample->weight;
+  site->samples++;
+  site->windowBytes[1] += sample->weight;
+}
+
+
+/* Folds the samples waiting in one buffer, or every buffer, into the site table.  Must hold the
+ * site lock. */
+static void drainBuffer(AllocBuffer *buffer) {
+  unsigned int head = buffer->head;
+  __sync_synchronize();
+  for (unsigned int i = buffer->tail; i != head; i++) {
+    addSample(&buffer->samples[i % ALLOC_BUFFER_SAMPLES]);
+  }
+  __sync_synchronize();
+  buffer->tail = head;
+}
+
+
+static void drainBuffers() {
+  rotateWindows(currentMillis());
+  for (AllocBuffer *buffer = profiler.buffers; buffer != NULL; buffer = buffer->next) {
+    drainBuffer(buffer);
+  }
+}
+
+
+bool initAllocationProfiler() {
+  memset(&profiler, 0, sizeof(profiler));
+  profiler.sites = (AllocSite *) calloc(ALLOC_SITE_CAPACITY, sizeof(AllocSite));
+  if (profiler.sites == NULL || pthread_key_create(&profiler.bufferKey, releaseBuffer) != 0) {
+    return false;
+  }
+  profiler.windowStart = currentMillis();
+  return true;
+}
+
+
+void JNICALL sampledObjectAlloc(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object, jclass klass, jlong size) {
+  AllocBuffer *buffer = threadBuffer();
+  if (buffer == NULL) {
+    __sync_fetch_and_add(&profiler.dropped, 1);
+    return;
+  }
+
+  /* A full buffer is folded in by its own thread, unless another thread is busy with the table. */
+  if (buffer->head - buffer->tail == ALLOC_BUFFER_SAMPLES) {
+    if (tryLockSites(1)) {
+      drainBuffer(buffer);
+      unlockSites();
+    } else {
+      __sync_fetch_and_add(&profiler.dropped, 1);
+      return;
+    }
+  }
+
+  AllocSample *sample = &buffer->samples[buffer->head % ALLOC_BUFFER_SAMPLES];
+  if (jvmti->GetStackTrace(NULL, 0, ALLOC_STACK_DEPTH, sample->frames, &sample->frameCount) != JVMTI_ERROR_NONE) {
+    sample->frameCount = 0;
+  }
+  /* Only the tag is read here, since registering takes the registry lock and may allocate.  A class
+   * with no entry yet is an array type, which the reserve keeper registers once it sees the count
+   * of such samples go up. */
+  jlong tag;
+  if (jvmti->GetTag(klass, &tag) == JVMTI_ERROR_NONE && isClassDetailsTag(tag)) {
+    sample->klass = (ClassDetails *)(void *)(ptrdiff_t) tag;
+    sample->generation = sample->klass->generation;
+  } else {
+    sample->klass = NULL;
+    sample->generation = 0;
+    __sync_fetch_and_add(&profiler.unregistered, 1);
+  }
+  sample->weight = size > gdata->allocInterval ? size : gdata->allocInterval;
+  __sync_synchronize();
+  buffer->head++;
+}
+
+
+jint takeUnregisteredSampleCount() {
+  return __sync_lock_test_and_set(&profiler.unregistered, 0);
+}
+
+
+static bool sortByRate;
+
+
+/* Comparison function for two AllocSites - used to sort largest bytes or rate first. */
+static int compareSites(const void *p1, const void *p2) {
+  const AllocSite *s1 = *(const AllocSite **) p1;
+  const AllocSite *s2 = *(const AllocSite **) p2;
+  jlong v1 = sortByRate ? s1->windowBytes[0] + s1->windowBytes[1] : s1->bytes;
+  jlong v2 = sortByRate ? s2->windowBytes[0] + s2->windowBytes[1] : s2->bytes;
+  return v1 < v2 ? 1 : v1 > v2 ? -1 : 0;
+}
+
+
+/* Prints the frames of a site.  Methods of unloaded classes can no longer be described. */
+static void printSiteFrames(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, const AllocSite *site) {
+  char text[MAX_FRAME_TEXT];
+  for (jint i = 0; i < site->frameCount && i < ALLOC_PRINT_DEPTH; i++) {
+    jclass declaringClass;
+    if (jvmti->GetMethodDeclaringClass(site->frames[i].method, &declaringClass) != JVMTI_ERROR_NONE) {
+      out->printf("\tat <unloaded method>\n");
+      continue;
+    }
+    jni->DeleteLocalRef(declaringClass);
+    jint line = describeFrame(jvmti, site->frames[i], text, sizeof(text));
+    if (line) {
+      out->printf("\tat %s:%d)\n", text, line);
+    } else {
+      out->printf("\tat %s)\n", text);
+    }
+  }
+  out->printf("\n");
+}
+
+
+void printAllocationSites(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, int limit, bool byRate) {
+  if (gdata->allocInterval <= 0) {
+    out->printf("Allocation sampling is off.  Start the agent with alloc=<bytes> to turn it on.\n\n");
+    return;
+  }
+
+  /* Copy the top sites out, so that frames are described without holding up allocating threads. */
+  AllocSite **sorted = (AllocSite **) scratchAllocate(sizeof(AllocSite *) * ALLOC_SITE_CAPACITY);
+  AllocSite *top = (AllocSite *) scratchAllocate(sizeof(AllocSite) * limit);
+  if (sorted == NULL || top == NULL || !tryLockSites(SITE_LOCK_ATTEMPTS)) {
+    out->printf(sorted == NULL || top == NULL ?
+        "Not enough native memory to sort allocation sites.\n\n" : "The allocation site table is busy.\n\n");
+    scratchFree(sorted);
+    scratchFree(top);
+    return;
+  }
+
+  drainBuffers();
+  jint sortedCount = 0;
+  for (jint i = 0; i < ALLOC_SITE_CAPACITY; i++) {
+    if (profiler.sites[i].samples != 0) {
+      sorted[sortedCount++] = &profiler.sites[i];
+    }
+  }
+  sortByRate = byRate;
+  qsort(sorted, sortedCount, sizeof(AllocSite *), &compareSites);
+  jint topCount = sortedCount < limit ? sortedCount : limit;
+  for (jint i = 0; i < topCount; i++) {
+    top[i] = *sorted[i];
+  }
+
+  jlong totalBytes = profiler.totalBytes;
+  jlong totalSamples = profiler.totalSamples;
+  jlong otherBytes = profiler.otherBytes;
+  jlong span = currentMillis() - profiler.windowStart + (profiler.havePrevious ? ALLOC_WINDOW_SECONDS * 1000 : 0);
+  unlockSites();
+  span = span > 0 ? span : 1;
+
+  out->printf("Sampled every %d bytes: %ld samples standing for %ld bytes, %ld samples dropped.\n",
+      gdata->allocInterval, (long) totalSamples, (long) totalBytes, (long) profiler.dropped);
+  if (otherBytes) {
+    out->printf("%ld bytes are from sites past the first %d and are not listed.\n",
+        (long) otherBytes, ALLOC_SITE_CAPACITY / 4 * 3);
+  }
+  out->printf("Bytes/s covers the last %ld seconds.  Sites are listed by %s.\n\n",
+      (long) (span / 1000), byRate ? "rate" : "bytes");
+
+  static const char *const columns[] = { "bytes", "bytesPerSecond", "samples", "class" };
+  out->setColumnNames(columns);
+  out->printf("Bytes      Bytes/s    Samples    Class Signature\n");
+  out->printf("---------- ---------- ---------- ----------------------\n");
+  for (jint i = 0; i < topCount; i++) {
+    AllocSite *site = &top[i];
+    bool known = site->klass != NULL && site->klass->generation == site->generation && !site->klass->unloaded;
+    long values[] = {
+        (long) site->bytes, (long) ((site->windowBytes[0] + site->windowBytes[1]) * 1000 / span), (long) site->samples };
+    out->printColumns(values, 3, 10,
+        known ? site->klass->signature : site->klass == NULL ? "<unregistered class>" : "<unloaded class>");
+    printSiteFrames(jvmti, jni, out, site);
+  }
+  out->printf("---------- ---------- ---------- ----------------------\n\n");
+  out->flush();
+
+  scratchFree(sorted);
+  scratchFree(top);
+}
@@ -0,0 +1,66 @@
+/*
+ * allocations.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_ALLOCATIONS_H
+#define POLARBEAR_ALLOCATIONS_H
+
+
+#include "jni.h"
+#include "jvmti.h"
+
+#include "io.h"
+
+
+/* Frames kept per sample, and how many of them a report prints. */
+#define ALLOC_STACK_DEPTH 16
+#define ALLOC_PRINT_DEPTH 8
+
+/* Samples each thread can hold before they are folded into the site table. */
+#define ALLOC_BUFFER_SAMPLES 128
+
+/* Distinct allocation sites kept.  Samples from further sites are only counted in total. */
+#define ALLOC_SITE_CAPACITY 8192
+
+/* Allocation rates are measured over windows of this many seconds. */
+#define ALLOC_WINDOW_SECONDS 60
+
+/* Sites the out of memory log lists. */
+#define ALLOC_OOM_SITES 10
+
+
+/* Sets up the site table.  Called from Agent_OnLoad when gdata->allocInterval is set.  Returns
+ * false if the memory for it is not available. */
+bool initAllocationProfiler();
+
+
+/* SampledObjectAlloc event callback.  Records the sample in the calling thread's buffer. */
+void JNICALL sampledObjectAlloc(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jobject object, jclass klass, jlong size);
+
+
+/* Returns the number of samples of classes with no registry entry since the last call, and starts
+ * counting again from zero. */
+jint takeUnregisteredSampleCount();
+
+
+/* Prints the limit allocation sites with the most bytes allocated, or with the highest rate over
+ * the last window.  Frames are described through the symbol cache, so this works in the out of
+ * memory dump. */
+void printAllocationSites(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, int limit, bool byRate);
+
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ * arena.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "base.h"
+
+
+#define ARENA_ALIGNMENT 16
+
+#define CHUNK_HEADER_SIZE ((sizeof(ArenaChunk) + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1))
+
+
+Arena::Arena(const char *_name)
+    : name(_name), growable(false), chunkSize(0), retainSize(0), first(0), current(0), base(0), size(0), used(0),
+      allocated(0), highWater(0), mapped(0), lastAllocated(0), resets(0) {
+}
+
+
+Arena::Arena(const char *_name, size_t _chunkSize, size_t _retainSize)
+    : name(_name), growable(true), chunkSize(_chunkSize), retainSize(_retainSize), first(0), current(0), base(0),
+      size(0), used(0), allocated(0), highWater(0), mapped(0), lastAllocated(0), resets(0) {
+}
+
+
+/* Maps a chunk with room for size bytes after its header. */
+static ArenaChunk *mapChunk(size_t size, bool populate) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+  if (populate) {
+    flags |= MAP_POPULATE;
+  }
+#endif
+  size_t total = CHUNK_HEADER_SIZE + size;
+  void *p = mmap(NULL, total, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+
+  if (populate) {
+    /* MAP_POPULATE is only a hint, so fault the pages in by hand as well. */
+    long pageSize = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < total; offset += pageSize) {
+      ((volatile char *) p)[offset] = 0;
+    }
+  }
+
+  ArenaChunk *chunk = (ArenaChunk *) p;
+  chunk->next = NULL;
+  chunk->size = size;
+  return chunk;
+}
+
+
+static void unmapChunk(ArenaChunk *chunk) {
+  munmap(chunk, CHUNK_HEADER_SIZE + chunk->size);
+}
+
+
+/* Makes chunk the one allocations come from. */
+static void useChunk(Arena *arena, ArenaChunk *chunk) {
+  arena->current = chunk;
+  arena->base = (char *) chunk + CHUNK_HEADER_SIZE;
+  arena->size = chunk->size;
+  arena->used = 0;
+}
+
+
+bool Arena::reserve(size_t size) {
+  if (this->growable || this->allocated != 0) {
+    return false;
+  }
+  ArenaChunk *chunk = mapChunk(size, true);
+  if (chunk == NULL) {
+    return false;
+  }
+  if (this->first != NULL) {
+    unmapChunk(this->first);
+  }
+  this->first = chunk;
+  this->mapped = size;
+  useChunk(this, chunk);
+  return true;
+}
+
+
+void *Arena::allocate(size_t size) {
+  size_t start = (this->used + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+  while (this->base == NULL || start > this->size || size > this->size - start) {
+    if (!this->growable) {
+      return NULL;
+    }
+
+    /* Move on to the next chunk, mapping one big enough if the next is too small. */
+    ArenaChunk *next = this->current ? this->current->next : this->first;
+    if (next == NULL || next->size < size) {
+      ArenaChunk *chunk = mapChunk(size > this->chunkSize ? size : this->chunkSize, false);
+      if (chunk == NULL) {
+        return NULL;
+      }
+      this->mapped += chunk->size;
+      chunk->next = next;
+      if (this->current) {
+        this->current->next = chunk;
+      } else {
+        this->first = chunk;
+      }
+      next = chunk;
+    }
+    useChunk(this, next);
+    start = 0;
+  }
+
+  this->used = start + size;
+  this->allocated += size;
+  if (this->allocated > this->highWater) {
+    this->highWater = this->allocated;
+  }
+  return this->base + start;
+}
+
+
+bool Arena::contains(const void *p) const {
+  for (ArenaChunk *chunk = this->first; chunk != NULL; chunk = chunk->next) {
+    const char *start = (const char *) chunk + CHUNK_HEADER_SIZE;
+    if ((const char *) p >= start && (const char *) p < start + chunk->size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void Arena::reset() {
+  if (this->first == NULL) {
+    return;
+  }
+
+  /* Keep the first chunks, up to retainSize, for the next command. */
+  if (this->growable) {
+    size_t kept = this->first->size;
+    ArenaChunk *last = this->first;
+    while (last->next != NULL && kept + last->next->size <= this->retainSize) {
+      last = last->next;
+      kept += last->size;
+    }
+    for (ArenaChunk *chunk = last->next; chunk != NULL; ) {
+      ArenaChunk *next = chunk->next;
+      this->mapped -= chunk->size;
+      unmapChunk(chunk);
+      chunk = next;
+    }
+    last->next = NULL;
+  }
+
+  useChunk(this, this->first);
+  this->lastAllocated = this->allocated;
+  this->allocated = 0;
+  this->resets++;
+}
+
+
+Arena::~Arena() {
+  for (ArenaChunk *chunk = this->first; chunk != NULL; ) {
+    ArenaChunk *next = chunk->next;
+    unmapChunk(chunk);
+    chunk = next;
+  }
+}
+
+
+/* The innermost ArenaScope of the calling thread.  Shell commands run on several threads at once,
+ * each with its own arena. */
+static __thread Arena *scratchArena;
+
+
+ArenaScope::ArenaScope(Arena *_arena) : arena(_arena), previous(scratchArena) {
+  scratchArena = _arena;
+}
+
+
+ArenaScope::~ArenaScope() {
+  scratchArena = this->previous;
+  this->arena->reset();
+}
+
+
+void printOmitted(Output *out, const char *section) {
+  out->printf(gdata->emergencyDump ? "%s omitted: out of reserve memory.\n\n" : "%s omitted: not enough native memory.\n\n",
+      section);
+}
+
+
+void *scratchAllocate(size_t size) {
+  if (scratchArena != NULL) {
+    return scratchArena->allocate(size);
+  }
+  return malloc(size);
+}
+
+
+void scratchFree(void *p) {
+  if (scratchArena == NULL || !scratchArena->contains(p)) {
+    free(p);
+  }
+}
+
+
+void printArenaStats(Arena *arena, Output *out) {
+  int chunks = 0;
+  for (ArenaChunk *chunk = arena->first; chunk != NULL; chunk = chunk->next) {
+    chunks++;
+  }
+  out->printf("%s arena: %ld bytes mapped in %d chunks, %ld bytes in use\n",
+      arena->name, (long) arena->mapped, chunks, (long) arena->allocated);
+  out->printf("  high water %ld bytes, last command %ld bytes, %ld commands\n",
+      (long) arena->highWater, (long) arena->lastAllocated, (long) arena->resets);
+}
@@ -0,0 +1,112 @@
+/*
+ * arena.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_ARENA_H
+#define POLARBEAR_ARENA_H
+
+
+#include <stddef.h>
+
+#include "jni.h"
+
+#include "io.h"
+
+
+/* Header at the start of each region an Arena maps. */
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t size;
+} ArenaChunk;
+
+
+/* A bump allocator over mapped regions.  Memory is handed out in order and only given back all at
+ * once by reset(), which makes freeing everything a command allocated a constant time operation
+ * and keeps short lived analysis state out of the malloc heap.
+ *
+ * A fixed arena is one region mapped up front by reserve() and never grows, so allocation cannot
+ * fail for any reason other than the region filling up.  A growable arena maps further chunks on
+ * demand and keeps the first retainSize bytes of them mapped across resets. */
+struct Arena {
+  const char *name;
+  bool growable;
+  size_t chunkSize;
+  size_t retainSize;
+
+  ArenaChunk *first;
+  ArenaChunk *current;
+  char *base;
+  size_t size;
+  size_t used;
+
+  /* Statistics. */
+  size_t allocated;
+  size_t highWater;
+  size_t mapped;
+  size_t lastAllocated;
+  jlong resets;
+
+  Arena(const char *name);
+  Arena(const char *name, size_t chunkSize, size_t retainSize);
+
+  /* Maps size bytes and touches every page, so the memory is really there when it is needed.  A
+   * fixed arena can be reserved again to change its size while nothing is allocated from it; the
+   * old region is kept if the new one cannot be mapped. */
+  bool reserve(size_t size);
+
+  /* Returns size bytes aligned for any type, or NULL if the arena is full. */
+  void *allocate(size_t size);
+
+  bool contains(const void *p) const;
+
+  /* Frees everything allocated since the last reset. */
+  void reset();
+
+  ~Arena();
+};
+
+
+/* Makes an arena the source of scratchAllocate on the calling thread for as long as the scope lasts,
+ * and resets it at the end.  Commands open one of these on their worker's arena. */
+struct ArenaScope {
+  Arena *arena;
+  Arena *previous;
+
+  ArenaScope(Arena *arena);
+  ~ArenaScope();
+};
+
+
+/* Prints the size and high water marks of an arena. */
+void printArenaStats(Arena *arena, Output *out);
+
+
+/* Prints the line that stands in for a section left out because scratchAllocate failed: out of
+ * the reserve during the out of memory dump, and out of native memory otherwise. */
+void printOmitted(Output *out, const char *section);
+
+
+/* Allocates scratch memory for the command in progress: from the calling thread's innermost
+ * ArenaScope if there is one, and from malloc otherwise.  Returns NULL on failure. */
+void *scratchAllocate(size_t size);
+
+
+/* Frees memory from scratchAllocate.  Arena memory is left for the arena to reclaim. */
+void scratchFree(void *p);
+
+
+#endif
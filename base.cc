@@ -42,6 +42,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 
 GlobalData globalData, *gdata = &globalData;
@@ -107,3 +108,17 @@ void enterAgentMonitor(jvmtiEnv *jvmti) {
 void exitAgentMonitor(jvmtiEnv *jvmti) {
   CHECK(jvmti->RawMonitorExit(gdata->lock));
 }
+
+
+jlong monotonicMillis() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (jlong) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+jlong monotonicMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (jlong) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
@@ -45,6 +45,10 @@
 #include "jvmti.h"
 
 
+struct Arena;
+struct ClassMatcher;
+
+
 /* Global static data */
 typedef struct {
   jboolean vmDeathCalled;
@@ -55,9 +59,35 @@ typedef struct {
   char *optionsCopy;
   int retainedSizeClassCount;
   char **retainedSizeClasses;
+  ClassMatcher *retainedSizeMatcher;
+
+  jlong classClassTag;
+
+  Arena *commandArena;
+  Arena *emergencyArena;
+  int emergencyLog;
+  jboolean emergencyDump;
+  jboolean groupedOomThreads;
+  jint oomThreadDepth;
+  const char *summaryPath;
+  int summaryFd;
+  const char *hprofPath;
+  int hprofFd;
+  int trendInterval;
+  int allocInterval;
+  int oomPathCount;
+  int snapshotLimitMb;
+  int graphLimitMb;
 
   int shellSocket;
-  int activeShellSocket;
+  int metricsPort;
+
+  /* Counters for the metrics endpoint, which reads them without the agent lock. */
+  volatile jint oomEvents;
+  volatile jlong lastOomDumpMillis;
+  volatile jlong lastHeapCommandMillis;
+  volatile jlong objectsVisited;
+  volatile jlong bytesWritten;
 } GlobalData;
 
 extern GlobalData *gdata;
@@ -85,4 +115,11 @@ void enterAgentMonitor(jvmtiEnv *jvmti);
 void exitAgentMonitor(jvmtiEnv *jvmti);
 
 
+/* Milliseconds on the monotonic clock. */
+jlong monotonicMillis();
+
+/* Microseconds on the monotonic clock. */
+jlong monotonicMicros();
+
+
 #endif
\ No newline at end of file
@@ -0,0 +1,534 @@
+/*
+ * classes.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "base.h"
+#include "classes.h"
+
+
+#define CLASS_CHUNK_BITS 10
+#define CLASS_CHUNK_SIZE (1 << CLASS_CHUNK_BITS)
+#define MAX_CLASS_CHUNKS 4096
+#define INITIAL_BUCKET_COUNT 4096
+#define SIGNATURE_BLOCK_SIZE (64 * 1024)
+
+/* How long a command waits for a class loading thread to finish registering a class.  The thread
+ * may have been suspended by the command, so this cannot block. */
+#define REGISTRY_LOCK_ATTEMPTS 1000
+
+/* Limit on the superclasses getFieldName looks through. */
+#define MAX_FIELD_SUPERCLASSES 64
+
+
+/* Hash chains of the live classes.  A table is replaced rather than resized, with its size kept
+ * alongside the heads, so a reader always indexes the table it loaded with that table's size. */
+typedef struct {
+  jint count;
+  ClassDetails *heads[1];
+} BucketTable;
+
+
+/* The class registry.  Entries are allocated in fixed chunks that never move, so readers can
+ * walk them while a class loading thread appends.  Writers are serialized by a spin lock rather
+ * than a raw monitor, so a command that suspended a thread in the middle of registering a class
+ * can give up instead of deadlocking.
+ *
+ * Readers take no lock.  Bucket heads, chain links, the slot count and each entry's unloaded flag
+ * are stored with release semantics after the fields they guard and loaded with acquire
+ * semantics, and an entry is filled in before unloaded is cleared.  Unloaded classes are retired
+ * rather than cleared: the sweep unlinks them from their chain, bumps their generation and keeps
+ * their own link, so a reader standing on one still reaches the end of its chain. */
+static struct {
+  volatile int writeLock;
+
+  ClassDetails *chunks[MAX_CLASS_CHUNKS];
+  volatile jint count;
+  ClassDetails *freeList;
+
+  BucketTable *buckets;
+  jint liveCount;
+
+  char *signatureBlock;
+  size_t signatureUsed;
+
+  volatile jint unloadedPending;
+} registry;
+
+
+static bool tryLockRegistry(int attempts) {
+  for (int i = 0; i < attempts; i++) {
+    if (!__sync_lock_test_and_set(&registry.writeLock, 1)) {
+      return true;
+    }
+    sched_yield();
+  }
+  return false;
+}
+
+
+static void unlockRegistry() {
+  __sync_lock_release(&registry.writeLock);
+}
+
+
+static unsigned int hashSignature(const char *signature) {
+  unsigned int hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *) signature; *p; p++) {
+    hash = (hash ^ *p) * 16777619u;
+  }
+  return hash;
+}
+
+
+/* Finds a live class with the given signature.  A class retired or registered while the chain is
+ * walked may be missed. */
+static ClassDetails *lookup(const char *signature, unsigned int hash) {
+  BucketTable *table = __atomic_load_n(&registry.buckets, __ATOMIC_ACQUIRE);
+  if (table == NULL) {
+    return NULL;
+  }
+  ClassDetails *d = __atomic_load_n(&table->heads[hash & (table->count - 1)], __ATOMIC_ACQUIRE);
+  for (; d != NULL; d = __atomic_load_n(&d->nextInBucket, __ATOMIC_ACQUIRE)) {
+    if (!__atomic_load_n(&d->unloaded, __ATOMIC_ACQUIRE) && d->hash == hash && strcmp(d->signature, signature) == 0) {
+      return d;
+    }
+  }
+  return NULL;
+}
+
+
+/* Returns a shared copy of the given signature.  Signatures are never freed, since classes with
+ * the same name are usually loaded again by the next class loader. */
+static char *internSignature(const char *signature, unsigned int hash) {
+  ClassDetails *existing = lookup(signature, hash);
+  if (existing != NULL) {
+    return existing->signature;
+  }
+
+  size_t len = strlen(signature) + 1;
+  if (len > SIGNATURE_BLOCK_SIZE / 4) {
+    char *copy = strdup(signature);
+    CHECK_FOR_NULL(copy);
+    return copy;
+  }
+  if (registry.signatureBlock == NULL || registry.signatureUsed + len > SIGNATURE_BLOCK_SIZE) {
+    registry.signatureBlock = (char *) malloc(SIGNATURE_BLOCK_SIZE);
+    CHECK_FOR_NULL(registry.signatureBlock);
+    registry.signatureUsed = 0;
+  }
+  char *copy = registry.signatureBlock + registry.signatureUsed;
+  memcpy(copy, signature, len);
+  registry.signatureUsed += len;
+  return copy;
+}
+
+
+/* Doubles the hash table.  The old table is left in place for readers that are still using it;
+ * relinking the entries may send them to the end of a chain of the new table early, so they miss
+ * a class but never lose their way. */
+static void growBuckets() {
+  jint bucketCount = registry.buckets ? registry.buckets->count * 2 : INITIAL_BUCKET_COUNT;
+  BucketTable *table = (BucketTable *) calloc(1, offsetof(BucketTable, heads) + sizeof(ClassDetails *) * bucketCount);
+  CHECK_FOR_NULL(table);
+  table->count = bucketCount;
+
+  for (jint i = 0; i < registry.count; i++) {
+    ClassDetails *d = getClassDetails(i);
+    if (d->klass != NULL) {
+      __atomic_store_n(&d->nextInBucket, table->heads[d->hash & (bucketCount - 1)], __ATOMIC_RELEASE);
+      table->heads[d->hash & (bucketCount - 1)] = d;
+    }
+  }
+
+  __atomic_store_n(&registry.buckets, table, __ATOMIC_RELEASE);
+}
+
+
+/* Returns an entry to fill in, reusing the slot of a retired class if there is one.  A reused entry
+ * is not cleared, since a reader may still be standing on it: it stays unloaded, with a valid
+ * signature and link, until addClass has filled it in. */
+static ClassDetails *allocateDetails() {
+  ClassDetails *d = registry.freeList;
+  if (d != NULL) {
+    registry.freeList = d->nextFree;
+    d->nextFree = NULL;
+    d->count = 0;
+    memset(d->referLevelCount, 0, sizeof(d->referLevelCount));
+    d->space = 0;
+    d->objectTag = 0;
+    d->retained = 0;
+    d->reachable = 0;
+    __atomic_store_n(&d->generation, d->generation + 1, __ATOMIC_RELEASE);
+    return d;
+  }
+
+  jint index = registry.count;
+  jint chunk = index >> CLASS_CHUNK_BITS;
+  if (chunk >= MAX_CLASS_CHUNKS) {
+    return NULL;
+  }
+  if (registry.chunks[chunk] == NULL) {
+    registry.chunks[chunk] = (ClassDetails *) calloc(sizeof(ClassDetails), CLASS_CHUNK_SIZE);
+    CHECK_FOR_NULL(registry.chunks[chunk]);
+  }
+  d = &registry.chunks[chunk][index & (CLASS_CHUNK_SIZE - 1)];
+  d->index = index;
+  __atomic_store_n(&registry.count, index + 1, __ATOMIC_RELEASE);
+  return d;
+}
+
+
+/* Adds a class to the registry.  Must hold the write lock. */
+static void addClass(jvmtiEnv *jvmti, JNIEnv *jni, jclass klass) {
+  jlong tag;
+  CHECK(jvmti->GetTag(klass, &tag));
+  if (isClassDetailsTag(tag)) {
+    return;
+  }
+
+  char *sig;
+  CHECK(jvmti->GetClassSignature(klass, &sig, NULL));
+  CHECK_FOR_NULL(sig);
+
+  ClassDetails *d = allocateDetails();
+  if (d == NULL) {
+    deallocate(jvmti, sig);
+    return;
+  }
+  if (registry.liveCount >= registry.buckets->count) {
+    growBuckets();
+  }
+
+  unsigned int hash = hashSignature(sig);
+  char *signature = internSignature(sig, hash);
+  deallocate(jvmti, sig);
+  d->hash = hash;
+  d->signature = signature;
+  d->reachSlot = -1;
+  d->klass = (jclass) jni->NewWeakGlobalRef(klass);
+  __atomic_store_n(&d->unloaded, JNI_FALSE, __ATOMIC_RELEASE);
+
+  ClassDetails **head = &registry.buckets->heads[hash & (registry.buckets->count - 1)];
+  __atomic_store_n(&d->nextInBucket, *head, __ATOMIC_RELEASE);
+  __atomic_store_n(head, d, __ATOMIC_RELEASE);
+  registry.liveCount++;
+
+  CHECK(jvmti->SetTag(klass, (jlong)(ptrdiff_t)(void*) d));
+  if (strcmp(d->signature, "Ljava/lang/Class;") == 0) {
+    gdata->classClassTag = (jlong)(ptrdiff_t)(void*) d;
+  }
+}
+
+
+/* Unlinks classes reported by objectFree and retires their slots for reuse.  Must hold the write
+ * lock. */
+static void sweepUnloadedClasses(JNIEnv *jni) {
+  if (registry.unloadedPending == 0) {
+    return;
+  }
+  __sync_lock_test_and_set(&registry.unloadedPending, 0);
+
+  for (jint i = 0; i < registry.count; i++) {
+    ClassDetails *d = getClassDetails(i);
+    if (d->unloaded && d->klass != NULL) {
+      ClassDetails **p = &registry.buckets->heads[d->hash & (registry.buckets->count - 1)];
+      while (*p != NULL && *p != d) {
+        p = &(*p)->nextInBucket;
+      }
+      if (*p == d) {
+        __atomic_store_n(p, d->nextInBucket, __ATOMIC_RELEASE);
+      }
+      __atomic_store_n(&d->generation, d->generation + 1, __ATOMIC_RELEASE);
+      jni->DeleteWeakGlobalRef(d->klass);
+      d->klass = NULL;
+      d->nextFree = registry.freeList;
+      registry.freeList = d;
+      registry.liveCount--;
+    }
+  }
+}
+
+
+void initClassRegistry(jvmtiEnv *jvmti) {
+  memset(&registry, 0, sizeof(registry));
+  gdata->classClassTag = 0;
+  growBuckets();
+}
+
+
+void registerLoadedClasses(jvmtiEnv *jvmti, JNIEnv *jni) {
+  jint count;
+  jclass *classes;
+
+  CHECK(jvmti->GetLoadedClasses(&count, &classes));
+  if (tryLockRegistry(REGISTRY_LOCK_ATTEMPTS)) {
+    sweepUnloadedClasses(jni);
+    for (jint i = 0; i < count; i++) {
+      addClass(jvmti, jni, classes[i]);
+    }
+    unlockRegistry();
+  }
+  for (jint i = 0; i < count; i++) {
+    jni->DeleteLocalRef(classes[i]);
+  }
+  deallocate(jvmti, classes);
+}
+
+
+ClassDetails *registerClass(jvmtiEnv *jvmti, JNIEnv *jni, jclass klass) {
+  jlong tag;
+  CHECK(jvmti->GetTag(klass, &tag));
+  if (!isClassDetailsTag(tag)) {
+    if (!tryLockRegistry(REGISTRY_LOCK_ATTEMPTS)) {
+      return NULL;
+    }
+    sweepUnloadedClasses(jni);
+    addClass(jvmti, jni, klass);
+    unlockRegistry();
+    CHECK(jvmti->GetTag(klass, &tag));
+  }
+  return isClassDetailsTag(tag) ? (ClassDetails *)(void *)(ptrdiff_t) tag : NULL;
+}
+
+
+/* A class left unregistered because a command holds the registry, or suspended the thread that
+ * does, is picked up by the next registerLoadedClasses. */
+void JNICALL classPrepare(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jclass klass) {
+  if (!tryLockRegistry(REGISTRY_LOCK_ATTEMPTS)) {
+    return;
+  }
+  sweepUnloadedClasses(jni);
+  addClass(jvmti, jni, klass);
+  unlockRegistry();
+}
+
+
+void JNICALL objectFree(jvmtiEnv *jvmti, jlong tag) {
+  /* Most freed objects carry scratch tags from an earlier analysis, so check the tag really
+   * points into the registry before treating it as a class. */
+  char *p = (char *)(void *)(ptrdiff_t) tag;
+  jint chunks = (registry.count + CLASS_CHUNK_SIZE - 1) >> CLASS_CHUNK_BITS;
+  for (jint i = 0; i < chunks; i++) {
+    char *start = (char *) registry.chunks[i];
+    if (start != NULL && p >= start && p < start + sizeof(ClassDetails) * CLASS_CHUNK_SIZE &&
+        (p - start) % sizeof(ClassDetails) == 0) {
+      ((ClassDetails *) p)->unloaded = JNI_TRUE;
+      __sync_fetch_and_add(&registry.unloadedPending, 1);
+      return;
+    }
+  }
+}
+
+
+ClassDetails *findClass(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature) {
+  unsigned int hash = hashSignature(signature);
+  ClassDetails *d = lookup(signature, hash);
+  if (d == NULL) {
+    /* Array classes are only registered when they are first seen. */
+    registerLoadedClasses(jvmti, jni);
+    d = lookup(signature, hash);
+  }
+  return d;
+}
+
+
+jint getClassCount() {
+  return __atomic_load_n(&registry.count, __ATOMIC_ACQUIRE);
+}
+
+
+jint getLoadedClassCount() {
+  return registry.liveCount;
+}
+
+
+ClassDetails *getClassDetails(jint index) {
+  return &registry.chunks[index >> CLASS_CHUNK_BITS][index & (CLASS_CHUNK_SIZE - 1)];
+}
+
+
+jint FieldHierarchy::getFieldBase(ClassDetails *d) {
+  this->seen = NULL;
+  this->seenCount = this->seenCapacity = 0;
+  this->count = 0;
+  this->failed = false;
+  for (ClassDetails *k = d; k != NULL && !this->failed; k = this->getSuperclass(k)) {
+    this->visitInterfaces(k);
+  }
+  scratchFree(this->seen);
+  return this->failed ? -1 : this->count;
+}
+
+
+/* Counts the fields of an interface and its superinterfaces, unless it has been counted already. */
+void FieldHierarchy::countInterface(ClassDetails *d) {
+  for (jint i = 0; i < this->seenCount; i++) {
+    if (this->seen[i] == d) {
+      return;
+    }
+  }
+  if (this->failed) {
+    return;
+  }
+  if (this->seenCount == this->seenCapacity) {
+    jint capacity = this->seenCapacity ? this->seenCapacity * 2 : 16;
+    ClassDetails **seen = (ClassDetails **) scratchAllocate(sizeof(ClassDetails *) * capacity);
+    if (seen == NULL) {
+      this->failed = true;
+      return;
+    }
+    if (this->seenCount) {
+      memcpy(seen, this->seen, sizeof(ClassDetails *) * this->seenCount);
+    }
+    scratchFree(this->seen);
+    this->seen = seen;
+    this->seenCapacity = capacity;
+  }
+  this->seen[this->seenCount++] = d;
+  this->count += this->getDeclaredFieldCount(d);
+  this->visitInterfaces(d);
+}
+
+
+/* Returns the registered class of a class object, or NULL. */
+static ClassDetails *detailsOf(jvmtiEnv *jvmti, jclass klass) {
+  jlong tag;
+  if (klass == NULL || jvmti->GetTag(klass, &tag) != JVMTI_ERROR_NONE || !isClassDetailsTag(tag)) {
+    return NULL;
+  }
+  return (ClassDetails *)(void *)(ptrdiff_t) tag;
+}
+
+
+/* The hierarchy of loaded classes, as JVMTI reports it now. */
+class JvmtiFieldHierarchy : public FieldHierarchy {
+  public:
+    JvmtiFieldHierarchy(jvmtiEnv *_jvmti, JNIEnv *_jni) : jvmti(_jvmti), jni(_jni) {}
+
+  protected:
+    virtual ClassDetails *getSuperclass(ClassDetails *d);
+    virtual jint getDeclaredFieldCount(ClassDetails *d);
+    virtual void visitInterfaces(ClassDetails *d);
+
+  private:
+    jvmtiEnv *jvmti;
+    JNIEnv *jni;
+};
+
+
+ClassDetails *JvmtiFieldHierarchy::getSuperclass(ClassDetails *d) {
+  jclass klass = d->unloaded ? NULL : (jclass) this->jni->NewLocalRef(d->klass);
+  if (klass == NULL) {
+    return NULL;
+  }
+  jclass super = this->jni->GetSuperclass(klass);
+  ClassDetails *s = detailsOf(this->jvmti, super);
+  if (super != NULL) {
+    this->jni->DeleteLocalRef(super);
+  }
+  this->jni->DeleteLocalRef(klass);
+  return s;
+}
+
+
+jint JvmtiFieldHierarchy::getDeclaredFieldCount(ClassDetails *d) {
+  jclass klass = d->unloaded ? NULL : (jclass) this->jni->NewLocalRef(d->klass);
+  if (klass == NULL) {
+    return 0;
+  }
+  jint fieldCount;
+  jfieldID *fields;
+  if (this->jvmti->GetClassFields(klass, &fieldCount, &fields) != JVMTI_ERROR_NONE) {
+    fieldCount = 0;
+  } else {
+    deallocate(this->jvmti, fields);
+  }
+  this->jni->DeleteLocalRef(klass);
+  return fieldCount;
+}
+
+
+void JvmtiFieldHierarchy::visitInterfaces(ClassDetails *d) {
+  jclass klass = d->unloaded ? NULL : (jclass) this->jni->NewLocalRef(d->klass);
+  if (klass == NULL) {
+    return;
+  }
+  jint interfaceCount;
+  jclass *interfaces;
+  if (this->jvmti->GetImplementedInterfaces(klass, &interfaceCount, &interfaces) == JVMTI_ERROR_NONE) {
+    for (jint i = 0; i < interfaceCount; i++) {
+      ClassDetails *implemented = detailsOf(this->jvmti, interfaces[i]);
+      this->jni->DeleteLocalRef(interfaces[i]);
+      if (implemented != NULL) {
+        this->countInterface(implemented);
+      }
+    }
+    deallocate(this->jvmti, interfaces);
+  }
+  this->jni->DeleteLocalRef(klass);
+}
+
+
+/* Counts back from the fields of the class itself to the superclass that declares the field. */
+bool getFieldName(jvmtiEnv *jvmti, JNIEnv *jni, ClassDetails *d, jint index, char *name, size_t length) {
+  if (d->klass == NULL || d->unloaded) {
+    return false;
+  }
+  JvmtiFieldHierarchy hierarchy(jvmti, jni);
+  jint base = hierarchy.getFieldBase(d);
+  if (base < 0 || jni->PushLocalFrame(MAX_FIELD_SUPERCLASSES) != 0) {
+    return false;
+  }
+  index -= base;
+
+  jclass chain[MAX_FIELD_SUPERCLASSES];
+  jint depth = 0;
+  for (jclass k = (jclass) jni->NewLocalRef(d->klass); k != NULL && depth < MAX_FIELD_SUPERCLASSES; k = jni->GetSuperclass(k)) {
+    chain[depth++] = k;
+  }
+
+  bool found = false;
+  for (jint i = depth - 1; i >= 0 && index >= 0; i--) {
+    jint fieldCount;
+    jfieldID *fields;
+    if (jvmti->GetClassFields(chain[i], &fieldCount, &fields) != JVMTI_ERROR_NONE) {
+      break;
+    }
+    if (index < fieldCount) {
+      char *fieldName;
+      if (jvmti->GetFieldName(chain[i], fields[index], &fieldName, NULL, NULL) == JVMTI_ERROR_NONE) {
+        snprintf(name, length, "%s", fieldName);
+        deallocate(jvmti, fieldName);
+        found = true;
+      }
+      index = -1;
+    } else {
+      index -= fieldCount;
+    }
+    deallocate(jvmti, fields);
+  }
+
+  jni->PopLocalFrame(NULL);
+  return found;
+}
@@ -0,0 +1,150 @@
+/*
+ * classes.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_CLASSES_H
+#define POLARBEAR_CLASSES_H
+
+
+#include "jni.h"
+#include "jvmti.h"
+
+#include "base.h"
+
+
+/* Details about a loaded class.  Entries live for as long as the agent does and each class object
+ * is permanently tagged with a pointer to its entry, so heap callbacks can go straight from a
+ * class_tag to the entry. */
+typedef struct ClassDetails {
+  jclass klass;
+  char *signature;
+  jint index;
+  /* Bumped when the class is retired and again when the slot is reused, so caches can tell a class
+   * that reuses the slot from the unloaded one. */
+  jint generation;
+  jboolean unloaded;
+  unsigned int hash;
+  struct ClassDetails *nextInBucket;
+  /* Next retired entry waiting to be reused. */
+  struct ClassDetails *nextFree;
+
+  /* Scratch space for the heap analysis in progress. */
+  int count;
+  int referLevelCount[4];
+  jlong space;
+  jlong objectTag;
+  jlong retained;
+  jint reachSlot;
+  jlong reachable;
+} ClassDetails;
+
+
+/* Sets up the class registry.  Called from Agent_OnLoad. */
+void initClassRegistry(jvmtiEnv *jvmti);
+
+
+/* Registers every loaded class that is not registered yet.  Array classes do not generate
+ * ClassPrepare events, so this also picks up array types created since the last call. */
+void registerLoadedClasses(jvmtiEnv *jvmti, JNIEnv *jni);
+
+
+/* Returns the entry of a class, registering it first if needed.  Returns NULL if the registry is
+ * busy or full. */
+ClassDetails *registerClass(jvmtiEnv *jvmti, JNIEnv *jni, jclass klass);
+
+
+/* ClassPrepare event callback that registers the new class. */
+void JNICALL classPrepare(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread, jclass klass);
+
+
+/* ObjectFree event callback that notices unloaded classes. */
+void JNICALL objectFree(jvmtiEnv *jvmti, jlong tag);
+
+
+/* Finds the class with the given signature, or NULL. */
+ClassDetails *findClass(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature);
+
+
+/* Number of registry slots.  Indexes below this are stable, but may hold unloaded classes. */
+jint getClassCount();
+
+
+/* Number of classes registered and not unloaded.  Read without a lock, so it may be a moment out of
+ * date. */
+jint getLoadedClassCount();
+
+
+/* Returns the registry slot with the given index. */
+ClassDetails *getClassDetails(jint index);
+
+
+/* The class hierarchy as JVMTI numbers fields through it: the fields of every interface a class
+ * implements come first, each interface once, then the fields of each class from java.lang.Object
+ * down.  Subclasses say where the hierarchy comes from. */
+class FieldHierarchy {
+  public:
+    virtual ~FieldHierarchy() {}
+
+    /* Returns the index of the first field the class itself declares, or -1 if there was not
+     * enough native memory to number them. */
+    jint getFieldBase(ClassDetails *d);
+
+  protected:
+    /* Returns the superclass of a class, or NULL. */
+    virtual ClassDetails *getSuperclass(ClassDetails *d) = 0;
+
+    /* Returns the number of fields a class declares, static ones included. */
+    virtual jint getDeclaredFieldCount(ClassDetails *d) = 0;
+
+    /* Calls countInterface with each interface the class implements directly. */
+    virtual void visitInterfaces(ClassDetails *d) = 0;
+
+    void countInterface(ClassDetails *d);
+
+  private:
+    ClassDetails **seen;
+    jint seenCount;
+    jint seenCapacity;
+    jint count;
+    bool failed;
+};
+
+
+/* Writes the name of the field that FollowReferences reports with the given index for the class,
+ * as a field of its instances or a static field of the class itself.  Calls into JVMTI, so not
+ * from a heap callback.  Returns false if the field cannot be found. */
+bool getFieldName(jvmtiEnv *jvmti, JNIEnv *jni, ClassDetails *d, jint index, char *name, size_t length);
+
+
+/* Positive tags up to this are scratch markers left by an analysis in progress.  Registered
+ * classes are tagged with ClassDetails pointers, which are always larger. */
+#define MAX_SCRATCH_TAG 4096
+
+
+/* Returns true if the tag is a ClassDetails pointer rather than a scratch marker. */
+static inline bool isClassDetailsTag(jlong tag) {
+  return tag > MAX_SCRATCH_TAG;
+}
+
+
+/* Returns true if an object with the given class_tag is itself a class. */
+static inline bool isClassObject(jlong class_tag) {
+  return class_tag != 0 && class_tag == gdata->classClassTag;
+}
+
+
+#endif
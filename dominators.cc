@@ -0,0 +1,305 @@
+/*
+ * dominators.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dominators.h"
+
+
+DominatorTree::DominatorTree() : nodeCount(0), idom(0), reachableCount(0), order(0) {
+}
+
+
+DominatorTree::~DominatorTree() {
+  free(this->idom);
+  free(this->order);
+}
+
+
+/* Numbers the nodes reachable from the root in depth first preorder.  dfn maps node to
+ * preorder number (-1 when unreachable), order maps back, and parent holds the preorder
+ * number of each node's DFS tree parent. */
+static jint depthFirstNumber(const HeapGraph *graph, jint *dfn, jint *order, jint *parent) {
+  jint n = graph->nodeCount;
+  jint *stack = (jint *) malloc(sizeof(jint) * n);
+  jlong *next = (jlong *) malloc(sizeof(jlong) * n);
+  if (stack == NULL || next == NULL) {
+    free(stack);
+    free(next);
+    return -1;
+  }
+
+  for (jint v = 0; v < n; v++) {
+    dfn[v] = -1;
+  }
+
+  jint count = 1;
+  jint top = 1;
+  dfn[HEAP_GRAPH_ROOT] = 0;
+  order[0] = HEAP_GRAPH_ROOT;
+  parent[0] = 0;
+  stack[0] = HEAP_GRAPH_ROOT;
+  next[0] = graph->edgeStart[HEAP_GRAPH_ROOT];
+
+  while (top > 0) {
+    jint v = stack[top - 1];
+    if (next[top - 1] < graph->edgeStart[v + 1]) {
+      jint w = graph->edges[next[top - 1]++];
+      if (dfn[w] == -1) {
+        dfn[w] = count;
+        order[count] = w;
+        parent[count] = dfn[v];
+        stack[top] = w;
+        next[top] = graph->edgeStart[w];
+        top++;
+        count++;
+      }
+    } else {
+      top--;
+    }
+  }
+
+  free(stack);
+  free(next);
+  return count;
+}
+
+
+/* Path compression for eval(), done iteratively since heap paths can be millions long. */
+static void compress(jint v, jint *ancestor, jint *label, const jint *semi, jint *stack) {
+  jint top = 0;
+  while (ancestor[ancestor[v]] != -1) {
+    stack[top++] = v;
+    v = ancestor[v];
+  }
+  while (top > 0) {
+    v = stack[--top];
+    jint a = ancestor[v];
+    if (semi[label[a]] < semi[label[v]]) {
+      label[v] = label[a];
+    }
+    ancestor[v] = ancestor[a];
+  }
+}
+
+
+/* Returns the vertex with minimal semidominator on the linked path above v. */
+static inline jint eval(jint v, jint *ancestor, jint *label, const jint *semi, jint *stack) {
+  if (ancestor[v] == -1) {
+    return v;
+  }
+  compress(v, ancestor, label, semi, stack);
+  return label[v];
+}
+
+
+bool computeDominatorTree(const HeapGraph *graph, DominatorTree *tree) {
+  jint n = graph->nodeCount;
+  bool ok = false;
+
+  jint *dfn = (jint *) malloc(sizeof(jint) * n);
+  jint *order = (jint *) malloc(sizeof(jint) * n);
+  jint *parent = (jint *) malloc(sizeof(jint) * n);
+  jint *idom = (jint *) malloc(sizeof(jint) * n);
+  jlong *predStart = NULL;
+  jint *preds = NULL, *semi = NULL, *label = NULL, *ancestor = NULL, *stack = NULL;
+  jint r = -1;
+
+  if (dfn == NULL || order == NULL || parent == NULL || idom == NULL) {
+    goto done;
+  }
+
+  r = depthFirstNumber(graph, dfn, order, parent);
+  if (r < 0) {
+    goto done;
+  }
+
+  /* Predecessor lists, in preorder numbers, for the reachable part of the graph. */
+  predStart = (jlong *) calloc(sizeof(jlong), r + 1);
+  preds = (jint *) malloc(sizeof(jint) * (graph->edgeCount ? graph->edgeCount : 1));
+  semi = (jint *) malloc(sizeof(jint) * r);
+  label = (jint *) malloc(sizeof(jint) * r);
+  ancestor = (jint *) malloc(sizeof(jint) * r);
+  stack = (jint *) malloc(sizeof(jint) * r);
+  if (predStart == NULL || preds == NULL || semi == NULL || label == NULL || ancestor == NULL || stack == NULL) {
+    goto done;
+  }
+
+  for (jint v = 0; v < n; v++) {
+    if (dfn[v] != -1) {
+      for (jlong e = graph->edgeStart[v]; e < graph->edgeStart[v + 1]; e++) {
+        predStart[dfn[graph->edges[e]] + 1]++;
+      }
+    }
+  }
+  for (jint w = 0; w < r; w++) {
+    predStart[w + 1] += predStart[w];
+  }
+  for (jint v = 0; v < n; v++) {
+    if (dfn[v] != -1) {
+      for (jlong e = graph->edgeStart[v]; e < graph->edgeStart[v + 1]; e++) {
+        preds[predStart[dfn[graph->edges[e]]]++] = dfn[v];
+      }
+    }
+  }
+  for (jint w = r; w > 0; w--) {
+    predStart[w] = predStart[w - 1];
+  }
+  predStart[0] = 0;
+
+  /* Semidominators, in reverse preorder. */
+  for (jint w = 0; w < r; w++) {
+    semi[w] = w;
+    label[w] = w;
+    ancestor[w] = -1;
+  }
+  for (jint w = r - 1; w > 0; w--) {
+    for (jlong e = predStart[w]; e < predStart[w + 1]; e++) {
+      jint u = eval(preds[e], ancestor, label, semi, stack);
+      if (semi[u] < semi[w]) {
+        semi[w] = semi[u];
+      }
+    }
+    ancestor[w] = parent[w];
+  }
+
+  /* Immediate dominators are the nearest common ancestor of parent and semidominator. */
+  idom[0] = 0;
+  for (jint w = 1; w < r; w++) {
+    jint d = parent[w];
+    while (d > semi[w]) {
+      d = idom[d];
+    }
+    idom[w] = d;
+  }
+
+  /* Translate from preorder numbers back to node indices, reusing dfn for the result. */
+  for (jint v = 0; v < n; v++) {
+    dfn[v] = -1;
+  }
+  for (jint w = 0; w < r; w++) {
+    dfn[order[w]] = order[idom[w]];
+  }
+
+  free(tree->idom);
+  free(tree->order);
+  tree->nodeCount = n;
+  tree->idom = dfn;
+  tree->reachableCount = r;
+  tree->order = order;
+  dfn = order = NULL;
+  ok = true;
+
+done:
+  free(dfn);
+  free(order);
+  free(parent);
+  free(idom);
+  free(predStart);
+  free(preds);
+  free(semi);
+  free(label);
+  free(ancestor);
+  free(stack);
+  return ok;
+}
+
+
+void computeRetainedSizes(const HeapGraph *graph, const DominatorTree *tree, jlong *retained) {
+  for (jint v = 0; v < tree->nodeCount; v++) {
+    retained[v] = tree->idom[v] == -1 ? 0 : graph->size[v];
+  }
+  for (jint i = tree->reachableCount - 1; i > 0; i--) {
+    jint v = tree->order[i];
+    retained[tree->idom[v]] += retained[v];
+  }
+}
+
+
+bool computeClassRetainedSizes(
+    const HeapGraph *graph, const DominatorTree *tree, const jlong *retained,
+    jint classCount, jlong *classRetained) {
+  jint n = tree->nodeCount;
+  jint r = tree->reachableCount;
+  bool ok = false;
+
+  jint *childStart = (jint *) calloc(sizeof(jint), n + 1);
+  jint *children = (jint *) malloc(sizeof(jint) * r);
+  jint *stack = (jint *) malloc(sizeof(jint) * r);
+  jint *next = (jint *) malloc(sizeof(jint) * r);
+  jint *active = (jint *) calloc(sizeof(jint), classCount ? classCount : 1);
+  if (childStart == NULL || children == NULL || stack == NULL || next == NULL || active == NULL) {
+    goto done;
+  }
+
+  /* Children lists of the dominator tree. */
+  for (jint i = 1; i < r; i++) {
+    childStart[tree->idom[tree->order[i]] + 1]++;
+  }
+  for (jint v = 0; v < n; v++) {
+    childStart[v + 1] += childStart[v];
+  }
+  for (jint i = 1; i < r; i++) {
+    jint v = tree->order[i];
+    children[childStart[tree->idom[v]]++] = v;
+  }
+  for (jint v = n; v > 0; v--) {
+    childStart[v] = childStart[v - 1];
+  }
+  childStart[0] = 0;
+
+  /* Walk the dominator tree, charging each class only for its outermost instances. */
+  memset(classRetained, 0, sizeof(jlong) * classCount);
+  {
+    jint top = 1;
+    stack[0] = HEAP_GRAPH_ROOT;
+    next[0] = childStart[HEAP_GRAPH_ROOT];
+    while (top > 0) {
+      jint v = stack[top - 1];
+      if (next[top - 1] < childStart[v + 1]) {
+        jint c = children[next[top - 1]++];
+        jint k = graph->classIndex[c];
+        if (k >= 0 && k < classCount) {
+          if (active[k] == 0) {
+            classRetained[k] += retained[c];
+          }
+          active[k]++;
+        }
+        stack[top] = c;
+        next[top] = childStart[c];
+        top++;
+      } else {
+        jint k = graph->classIndex[v];
+        if (v != HEAP_GRAPH_ROOT && k >= 0 && k < classCount) {
+          active[k]--;
+        }
+        top--;
+      }
+    }
+  }
+  ok = true;
+
+done:
+  free(childStart);
+  free(children);
+  free(stack);
+  free(next);
+  free(active);
+  return ok;
+}
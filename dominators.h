@@ -0,0 +1,63 @@
+/*
+ * dominators.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_DOMINATORS_H
+#define POLARBEAR_DOMINATORS_H
+
+
+#include "jni.h"
+
+#include "heapgraph.h"
+
+
+/* Dominator tree of a HeapGraph rooted at HEAP_GRAPH_ROOT. */
+struct DominatorTree {
+  jint nodeCount;
+
+  /* Immediate dominator of each node, or -1 for nodes not reachable from the root. */
+  jint *idom;
+
+  /* Reachable nodes in depth first preorder, so every node comes after its dominator. */
+  jint reachableCount;
+  jint *order;
+
+  DominatorTree();
+
+  ~DominatorTree();
+};
+
+
+/* Builds the dominator tree with the Semi-NCA algorithm.  Returns false if there is not
+ * enough native memory for the scratch arrays. */
+bool computeDominatorTree(const HeapGraph *graph, DominatorTree *tree);
+
+
+/* Computes the retained size of every node: its own size plus the size of every node it
+ * dominates. */
+void computeRetainedSizes(const HeapGraph *graph, const DominatorTree *tree, jlong *retained);
+
+
+/* Computes the retained size of every class: the total size of the objects that are only
+ * reachable through instances of that class.  Instances dominated by another instance of the
+ * same class are counted once, through the outermost instance. */
+bool computeClassRetainedSizes(
+    const HeapGraph *graph, const DominatorTree *tree, const jlong *retained,
+    jint classCount, jlong *classRetained);
+
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * dumpstream.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <sys/uio.h>
+
+#include "arena.h"
+#include "dumpstream.h"
+#include "io.h"
+
+
+/* Compression level for gzipped dumps.  The fastest level already gets most of the gain on heap
+ * data, which is dominated by zeroes and repeated class ids. */
+#define DUMP_GZIP_LEVEL 1
+
+
+/* zlib allocators, so the compressor state comes from the same reserved memory as the blocks. */
+static voidpf zipAllocate(voidpf opaque, uInt items, uInt size) {
+  return scratchAllocate((size_t) items * size);
+}
+
+
+static void zipFree(voidpf opaque, voidpf address) {
+  scratchFree(address);
+}
+
+
+static bool writeBytes(DumpStream *stream, const char *data, size_t len) {
+  struct iovec iov;
+  iov.iov_base = (void *) data;
+  iov.iov_len = len;
+  stream->bytesOut += len;
+  return writeFully(stream->fd, &iov, 1);
+}
+
+
+/* Compresses or writes one block.  With flush set, also ends the gzip stream. */
+static bool drainBlock(DumpStream *stream, const char *data, size_t len, bool flush) {
+  if (!stream->compress) {
+    return writeBytes(stream, data, len);
+  }
+
+  stream->zip.next_in = (Bytef *) data;
+  stream->zip.avail_in = len;
+  int rc;
+  do {
+    stream->zip.next_out = (Bytef *) stream->out;
+    stream->zip.avail_out = DUMP_BLOCK_SIZE;
+    rc = deflate(&stream->zip, flush ? Z_FINISH : Z_NO_FLUSH);
+    if (rc == Z_STREAM_ERROR) {
+      return false;
+    }
+    size_t produced = DUMP_BLOCK_SIZE - stream->zip.avail_out;
+    if (produced > 0 && !writeBytes(stream, stream->out, produced)) {
+      return false;
+    }
+  } while (stream->zip.avail_out == 0 || flush && rc != Z_STREAM_END);
+  return true;
+}
+
+
+/* Body of the writer thread: drains full blocks in order until the stream is closed. */
+static void *drain(void *arg) {
+  DumpStream *stream = (DumpStream *) arg;
+
+  pthread_mutex_lock(&stream->lock);
+  while (true) {
+    while (stream->pendingCount == 0 && !stream->closing) {
+      pthread_cond_wait(&stream->changed, &stream->lock);
+    }
+    if (stream->pendingCount == 0) {
+      break;
+    }
+    int block = stream->pending[stream->pendingHead];
+    bool failed = stream->failed;
+    pthread_mutex_unlock(&stream->lock);
+
+    /* After a failure, blocks are still recycled so the walk can finish. */
+    bool ok = failed || drainBlock(stream, stream->blocks[block], stream->blockUsed[block], false);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->failed = stream->failed || !ok;
+    stream->pendingHead = (stream->pendingHead + 1) % DUMP_BLOCK_COUNT;
+    stream->pendingCount--;
+    stream->freeBlocks[stream->freeCount++] = block;
+    pthread_cond_broadcast(&stream->changed);
+  }
+  bool failed = stream->failed;
+  pthread_mutex_unlock(&stream->lock);
+
+  if (!failed && stream->compress && !drainBlock(stream, NULL, 0, true)) {
+    pthread_mutex_lock(&stream->lock);
+    stream->failed = true;
+    pthread_mutex_unlock(&stream->lock);
+  }
+  return NULL;
+}
+
+
+DumpStream::DumpStream() : fd(-1), compress(false), out(0), started(false), pendingHead(0), pendingCount(0),
+    freeCount(0), closing(false), failed(false), current(-1), used(0), bytesIn(0), bytesOut(0) {
+  memset(&this->zip, 0, sizeof(this->zip));
+  pthread_mutex_init(&this->lock, NULL);
+  pthread_cond_init(&this->changed, NULL);
+}
+
+
+bool DumpStream::open(int fd, bool compress) {
+  this->fd = fd;
+  this->compress = compress;
+
+  for (int i = 0; i < DUMP_BLOCK_COUNT; i++) {
+    this->blocks[i] = (char *) scratchAllocate(DUMP_BLOCK_SIZE);
+    if (this->blocks[i] == NULL) {
+      return false;
+    }
+    this->freeBlocks[this->freeCount++] = i;
+  }
+  if (compress) {
+    this->out = (char *) scratchAllocate(DUMP_BLOCK_SIZE);
+    this->zip.zalloc = zipAllocate;
+    this->zip.zfree = zipFree;
+    /* Window bits above 15 ask for a gzip header rather than a zlib one. */
+    if (this->out == NULL ||
+        deflateInit2(&this->zip, DUMP_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      this->compress = false;
+      return false;
+    }
+  }
+
+  if (pthread_create(&this->writer, NULL, drain, this) != 0) {
+    return false;
+  }
+  this->started = true;
+  this->current = this->freeBlocks[--this->freeCount];
+  this->used = 0;
+  return true;
+}
+
+
+void DumpStream::next() {
+  pthread_mutex_lock(&this->lock);
+  if (this->used > 0) {
+    this->blockUsed[this->current] = this->used;
+    this->pending[(this->pendingHead + this->pendingCount) % DUMP_BLOCK_COUNT] = this->current;
+    this->pendingCount++;
+    pthread_cond_broadcast(&this->changed);
+    while (this->freeCount == 0) {
+      pthread_cond_wait(&this->changed, &this->lock);
+    }
+    this->current = this->freeBlocks[--this->freeCount];
+  }
+  pthread_mutex_unlock(&this->lock);
+  this->bytesIn += this->used;
+  this->used = 0;
+}
+
+
+char *DumpStream::take(size_t len) {
+  if (len > this->room()) {
+    this->next();
+  }
+  char *p = this->blocks[this->current] + this->used;
+  this->used += len;
+  return p;
+}
+
+
+void DumpStream::write(const void *data, size_t len) {
+  const char *p = (const char *) data;
+  while (len > 0) {
+    if (this->room() == 0) {
+      this->next();
+    }
+    size_t n = len < this->room() ? len : this->room();
+    memcpy(this->blocks[this->current] + this->used, p, n);
+    this->used += n;
+    p += n;
+    len -= n;
+  }
+}
+
+
+bool DumpStream::close() {
+  if (!this->started) {
+    return false;
+  }
+  this->next();
+
+  pthread_mutex_lock(&this->lock);
+  this->closing = true;
+  pthread_cond_broadcast(&this->changed);
+  pthread_mutex_unlock(&this->lock);
+
+  pthread_join(this->writer, NULL);
+  this->started = false;
+  return !this->failed;
+}
+
+
+DumpStream::~DumpStream() {
+  if (this->started) {
+    this->close();
+  }
+  if (this->compress) {
+    deflateEnd(&this->zip);
+  }
+  pthread_cond_destroy(&this->changed);
+  pthread_mutex_destroy(&this->lock);
+}
@@ -0,0 +1,94 @@
+/*
+ * dumpstream.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_DUMPSTREAM_H
+#define POLARBEAR_DUMPSTREAM_H
+
+
+#include <pthread.h>
+#include <stddef.h>
+#include <zlib.h>
+
+#include "jni.h"
+
+
+#define DUMP_BLOCK_SIZE (1024 * 1024)
+#define DUMP_BLOCK_COUNT 4
+
+
+/* A byte stream to a file, filled by a heap walk and drained by a writer thread.  The walk writes
+ * into fixed blocks; each full block is handed to the writer, which gzips it if asked and writes it
+ * out, so the walk only waits for the disk when every block is in flight.
+ *
+ * The writer is a native thread rather than an agent thread: heap walks run at a safepoint with
+ * the other Java threads suspended, and an agent thread would be stopped along with them. */
+struct DumpStream {
+  int fd;
+  bool compress;
+  z_stream zip;
+  char *out;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t writer;
+  bool started;
+
+  char *blocks[DUMP_BLOCK_COUNT];
+  size_t blockUsed[DUMP_BLOCK_COUNT];
+  int pending[DUMP_BLOCK_COUNT];
+  int pendingHead;
+  int pendingCount;
+  int freeBlocks[DUMP_BLOCK_COUNT];
+  int freeCount;
+  bool closing;
+  bool failed;
+
+  /* The block being filled by the walk. */
+  int current;
+  size_t used;
+
+  jlong bytesIn;
+  jlong bytesOut;
+
+  DumpStream();
+
+  /* Sets up the blocks and the compressor from scratch memory and starts the writer.  Returns
+   * false if there is not enough memory or no thread could be started. */
+  bool open(int fd, bool compress);
+
+  /* Bytes left in the current block. */
+  size_t room() const { return DUMP_BLOCK_SIZE - this->used; }
+
+  /* Returns len contiguous bytes to fill, len at most DUMP_BLOCK_SIZE, moving on to a fresh block
+   * if the current one is too full. */
+  char *take(size_t len);
+
+  /* Appends len bytes, spanning blocks as needed. */
+  void write(const void *data, size_t len);
+
+  /* Hands the current block to the writer and waits for a free one. */
+  void next();
+
+  /* Writes out everything and stops the writer.  Returns false if anything failed to write. */
+  bool close();
+
+  ~DumpStream();
+};
+
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * gchistory.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "gchistory.h"
+
+
+/* The last GC_HISTORY_SIZE collections.  The event callbacks are the only writers of the records,
+ * and the VM never runs two collections at once, so a record is written by one thread at a time.
+ * Readers copy a record and check its seq to detect one rewritten under them. */
+static struct {
+  GcRecord records[GC_HISTORY_SIZE];
+  volatile jlong finished;
+  volatile jlong startTime;
+  volatile jlong totalPause;
+  volatile jlong longestPause;
+  int signal[2];
+} history;
+
+
+/* Copies the record of collection seq, returning false if it has been overwritten. */
+static bool readRecord(jlong seq, GcRecord *r) {
+  GcRecord *source = &history.records[seq % GC_HISTORY_SIZE];
+  *r = *source;
+  __sync_synchronize();
+  return r->seq == seq && source->seq == seq;
+}
+
+
+void initGcHistory() {
+  memset(&history, 0, sizeof(history));
+  history.signal[0] = history.signal[1] = -1;
+  if (pipe(history.signal) == 0) {
+    fcntl(history.signal[1], F_SETFL, O_NONBLOCK);
+  }
+}
+
+
+void JNICALL gcStart(jvmtiEnv *jvmti) {
+  history.startTime = monotonicMicros();
+}
+
+
+void JNICALL gcFinish(jvmtiEnv *jvmti) {
+  jlong seq = history.finished + 1;
+  GcRecord *r = &history.records[seq % GC_HISTORY_SIZE];
+
+  r->seq = 0;
+  __sync_synchronize();
+  r->start = history.startTime;
+  r->pause = monotonicMicros() - r->start;
+  r->used = -1;
+  r->committed = -1;
+  __sync_synchronize();
+  r->seq = seq;
+  history.totalPause += r->pause;
+  if (r->pause > history.longestPause) {
+    history.longestPause = r->pause;
+  }
+  history.finished = seq;
+
+  /* A full pipe already holds a wakeup, so a failed write loses nothing. */
+  if (history.signal[1] >= 0) {
+    char c = 0;
+    ssize_t ignored = write(history.signal[1], &c, 1);
+    (void) ignored;
+  }
+}
+
+
+void JNICALL gcMonitor(jvmtiEnv *jvmti, JNIEnv *jni, void *arg) {
+  jclass runtimeClass = jni->FindClass("java/lang/Runtime");
+  jmethodID getRuntime =
+      runtimeClass ? jni->GetStaticMethodID(runtimeClass, "getRuntime", "()Ljava/lang/Runtime;") : NULL;
+  jmethodID totalMemory = runtimeClass ? jni->GetMethodID(runtimeClass, "totalMemory", "()J") : NULL;
+  jmethodID freeMemory = runtimeClass ? jni->GetMethodID(runtimeClass, "freeMemory", "()J") : NULL;
+  jobject runtime = getRuntime ? jni->CallStaticObjectMethod(runtimeClass, getRuntime) : NULL;
+  if (runtime == NULL || totalMemory == NULL || freeMemory == NULL || history.signal[0] < 0) {
+    jni->ExceptionClear();
+    fprintf(stderr, "WARNING: Unable to track the heap in use after garbage collection.\n");
+    return;
+  }
+
+  /* Each wakeup measures the latest collection.  Collections that finish while the last one is
+   * measured share a wakeup and are left unmeasured. */
+  char drain[64];
+  for (;;) {
+    ssize_t n = read(history.signal[0], drain, sizeof(drain));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+
+    jlong seq = history.finished;
+    jlong committed = jni->CallLongMethod(runtime, totalMemory);
+    jlong used = committed - jni->CallLongMethod(runtime, freeMemory);
+    if (jni->ExceptionCheck()) {
+      jni->ExceptionClear();
+      continue;
+    }
+
+    GcRecord *r = &history.records[seq % GC_HISTORY_SIZE];
+    if (r->seq == seq) {
+      r->used = used;
+      r->committed = committed;
+    }
+  }
+}
+
+
+void getGcTotals(GcTotals *totals) {
+  memset(totals, 0, sizeof(GcTotals));
+  totals->lastUsed = totals->lastCommitted = -1;
+
+  /* Retry if a collection finishes while the totals are read. */
+  for (int attempt = 0; attempt < 3; attempt++) {
+    jlong finished = history.finished;
+    totals->collections = finished;
+    totals->totalPause = history.totalPause;
+    totals->longestPause = history.longestPause;
+
+    GcRecord r;
+    if (finished == 0 || (readRecord(finished, &r) && history.finished == finished)) {
+      if (finished > 0) {
+        totals->lastPause = r.pause;
+        totals->lastUsed = r.used;
+        totals->lastCommitted = r.committed;
+      }
+      return;
+    }
+  }
+}
+
+
+void printGcHistory(Output *out, int limit) {
+  jlong finished = history.finished;
+  if (finished == 0) {
+    out->printf("No garbage collections yet.\n\n");
+    return;
+  }
+
+  /* Totals over every collection still remembered. */
+  jlong now = monotonicMicros();
+  jlong first = finished > GC_HISTORY_SIZE ? finished - GC_HISTORY_SIZE + 1 : 1;
+  jlong count = 0, totalPause = 0, longestPause = 0, earliestStart = now;
+  GcRecord earliestUsed, latestUsed;
+  earliestUsed.seq = latestUsed.seq = 0;
+  for (jlong seq = first; seq <= finished; seq++) {
+    GcRecord r;
+    if (!readRecord(seq, &r)) {
+      continue;
+    }
+    count++;
+    totalPause += r.pause;
+    longestPause = r.pause > longestPause ? r.pause : longestPause;
+    earliestStart = r.start < earliestStart ? r.start : earliestStart;
+    if (r.used >= 0) {
+      if (earliestUsed.seq == 0) {
+        earliestUsed = r;
+      }
+      latestUsed = r;
+    }
+  }
+  if (count == 0) {
+    out->printf("No garbage collections recorded.\n\n");
+    return;
+  }
+
+  jlong window = now - earliestStart > 0 ? now - earliestStart : 1;
+  char text[512];
+  snprintf(text, sizeof(text), "%ld collections in total.  The last %ld took place over %ld seconds: %.1f per minute, "
+      "paused for %.2f%% of the time.\nPause average %ld us, longest %ld us.\n",
+      (long) finished, (long) count, (long) (window / 1000000), count * 60e6 / window, totalPause * 100.0 / window,
+      (long) (totalPause / count), (long) longestPause);
+  RecordField totals[] = {
+    { "collections", (long) finished, NULL },
+    { "recorded", (long) count, NULL },
+    { "windowMicros", (long) window, NULL },
+    { "pauseMicros", (long) totalPause, NULL },
+    { "averagePauseMicros", (long) (totalPause / count), NULL },
+    { "longestPauseMicros", (long) longestPause, NULL },
+  };
+  out->printRecord("gcTotals", totals, sizeof(totals) / sizeof(totals[0]), text);
+  if (latestUsed.seq != 0 && latestUsed.seq != earliestUsed.seq) {
+    jlong span = latestUsed.start - earliestUsed.start;
+    snprintf(text, sizeof(text), "Heap in use after collection went from %ld to %ld bytes over %ld seconds.\n",
+        (long) earliestUsed.used, (long) latestUsed.used, (long) (span / 1000000));
+    RecordField used[] = {
+      { "fromBytes", (long) earliestUsed.used, NULL },
+      { "toBytes", (long) latestUsed.used, NULL },
+      { "spanMicros", (long) span, NULL },
+    };
+    out->printRecord("gcUsed", used, sizeof(used) / sizeof(used[0]), text);
+  }
+
+  /* Collections whose heap use is unknown have only the first two columns. */
+  static const char *const columns[] = { "agoMillis", "pauseMicros", "usedAfter", "committed", NULL };
+  out->setColumnNames(columns);
+  out->printf("\nAgo (ms)   Pause (us) Used after Committed\n");
+  out->printf("---------- ---------- ---------- ----------\n");
+  for (jlong seq = finished; seq >= first && seq > finished - limit; seq--) {
+    GcRecord r;
+    if (!readRecord(seq, &r)) {
+      continue;
+    }
+    long values[] = { (long) ((now - r.start) / 1000), (long) r.pause, (long) r.used, (long) r.committed };
+    out->printColumns(values, r.used >= 0 ? 4 : 2, 10, NULL);
+  }
+  out->printf("---------- ---------- ---------- ----------\n\n");
+  out->flush();
+}
@@ -0,0 +1,80 @@
+/*
+ * gchistory.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_GC_HISTORY_H
+#define POLARBEAR_GC_HISTORY_H
+
+
+#include "jni.h"
+#include "jvmti.h"
+
+#include "io.h"
+
+
+/* Collections remembered, and how many of them the out of memory log lists. */
+#define GC_HISTORY_SIZE 256
+#define GC_OOM_RECORDS 20
+
+
+/* One garbage collection.  Times are in microseconds on the monotonic clock. */
+typedef struct {
+  jlong seq;
+  jlong start;
+  jlong pause;
+  /* Heap in use and committed just after the collection, or -1 if not measured yet. */
+  jlong used;
+  jlong committed;
+} GcRecord;
+
+
+/* Totals over every collection since startup.  Times are in microseconds. */
+typedef struct {
+  jlong collections;
+  jlong totalPause;
+  jlong longestPause;
+  jlong lastPause;
+  /* Heap in use and committed after the last collection, or -1 if not measured yet. */
+  jlong lastUsed;
+  jlong lastCommitted;
+} GcTotals;
+
+
+/* Sets up the history and the pipe the event callbacks signal through.  Called from Agent_OnLoad. */
+void initGcHistory();
+
+
+/* GarbageCollectionStart and GarbageCollectionFinish event callbacks.  These run with the VM
+ * stopped, so they only write to the history and the pipe and never take a lock. */
+void JNICALL gcStart(jvmtiEnv *jvmti);
+void JNICALL gcFinish(jvmtiEnv *jvmti);
+
+
+/* Agent thread that wakes after each collection and records how much of the heap is in use. */
+void JNICALL gcMonitor(jvmtiEnv *jvmti, JNIEnv *jni, void *arg);
+
+
+/* Reads the totals without blocking, for the metrics endpoint. */
+void getGcTotals(GcTotals *totals);
+
+
+/* Prints collection frequency, pause times and the heap in use after the last limit collections.
+ * Never allocates. */
+void printGcHistory(Output *out, int limit);
+
+
+#endif
@@ -0,0 +1,258 @@
+/*
+ * graphbench.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Times the heap analyses on synthetic heaps, without a JVM. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base.h"
+#include "dominators.h"
+#include "heapgraph.h"
+#include "heapsource.h"
+#include "syntheticheap.h"
+
+
+/* Depth of the referrer levels, as in the agent. */
+#define BENCH_REFER_DEPTH 3
+
+/* Classes whose reachable sizes are computed together, as one propagation. */
+#define BENCH_REACH_SLOTS 64
+
+
+typedef struct {
+  jint objects;
+  jint classes;
+  jint degree;
+  unsigned int seed;
+  int runs;
+} Options;
+
+
+typedef struct {
+  jlong best;
+  jlong total;
+} Timing;
+
+
+static void record(Timing *t, jlong micros) {
+  if (t->total == 0 || micros < t->best) {
+    t->best = micros;
+  }
+  t->total += micros;
+}
+
+
+static void printTiming(const char *name, const Timing *t, int runs) {
+  printf("%10ld %10ld %s\n", (long) (t->best / 1000), (long) (t->total / runs / 1000), name);
+}
+
+
+/* Runs every analysis the given number of times.  Returns false if one of them gave a wrong answer
+ * or ran out of memory. */
+static bool bench(SyntheticHeapSource *heap, const Options *options) {
+  jint classCount = options->classes;
+  jint *counts = (jint *) malloc(sizeof(jint) * classCount);
+  jlong *space = (jlong *) malloc(sizeof(jlong) * classCount);
+  jint *levels = (jint *) malloc(sizeof(jint) * classCount * BENCH_REFER_DEPTH);
+  jint *classSlot = (jint *) malloc(sizeof(jint) * classCount);
+  jlong *reachable = (jlong *) malloc(sizeof(jlong) * BENCH_REACH_SLOTS);
+  jlong *retained = (jlong *) malloc(sizeof(jlong) * heap->graph.nodeCount);
+  jlong *classRetained = (jlong *) malloc(sizeof(jlong) * classCount);
+  jint *parent = (jint *) malloc(sizeof(jint) * heap->graph.nodeCount);
+  if (!counts || !space || !levels || !classSlot || !reachable || !retained || !classRetained || !parent) {
+    fprintf(stderr, "Out of memory.\n");
+    return false;
+  }
+  for (jint k = 0; k < classCount; k++) {
+    classSlot[k] = k < BENCH_REACH_SLOTS ? k : -1;
+  }
+
+  jlong totalSize = 0;
+  jlong firstLevelReferences = 0;
+  for (jint v = HEAP_GRAPH_ROOT + 1; v < heap->graph.nodeCount; v++) {
+    totalSize += heap->graph.size[v];
+    for (jlong e = heap->graph.edgeStart[v]; e < heap->graph.edgeStart[v + 1]; e++) {
+      if (heap->graph.classIndex[v] != 0 && heap->graph.classIndex[heap->graph.edges[e]] == 0) {
+        firstLevelReferences++;
+      }
+    }
+  }
+
+  Timing timings[10];
+  memset(timings, 0, sizeof(timings));
+  bool ok = true;
+  for (int run = 0; run < options->runs && ok; run++) {
+    memset(counts, 0, sizeof(jint) * classCount);
+    memset(space, 0, sizeof(jlong) * classCount);
+    jlong start = monotonicMicros();
+    countObjects(heap, -1, classCount, counts, space);
+    record(&timings[0], monotonicMicros() - start);
+    jlong counted = 0;
+    for (jint k = 0; k < classCount; k++) {
+      counted += counts[k];
+    }
+    if (counted != options->objects) {
+      fprintf(stderr, "Counted %ld objects of %ld.\n", (long) counted, (long) options->objects);
+      ok = false;
+    }
+
+    memset(levels, 0, sizeof(jint) * classCount * BENCH_REFER_DEPTH);
+    start = monotonicMicros();
+    countReferrerLevels(heap, 0, BENCH_REFER_DEPTH, classCount, levels);
+    record(&timings[1], monotonicMicros() - start);
+
+    start = monotonicMicros();
+    markReachableSize(heap, 0);
+    record(&timings[2], monotonicMicros() - start);
+
+    HeapGraph graph;
+    HeapGraphBuilder builder;
+    start = monotonicMicros();
+    ok = ok && captureHeapGraph(heap, classCount, &builder, &graph);
+    record(&timings[3], monotonicMicros() - start);
+
+    if (ok) {
+      HeapGraph labelled;
+      HeapGraphBuilder labelledBuilder(true);
+      jint rowCount = 0;
+      start = monotonicMicros();
+      ReferrerField *rows = NULL;
+      if (captureHeapGraph(heap, classCount, &labelledBuilder, &labelled)) {
+        rows = countReferrerFields(&labelled, 0, BENCH_REFER_DEPTH, &rowCount);
+      }
+      record(&timings[8], monotonicMicros() - start);
+
+      jlong references = 0;
+      for (jint i = 0; i < rowCount && rows[i].level == 1; i++) {
+        references += rows[i].references;
+      }
+      if (rows == NULL || references != firstLevelReferences) {
+        fprintf(stderr, "Attributed %ld references of %ld.\n", (long) references, (long) firstLevelReferences);
+        ok = false;
+      }
+      free(rows);
+    }
+
+    start = monotonicMicros();
+    ok = ok && computeReachableSizes(&graph, classSlot, classCount, BENCH_REACH_SLOTS < classCount ? BENCH_REACH_SLOTS : classCount, reachable);
+    record(&timings[4], monotonicMicros() - start);
+
+    start = monotonicMicros();
+    ok = ok && computeRootPaths(&graph, parent);
+    record(&timings[9], monotonicMicros() - start);
+    for (jint v = HEAP_GRAPH_ROOT + 1; ok && v < graph.nodeCount; v++) {
+      if (parent[v] < 0) {
+        fprintf(stderr, "No path from the roots to object %d.\n", (int) v);
+        ok = false;
+      }
+    }
+
+    DominatorTree tree;
+    start = monotonicMicros();
+    ok = ok && computeDominatorTree(&graph, &tree);
+    record(&timings[5], monotonicMicros() - start);
+
+    if (ok) {
+      start = monotonicMicros();
+      computeRetainedSizes(&graph, &tree, retained);
+      record(&timings[6], monotonicMicros() - start);
+
+      start = monotonicMicros();
+      ok = computeClassRetainedSizes(&graph, &tree, retained, classCount, classRetained);
+      record(&timings[7], monotonicMicros() - start);
+
+      /* Everything is reachable, so the roots retain the whole heap. */
+      if (retained[HEAP_GRAPH_ROOT] != totalSize) {
+        fprintf(stderr, "The roots retain %ld bytes of %ld.\n", (long) retained[HEAP_GRAPH_ROOT], (long) totalSize);
+        ok = false;
+      }
+    }
+  }
+
+  if (ok) {
+    printf("Best (ms)  Mean (ms)  Analysis\n");
+    printf("---------- ---------- ----------------------\n");
+    printTiming("count instances", &timings[0], options->runs);
+    printTiming("referrer levels", &timings[1], options->runs);
+    printTiming("referrer fields", &timings[8], options->runs);
+    printTiming("mark reachable", &timings[2], options->runs);
+    printTiming("capture graph", &timings[3], options->runs);
+    printTiming("reachable sizes", &timings[4], options->runs);
+    printTiming("root paths", &timings[9], options->runs);
+    printTiming("dominators", &timings[5], options->runs);
+    printTiming("retained sizes", &timings[6], options->runs);
+    printTiming("class retained sizes", &timings[7], options->runs);
+    printf("---------- ---------- ----------------------\n");
+  }
+
+  free(counts);
+  free(space);
+  free(levels);
+  free(classSlot);
+  free(reachable);
+  free(retained);
+  free(classRetained);
+  free(parent);
+  return ok;
+}
+
+
+static void usage() {
+  fprintf(stderr, "Usage: graphbench [-n objects] [-c classes] [-d degree] [-s seed] [-r runs]\n");
+  exit(2);
+}
+
+
+int main(int argc, char **argv) {
+  Options options = { 1000000, 1000, 3, 1, 3 };
+  for (int i = 1; i < argc; i++) {
+    int value = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+    if (value <= 0) {
+      usage();
+    } else if (strcmp(argv[i], "-n") == 0) {
+      options.objects = value;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      options.classes = value;
+    } else if (strcmp(argv[i], "-d") == 0) {
+      options.degree = value;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      options.seed = value;
+    } else if (strcmp(argv[i], "-r") == 0) {
+      options.runs = value;
+    } else {
+      usage();
+    }
+    i++;
+  }
+
+  SyntheticHeapSource heap;
+  {
+    HeapGraphBuilder builder(true);
+    jlong start = monotonicMicros();
+    if (!generateHeap(&builder, options.objects, options.classes, options.degree, options.seed) || !heap.build(&builder)) {
+      fprintf(stderr, "Not enough memory for %d objects.\n", (int) options.objects);
+      return 1;
+    }
+    printf("%d objects of %d classes, %ld references, generated in %ld ms.\n\n", (int) options.objects,
+        (int) options.classes, (long) heap.graph.edgeCount, (long) ((monotonicMicros() - start) / 1000));
+  }
+
+  return bench(&heap, &options) ? 0 : 1;
+}
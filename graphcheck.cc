@@ -0,0 +1,599 @@
+/*
+ * graphcheck.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Checks the heap analyses against small hand-built heaps whose answers are known, without a JVM. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dominators.h"
+#include "heapgraph.h"
+#include "heapsource.h"
+#include "syntheticheap.h"
+
+
+/* Most classes in any of the heaps. */
+#define CHECK_CLASSES 8
+
+/* Referrer levels looked back through, as in the agent. */
+#define CHECK_REFER_DEPTH 3
+
+
+static const char *heapName;
+static int failures;
+
+
+/* Reports a value that differs from the one expected. */
+static void expect(const char *what, jlong actual, jlong expected) {
+  if (actual != expected) {
+    fprintf(stderr, "%s: %s is %ld, expected %ld.\n", heapName, what, (long) actual, (long) expected);
+    failures++;
+  }
+}
+
+
+/* Adds a reference with its label. */
+static void reference(HeapGraphBuilder *builder, jint from, jint to, jint kind, jint index, jint holder) {
+  HeapReference ref = { kind, index, holder };
+  builder->addEdge(from, to, packHeapReference(&ref));
+}
+
+
+/* Adds a reference from the GC roots. */
+static void root(HeapGraphBuilder *builder, jint to) {
+  reference(builder, HEAP_GRAPH_ROOT, to, HEAP_REFERENCE_ROOT_JNI_GLOBAL, 0, -1);
+}
+
+
+/* Adds a reference held in an instance field. */
+static void field(HeapGraphBuilder *builder, jint from, jint to, jint index) {
+  reference(builder, from, to, HEAP_REFERENCE_FIELD, index, -1);
+}
+
+
+/* What one heap should give.  Node arrays are indexed as the nodes were added; a negative expected
+ * value is not checked. */
+typedef struct {
+  jint classCount;
+  const jint *idom;
+  const jlong *retained;
+  const jlong *classRetained;
+  const jlong *reachable;
+  /* Class whose referrers are counted, and what countReferrerLevels gives for it. */
+  jint target;
+  const jint *levels;
+} Expected;
+
+
+/* Checks the dominators, retained sizes and reachable sizes of a graph. */
+static void checkGraph(const HeapGraph *graph, const Expected *expected) {
+  DominatorTree tree;
+  if (!computeDominatorTree(graph, &tree)) {
+    expect("computeDominatorTree", 0, 1);
+    return;
+  }
+  jlong retained[16];
+  jlong classRetained[CHECK_CLASSES];
+  jlong reachable[CHECK_CLASSES];
+  jint classSlot[CHECK_CLASSES];
+  for (jint k = 0; k < expected->classCount; k++) {
+    classSlot[k] = k;
+  }
+  computeRetainedSizes(graph, &tree, retained);
+  expect("computeClassRetainedSizes", computeClassRetainedSizes(graph, &tree, retained, expected->classCount, classRetained), 1);
+  expect("computeReachableSizes",
+      computeReachableSizes(graph, classSlot, expected->classCount, expected->classCount, reachable), 1);
+
+  char what[64];
+  for (jint v = HEAP_GRAPH_ROOT + 1; v < graph->nodeCount; v++) {
+    snprintf(what, sizeof(what), "idom of node %d", (int) v);
+    expect(what, tree.idom[v], expected->idom[v]);
+    if (expected->retained[v] >= 0) {
+      snprintf(what, sizeof(what), "retained size of node %d", (int) v);
+      expect(what, retained[v], expected->retained[v]);
+    }
+  }
+  expect("retained size of the roots", retained[HEAP_GRAPH_ROOT], expected->retained[HEAP_GRAPH_ROOT]);
+  for (jint k = 0; k < expected->classCount; k++) {
+    snprintf(what, sizeof(what), "retained size of class %d", (int) k);
+    expect(what, classRetained[k], expected->classRetained[k]);
+    if (expected->reachable[k] >= 0) {
+      snprintf(what, sizeof(what), "reachable size of class %d", (int) k);
+      expect(what, reachable[k], expected->reachable[k]);
+    }
+  }
+}
+
+
+/* Checks the analyses that walk a heap source: instance counts, referrer levels, marked reachable
+ * sizes and the capture of the reachable graph. */
+static void checkHeap(SyntheticHeapSource *heap, const Expected *expected, jint reachableNodes) {
+  checkGraph(&heap->graph, expected);
+
+  char what[64];
+  jint counts[CHECK_CLASSES];
+  jlong space[CHECK_CLASSES];
+  memset(counts, 0, sizeof(counts));
+  memset(space, 0, sizeof(space));
+  expect("objects of unknown classes", countObjects(heap, -1, expected->classCount, counts, space), 0);
+  for (jint k = 0; k < expected->classCount; k++) {
+    jint count = 0;
+    jlong size = 0;
+    for (jint v = HEAP_GRAPH_ROOT + 1; v < heap->graph.nodeCount; v++) {
+      if (heap->graph.classIndex[v] == k) {
+        count++;
+        size += heap->graph.size[v];
+      }
+    }
+    snprintf(what, sizeof(what), "count of class %d", (int) k);
+    expect(what, counts[k], count);
+    snprintf(what, sizeof(what), "space of class %d", (int) k);
+    expect(what, space[k], size);
+  }
+
+  jint levels[CHECK_CLASSES * CHECK_REFER_DEPTH];
+  memset(levels, 0, sizeof(levels));
+  countReferrerLevels(heap, expected->target, CHECK_REFER_DEPTH, expected->classCount, levels);
+  for (jint i = 0; i < expected->classCount * CHECK_REFER_DEPTH; i++) {
+    snprintf(what, sizeof(what), "level %d referrers of class %d", (int) (i % CHECK_REFER_DEPTH + 1), (int) (i / CHECK_REFER_DEPTH));
+    expect(what, levels[i], expected->levels[i]);
+  }
+
+  /* Marking follows references in the order they are reported, which is breadth first from the
+   * roots here, so it finds everything the graph does. */
+  for (jint k = 0; k < expected->classCount; k++) {
+    if (expected->reachable[k] >= 0) {
+      snprintf(what, sizeof(what), "marked reachable size of class %d", (int) k);
+      expect(what, markReachableSize(heap, k), expected->reachable[k]);
+    }
+  }
+  jint classSlot[CHECK_CLASSES];
+  jlong slotReachable[CHECK_CLASSES];
+  for (jint k = 0; k < expected->classCount; k++) {
+    classSlot[k] = expected->classCount - 1 - k;
+  }
+  markReachableSizes(heap, classSlot, expected->classCount, expected->classCount, slotReachable);
+  for (jint k = 0; k < expected->classCount; k++) {
+    if (expected->reachable[k] >= 0) {
+      snprintf(what, sizeof(what), "batch marked reachable size of class %d", (int) k);
+      expect(what, slotReachable[classSlot[k]], expected->reachable[k]);
+    }
+  }
+
+  /* The captured graph numbers nodes in discovery order, so compare what does not depend on it. */
+  HeapGraph graph;
+  HeapGraphBuilder builder(true);
+  if (!captureHeapGraph(heap, expected->classCount, &builder, &graph)) {
+    expect("captureHeapGraph", 0, 1);
+    return;
+  }
+  expect("captured nodes", graph.nodeCount, reachableNodes);
+  DominatorTree tree;
+  jlong retained[16];
+  jlong classRetained[CHECK_CLASSES];
+  if (!computeDominatorTree(&graph, &tree)) {
+    expect("computeDominatorTree of the capture", 0, 1);
+    return;
+  }
+  computeRetainedSizes(&graph, &tree, retained);
+  computeClassRetainedSizes(&graph, &tree, retained, expected->classCount, classRetained);
+  expect("captured retained size of the roots", retained[HEAP_GRAPH_ROOT], expected->retained[HEAP_GRAPH_ROOT]);
+  for (jint k = 0; k < expected->classCount; k++) {
+    snprintf(what, sizeof(what), "captured retained size of class %d", (int) k);
+    expect(what, classRetained[k], expected->classRetained[k]);
+  }
+}
+
+
+/* Builds a heap from a filled builder. */
+static bool build(SyntheticHeapSource *heap, HeapGraphBuilder *builder) {
+  if (!heap->build(builder)) {
+    fprintf(stderr, "%s: out of memory.\n", heapName);
+    failures++;
+    return false;
+  }
+  return true;
+}
+
+
+/* Returns the row for one holder of references at one level, or NULL. */
+static const ReferrerField *findRow(
+    const ReferrerField *rows, jint rowCount, jint level, jint holder, jint kind, jint index) {
+  for (jint i = 0; i < rowCount; i++) {
+    if (rows[i].level == level && rows[i].holder == holder && rows[i].kind == kind && rows[i].index == index) {
+      return &rows[i];
+    }
+  }
+  return NULL;
+}
+
+
+/* Checks one row of countReferrerFields. */
+static void expectRow(const ReferrerField *rows, jint rowCount, jint level, jint holder, jint kind, jint index,
+    jlong references, jlong bytes) {
+  char what[96];
+  const ReferrerField *row = findRow(rows, rowCount, level, holder, kind, index);
+  snprintf(what, sizeof(what), "level %d references held by class %d kind %d index %d",
+      (int) level, (int) holder, (int) kind, (int) index);
+  expect(what, row ? row->references : 0, references);
+  snprintf(what, sizeof(what), "level %d bytes held by class %d kind %d index %d",
+      (int) level, (int) holder, (int) kind, (int) index);
+  expect(what, row ? row->bytes : 0, bytes);
+}
+
+
+/* Two paths from A to D, so D is dominated by A and by neither branch.
+ *
+ *   roots -> A -> B -> D
+ *            A -> C -> D
+ */
+static bool buildDiamond(SyntheticHeapSource *heap) {
+  HeapGraphBuilder builder(true);
+  jint a = builder.addNode(10, 0);
+  jint b = builder.addNode(20, 1);
+  jint c = builder.addNode(30, 2);
+  jint d = builder.addNode(40, 3);
+  root(&builder, a);
+  field(&builder, a, b, 0);
+  field(&builder, a, c, 1);
+  field(&builder, b, d, 0);
+  field(&builder, c, d, 0);
+  return build(heap, &builder);
+}
+
+
+static void checkDiamond() {
+  heapName = "diamond";
+  SyntheticHeapSource heap;
+  if (!buildDiamond(&heap)) {
+    return;
+  }
+
+  static const jint idom[] = { -1, 0, 1, 1, 1 };
+  static const jlong retained[] = { 100, 100, 20, 30, 40 };
+  static const jlong classRetained[] = { 100, 20, 30, 40 };
+  static const jlong reachable[] = { 100, 60, 70, 40 };
+  /* D is held by B and C, and they by A. */
+  static const jint levels[] = {
+    0, 1, 0,
+    1, 0, 0,
+    1, 0, 0,
+    0, 0, 0,
+  };
+  Expected expected = { 4, idom, retained, classRetained, reachable, 3, levels };
+  checkHeap(&heap, &expected, 5);
+}
+
+
+/* A cache shared by two holders.  Neither holder retains it, but both reach it.
+ *
+ *   roots -> H1 -> C -> E1, E2, E3
+ *   roots -> H2 -> C
+ */
+static bool buildSharedCache(SyntheticHeapSource *heap) {
+  HeapGraphBuilder builder(true);
+  jint h1 = builder.addNode(16, 0);
+  jint h2 = builder.addNode(16, 0);
+  jint cache = builder.addNode(24, 1);
+  root(&builder, h1);
+  root(&builder, h2);
+  field(&builder, h1, cache, 5);
+  field(&builder, h2, cache, 5);
+  for (jint i = 0; i < 3; i++) {
+    jint entry = builder.addNode(100, 2);
+    reference(&builder, cache, entry, HEAP_REFERENCE_ARRAY_ELEMENT, i, -1);
+  }
+  return build(heap, &builder);
+}
+
+
+static void checkSharedCache() {
+  heapName = "shared cache";
+  SyntheticHeapSource heap;
+  if (!buildSharedCache(&heap)) {
+    return;
+  }
+
+  static const jint idom[] = { -1, 0, 0, 0, 3, 3, 3 };
+  static const jlong retained[] = { 356, 16, 16, 324, 100, 100, 100 };
+  static const jlong classRetained[] = { 32, 324, 300 };
+  static const jlong reachable[] = { 356, 324, 300 };
+  static const jint levels[] = {
+    0, 2, 0,
+    1, 0, 0,
+    0, 0, 0,
+  };
+  Expected expected = { 3, idom, retained, classRetained, reachable, 2, levels };
+  checkHeap(&heap, &expected, 7);
+
+}
+
+
+/* A cycle entered at X.  Only X is reachable without going around the cycle, so X dominates it,
+ * and the class is charged once, through X.
+ *
+ *   roots -> X -> Y -> Z -> X
+ *                      Z -> W
+ */
+static bool buildCycle(SyntheticHeapSource *heap) {
+  HeapGraphBuilder builder(true);
+  jint x = builder.addNode(10, 0);
+  jint y = builder.addNode(10, 0);
+  jint z = builder.addNode(10, 0);
+  jint w = builder.addNode(50, 1);
+  root(&builder, x);
+  field(&builder, x, y, 0);
+  field(&builder, y, z, 0);
+  field(&builder, z, x, 0);
+  field(&builder, z, w, 1);
+  return build(heap, &builder);
+}
+
+
+static void checkCycle() {
+  heapName = "cycle";
+  SyntheticHeapSource heap;
+  if (!buildCycle(&heap)) {
+    return;
+  }
+
+  static const jint idom[] = { -1, 0, 1, 2, 3 };
+  static const jlong retained[] = { 80, 80, 70, 60, 50 };
+  static const jlong classRetained[] = { 80, 50 };
+  static const jlong reachable[] = { 80, 50 };
+  /* Z holds W; Y and X are further back, and X is also one more step round the cycle. */
+  static const jint levels[] = {
+    1, 1, 1,
+    0, 0, 0,
+  };
+  Expected expected = { 2, idom, retained, classRetained, reachable, 1, levels };
+  checkHeap(&heap, &expected, 5);
+}
+
+
+/* Objects nothing reachable refers to, though they refer to a reachable one.  They are left out
+ * of the dominator tree, the root paths and the capture, but are still counted as instances.
+ *
+ *   roots -> P
+ *   Q -> R -> Q, Q -> P
+ */
+static bool buildUnreachableIsland(SyntheticHeapSource *heap) {
+  HeapGraphBuilder builder(true);
+  jint p = builder.addNode(8, 0);
+  jint q = builder.addNode(8, 0);
+  jint r = builder.addNode(32, 1);
+  root(&builder, p);
+  field(&builder, q, r, 0);
+  field(&builder, r, q, 0);
+  field(&builder, q, p, 1);
+  return build(heap, &builder);
+}
+
+
+static void checkUnreachableIsland() {
+  heapName = "unreachable island";
+  SyntheticHeapSource heap;
+  if (!buildUnreachableIsland(&heap)) {
+    return;
+  }
+
+  static const jint idom[] = { -1, 0, -1, -1 };
+  static const jlong retained[] = { 8, 8, -1, -1 };
+  static const jlong classRetained[] = { 8, 0 };
+  /* Reachable sizes of the island depend on whether the analysis starts from every instance or
+   * only from what the walk reaches, so only the reachable class is checked. */
+  static const jlong reachable[] = { -1, -1 };
+  static const jint levels[] = {
+    0, 0, 0,
+    0, 0, 0,
+  };
+  Expected expected = { 2, idom, retained, classRetained, reachable, 0, levels };
+  checkHeap(&heap, &expected, 2);
+
+  DominatorTree tree;
+  if (computeDominatorTree(&heap.graph, &tree)) {
+    expect("reachable nodes", tree.reachableCount, 2);
+  }
+}
+
+
+/* A chain of referrers three levels deep, and a static field one level from the target, which
+ * the shortest path from the roots goes through.
+ *
+ *   roots -> L3 -> L2 -> L1 -> T
+ *   roots -> S  -> T               (S is a class object, holding T in a static field of class 5)
+ */
+static bool buildReferrerChain(SyntheticHeapSource *heap) {
+  HeapGraphBuilder builder(true);
+  jint t = builder.addNode(64, 0);
+  jint l1 = builder.addNode(16, 1);
+  jint l2 = builder.addNode(16, 2);
+  jint l3 = builder.addNode(16, 3);
+  jint s = builder.addNode(8, 4);
+  root(&builder, l3);
+  reference(&builder, HEAP_GRAPH_ROOT, s, HEAP_REFERENCE_ROOT_SYSTEM_CLASS, 0, -1);
+  field(&builder, l3, l2, 2);
+  field(&builder, l2, l1, 1);
+  field(&builder, l1, t, 0);
+  reference(&builder, s, t, HEAP_REFERENCE_STATIC_FIELD, 2, 5);
+  return build(heap, &builder);
+}
+
+
+static void checkReferrerChain() {
+  heapName = "referrer chain";
+  SyntheticHeapSource heap;
+  if (!buildReferrerChain(&heap)) {
+    return;
+  }
+
+  static const jint idom[] = { -1, 0, 3, 4, 0, 0 };
+  static const jlong retained[] = { 120, 64, 16, 32, 48, 8 };
+  static const jlong classRetained[] = { 64, 16, 32, 48, 8, 0 };
+  static const jlong reachable[] = { 64, 80, 96, 112, 72, 0 };
+  static const jint levels[] = {
+    0, 0, 0,
+    1, 0, 0,
+    0, 1, 0,
+    0, 0, 1,
+    1, 0, 0,
+    0, 0, 0,
+  };
+  Expected expected = { 6, idom, retained, classRetained, reachable, 0, levels };
+  checkHeap(&heap, &expected, 6);
+
+}
+
+/* The rows of countReferrerFields: references by level, holding class, kind and field index, with
+ * the bytes they hold. */
+static void checkReferrerFields() {
+  SyntheticHeapSource diamond;
+  heapName = "diamond";
+  if (buildDiamond(&diamond)) {
+    jint rowCount;
+    ReferrerField *rows = countReferrerFields(&diamond.graph, 3, CHECK_REFER_DEPTH, &rowCount);
+    expect("referrer field rows", rows ? rowCount : -1, 4);
+    expectRow(rows, rowCount, 1, 1, HEAP_REFERENCE_FIELD, 0, 1, 40);
+    expectRow(rows, rowCount, 1, 2, HEAP_REFERENCE_FIELD, 0, 1, 40);
+    /* A holds both branches, one in each field. */
+    expectRow(rows, rowCount, 2, 0, HEAP_REFERENCE_FIELD, 0, 1, 20);
+    expectRow(rows, rowCount, 2, 0, HEAP_REFERENCE_FIELD, 1, 1, 30);
+    free(rows);
+  }
+
+  SyntheticHeapSource shared;
+  heapName = "shared cache";
+  if (buildSharedCache(&shared)) {
+    /* Array elements are counted together, whatever their index; fields by index.  The same answer
+     * comes from a captured graph, whose labels come from the walk. */
+    for (int captured = 0; captured < 2; captured++) {
+      HeapGraph graph;
+      HeapGraphBuilder capture(true);
+      if (captured && !captureHeapGraph(&shared, 3, &capture, &graph)) {
+        expect("captureHeapGraph", 0, 1);
+        break;
+      }
+      jint rowCount;
+      ReferrerField *rows = countReferrerFields(captured ? &graph : &shared.graph, 2, CHECK_REFER_DEPTH, &rowCount);
+      expect("referrer field rows", rows ? rowCount : -1, 2);
+      expectRow(rows, rowCount, 1, 1, HEAP_REFERENCE_ARRAY_ELEMENT, 0, 3, 300);
+      expectRow(rows, rowCount, 2, 0, HEAP_REFERENCE_FIELD, 5, 2, 48);
+      if (rows != NULL && rowCount == 2) {
+        expect("level of the first row", rows[0].level, 1);
+      }
+      free(rows);
+    }
+  }
+
+  SyntheticHeapSource chain;
+  heapName = "referrer chain";
+  if (buildReferrerChain(&chain)) {
+    jint rowCount;
+    ReferrerField *rows = countReferrerFields(&chain.graph, 0, CHECK_REFER_DEPTH, &rowCount);
+    expect("referrer field rows", rows ? rowCount : -1, 4);
+    expectRow(rows, rowCount, 1, 1, HEAP_REFERENCE_FIELD, 0, 1, 64);
+    /* A static field is held by the class it belongs to, not by the class object's class. */
+    expectRow(rows, rowCount, 1, 5, HEAP_REFERENCE_STATIC_FIELD, 2, 1, 64);
+    expectRow(rows, rowCount, 2, 2, HEAP_REFERENCE_FIELD, 1, 1, 16);
+    expectRow(rows, rowCount, 3, 3, HEAP_REFERENCE_FIELD, 2, 1, 16);
+    free(rows);
+
+    /* A shallower search stops short of L3. */
+    rows = countReferrerFields(&chain.graph, 0, 2, &rowCount);
+    expect("referrer field rows two levels deep", rows ? rowCount : -1, 3);
+    expectRow(rows, rowCount, 3, 3, HEAP_REFERENCE_FIELD, 2, 0, 0);
+    free(rows);
+  }
+}
+
+
+/* Checks the parent of every node on its shortest path from the roots; -1 for nodes the roots do
+ * not reach. */
+static void expectRootPaths(const SyntheticHeapSource *heap, const jint *expected) {
+  jint parent[16];
+  if (!computeRootPaths(&heap->graph, parent)) {
+    expect("computeRootPaths", 0, 1);
+    return;
+  }
+  char what[64];
+  for (jint v = HEAP_GRAPH_ROOT + 1; v < heap->graph.nodeCount; v++) {
+    snprintf(what, sizeof(what), "path parent of node %d", (int) v);
+    expect(what, parent[v], expected[v]);
+  }
+}
+
+
+/* The shortest paths from the roots that the path command prints. */
+static void checkRootPaths() {
+  SyntheticHeapSource diamond;
+  heapName = "diamond";
+  if (buildDiamond(&diamond)) {
+    /* D is reached through B, the first branch found. */
+    static const jint parent[] = { -1, 0, 1, 1, 2 };
+    expectRootPaths(&diamond, parent);
+  }
+
+  SyntheticHeapSource shared;
+  heapName = "shared cache";
+  if (buildSharedCache(&shared)) {
+    static const jint parent[] = { -1, 0, 0, 1, 3, 3, 3 };
+    expectRootPaths(&shared, parent);
+  }
+
+  SyntheticHeapSource cycle;
+  heapName = "cycle";
+  if (buildCycle(&cycle)) {
+    /* The reference from Z back to X does not shorten the path to X. */
+    static const jint parent[] = { -1, 0, 1, 2, 3 };
+    expectRootPaths(&cycle, parent);
+  }
+
+  SyntheticHeapSource island;
+  heapName = "unreachable island";
+  if (buildUnreachableIsland(&island)) {
+    static const jint parent[] = { -1, 0, -1, -1 };
+    expectRootPaths(&island, parent);
+  }
+
+  SyntheticHeapSource chain;
+  heapName = "referrer chain";
+  if (buildReferrerChain(&chain)) {
+    /* T is two steps from the roots through S, and four through the chain. */
+    static const jint parent[] = { -1, 5, 3, 4, 0, 0 };
+    expectRootPaths(&chain, parent);
+  }
+}
+
+
+int main(int argc, char **argv) {
+  checkDiamond();
+  checkSharedCache();
+  checkCycle();
+  checkUnreachableIsland();
+  checkReferrerChain();
+  checkReferrerFields();
+  checkRootPaths();
+
+  if (failures) {
+    fprintf(stderr, "%d checks failed.\n", failures);
+    return 1;
+  }
+  printf("All heap analysis checks passed.\n");
+  return 0;
+}
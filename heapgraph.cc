@@ -0,0 +1,331 @@
+/*
+ * heapgraph.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "heapgraph.h"
+
+
+#define INITIAL_NODE_CAPACITY (64 * 1024)
+#define INITIAL_EDGE_CAPACITY (128 * 1024)
+
+/* Bytes a builder holds for each node and edge of capacity. */
+#define NODE_BYTES (sizeof(jlong) + sizeof(jint))
+#define EDGE_BYTES(labelled) (2 * sizeof(jint) + ((labelled) ? sizeof(jlong) : 0))
+
+
+HeapGraph::HeapGraph() : nodeCount(0), edgeCount(0), size(0), classIndex(0), edgeStart(0), edges(0), edgeLabel(0) {
+}
+
+
+HeapGraph::~HeapGraph() {
+  free(this->size);
+  free(this->classIndex);
+  free(this->edgeStart);
+  free(this->edges);
+  free(this->edgeLabel);
+}
+
+
+/* Propagates the seed bits in mask to every reachable node, using a FIFO work list.  A node is
+ * requeued only when its mask gains bits, so each node is processed at most 65 times. */
+static void propagateMasks(const HeapGraph *graph, unsigned long long *mask, jint *queue, char *queued) {
+  jint n = graph->nodeCount;
+  jint head = 0, tail = 0, pending = 0;
+
+  for (jint v = 0; v < n; v++) {
+    queued[v] = mask[v] != 0;
+    if (queued[v]) {
+      queue[tail++] = v;
+      pending++;
+    }
+  }
+  if (tail == n) {
+    tail = 0;
+  }
+
+  while (pending > 0) {
+    jint u = queue[head];
+    head = head + 1 == n ? 0 : head + 1;
+    pending--;
+    queued[u] = 0;
+
+    for (jlong e = graph->edgeStart[u]; e < graph->edgeStart[u + 1]; e++) {
+      jint w = graph->edges[e];
+      if ((mask[w] | mask[u]) != mask[w]) {
+        mask[w] |= mask[u];
+        if (!queued[w]) {
+          queued[w] = 1;
+          queue[tail] = w;
+          tail = tail + 1 == n ? 0 : tail + 1;
+          pending++;
+        }
+      }
+    }
+  }
+}
+
+
+bool computeReachableSizes(
+    const HeapGraph *graph, const jint *classSlot, jint classCount, jint slotCount, jlong *reachable) {
+  jint n = graph->nodeCount;
+
+  memset(reachable, 0, sizeof(jlong) * slotCount);
+  if (slotCount == 0) {
+    return true;
+  }
+
+  unsigned long long *mask = (unsigned long long *) malloc(sizeof(unsigned long long) * n);
+  jint *queue = (jint *) malloc(sizeof(jint) * n);
+  char *queued = (char *) malloc(n);
+  if (mask == NULL || queue == NULL || queued == NULL) {
+    free(mask);
+    free(queue);
+    free(queued);
+    return false;
+  }
+
+  for (jint first = 0; first < slotCount; first += 64) {
+    for (jint v = 0; v < n; v++) {
+      jint k = graph->classIndex[v];
+      jint slot = k >= 0 && k < classCount ? classSlot[k] : -1;
+      mask[v] = slot >= first && slot < first + 64 ? 1ULL << (slot - first) : 0;
+    }
+
+    propagateMasks(graph, mask, queue, queued);
+
+    for (jint v = 0; v < n; v++) {
+      for (unsigned long long bits = mask[v]; bits; bits &= bits - 1) {
+        reachable[first + __builtin_ctzll(bits)] += graph->size[v];
+      }
+    }
+  }
+
+  free(mask);
+  free(queue);
+  free(queued);
+  return true;
+}
+
+
+bool computeRootPaths(const HeapGraph *graph, jint *parent) {
+  jint n = graph->nodeCount;
+  jint *queue = (jint *) malloc(sizeof(jint) * n);
+  if (queue == NULL) {
+    return false;
+  }
+
+  for (jint v = 0; v < n; v++) {
+    parent[v] = -1;
+  }
+  jint head = 0, tail = 0;
+  queue[tail++] = HEAP_GRAPH_ROOT;
+  while (head < tail) {
+    jint u = queue[head++];
+    for (jlong e = graph->edgeStart[u]; e < graph->edgeStart[u + 1]; e++) {
+      jint w = graph->edges[e];
+      if (parent[w] < 0 && w != HEAP_GRAPH_ROOT) {
+        parent[w] = u;
+        queue[tail++] = w;
+      }
+    }
+  }
+
+  free(queue);
+  return true;
+}
+
+
+jlong findEdge(const HeapGraph *graph, jint from, jint to) {
+  for (jlong e = graph->edgeStart[from]; e < graph->edgeStart[from + 1]; e++) {
+    if (graph->edges[e] == to) {
+      return e;
+    }
+  }
+  return -1;
+}
+
+
+HeapGraphBuilder::HeapGraphBuilder()
+    : nodeCount(0), nodeCapacity(0), size(0), classIndex(0),
+      edgeCount(0), edgeCapacity(0), edgeFrom(0), edgeTo(0), edgeLabel(0), labelled(false), failed(false),
+      memoryLimit(0), overLimit(false) {
+  /* The synthetic root always comes first. */
+  this->addNode(0, -1);
+}
+
+
+HeapGraphBuilder::HeapGraphBuilder(bool _labelled)
+    : nodeCount(0), nodeCapacity(0), size(0), classIndex(0),
+      edgeCount(0), edgeCapacity(0), edgeFrom(0), edgeTo(0), edgeLabel(0), labelled(_labelled), failed(false),
+      memoryLimit(0), overLimit(false) {
+  this->addNode(0, -1);
+}
+
+
+/* Grows an array to hold newCapacity elements, leaving it untouched on failure. */
+static bool grow(void **array, size_t elementSize, size_t newCapacity) {
+  void *p = realloc(*array, elementSize * newCapacity);
+  if (p == NULL) {
+    return false;
+  }
+  *array = p;
+  return true;
+}
+
+
+jint HeapGraphBuilder::addNode(jlong size, jint classIndex) {
+  if (this->failed) {
+    return -1;
+  }
+  if (this->nodeCount == this->nodeCapacity) {
+    jint capacity = this->nodeCapacity ? this->nodeCapacity * 2 : INITIAL_NODE_CAPACITY;
+    if (this->memoryLimit > 0) {
+      /* Grow by less than double if that is all the limit leaves room for. */
+      jlong fit = (this->memoryLimit - this->edgeCapacity * (jlong) EDGE_BYTES(this->labelled)) / (jlong) NODE_BYTES;
+      if (fit <= this->nodeCount) {
+        this->failed = this->overLimit = true;
+        return -1;
+      }
+      if (capacity > fit) {
+        capacity = (jint) fit;
+      }
+    }
+    if (capacity < this->nodeCapacity ||
+        !grow((void **) &this->size, sizeof(jlong), capacity) ||
+        !grow((void **) &this->classIndex, sizeof(jint), capacity)) {
+      this->failed = true;
+      return -1;
+    }
+    this->nodeCapacity = capacity;
+  }
+  this->size[this->nodeCount] = size;
+  this->classIndex[this->nodeCount] = classIndex;
+  return this->nodeCount++;
+}
+
+
+bool HeapGraphBuilder::addEdge(jint from, jint to, jlong label) {
+  if (this->failed) {
+    return false;
+  }
+  if (this->edgeCount == this->edgeCapacity) {
+    jlong capacity = this->edgeCapacity ? this->edgeCapacity * 2 : INITIAL_EDGE_CAPACITY;
+    if (this->memoryLimit > 0) {
+      jlong fit = (this->memoryLimit - this->nodeCapacity * (jlong) NODE_BYTES) / (jlong) EDGE_BYTES(this->labelled);
+      if (fit <= this->edgeCount) {
+        this->failed = this->overLimit = true;
+        return false;
+      }
+      if (capacity > fit) {
+        capacity = fit;
+      }
+    }
+    if (!grow((void **) &this->edgeFrom, sizeof(jint), capacity) ||
+        !grow((void **) &this->edgeTo, sizeof(jint), capacity) ||
+        (this->labelled && !grow((void **) &this->edgeLabel, sizeof(jlong), capacity))) {
+      this->failed = true;
+      return false;
+    }
+    this->edgeCapacity = capacity;
+  }
+  this->edgeFrom[this->edgeCount] = from;
+  this->edgeTo[this->edgeCount] = to;
+  if (this->labelled) {
+    this->edgeLabel[this->edgeCount] = label;
+  }
+  this->edgeCount++;
+  return true;
+}
+
+
+bool HeapGraphBuilder::build(HeapGraph *graph) {
+  if (this->failed) {
+    return false;
+  }
+  jlong packed = (this->nodeCount + 1) * (jlong) sizeof(jlong) + this->edgeCount * (jlong) (EDGE_BYTES(this->labelled) - sizeof(jint));
+  if (this->memoryLimit > 0 &&
+      this->nodeCapacity * (jlong) NODE_BYTES + this->edgeCapacity * (jlong) EDGE_BYTES(this->labelled) + packed > this->memoryLimit) {
+    this->failed = this->overLimit = true;
+    return false;
+  }
+
+  jlong *edgeStart = (jlong *) calloc(sizeof(jlong), this->nodeCount + 1);
+  jint *edges = (jint *) malloc(sizeof(jint) * (this->edgeCount ? this->edgeCount : 1));
+  jlong *labels = this->labelled ? (jlong *) malloc(sizeof(jlong) * (this->edgeCount ? this->edgeCount : 1)) : NULL;
+  if (edgeStart == NULL || edges == NULL || (this->labelled && labels == NULL)) {
+    free(edgeStart);
+    free(edges);
+    free(labels);
+    this->failed = true;
+    return false;
+  }
+
+  /* Counting sort of the edge list by source node. */
+  for (jlong e = 0; e < this->edgeCount; e++) {
+    edgeStart[this->edgeFrom[e] + 1]++;
+  }
+  for (jint n = 0; n < this->nodeCount; n++) {
+    edgeStart[n + 1] += edgeStart[n];
+  }
+  for (jlong e = 0; e < this->edgeCount; e++) {
+    jint from = this->edgeFrom[e];
+    if (labels != NULL) {
+      labels[edgeStart[from]] = this->edgeLabel[e];
+    }
+    edges[edgeStart[from]++] = this->edgeTo[e];
+  }
+  for (jint n = this->nodeCount; n > 0; n--) {
+    edgeStart[n] = edgeStart[n - 1];
+  }
+  edgeStart[0] = 0;
+
+  free(this->edgeFrom);
+  free(this->edgeTo);
+  free(this->edgeLabel);
+  this->edgeFrom = this->edgeTo = 0;
+  this->edgeLabel = 0;
+
+  /* Give back the slack of the last doubling, since a graph may be kept for a while. */
+  grow((void **) &this->size, sizeof(jlong), this->nodeCount);
+  grow((void **) &this->classIndex, sizeof(jint), this->nodeCount);
+
+  graph->nodeCount = this->nodeCount;
+  graph->edgeCount = this->edgeCount;
+  graph->size = this->size;
+  graph->classIndex = this->classIndex;
+  graph->edgeStart = edgeStart;
+  graph->edges = edges;
+  graph->edgeLabel = labels;
+
+  this->size = 0;
+  this->classIndex = 0;
+  this->nodeCount = this->nodeCapacity = 0;
+  this->edgeCount = this->edgeCapacity = 0;
+  return true;
+}
+
+
+HeapGraphBuilder::~HeapGraphBuilder() {
+  free(this->size);
+  free(this->classIndex);
+  free(this->edgeFrom);
+  free(this->edgeTo);
+  free(this->edgeLabel);
+}
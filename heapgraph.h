@@ -0,0 +1,108 @@
+/*
+ * heapgraph.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_HEAP_GRAPH_H
+#define POLARBEAR_HEAP_GRAPH_H
+
+
+#include "jni.h"
+
+
+/* Index of the synthetic node that refers to every GC root. */
+#define HEAP_GRAPH_ROOT 0
+
+
+/* The reachable object graph in compressed sparse row form.  The successors of node n are
+ * edges[edgeStart[n]] .. edges[edgeStart[n + 1] - 1].  A labelled graph also says how each edge is
+ * held, in edgeLabel; otherwise edgeLabel is NULL. */
+struct HeapGraph {
+  jint nodeCount;
+  jlong edgeCount;
+  jlong *size;
+  jint *classIndex;
+  jlong *edgeStart;
+  jint *edges;
+  jlong *edgeLabel;
+
+  HeapGraph();
+
+  ~HeapGraph();
+};
+
+
+/* Computes, for each watched class, the total size of its instances and everything reachable from
+ * them.  classSlot maps a class index to its slot in reachable, or -1 if the class is not watched.
+ * Up to 64 slots are coloured at once with a bitmask per node, so each group of 64 watched classes
+ * costs one propagation over the graph.  Returns false if scratch memory could not be allocated. */
+bool computeReachableSizes(
+    const HeapGraph *graph, const jint *classSlot, jint classCount, jint slotCount, jlong *reachable);
+
+
+/* Finds the shortest path from the root to every node, breadth first.  parent gets the node each
+ * one is first reached from, or -1 for the root and for nodes it does not reach.  Returns false if
+ * scratch memory could not be allocated. */
+bool computeRootPaths(const HeapGraph *graph, jint *parent);
+
+
+/* Returns the index of the first edge from one node to another, or -1 if there is none. */
+jlong findEdge(const HeapGraph *graph, jint from, jint to);
+
+
+/* Accumulates nodes and edges in discovery order and packs them into a HeapGraph.  All
+ * allocation failures are sticky: once one happens every later call fails too, so callers
+ * capturing from inside a heap walk only need to check the result of build(). */
+struct HeapGraphBuilder {
+  jint nodeCount;
+  jint nodeCapacity;
+  jlong *size;
+  jint *classIndex;
+
+  jlong edgeCount;
+  jlong edgeCapacity;
+  jint *edgeFrom;
+  jint *edgeTo;
+  jlong *edgeLabel;
+
+  bool labelled;
+  bool failed;
+
+  /* Most native memory the builder may hold at once, counting the packed graph while build() makes
+   * it, or 0 for no limit.  overLimit says whether that is why it failed. */
+  jlong memoryLimit;
+  bool overLimit;
+
+  HeapGraphBuilder();
+
+  /* A labelled builder keeps the label of every edge, at 8 more bytes an edge. */
+  HeapGraphBuilder(bool labelled);
+
+  /* Adds a node and returns its index, or -1 if memory is exhausted. */
+  jint addNode(jlong size, jint classIndex);
+
+  /* Adds an edge, returning false if memory is exhausted.  The label is dropped unless the builder
+   * is labelled. */
+  bool addEdge(jint from, jint to, jlong label);
+
+  /* Moves the accumulated nodes and edges into the given graph. */
+  bool build(HeapGraph *graph);
+
+  ~HeapGraphBuilder();
+};
+
+
+#endif
@@ -0,0 +1,454 @@
+/*
+ * heapsource.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "heapsource.h"
+
+
+class CountVisitor : public HeapVisitor {
+  public:
+    jint classCount;
+    jint *counts;
+    jlong *space;
+    jint unknown;
+
+    virtual bool object(jint classIndex, jlong size, jlong *mark) {
+      if (classIndex >= 0 && classIndex < this->classCount) {
+        this->counts[classIndex]++;
+        this->space[classIndex] += size;
+      } else {
+        this->unknown++;
+      }
+      return true;
+    }
+};
+
+
+jint countObjects(HeapSource *heap, jint classIndex, jint classCount, jint *counts, jlong *space) {
+  CountVisitor visitor;
+  visitor.classCount = classCount;
+  visitor.counts = counts;
+  visitor.space = space;
+  visitor.unknown = 0;
+  heap->iterateObjects(&visitor, classIndex, false);
+  return visitor.unknown;
+}
+
+
+/* Marks the referrers of instances of the target class with 1. */
+class ReferrerFinder : public HeapVisitor {
+  public:
+    jint target;
+
+    virtual bool reference(jint classIndex, jlong size, jlong *mark,
+        jint referrerClassIndex, jlong *referrerMark, const HeapReference *ref) {
+      if (referrerMark != NULL && classIndex == this->target) {
+        *referrerMark = 1;
+      }
+      return true;
+    }
+};
+
+
+/* Marks each referrer of a marked object with one more than the object's mark, keeping the
+ * shortest distance to the target. */
+class ReferrerDepthCounter : public HeapVisitor {
+  public:
+    virtual bool reference(jint classIndex, jlong size, jlong *mark,
+        jint referrerClassIndex, jlong *referrerMark, const HeapReference *ref) {
+      if (referrerMark != NULL && *mark) {
+        if (*referrerMark == 0 || *mark + 1 < *referrerMark) {
+          *referrerMark = *mark + 1;
+        }
+      }
+      return true;
+    }
+};
+
+
+/* Adds up the marked objects by class and distance. */
+class ReferrerLevelCounter : public HeapVisitor {
+  public:
+    jint depth;
+    jint classCount;
+    jint *levelCounts;
+
+    virtual bool object(jint classIndex, jlong size, jlong *mark) {
+      if (classIndex >= 0 && classIndex < this->classCount && *mark > 0 && *mark <= this->depth) {
+        this->levelCounts[classIndex * this->depth + *mark - 1]++;
+      }
+      return true;
+    }
+};
+
+
+void countReferrerLevels(HeapSource *heap, jint target, jint depth, jint classCount, jint *levelCounts) {
+  if (depth >= MAX_HEAP_MARK) {
+    depth = MAX_HEAP_MARK - 1;
+  }
+
+  ReferrerFinder finder;
+  finder.target = target;
+  heap->followReferences(&finder);
+
+  ReferrerDepthCounter counter;
+  for (jint i = 0; i < depth - 1 && !heap->cancelled(); i++) {
+    heap->followReferences(&counter);
+  }
+
+  if (!heap->cancelled()) {
+    ReferrerLevelCounter levels;
+    levels.depth = depth;
+    levels.classCount = classCount;
+    levels.levelCounts = levelCounts;
+    heap->iterateObjects(&levels, -1, true);
+  }
+
+  heap->clearMarks();
+}
+
+
+class MarkVisitor : public HeapVisitor {
+  public:
+    virtual bool object(jint classIndex, jlong size, jlong *mark) {
+      *mark = 1;
+      return true;
+    }
+};
+
+
+/* Marks the objects referred to by marked objects. */
+class MarkPropagator : public HeapVisitor {
+  public:
+    virtual bool reference(jint classIndex, jlong size, jlong *mark,
+        jint referrerClassIndex, jlong *referrerMark, const HeapReference *ref) {
+      if (referrerMark != NULL && *referrerMark && *mark == 0) {
+        *mark = 1;
+      }
+      return true;
+    }
+};
+
+
+class MarkedSizeVisitor : public HeapVisitor {
+  public:
+    jlong total;
+
+    virtual bool object(jint classIndex, jlong size, jlong *mark) {
+      if (*mark) {
+        this->total += size;
+      }
+      return true;
+    }
+};
+
+
+/* Marks the instances of the classes in one batch of slots, each with the bit of its slot. */
+class BatchMarkVisitor : public HeapVisitor {
+  public:
+    const jint *classSlot;
+    jint classCount;
+    jint firstSlot;
+    jint slotCount;
+
+    virtual bool object(jint classIndex, jlong size, jlong *mark) {
+      if (classIndex >= 0 && classIndex < this->classCount) {
+        jint slot = this->classSlot[classIndex] - this->firstSlot;
+        if (slot >= 0 && slot < this->slotCount) {
+          *mark |= (jlong) 1 << slot;
+        }
+      }
+      return true;
+    }
+};
+
+
+/* Gives each object the bits of its referrers, noting whether any mark changed. */
+class BatchMarkPropagator : public HeapVisitor {
+  public:
+    bool changed;
+
+    virtual bool reference(jint classIndex, jlong size, jlong *mark,
+        jint referrerClassIndex, jlong *referrerMark, const HeapReference *ref) {
+      if (referrerMark != NULL && (*referrerMark & ~*mark) != 0) {
+        *mark |= *referrerMark;
+        this->changed = true;
+      }
+      return true;
+    }
+};
+
+
+/* Adds the size of each marked object to the slot of every bit it has. */
+class BatchSizeVisitor : public HeapVisitor {
+  public:
+    jint firstSlot;
+    jlong *slotReachable;
+
+    virtual bool object(jint classIndex, jlong size, jlong *mark) {
+      for (jint bit = 0; bit < MARK_BATCH_CLASSES; bit++) {
+        if (*mark & ((jlong) 1 << bit)) {
+          this->slotReachable[this->firstSlot + bit] += size;
+        }
+      }
+      return true;
+    }
+};
+
+
+void markReachableSizes(HeapSource *heap, const jint *classSlot, jint classCount, jint slotCount, jlong *slotReachable) {
+  memset(slotReachable, 0, sizeof(jlong) * slotCount);
+  for (jint first = 0; first < slotCount && !heap->cancelled(); first += MARK_BATCH_CLASSES) {
+    BatchMarkVisitor marker;
+    marker.classSlot = classSlot;
+    marker.classCount = classCount;
+    marker.firstSlot = first;
+    marker.slotCount = slotCount - first < MARK_BATCH_CLASSES ? slotCount - first : MARK_BATCH_CLASSES;
+    heap->iterateObjects(&marker, -1, false);
+
+    /* A reference followed before its referrer was marked is caught by the next pass.  Reports
+     * mostly follow discovery order, so that is seldom more than one more pass. */
+    BatchMarkPropagator propagator;
+    do {
+      propagator.changed = false;
+      heap->followReferences(&propagator);
+    } while (propagator.changed && !heap->cancelled());
+
+    if (!heap->cancelled()) {
+      BatchSizeVisitor sizes;
+      sizes.firstSlot = first;
+      sizes.slotReachable = slotReachable;
+      heap->iterateObjects(&sizes, -1, true);
+    }
+    heap->clearMarks();
+  }
+}
+
+
+jlong markReachableSize(HeapSource *heap, jint classIndex) {
+  MarkVisitor marker;
+  heap->iterateObjects(&marker, classIndex, false);
+
+  MarkPropagator propagator;
+  heap->followReferences(&propagator);
+
+  MarkedSizeVisitor sizes;
+  sizes.total = 0;
+  if (!heap->cancelled()) {
+    heap->iterateObjects(&sizes, -1, true);
+  }
+
+  heap->clearMarks();
+  return sizes.total;
+}
+
+
+/* Records every reference into a HeapGraphBuilder.  Objects are marked with their negated node
+ * index. */
+class GraphCapture : public HeapVisitor {
+  public:
+    jint classCount;
+    HeapGraphBuilder *builder;
+
+    jint node(jint classIndex, jlong size, jlong *mark) {
+      if (*mark < 0) {
+        return (jint) -*mark;
+      }
+      jint node = this->builder->addNode(size, classIndex < this->classCount ? classIndex : -1);
+      if (node > 0) {
+        *mark = -node;
+      }
+      return node;
+    }
+
+    virtual bool reference(jint classIndex, jlong size, jlong *mark,
+        jint referrerClassIndex, jlong *referrerMark, const HeapReference *ref) {
+      jint to = this->node(classIndex, size, mark);
+      jint from = HEAP_GRAPH_ROOT;
+      if (referrerMark != NULL) {
+        from = this->node(referrerClassIndex, 0, referrerMark);
+      }
+      return to >= 0 && from >= 0 && this->builder->addEdge(from, to, packHeapReference(ref));
+    }
+};
+
+
+bool walkHeapGraph(HeapSource *heap, jint classCount, HeapGraphBuilder *builder) {
+  GraphCapture capture;
+  capture.classCount = classCount;
+  capture.builder = builder;
+
+  heap->followReferences(&capture);
+  heap->clearMarks();
+
+  return !heap->cancelled() && !builder->failed;
+}
+
+
+bool captureHeapGraph(HeapSource *heap, jint classCount, HeapGraphBuilder *builder, HeapGraph *graph) {
+  return walkHeapGraph(heap, classCount, builder) && builder->build(graph);
+}
+
+
+/* Accumulates ReferrerField rows in an open addressed table keyed by everything but the totals. */
+class ReferrerFieldTable {
+  public:
+    ReferrerField *rows;
+    jint capacity;
+    jint count;
+
+    ReferrerFieldTable() : rows(NULL), capacity(0), count(0) {
+    }
+
+    ~ReferrerFieldTable() {
+      free(this->rows);
+    }
+
+    static unsigned int hash(jint level, jint holder, jint kind, jint index) {
+      unsigned int h = (unsigned int) level * 2654435761u;
+      h = (h ^ (unsigned int) holder) * 2654435761u;
+      h = (h ^ (unsigned int) kind) * 2654435761u;
+      h = (h ^ (unsigned int) index) * 2654435761u;
+      return h ^ (h >> 16);
+    }
+
+    ReferrerField *find(jint level, jint holder, jint kind, jint index) {
+      unsigned int mask = (unsigned int) this->capacity - 1;
+      for (unsigned int i = hash(level, holder, kind, index) & mask; ; i = (i + 1) & mask) {
+        ReferrerField *row = &this->rows[i];
+        if (row->references == 0 || (row->level == level && row->holder == holder &&
+            row->kind == kind && row->index == index)) {
+          return row;
+        }
+      }
+    }
+
+    bool grow() {
+      ReferrerField *old = this->rows;
+      jint oldCapacity = this->capacity;
+      jint capacity = oldCapacity ? oldCapacity * 2 : 256;
+      this->rows = (ReferrerField *) calloc(capacity, sizeof(ReferrerField));
+      if (this->rows == NULL) {
+        this->rows = old;
+        return false;
+      }
+      this->capacity = capacity;
+      for (jint i = 0; i < oldCapacity; i++) {
+        if (old[i].references) {
+          *this->find(old[i].level, old[i].holder, old[i].kind, old[i].index) = old[i];
+        }
+      }
+      free(old);
+      return true;
+    }
+
+    bool add(jint level, const HeapReference *ref, jint referrerClass, jlong bytes) {
+      if (this->count * 2 >= this->capacity && !this->grow()) {
+        return false;
+      }
+      jint holder = ref->kind == HEAP_REFERENCE_STATIC_FIELD ? ref->holder : referrerClass;
+      jint index = ref->kind == HEAP_REFERENCE_FIELD || ref->kind == HEAP_REFERENCE_STATIC_FIELD ? ref->index : 0;
+      ReferrerField *row = this->find(level, holder, ref->kind, index);
+      if (row->references == 0) {
+        row->level = level;
+        row->holder = holder;
+        row->kind = ref->kind;
+        row->index = index;
+        this->count++;
+      }
+      row->references++;
+      row->bytes += bytes;
+      return true;
+    }
+};
+
+
+static int compareReferrerFields(const void *a, const void *b) {
+  const ReferrerField *x = (const ReferrerField *) a;
+  const ReferrerField *y = (const ReferrerField *) b;
+  if (x->level != y->level) {
+    return x->level < y->level ? -1 : 1;
+  }
+  if (x->bytes != y->bytes) {
+    return x->bytes > y->bytes ? -1 : 1;
+  }
+  return x->references > y->references ? -1 : x->references < y->references;
+}
+
+
+ReferrerField *countReferrerFields(const HeapGraph *graph, jint target, jint depth, jint *rowCount) {
+  *rowCount = 0;
+  ReferrerFieldTable table;
+  jint *level = (jint *) malloc(graph->nodeCount * sizeof(jint));
+  if (level == NULL || !table.grow()) {
+    free(level);
+    return NULL;
+  }
+  for (jint n = 0; n < graph->nodeCount; n++) {
+    level[n] = n != HEAP_GRAPH_ROOT && graph->classIndex[n] == target ? 0 : -1;
+  }
+
+  /* One pass over the edges per level.  A referrer joins level k the first time it is seen
+   * pointing at level k - 1, and every such reference it holds is counted. */
+  bool failed = false;
+  for (jint k = 1; k <= depth && !failed; k++) {
+    bool grew = false;
+    for (jint u = 1; u < graph->nodeCount && !failed; u++) {
+      if (level[u] >= 0 && level[u] < k) {
+        continue;
+      }
+      for (jlong e = graph->edgeStart[u]; e < graph->edgeStart[u + 1]; e++) {
+        jint w = graph->edges[e];
+        if (level[w] == k - 1) {
+          HeapReference ref = { HEAP_REFERENCE_UNKNOWN, 0, -1 };
+          if (graph->edgeLabel != NULL) {
+            unpackHeapReference(graph->edgeLabel[e], &ref);
+          }
+          if (!table.add(k, &ref, graph->classIndex[u], graph->size[w])) {
+            failed = true;
+            break;
+          }
+          level[u] = k;
+          grew = true;
+        }
+      }
+    }
+    if (!grew) {
+      break;
+    }
+  }
+  free(level);
+  if (failed) {
+    return NULL;
+  }
+
+  /* Compact the table in place into the rows to return. */
+  ReferrerField *rows = table.rows;
+  jint count = 0;
+  for (jint i = 0; i < table.capacity; i++) {
+    if (rows[i].references) {
+      rows[count++] = rows[i];
+    }
+  }
+  qsort(rows, count, sizeof(ReferrerField), compareReferrerFields);
+  table.rows = NULL;
+  *rowCount = count;
+  return rows;
+}
@@ -0,0 +1,179 @@
+/*
+ * heapsource.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_HEAP_SOURCE_H
+#define POLARBEAR_HEAP_SOURCE_H
+
+
+#include "jni.h"
+
+#include "heapgraph.h"
+
+
+/* Kinds of reference, for attributing them to what holds them. */
+#define HEAP_REFERENCE_OTHER 0
+#define HEAP_REFERENCE_FIELD 1
+#define HEAP_REFERENCE_STATIC_FIELD 2
+#define HEAP_REFERENCE_ARRAY_ELEMENT 3
+
+/* Kinds of GC root. */
+#define HEAP_REFERENCE_ROOT_OTHER 4
+#define HEAP_REFERENCE_ROOT_SYSTEM_CLASS 5
+#define HEAP_REFERENCE_ROOT_JNI_GLOBAL 6
+#define HEAP_REFERENCE_ROOT_THREAD 7
+#define HEAP_REFERENCE_ROOT_STACK_LOCAL 8
+#define HEAP_REFERENCE_ROOT_JNI_LOCAL 9
+#define HEAP_REFERENCE_ROOT_MONITOR 10
+
+/* Any reference of a graph captured without labels. */
+#define HEAP_REFERENCE_UNKNOWN 11
+
+
+/* How a reference is held. */
+typedef struct {
+  jint kind;
+  /* The JVMTI index of the field, for field references. */
+  jint index;
+  /* For static fields, the class whose field it is, since the referrer is its class object.
+   * Otherwise -1. */
+  jint holder;
+} HeapReference;
+
+
+/* Packs a reference into an edge label, and back. */
+static inline jlong packHeapReference(const HeapReference *ref) {
+  return ((jlong) (ref->holder + 1) << 32) | ((jlong) ref->kind << 28) | (ref->index & 0x0FFFFFFF);
+}
+
+
+static inline void unpackHeapReference(jlong label, HeapReference *ref) {
+  ref->holder = (jint) (label >> 32) - 1;
+  ref->kind = (jint) (label >> 28) & 0xF;
+  ref->index = (jint) label & 0x0FFFFFFF;
+}
+
+
+/* Receives the objects and references of a heap walk.  Objects are identified by their class
+ * index, or -1 if the class is unknown, and carry a scratch mark the visitor may change.  Marks
+ * start at zero, and must stay at or below MAX_HEAP_MARK when positive.  Returning false stops the
+ * walk. */
+class HeapVisitor {
+  public:
+    virtual ~HeapVisitor() {}
+
+    virtual bool object(jint classIndex, jlong size, jlong *mark) { return true; }
+
+    /* A reference to an object.  referrerMark is NULL for references from GC roots. */
+    virtual bool reference(jint classIndex, jlong size, jlong *mark,
+        jint referrerClassIndex, jlong *referrerMark, const HeapReference *ref) {
+      return true;
+    }
+};
+
+
+/* Largest positive mark.  The live heap keeps marks in object tags, where larger values are taken. */
+#define MAX_HEAP_MARK 4096
+
+
+/* A heap the analyses can walk: the live heap through JVMTI, or a synthetic graph. */
+class HeapSource {
+  public:
+    virtual ~HeapSource() {}
+
+    /* Visits every object, or only the instances of classIndex if it is not -1.  If markedOnly is
+     * set, objects whose mark is zero may be skipped.  Returns false if the walk was stopped. */
+    virtual bool iterateObjects(HeapVisitor *visitor, jint classIndex, bool markedOnly) = 0;
+
+    /* Visits every reference from the GC roots and from the objects reachable from them. */
+    virtual bool followReferences(HeapVisitor *visitor) = 0;
+
+    /* Sets every mark back to zero. */
+    virtual void clearMarks() = 0;
+
+    /* Returns true if the walk in progress has been cancelled, so its results are incomplete. */
+    virtual bool cancelled() { return false; }
+};
+
+
+/* Counts the instances of classIndex, or of every class if it is -1, into counts and space, which
+ * hold classCount entries and must be zeroed by the caller.  Returns the number of objects whose
+ * class is unknown or at least classCount. */
+jint countObjects(HeapSource *heap, jint classIndex, jint classCount, jint *counts, jlong *space);
+
+
+/* Counts, by class, the objects up to depth references away from an instance of target.
+ * levelCounts holds depth entries for each of classCount classes, for the objects one reference
+ * away first, and must be zeroed by the caller.  Marks must be clear, and are clear after. */
+void countReferrerLevels(HeapSource *heap, jint target, jint depth, jint classCount, jint *levelCounts);
+
+
+/* Returns the total size of the instances of classIndex and the objects marked reachable from them
+ * in one pass over the references.  Needs no memory, but a reference followed before its referrer
+ * was marked is missed.  Marks must be clear, and are clear after. */
+jlong markReachableSize(HeapSource *heap, jint classIndex);
+
+
+/* Classes markReachableSizes marks from in one batch, one bit of the mark each. */
+#define MARK_BATCH_CLASSES 12
+
+
+/* Fills slotReachable with the total size of the instances of the classes given each slot, and of
+ * the objects reachable from them, for the classes of classCount whose classSlot is not -1.
+ * Classes are marked from MARK_BATCH_CLASSES at a time, and references are followed again until
+ * no mark changes, so nothing is missed.  Needs no memory.  Marks must be clear, and are clear
+ * after. */
+void markReachableSizes(HeapSource *heap, const jint *classSlot, jint classCount, jint slotCount, jlong *slotReachable);
+
+
+/* Captures every reachable object and reference into graph through an empty builder, with node
+ * HEAP_GRAPH_ROOT standing for the GC roots.  Classes at or above classCount get class index -1.  A
+ * labelled builder labels every edge with packHeapReference.  Marks must be clear, and are clear
+ * after.  Returns false if memory ran out, the builder's limit was reached or the walk was
+ * cancelled; the walk stops as soon as the builder fails. */
+bool captureHeapGraph(HeapSource *heap, jint classCount, HeapGraphBuilder *builder, HeapGraph *graph);
+
+
+/* The walk of captureHeapGraph, without packing the graph, so a caller can let the heap change
+ * again before it calls builder->build.  Returns false if the builder failed or the walk was
+ * cancelled. */
+bool walkHeapGraph(HeapSource *heap, jint classCount, HeapGraphBuilder *builder);
+
+
+/* The references at one level that are held by one field, or by the elements of arrays of one
+ * class. */
+typedef struct {
+  jint level;
+  /* The class of the referrers, or for static fields the class whose field it is. */
+  jint holder;
+  jint kind;
+  jint index;
+  jlong references;
+  /* Total size of the objects referred to. */
+  jlong bytes;
+} ReferrerField;
+
+
+/* Attributes the references leading to instances of target to the class and field that hold them,
+ * or only to the class in a graph without labels.  Each object is placed at its shortest distance from an instance of
+ * target, up to depth, and a reference from an object at level k to one at level k - 1 is counted
+ * at level k.  The instances are level 0.  Returns the rows by level and then by bytes, largest
+ * first, to be given back with free, or NULL if memory ran out. */
+ReferrerField *countReferrerFields(const HeapGraph *graph, jint target, jint depth, jint *rowCount);
+
+
+#endif
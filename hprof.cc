@@ -0,0 +1,946 @@
+/*
+ * hprof.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "arena.h"
+#include "base.h"
+#include "classes.h"
+#include "dumpstream.h"
+#include "hprof.h"
+#include "perf.h"
+#include "progress.h"
+
+
+#define HPROF_HEADER "JAVA PROFILE 1.0.2"
+#define HPROF_ID_SIZE 8
+
+/* Record tags. */
+#define HPROF_UTF8 0x01
+#define HPROF_LOAD_CLASS 0x02
+#define HPROF_STACK_TRACE 0x05
+#define HPROF_HEAP_DUMP_SEGMENT 0x1C
+#define HPROF_HEAP_DUMP_END 0x2C
+
+/* Heap dump sub-record tags. */
+#define HPROF_GC_ROOT_UNKNOWN 0xFF
+#define HPROF_GC_ROOT_JNI_GLOBAL 0x01
+#define HPROF_GC_ROOT_JNI_LOCAL 0x02
+#define HPROF_GC_ROOT_JAVA_FRAME 0x03
+#define HPROF_GC_ROOT_STICKY_CLASS 0x05
+#define HPROF_GC_ROOT_MONITOR_USED 0x07
+#define HPROF_GC_ROOT_THREAD_OBJ 0x08
+#define HPROF_GC_CLASS_DUMP 0x20
+#define HPROF_GC_INSTANCE_DUMP 0x21
+#define HPROF_GC_OBJ_ARRAY_DUMP 0x22
+#define HPROF_GC_PRIM_ARRAY_DUMP 0x23
+
+/* Basic types. */
+#define HPROF_OBJECT 2
+#define HPROF_BOOLEAN 4
+#define HPROF_CHAR 5
+#define HPROF_FLOAT 6
+#define HPROF_DOUBLE 7
+#define HPROF_BYTE 8
+#define HPROF_SHORT 9
+#define HPROF_INT 10
+#define HPROF_LONG 11
+
+/* Tag, time and length. */
+#define RECORD_HEADER_SIZE 9
+
+/* Every class and object refers to this one empty stack trace. */
+#define HPROF_STACK_SERIAL 1
+
+/* Largest sub-record a segment's 32 bit length can hold.  Longer arrays are truncated, as the JDK's
+ * own dumper does. */
+#define MAX_RECORD_LENGTH (0xFFFFFFFFu - 64)
+#define MAX_OBJECT_ARRAY_LENGTH (MAX_RECORD_LENGTH / HPROF_ID_SIZE)
+
+/* Objects are tagged with their dump id for the length of the dump.  Ids are odd, so they cannot be
+ * mistaken for the ClassDetails pointers that serve as class ids.  Above the sequence number they
+ * hold the length of arrays, which the walk reports when it finds an array but not when it visits
+ * the elements. */
+#define ID_SEQUENCE_BITS 33
+#define ID_LENGTH_SHIFT 34
+
+/* Field slots map the JVMTI index of a field, less the class's fieldBase, to where its value goes:
+ * an offset into the instance data if it is not negative, or static -1 - slot of the class. */
+#define NO_SLOT INT_MIN
+
+/* What the object being visited turns into. */
+#define CURRENT_NONE 0
+#define CURRENT_SKIP 1
+#define CURRENT_INSTANCE 2
+#define CURRENT_OBJECT_ARRAY 3
+#define CURRENT_CLASS 4
+
+/* Kinds of class. */
+#define CLASS_INSTANCE 0
+#define CLASS_OBJECT_ARRAY 1
+#define CLASS_PRIMITIVE_ARRAY 2
+
+
+/* A field declared by a class, in GetClassFields order. */
+typedef struct {
+  jlong name;
+  jint type;
+  bool isStatic;
+} HprofField;
+
+
+/* What the dump needs to know about a class, gathered before the walk since heap callbacks cannot
+ * call back into JVMTI. */
+typedef struct HprofClass {
+  ClassDetails *details;
+  jint kind;
+  ClassDetails *superDetails;
+  struct HprofClass *super;
+  ClassDetails **interfaces;
+  jint interfaceCount;
+
+  HprofField *declared;
+  jint declaredCount;
+  jint staticCount;
+  jint ownInstanceSize;
+
+  /* Built from the superclass down. */
+  jint instanceSize;
+  jint totalFields;
+  jint fieldBase;
+  jint *slots;
+
+  /* Filled in by the walk. */
+  jvalue *statics;
+  jlong loader;
+  jlong signers;
+  jlong domain;
+} HprofClass;
+
+
+/* State of a dump, passed to the heap callbacks. */
+typedef struct {
+  DumpStream *stream;
+  HprofClass **classes;
+  jint classCount;
+  jlong nextString;
+  jlong nextSequence;
+  jint threadCount;
+
+  /* Header of the open heap dump segment, or NULL. */
+  char *segment;
+  jlong segmentLength;
+
+  /* The object being visited.  The walk reports everything about one object before moving on. */
+  jlong currentId;
+  jint currentKind;
+  HprofClass *currentClass;
+  char *body;
+  jint arrayLength;
+  jint nextIndex;
+
+  jlong objects;
+  jlong skipped;
+  bool overflow;
+} HprofWriter;
+
+
+static const char zeroes[4096] = { 0 };
+
+
+static inline char *putU1(char *p, jint value) {
+  *p = (char) value;
+  return p + 1;
+}
+
+
+static inline char *putU2(char *p, jint value) {
+  uint16_t v = htons((uint16_t) value);
+  memcpy(p, &v, sizeof(v));
+  return p + 2;
+}
+
+
+static inline char *putU4(char *p, jint value) {
+  uint32_t v = htonl((uint32_t) value);
+  memcpy(p, &v, sizeof(v));
+  return p + 4;
+}
+
+
+static inline char *putU8(char *p, jlong value) {
+  putU4(p, (jint) (value >> 32));
+  return putU4(p + 4, (jint) value);
+}
+
+
+/* Returns the basic type for a field signature or JVMTI primitive type. */
+static jint basicType(char c) {
+  switch (c) {
+    case 'Z': return HPROF_BOOLEAN;
+    case 'C': return HPROF_CHAR;
+    case 'F': return HPROF_FLOAT;
+    case 'D': return HPROF_DOUBLE;
+    case 'B': return HPROF_BYTE;
+    case 'S': return HPROF_SHORT;
+    case 'I': return HPROF_INT;
+    case 'J': return HPROF_LONG;
+    default: return HPROF_OBJECT;
+  }
+}
+
+
+static jint typeSize(jint type) {
+  switch (type) {
+    case HPROF_BOOLEAN: case HPROF_BYTE: return 1;
+    case HPROF_CHAR: case HPROF_SHORT: return 2;
+    case HPROF_FLOAT: case HPROF_INT: return 4;
+    default: return 8;
+  }
+}
+
+
+static char *putValue(char *p, jvalue value, jint type) {
+  switch (typeSize(type)) {
+    case 1: return putU1(p, value.b);
+    case 2: return putU2(p, value.s);
+    case 4: return putU4(p, value.i);
+    default: return putU8(p, value.j);
+  }
+}
+
+
+static inline bool isDumpId(jlong tag) {
+  return tag & 1;
+}
+
+
+static jlong makeDumpId(HprofWriter *w, jint length) {
+  jlong sequence = w->nextSequence++;
+  if (sequence >> ID_SEQUENCE_BITS) {
+    w->overflow = true;
+  }
+  jlong stored = length < 0 ? 0 : (length < (jint) MAX_OBJECT_ARRAY_LENGTH ? length : MAX_OBJECT_ARRAY_LENGTH) + 1;
+  return 1 | (sequence & ((1LL << ID_SEQUENCE_BITS) - 1)) << 1 | stored << ID_LENGTH_SHIFT;
+}
+
+
+static jint dumpIdLength(jlong id) {
+  return (jint) (id >> ID_LENGTH_SHIFT) - 1;
+}
+
+
+/* Returns the thread serial number of a thread object.  Threads are tagged first, so their
+ * sequence numbers are their serials. */
+static jint threadSerial(HprofWriter *w, jlong tag) {
+  jlong sequence = (tag >> 1) & ((1LL << ID_SEQUENCE_BITS) - 1);
+  return isDumpId(tag) && sequence <= w->threadCount ? (jint) sequence : 0;
+}
+
+
+/* Returns the class with the given ClassDetails tag, or NULL. */
+static HprofClass *classOf(HprofWriter *w, jlong tag) {
+  if (isDumpId(tag) || !isClassDetailsTag(tag)) {
+    return NULL;
+  }
+  ClassDetails *d = (ClassDetails *)(void *)(ptrdiff_t) tag;
+  return d->index < w->classCount ? w->classes[d->index] : NULL;
+}
+
+
+static inline jlong classId(HprofClass *c) {
+  return c ? (jlong)(ptrdiff_t)(void *) c->details : 0;
+}
+
+
+/* Closes the open heap dump segment, filling in its length. */
+static void endSegment(HprofWriter *w) {
+  if (w->segment != NULL) {
+    putU4(w->segment + 5, (jint) w->segmentLength);
+    w->segment = NULL;
+  }
+}
+
+
+/* Starts a top level record, closing any heap dump segment. */
+static void beginRecord(HprofWriter *w, jint tag, jlong length) {
+  endSegment(w);
+  char *p = w->stream->take(RECORD_HEADER_SIZE);
+  p = putU1(p, tag);
+  p = putU4(p, 0);
+  putU4(p, (jint) length);
+}
+
+
+/* Makes room for a heap dump sub-record of length bytes.  Sub-records are packed into segments
+ * that each fit in one stream block, so a segment's length can be filled in before its block is
+ * handed to the writer.  A sub-record too large for a block gets a segment of its own. */
+static void beginSubRecord(HprofWriter *w, uint64_t length) {
+  if (w->segment != NULL && length <= w->stream->room()) {
+    w->segmentLength += length;
+    return;
+  }
+  endSegment(w);
+  if (length + RECORD_HEADER_SIZE <= DUMP_BLOCK_SIZE) {
+    if (length + RECORD_HEADER_SIZE > w->stream->room()) {
+      w->stream->next();
+    }
+    w->segment = w->stream->take(RECORD_HEADER_SIZE);
+    w->segmentLength = length;
+    putU4(putU1(w->segment, HPROF_HEAP_DUMP_SEGMENT), 0);
+  } else {
+    beginRecord(w, HPROF_HEAP_DUMP_SEGMENT, length);
+  }
+}
+
+
+static jlong writeString(HprofWriter *w, const char *s, size_t length) {
+  jlong id = ++w->nextString;
+  beginRecord(w, HPROF_UTF8, HPROF_ID_SIZE + length);
+  putU8(w->stream->take(HPROF_ID_SIZE), id);
+  w->stream->write(s, length);
+  return id;
+}
+
+
+/* Writes out the object being visited, if it is written whole. */
+static void finishObject(HprofWriter *w) {
+  if (w->currentKind == CURRENT_INSTANCE) {
+    HprofClass *c = w->currentClass;
+    beginSubRecord(w, 1 + HPROF_ID_SIZE + 4 + HPROF_ID_SIZE + 4 + c->instanceSize);
+    char *p = w->stream->take(1 + HPROF_ID_SIZE + 4 + HPROF_ID_SIZE + 4);
+    p = putU1(p, HPROF_GC_INSTANCE_DUMP);
+    p = putU8(p, w->currentId);
+    p = putU4(p, HPROF_STACK_SERIAL);
+    p = putU8(p, classId(c));
+    putU4(p, c->instanceSize);
+    w->stream->write(w->body, c->instanceSize);
+    w->objects++;
+
+  } else if (w->currentKind == CURRENT_OBJECT_ARRAY) {
+    for (jlong left = (jlong)(w->arrayLength - w->nextIndex) * HPROF_ID_SIZE; left > 0; left -= sizeof(zeroes)) {
+      w->stream->write(zeroes, left < (jlong) sizeof(zeroes) ? left : sizeof(zeroes));
+    }
+    w->objects++;
+  }
+  w->currentKind = CURRENT_NONE;
+  w->currentId = 0;
+}
+
+
+/* Makes the given object the one being visited. */
+static void startObject(HprofWriter *w, jlong id, jlong class_tag) {
+  finishObject(w);
+  w->currentId = id;
+
+  if (isClassObject(class_tag)) {
+    w->currentClass = classOf(w, id);
+    w->currentKind = w->currentClass ? CURRENT_CLASS : CURRENT_SKIP;
+    return;
+  }
+
+  HprofClass *c = classOf(w, class_tag);
+  w->currentClass = c;
+  if (c == NULL) {
+    w->currentKind = CURRENT_SKIP;
+    w->skipped++;
+  } else if (c->kind == CLASS_INSTANCE) {
+    w->currentKind = CURRENT_INSTANCE;
+    memset(w->body, 0, c->instanceSize);
+  } else if (c->kind == CLASS_OBJECT_ARRAY) {
+    /* Elements arrive in index order, so the array is streamed out as they do. */
+    w->currentKind = CURRENT_OBJECT_ARRAY;
+    w->arrayLength = dumpIdLength(id) > 0 ? dumpIdLength(id) : 0;
+    w->nextIndex = 0;
+    beginSubRecord(w, 1 + HPROF_ID_SIZE + 4 + 4 + HPROF_ID_SIZE + (uint64_t) w->arrayLength * HPROF_ID_SIZE);
+    char *p = w->stream->take(1 + HPROF_ID_SIZE + 4 + 4 + HPROF_ID_SIZE);
+    p = putU1(p, HPROF_GC_OBJ_ARRAY_DUMP);
+    p = putU8(p, id);
+    p = putU4(p, HPROF_STACK_SERIAL);
+    p = putU4(p, w->arrayLength);
+    putU8(p, classId(c));
+  } else {
+    /* Primitive arrays are written by dumpPrimitiveArray. */
+    w->currentKind = CURRENT_NONE;
+  }
+}
+
+
+/* Stores the value of field index of the object being visited. */
+static void setField(HprofWriter *w, jint index, jvalue value, jint type) {
+  HprofClass *c = w->currentClass;
+  jint i = index - c->fieldBase;
+  if (i < 0 || i >= c->totalFields || c->slots[i] == NO_SLOT) {
+    return;
+  }
+  jint slot = c->slots[i];
+  if (w->currentKind == CURRENT_INSTANCE && slot >= 0 && slot + typeSize(type) <= c->instanceSize) {
+    putValue(w->body + slot, value, type);
+  } else if (w->currentKind == CURRENT_CLASS && slot < 0) {
+    c->statics[-1 - slot] = value;
+  }
+}
+
+
+static void writeRoot(HprofWriter *w, jvmtiHeapReferenceKind kind, const jvmtiHeapReferenceInfo *info, jlong id) {
+  finishObject(w);
+
+  jint type = HPROF_GC_ROOT_UNKNOWN;
+  jint serial = -1, depth = 0;
+  jlong global = -1;
+  switch (kind) {
+    case JVMTI_HEAP_REFERENCE_JNI_GLOBAL:
+      type = HPROF_GC_ROOT_JNI_GLOBAL;
+      global = 0;
+      break;
+    case JVMTI_HEAP_REFERENCE_SYSTEM_CLASS:
+      type = HPROF_GC_ROOT_STICKY_CLASS;
+      break;
+    case JVMTI_HEAP_REFERENCE_MONITOR:
+      type = HPROF_GC_ROOT_MONITOR_USED;
+      break;
+    case JVMTI_HEAP_REFERENCE_STACK_LOCAL:
+      type = HPROF_GC_ROOT_JAVA_FRAME;
+      serial = threadSerial(w, info->stack_local.thread_tag);
+      depth = info->stack_local.depth;
+      break;
+    case JVMTI_HEAP_REFERENCE_JNI_LOCAL:
+      type = HPROF_GC_ROOT_JNI_LOCAL;
+      serial = threadSerial(w, info->jni_local.thread_tag);
+      depth = info->jni_local.depth;
+      break;
+    case JVMTI_HEAP_REFERENCE_THREAD:
+      type = HPROF_GC_ROOT_THREAD_OBJ;
+      serial = threadSerial(w, id);
+      depth = HPROF_STACK_SERIAL;
+      break;
+    default:
+      break;
+  }
+
+  jint length = 1 + HPROF_ID_SIZE + (global >= 0 ? HPROF_ID_SIZE : 0) + (serial >= 0 ? 8 : 0);
+  beginSubRecord(w, length);
+  char *p = w->stream->take(length);
+  p = putU1(p, type);
+  p = putU8(p, id);
+  if (global >= 0) {
+    p = putU8(p, global);
+  }
+  if (serial >= 0) {
+    p = putU4(p, serial);
+    putU4(p, depth);
+  }
+}
+
+
+/* FollowReferences callback that writes roots and gathers the references held by each object. */
+static jint JNICALL dumpReference(
+    jvmtiHeapReferenceKind reference_kind,
+    const jvmtiHeapReferenceInfo* reference_info,
+    jlong class_tag,
+    jlong referrer_class_tag,
+    jlong size,
+    jlong* tag_ptr,
+    jlong* referrer_tag_ptr,
+    jint length,
+    void* user_data) {
+  HprofWriter *w = (HprofWriter *) user_data;
+  if (heapWalkStep()) {
+    return JVMTI_VISIT_ABORT;
+  }
+
+  jlong id = *tag_ptr;
+  if (id == 0) {
+    if (isClassObject(class_tag)) {
+      /* A class the registry has not seen; it and its instances are left out. */
+      return JVMTI_VISIT_OBJECTS;
+    }
+    id = *tag_ptr = makeDumpId(w, length);
+  }
+
+  if (referrer_tag_ptr == NULL) {
+    writeRoot(w, reference_kind, reference_info, id);
+    return JVMTI_VISIT_OBJECTS;
+  }
+  if (*referrer_tag_ptr != w->currentId) {
+    startObject(w, *referrer_tag_ptr, referrer_class_tag);
+  }
+
+  jvalue value;
+  value.j = id;
+  switch (w->currentKind) {
+    case CURRENT_INSTANCE:
+      if (reference_kind == JVMTI_HEAP_REFERENCE_FIELD) {
+        setField(w, reference_info->field.index, value, HPROF_OBJECT);
+      }
+      break;
+
+    case CURRENT_OBJECT_ARRAY:
+      if (reference_kind == JVMTI_HEAP_REFERENCE_ARRAY_ELEMENT) {
+        jint index = reference_info->array.index;
+        if (index >= w->nextIndex && index < w->arrayLength) {
+          for (jlong gap = (jlong)(index - w->nextIndex) * HPROF_ID_SIZE; gap > 0; gap -= sizeof(zeroes)) {
+            w->stream->write(zeroes, gap < (jlong) sizeof(zeroes) ? gap : sizeof(zeroes));
+          }
+          putU8(w->stream->take(HPROF_ID_SIZE), id);
+          w->nextIndex = index + 1;
+        }
+      }
+      break;
+
+    case CURRENT_CLASS:
+      if (reference_kind == JVMTI_HEAP_REFERENCE_STATIC_FIELD) {
+        setField(w, reference_info->field.index, value, HPROF_OBJECT);
+      } else if (reference_kind == JVMTI_HEAP_REFERENCE_CLASS_LOADER) {
+        w->currentClass->loader = id;
+      } else if (reference_kind == JVMTI_HEAP_REFERENCE_SIGNERS) {
+        w->currentClass->signers = id;
+      } else if (reference_kind == JVMTI_HEAP_REFERENCE_PROTECTION_DOMAIN) {
+        w->currentClass->domain = id;
+      }
+      break;
+  }
+  return JVMTI_VISIT_OBJECTS;
+}
+
+
+/* FollowReferences callback for the primitive fields of instances and classes. */
+static jint JNICALL dumpPrimitiveField(
+    jvmtiHeapReferenceKind kind,
+    const jvmtiHeapReferenceInfo* info,
+    jlong object_class_tag,
+    jlong* object_tag_ptr,
+    jvalue value,
+    jvmtiPrimitiveType value_type,
+    void* user_data) {
+  HprofWriter *w = (HprofWriter *) user_data;
+  if (*object_tag_ptr != w->currentId) {
+    startObject(w, *object_tag_ptr, object_class_tag);
+  }
+  if (w->currentKind == CURRENT_INSTANCE || w->currentKind == CURRENT_CLASS) {
+    setField(w, info->field.index, value, basicType((char) value_type));
+  }
+  return 0;
+}
+
+
+/* FollowReferences callback that writes a primitive array. */
+static jint JNICALL dumpPrimitiveArray(
+    jlong class_tag,
+    jlong size,
+    jlong* tag_ptr,
+    jint element_count,
+    jvmtiPrimitiveType element_type,
+    const void* elements,
+    void* user_data) {
+  HprofWriter *w = (HprofWriter *) user_data;
+  finishObject(w);
+
+  jlong id = *tag_ptr ? *tag_ptr : (*tag_ptr = makeDumpId(w, element_count));
+  jint type = basicType((char) element_type);
+  jint elementSize = typeSize(type);
+  uint64_t count = element_count;
+  if (count * elementSize > MAX_RECORD_LENGTH) {
+    count = MAX_RECORD_LENGTH / elementSize;
+  }
+
+  beginSubRecord(w, 1 + HPROF_ID_SIZE + 4 + 4 + 1 + count * elementSize);
+  char *p = w->stream->take(1 + HPROF_ID_SIZE + 4 + 4 + 1);
+  p = putU1(p, HPROF_GC_PRIM_ARRAY_DUMP);
+  p = putU8(p, id);
+  p = putU4(p, HPROF_STACK_SERIAL);
+  p = putU4(p, (jint) count);
+  putU1(p, type);
+
+  if (elementSize == 1) {
+    w->stream->write(elements, count);
+  } else {
+    /* HPROF is big endian, so swap as the elements are copied in. */
+    const char *from = (const char *) elements;
+    while (count > 0) {
+      uint64_t n = w->stream->room() / elementSize;
+      n = n == 0 ? 1 : n < count ? n : count;
+      char *to = w->stream->take(n * elementSize);
+      for (uint64_t i = 0; i < n; i++, from += elementSize) {
+        jvalue v;
+        memcpy(&v, from, elementSize);
+        to = putValue(to, v, type);
+      }
+      count -= n;
+    }
+  }
+  w->objects++;
+  return 0;
+}
+
+
+/* IterateThroughHeap callback that removes dump ids, leaving class tags alone. */
+static jint JNICALL clearDumpId(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
+  if (isDumpId(*tag_ptr)) {
+    *tag_ptr = 0;
+  }
+  return JVMTI_VISIT_OBJECTS;
+}
+
+
+/* Returns the ClassDetails of a class object, or NULL if it is not registered. */
+static ClassDetails *detailsOf(jvmtiEnv *jvmti, jclass klass) {
+  jlong tag;
+  if (klass == NULL || jvmti->GetTag(klass, &tag) != JVMTI_ERROR_NONE || isDumpId(tag) || !isClassDetailsTag(tag)) {
+    return NULL;
+  }
+  return (ClassDetails *)(void *)(ptrdiff_t) tag;
+}
+
+
+/* Gathers the fields, superclass and interfaces of a class, and writes its LOAD CLASS record. */
+static HprofClass *describeClass(jvmtiEnv *jvmti, JNIEnv *jni, HprofWriter *w, ClassDetails *d) {
+  jclass klass = (jclass) jni->NewLocalRef(d->klass);
+  if (klass == NULL) {
+    return NULL;
+  }
+  HprofClass *c = (HprofClass *) scratchAllocate(sizeof(HprofClass));
+  if (c == NULL) {
+    jni->DeleteLocalRef(klass);
+    return NULL;
+  }
+  memset(c, 0, sizeof(HprofClass));
+  c->details = d;
+  c->kind = d->signature[0] != '[' ? CLASS_INSTANCE :
+      d->signature[1] == 'L' || d->signature[1] == '[' ? CLASS_OBJECT_ARRAY : CLASS_PRIMITIVE_ARRAY;
+
+  /* Classes that are loaded but not yet prepared have no fields to report. */
+  jint fieldCount;
+  jfieldID *fields;
+  if (jvmti->GetClassFields(klass, &fieldCount, &fields) != JVMTI_ERROR_NONE) {
+    fieldCount = 0;
+    fields = NULL;
+  }
+  c->declared = (HprofField *) scratchAllocate(sizeof(HprofField) * (fieldCount ? fieldCount : 1));
+  for (jint i = 0; c->declared != NULL && i < fieldCount; i++) {
+    char *name, *signature;
+    jint modifiers;
+    if (jvmti->GetFieldName(klass, fields[i], &name, &signature, NULL) != JVMTI_ERROR_NONE) {
+      continue;
+    }
+    CHECK(jvmti->GetFieldModifiers(klass, fields[i], &modifiers));
+    HprofField *f = &c->declared[c->declaredCount++];
+    f->name = writeString(w, name, strlen(name));
+    f->type = basicType(signature[0]);
+    f->isStatic = (modifiers & 0x0008) != 0;
+    if (f->isStatic) {
+      c->staticCount++;
+    } else {
+      c->ownInstanceSize += typeSize(f->type);
+    }
+    deallocate(jvmti, name);
+    deallocate(jvmti, signature);
+  }
+  if (fields != NULL) {
+    deallocate(jvmti, fields);
+  }
+  c->statics = (jvalue *) scratchAllocate(sizeof(jvalue) * (c->staticCount ? c->staticCount : 1));
+
+  jclass super;
+  if ((super = jni->GetSuperclass(klass)) != NULL) {
+    c->superDetails = detailsOf(jvmti, super);
+    jni->DeleteLocalRef(super);
+  }
+  jint interfaceCount;
+  jclass *interfaces;
+  if (jvmti->GetImplementedInterfaces(klass, &interfaceCount, &interfaces) == JVMTI_ERROR_NONE) {
+    c->interfaces = (ClassDetails **) scratchAllocate(sizeof(ClassDetails *) * (interfaceCount ? interfaceCount : 1));
+    for (jint i = 0; i < interfaceCount; i++) {
+      if (c->interfaces != NULL && (c->interfaces[c->interfaceCount] = detailsOf(jvmti, interfaces[i])) != NULL) {
+        c->interfaceCount++;
+      }
+      jni->DeleteLocalRef(interfaces[i]);
+    }
+    deallocate(jvmti, interfaces);
+  }
+  jni->DeleteLocalRef(klass);
+  if (c->declared == NULL || c->statics == NULL) {
+    return NULL;
+  }
+  memset(c->statics, 0, sizeof(jvalue) * c->staticCount);
+
+  /* Class names are written the way the JDK writes them: java/lang/String, [Ljava/lang/String; */
+  const char *name = d->signature;
+  size_t nameLength = strlen(name);
+  if (name[0] == 'L' && nameLength > 2) {
+    name++;
+    nameLength -= 2;
+  }
+  jlong nameId = writeString(w, name, nameLength);
+  beginRecord(w, HPROF_LOAD_CLASS, 4 + HPROF_ID_SIZE + 4 + HPROF_ID_SIZE);
+  char *p = w->stream->take(4 + HPROF_ID_SIZE + 4 + HPROF_ID_SIZE);
+  p = putU4(p, d->index + 1);
+  p = putU8(p, classId(c));
+  p = putU4(p, HPROF_STACK_SERIAL);
+  putU8(p, nameId);
+  return c;
+}
+
+
+/* The class hierarchy as the dump gathered it, which is what the heap walk reported fields by. */
+class HprofFieldHierarchy : public FieldHierarchy {
+  public:
+    HprofFieldHierarchy(HprofWriter *_w) : w(_w) {}
+
+  protected:
+    virtual ClassDetails *getSuperclass(ClassDetails *d) {
+      HprofClass *c = this->classOf(d);
+      return c != NULL ? c->superDetails : NULL;
+    }
+
+    virtual jint getDeclaredFieldCount(ClassDetails *d) {
+      HprofClass *c = this->classOf(d);
+      return c != NULL ? c->declaredCount : 0;
+    }
+
+    virtual void visitInterfaces(ClassDetails *d) {
+      HprofClass *c = this->classOf(d);
+      for (jint i = 0; c != NULL && i < c->interfaceCount; i++) {
+        this->countInterface(c->interfaces[i]);
+      }
+    }
+
+  private:
+    HprofClass *classOf(ClassDetails *d) {
+      return d->index < this->w->classCount ? this->w->classes[d->index] : NULL;
+    }
+
+    HprofWriter *w;
+};
+
+
+/* Numbers the fields of a class the way JVMTI does: the fields of every interface it implements,
+ * then the fields of each class from java.lang.Object down.  Instance data is laid out the way HPROF
+ * wants it, the class's own fields first and then its superclass's. */
+static void layoutFields(HprofWriter *w, HprofClass *c) {
+  if (c->slots != NULL) {
+    return;
+  }
+  HprofClass *s = c->super;
+  if (s != NULL) {
+    layoutFields(w, s);
+  }
+
+  HprofFieldHierarchy hierarchy(w);
+  c->fieldBase = hierarchy.getFieldBase(c->details);
+
+  jint inherited = s ? s->totalFields : 0;
+  c->totalFields = inherited + c->declaredCount;
+  c->instanceSize = c->ownInstanceSize + (s ? s->instanceSize : 0);
+  c->slots = (jint *) scratchAllocate(sizeof(jint) * (c->totalFields ? c->totalFields : 1));
+  if (c->slots == NULL || c->fieldBase < 0) {
+    c->totalFields = 0;
+    return;
+  }
+  for (jint i = 0; i < inherited; i++) {
+    c->slots[i] = s->slots[i] >= 0 ? s->slots[i] + c->ownInstanceSize : NO_SLOT;
+  }
+  jint offset = 0, statics = 0;
+  for (jint i = 0; i < c->declaredCount; i++) {
+    HprofField *f = &c->declared[i];
+    if (f->isStatic) {
+      c->slots[inherited + i] = -1 - statics++;
+    } else {
+      c->slots[inherited + i] = offset;
+      offset += typeSize(f->type);
+    }
+  }
+}
+
+
+/* Builds the class table and writes the string and class records ahead of the heap dump. */
+static bool describeClasses(jvmtiEnv *jvmti, JNIEnv *jni, HprofWriter *w) {
+  w->classCount = getClassCount();
+  w->classes = (HprofClass **) scratchAllocate(sizeof(HprofClass *) * (w->classCount ? w->classCount : 1));
+  if (w->classes == NULL) {
+    return false;
+  }
+  for (jint i = 0; i < w->classCount; i++) {
+    ClassDetails *d = getClassDetails(i);
+    w->classes[i] = d->klass != NULL && !d->unloaded ? describeClass(jvmti, jni, w, d) : NULL;
+  }
+
+  jint largest = 0;
+  for (jint i = 0; i < w->classCount; i++) {
+    HprofClass *c = w->classes[i];
+    if (c != NULL && c->superDetails != NULL && c->superDetails->index < w->classCount) {
+      c->super = w->classes[c->superDetails->index];
+    }
+  }
+  for (jint i = 0; i < w->classCount; i++) {
+    if (w->classes[i] != NULL) {
+      layoutFields(w, w->classes[i]);
+      if (w->classes[i]->instanceSize > largest) {
+        largest = w->classes[i]->instanceSize;
+      }
+    }
+  }
+  w->body = (char *) scratchAllocate(largest ? largest : 1);
+  return w->body != NULL;
+}
+
+
+static void writeClassDump(HprofWriter *w, HprofClass *c) {
+  jint fixed = 1 + HPROF_ID_SIZE + 4 + 6 * HPROF_ID_SIZE + 4 + 2 + 2;
+  jint length = fixed + 2;
+  for (jint i = 0; i < c->declaredCount; i++) {
+    length += HPROF_ID_SIZE + 1 + (c->declared[i].isStatic ? typeSize(c->declared[i].type) : 0);
+  }
+
+  beginSubRecord(w, length);
+  char *p = w->stream->take(fixed);
+  p = putU1(p, HPROF_GC_CLASS_DUMP);
+  p = putU8(p, classId(c));
+  p = putU4(p, HPROF_STACK_SERIAL);
+  p = putU8(p, classId(c->super));
+  p = putU8(p, c->loader);
+  p = putU8(p, c->signers);
+  p = putU8(p, c->domain);
+  p = putU8(p, 0);
+  p = putU8(p, 0);
+  p = putU4(p, c->instanceSize);
+  p = putU2(p, 0);
+  putU2(p, c->staticCount);
+
+  jint statics = 0;
+  for (jint i = 0; i < c->declaredCount; i++) {
+    HprofField *f = &c->declared[i];
+    if (f->isStatic) {
+      p = w->stream->take(HPROF_ID_SIZE + 1 + typeSize(f->type));
+      p = putU8(p, f->name);
+      p = putU1(p, f->type);
+      putValue(p, c->statics[statics++], f->type);
+    }
+  }
+  putU2(w->stream->take(2), c->declaredCount - c->staticCount);
+  for (jint i = 0; i < c->declaredCount; i++) {
+    HprofField *f = &c->declared[i];
+    if (!f->isStatic) {
+      p = w->stream->take(HPROF_ID_SIZE + 1);
+      p = putU8(p, f->name);
+      putU1(p, f->type);
+    }
+  }
+}
+
+
+/* Tags every thread object first, so thread serials are the sequence numbers 1 to threadCount. */
+static void tagThreads(jvmtiEnv *jvmti, JNIEnv *jni, HprofWriter *w) {
+  jint count;
+  jthread *threads;
+  CHECK(jvmti->GetAllThreads(&count, &threads));
+  for (jint i = 0; i < count; i++) {
+    jlong tag;
+    CHECK(jvmti->GetTag(threads[i], &tag));
+    if (tag == 0) {
+      CHECK(jvmti->SetTag(threads[i], makeDumpId(w, -1)));
+    }
+    jni->DeleteLocalRef(threads[i]);
+  }
+  deallocate(jvmti, threads);
+  w->threadCount = (jint) w->nextSequence - 1;
+}
+
+
+bool isGzipPath(const char *path) {
+  size_t len = strlen(path);
+  return len > 3 && strcmp(path + len - 3, ".gz") == 0;
+}
+
+
+bool writeHprofDump(jvmtiEnv *jvmti, JNIEnv *jni, int fd, bool compress, HprofStats *stats) {
+  memset(stats, 0, sizeof(HprofStats));
+  if (gdata->vmDeathCalled || gdata->dumpInProgress) {
+    return false;
+  }
+  gdata->dumpInProgress = JNI_TRUE;
+  PerfTimer timer(PERF_HPROF_DUMP);
+
+  /* Array classes are only registered once something looks for them. */
+  if (!gdata->emergencyDump) {
+    registerLoadedClasses(jvmti, jni);
+  }
+
+  DumpStream stream;
+  HprofWriter w;
+  memset(&w, 0, sizeof(w));
+  w.stream = &stream;
+  w.nextSequence = 1;
+
+  bool ok = stream.open(fd, compress);
+  if (ok) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    stream.write(HPROF_HEADER, sizeof(HPROF_HEADER));
+    char *p = stream.take(4 + 8);
+    p = putU4(p, HPROF_ID_SIZE);
+    putU8(p, (jlong) now.tv_sec * 1000 + now.tv_usec / 1000);
+
+    beginRecord(&w, HPROF_STACK_TRACE, 12);
+    p = stream.take(12);
+    p = putU4(p, HPROF_STACK_SERIAL);
+    p = putU4(p, 0);
+    putU4(p, 0);
+
+    ok = describeClasses(jvmti, jni, &w);
+  }
+
+  if (ok) {
+    tagThreads(jvmti, jni, &w);
+
+    jvmtiHeapCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.heap_reference_callback = dumpReference;
+    callbacks.primitive_field_callback = dumpPrimitiveField;
+    callbacks.array_primitive_value_callback = dumpPrimitiveArray;
+    setHeapWalkPhase("writing the heap dump");
+    CHECK(jvmti->FollowReferences(0, NULL, NULL, &callbacks, &w));
+    finishObject(&w);
+
+    for (jint i = 0; i < w.classCount; i++) {
+      if (w.classes[i] != NULL) {
+        writeClassDump(&w, w.classes[i]);
+        stats->classes++;
+      }
+    }
+    beginRecord(&w, HPROF_HEAP_DUMP_END, 0);
+
+    jvmtiHeapCallbacks clear;
+    memset(&clear, 0, sizeof(clear));
+    clear.heap_iteration_callback = clearDumpId;
+    CHECK(jvmti->IterateThroughHeap(JVMTI_HEAP_FILTER_UNTAGGED, (jclass) 0, &clear, NULL));
+  }
+
+  ok = stream.close() && ok && !w.overflow && !heapWalkCancelled();
+  stats->objects = w.objects;
+  stats->bytes = stream.bytesIn;
+  stats->compressedBytes = stream.bytesOut;
+
+  gdata->dumpInProgress = JNI_FALSE;
+  return ok;
+}
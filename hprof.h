@@ -0,0 +1,47 @@
+/*
+ * hprof.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_HPROF_H
+#define POLARBEAR_HPROF_H
+
+
+#include "jni.h"
+#include "jvmti.h"
+
+
+/* What a heap dump wrote. */
+typedef struct {
+  jlong classes;
+  jlong objects;
+  jlong bytes;
+  jlong compressedBytes;
+} HprofStats;
+
+
+/* Writes an HPROF 1.0.2 dump of the live heap to fd, gzipped if compress is set.  The dump is
+ * streamed out during a single FollowReferences walk, so it needs a few megabytes of scratch memory
+ * however large the heap is.  Must be called inside an ArenaScope.  Returns false if the dump could
+ * not be taken or written. */
+bool writeHprofDump(jvmtiEnv *jvmti, JNIEnv *jni, int fd, bool compress, HprofStats *stats);
+
+
+/* Returns true if a dump written to path should be gzipped, which is when it ends in ".gz". */
+bool isGzipPath(const char *path);
+
+
+#endif
@@ -15,16 +15,91 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
-
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "base.h"
 #include "io.h"
 
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Without MSG_NOSIGNAL the socket is set up with SO_NOSIGPIPE instead. */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+
+char *formatDecimal(char *end, long value, int width) {
+  unsigned long magnitude = value < 0 ? 0UL - (unsigned long) value : (unsigned long) value;
+  char *p = end;
+
+  do {
+    *--p = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0) {
+    *--p = '-';
+  }
+  while (p > end - width) {
+    *--p = ' ';
+  }
+  return p;
+}
+
+
+/* Widest column printColumns will pad to. */
+#define MAX_COLUMN_WIDTH 40
+
+
+int Output::printColumns(const long *values, int count, int width, const char *text) {
+  char row[8 * (MAX_COLUMN_WIDTH + 1)];
+  char *p = row;
+  int total = 0;
+
+  if (width > MAX_COLUMN_WIDTH) {
+    width = MAX_COLUMN_WIDTH;
+  }
+
+  for (int i = 0; i < count; i++) {
+    char field[MAX_COLUMN_WIDTH];
+    char *start = this->formatter(field + sizeof(field), values[i], width);
+    int len = field + sizeof(field) - start;
+
+    if (p + len + 1 > row + sizeof(row)) {
+      total += this->write(row, p - row);
+      p = row;
+    }
+    memcpy(p, start, len);
+    p += len;
+    *p++ = ' ';
+  }
+  if (text == NULL && p > row) {
+    p--;
+  }
+  total += this->write(row, p - row);
+  if (text != NULL) {
+    total += this->write(text, strlen(text));
+  }
+  total += this->write("\n", 1);
+  return total;
+}
+
+
+int Output::printRecord(const char *type, const RecordField *fields, int count, const char *text) {
+  return this->write(text, strlen(text));
+}
+
+
 int FileOutput::printf(const char *msg, ...) {
   va_list argList;
   va_start(argList, msg);
@@ -37,46 +112,217 @@ int FileOutput::printf(const char *msg, ...) {
 }
 
 
+int FileOutput::write(const char *data, int len) {
+  return fwrite(data, 1, len, this->f);
+}
+
+
 void FileOutput::flush() {
   fflush(this->f);
 }
 
 
-int writestring(int sockd, const char *vptr, int n) {
-  int nwritten;
-  const char *buffer = vptr;
-  int nleft = n;
+/* Drops the first written bytes from an iovec list. */
+static void advance(struct iovec **iov, int *iovcnt, size_t written) {
+  while (*iovcnt > 0 && written >= (*iov)->iov_len) {
+    written -= (*iov)->iov_len;
+    (*iov)++;
+    (*iovcnt)--;
+  }
+  if (*iovcnt > 0) {
+    (*iov)->iov_base = (char *) (*iov)->iov_base + written;
+    (*iov)->iov_len -= written;
+  }
+}
+
 
-  while (nleft > 0) {
-    if ((nwritten = write(sockd, buffer, nleft)) <= 0) {
+bool writeFully(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t written = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+    if (written < 0) {
       if (errno == EINTR) {
-        nwritten = 0;
-      } else {
-        return -1;
+        continue;
       }
+      return false;
     }
-    nleft  -= nwritten;
-    buffer += nwritten;
+    __sync_fetch_and_add(&gdata->bytesWritten, written);
+    advance(&iov, &iovcnt, written);
   }
+  return true;
+}
+
 
-  return n;
+/* writeFully for a socket.  A client that has gone away is an error rather than a SIGPIPE. */
+static bool sendFully(int socket, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+    ssize_t written = sendmsg(socket, &message, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    __sync_fetch_and_add(&gdata->bytesWritten, written);
+    advance(&iov, &iovcnt, written);
+  }
+  return true;
+}
+
+
+int FdOutput::printf(const char *msg, ...) {
+  va_list argList;
+  va_start(argList, msg);
+  va_list retryList;
+  va_copy(retryList, argList);
+
+  size_t available = this->capacity - this->used;
+  int len = vsnprintf(this->buffer + this->used, available, msg, argList);
+  if (len >= 0 && (size_t) len >= available && this->used > 0) {
+    this->flush();
+    available = this->capacity;
+    len = vsnprintf(this->buffer, available, msg, retryList);
+  }
+
+  va_end(retryList);
+  va_end(argList);
+
+  if (len < 0) {
+    return len;
+  }
+  if ((size_t) len >= available) {
+    len = available - 1;
+  }
+  this->used += len;
+  return len;
+}
+
+
+int FdOutput::write(const char *data, int len) {
+  for (int done = 0; done < len; ) {
+    if (this->used == this->capacity) {
+      this->flush();
+    }
+    size_t n = this->capacity - this->used;
+    if (n > (size_t) (len - done)) {
+      n = len - done;
+    }
+    memcpy(this->buffer + this->used, data + done, n);
+    this->used += n;
+    done += n;
+  }
+  return len;
+}
+
+
+void FdOutput::flush() {
+  struct iovec iov = { this->buffer, this->used };
+  writeFully(this->fd, &iov, 1);
+  this->used = 0;
+}
+
+
+SocketOutput::SocketOutput(int _socket) : socket(_socket), blockCount(0), failed(false) {
+  memset(this->blocks, 0, sizeof(this->blocks));
+  memset(this->capacity, 0, sizeof(this->capacity));
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(_socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+
+SocketOutput::~SocketOutput() {
+  this->flush();
+  for (int i = 0; i < SOCKET_MAX_BLOCKS; i++) {
+    free(this->blocks[i].iov_base);
+  }
+}
+
+
+/* Returns space for at least len bytes at the end of the buffered text, starting a new block or
+ * flushing if the current block is full.  Blocks are kept across flushes.  Returns NULL if the
+ * space cannot be allocated. */
+char *SocketOutput::reserve(size_t len, size_t *available) {
+  int current = this->blockCount - 1;
+  if (current < 0 || this->capacity[current] - this->blocks[current].iov_len < len) {
+    if (this->blockCount == SOCKET_MAX_BLOCKS) {
+      this->flush();
+    }
+    current = this->blockCount;
+    if (this->capacity[current] < len) {
+      size_t size = len > SOCKET_BLOCK_SIZE ? len : SOCKET_BLOCK_SIZE;
+      void *p = realloc(this->blocks[current].iov_base, size);
+      if (p == NULL) {
+        return NULL;
+      }
+      this->blocks[current].iov_base = p;
+      this->capacity[current] = size;
+    }
+    this->blocks[current].iov_len = 0;
+    this->blockCount++;
+  }
+
+  *available = this->capacity[current] - this->blocks[current].iov_len;
+  return (char *) this->blocks[current].iov_base + this->blocks[current].iov_len;
 }
 
 
 int SocketOutput::printf(const char *msg, ...) {
-  char buffer[1000];
+  size_t available;
+  char *buffer = this->reserve(1, &available);
+  if (buffer == NULL) {
+    return -1;
+  }
 
   va_list argList;
   va_start(argList, msg);
+  va_list retryList;
+  va_copy(retryList, argList);
 
-  int len = vsprintf(buffer, msg, argList);
+  int len = vsnprintf(buffer, available, msg, argList);
+  if (len >= 0 && (size_t) len >= available) {
+    /* Did not fit: format again into a block with room for all of it. */
+    buffer = this->reserve(len + 1, &available);
+    if (buffer != NULL) {
+      len = vsnprintf(buffer, available, msg, retryList);
+    } else {
+      len = -1;
+    }
+  }
 
+  va_end(retryList);
   va_end(argList);
 
-  return writestring(this->socket, buffer, len);
+  if (len > 0) {
+    this->blocks[this->blockCount - 1].iov_len += len;
+  }
+  return len;
+}
+
+
+int SocketOutput::write(const char *data, int len) {
+  size_t available;
+  char *buffer = this->reserve(len, &available);
+  if (buffer == NULL) {
+    return -1;
+  }
+  memcpy(buffer, data, len);
+  this->blocks[this->blockCount - 1].iov_len += len;
+  return len;
 }
 
 
 void SocketOutput::flush() {
-  // Do nothing for now.
+  /* Work on a copy of the block list, so short writes can be resumed without losing the blocks. */
+  struct iovec pending[SOCKET_MAX_BLOCKS];
+  memcpy(pending, this->blocks, sizeof(struct iovec) * this->blockCount);
+
+  if (!this->failed && !sendFully(this->socket, pending, this->blockCount)) {
+    this->failed = true;
+  }
+  this->blockCount = 0;
 }
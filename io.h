@@ -20,12 +20,58 @@
 #define POLARBEAR_IO_H
 
 #include <stdlib.h>
+#include <sys/uio.h>
+
+
+/* Writes value right aligned in a field of the given width, ending just before end.  Returns the
+ * start of the field, which is earlier than end - width if the value does not fit. */
+typedef char *(*IntegerFormatter)(char *end, long value, int width);
+
+
+/* Writes all of the buffers to fd, in as few writev calls as it can, resuming after short writes.
+ * The iovecs are modified.  Returns false on error. */
+bool writeFully(int fd, struct iovec *iov, int iovcnt);
+
+
+/* The default IntegerFormatter: plain decimal, like printf's %*ld. */
+char *formatDecimal(char *end, long value, int width);
+
+
+/* One named value of a record: an integer, or a string if text is not NULL.  A field with no name
+ * is left out, so a caller can drop a value it does not have. */
+typedef struct {
+  const char *name;
+  long value;
+  const char *text;
+} RecordField;
 
 
 class Output {
+  protected:
+    IntegerFormatter formatter;
+
   public:
+    Output() : formatter(formatDecimal) {}
+    virtual ~Output() {}
+
     virtual int printf(const char *msg, ...) = 0;
+    virtual int write(const char *data, int len) = 0;
     virtual void flush() = 0;
+
+    void setIntegerFormatter(IntegerFormatter f) { this->formatter = f; }
+
+    /* Names the integer columns of the rows that follow, then their text column, for outputs that
+     * label fields rather than print a header.  The names must outlive the table. */
+    virtual void setColumnNames(const char *const *) {}
+
+    /* Prints count integer columns, each followed by a space, then text and a newline.  This is the
+     * shape of a histogram row, and avoids printf for the bulk of a large table.  A table without a
+     * text column passes NULL. */
+    virtual int printColumns(const long *values, int count, int width, const char *text);
+
+    /* Prints text, which says what the fields hold in words, or for outputs that label fields, the
+     * fields as one record of the given type instead. */
+    virtual int printRecord(const char *type, const RecordField *fields, int count, const char *text);
 };
 
 
@@ -37,20 +83,59 @@ class FileOutput : public Output {
     FileOutput(FILE *_f) : f(_f) {}
 
     virtual int printf(const char *msg, ...);
+    virtual int write(const char *data, int len);
     virtual void flush();
 };
 
 
+/* Output to a file descriptor through a fixed buffer supplied by the caller.  It never allocates,
+ * so it can be used while native memory is exhausted.  A line longer than the buffer is cut. */
+class FdOutput : public Output {
+  private:
+    int fd;
+    char *buffer;
+    size_t capacity;
+    size_t used;
+
+  public:
+    FdOutput(int _fd, char *_buffer, size_t _capacity) : fd(_fd), buffer(_buffer), capacity(_capacity), used(0) {}
+    virtual ~FdOutput() { this->flush(); }
+
+    virtual int printf(const char *msg, ...);
+    virtual int write(const char *data, int len);
+    virtual void flush();
+};
+
+
+#define SOCKET_BLOCK_SIZE (64 * 1024)
+#define SOCKET_MAX_BLOCKS 64
+
+
+/* Output to a socket.  Text is gathered into a list of blocks and sent with one writev when
+ * flush() is called or SOCKET_MAX_BLOCKS blocks fill up, so a large table costs a handful of
+ * system calls instead of one per line. */
 class SocketOutput : public Output {
   private:
     int socket;
+    struct iovec blocks[SOCKET_MAX_BLOCKS];
+    int blockCount;
+    size_t capacity[SOCKET_MAX_BLOCKS];
+    bool failed;
+
+    char *reserve(size_t len, size_t *available);
 
   public:
-    SocketOutput(int _socket) : socket(_socket) {}
+    SocketOutput(int _socket);
+    virtual ~SocketOutput();
 
     virtual int printf(const char *msg, ...);
+    virtual int write(const char *data, int len);
     virtual void flush();
+
+    /* True once a send failed, because the client went away or stopped reading.  Nothing more is
+     * sent after that. */
+    bool hasFailed() const { return this->failed; }
 };
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,341 @@
+/*
+ * json.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+
+
+static const char *skipSpace(const char *p) {
+  while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+    p++;
+  }
+  return p;
+}
+
+
+/* Reads a JSON string starting at its opening quote into buffer, decoding escapes.  Returns the
+ * position after the closing quote, or NULL if the string is malformed or does not fit. */
+static const char *readString(const char *p, char *buffer, int size) {
+  int used = 0;
+  for (p++; *p != '"'; p++) {
+    char c = *p;
+    if (c == 0) {
+      return NULL;
+    }
+    if (c == '\\') {
+      switch (*++p) {
+        case '"': case '\\': case '/': c = *p; break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'u': {
+          /* Commands are ASCII, so only escapes below 0x80 are decoded. */
+          unsigned int code;
+          if (sscanf(p + 1, "%4x", &code) != 1 || code >= 0x80 || strspn(p + 1, "0123456789abcdefABCDEF") < 4) {
+            return NULL;
+          }
+          c = (char) code;
+          p += 4;
+          break;
+        }
+        default:
+          return NULL;
+      }
+    }
+    if (used + 1 >= size) {
+      return NULL;
+    }
+    buffer[used++] = c;
+  }
+  buffer[used] = 0;
+  return p + 1;
+}
+
+
+/* Skips a number, true, false or null, returning the position after it or NULL. */
+static const char *skipLiteral(const char *p) {
+  const char *start = p;
+  if (strncmp(p, "true", 4) == 0 || strncmp(p, "null", 4) == 0) {
+    return p + 4;
+  }
+  if (strncmp(p, "false", 5) == 0) {
+    return p + 5;
+  }
+  p += *p == '-';
+  p += strspn(p, "0123456789");
+  if (*p == '.') {
+    p += 1 + strspn(p + 1, "0123456789");
+  }
+  if (*p == 'e' || *p == 'E') {
+    p++;
+    p += *p == '+' || *p == '-';
+    p += strspn(p, "0123456789");
+  }
+  return p > start && p[-1] >= '0' && p[-1] <= '9' ? p : NULL;
+}
+
+
+const char *parseJsonRequest(const char *line, JsonRequest *request) {
+  char key[16];
+  char args[JSON_MAX_COMMAND];
+  bool haveCommand = false;
+
+  strcpy(request->id, "null");
+  request->command[0] = 0;
+  args[0] = 0;
+
+  const char *p = skipSpace(line);
+  if (*p != '{') {
+    return "request is not a JSON object";
+  }
+  p = skipSpace(p + 1);
+  while (*p != '}') {
+    if (*p != '"') {
+      return "expected a field name";
+    }
+    /* Fields that are not ours are skipped, so their names may be long. */
+    const char *name = p;
+    p = readString(p, key, sizeof(key));
+    if (p == NULL) {
+      p = strchr(name + 1, '"');
+      if (p == NULL) {
+        return "unterminated field name";
+      }
+      key[0] = 0;
+      p++;
+    }
+    p = skipSpace(p);
+    if (*p != ':') {
+      return "expected ':'";
+    }
+    p = skipSpace(p + 1);
+
+    const char *value = p;
+    if (strcmp(key, "command") == 0 || strcmp(key, "args") == 0) {
+      bool isCommand = strcmp(key, "command") == 0;
+      if (*p != '"') {
+        return "command and args must be strings";
+      }
+      p = readString(p, isCommand ? request->command : args, JSON_MAX_COMMAND);
+      haveCommand |= isCommand;
+    } else if (*p == '"') {
+      char ignored[JSON_MAX_COMMAND];
+      p = readString(p, ignored, sizeof(ignored));
+    } else if (*p == '{' || *p == '[') {
+      return "nested values are not supported";
+    } else {
+      p = skipLiteral(p);
+    }
+    if (p == NULL) {
+      return "malformed value";
+    }
+
+    if (strcmp(key, "id") == 0) {
+      if (p - value >= JSON_MAX_ID || (*value != '"' && (*value < '0' || *value > '9') && *value != '-')) {
+        return "id must be a number or a short string";
+      }
+      memcpy(request->id, value, p - value);
+      request->id[p - value] = 0;
+    }
+
+    p = skipSpace(p);
+    if (*p == ',') {
+      p = skipSpace(p + 1);
+    } else if (*p != '}') {
+      return "expected ',' or '}'";
+    }
+  }
+  if (*skipSpace(p + 1) != 0) {
+    return "unexpected text after the request";
+  }
+
+  if (!haveCommand || request->command[0] == 0) {
+    return "missing command";
+  }
+  if (args[0]) {
+    size_t length = strlen(request->command);
+    if (length + 1 + strlen(args) >= JSON_MAX_COMMAND) {
+      return "command too long";
+    }
+    request->command[length] = ' ';
+    strcpy(request->command + length + 1, args);
+  }
+  return NULL;
+}
+
+
+/* Writes s as a quoted JSON string. */
+void JsonOutput::writeString(const char *s, int len) {
+  static const char hex[] = "0123456789abcdef";
+  int start = 0;
+
+  this->out->write("\"", 1);
+  for (int i = 0; i < len; i++) {
+    unsigned char c = (unsigned char) s[i];
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    this->out->write(s + start, i - start);
+    char escape[6] = { '\\', (char) c, 0, 0, 0, 0 };
+    int escapeLength = 2;
+    if (c < 0x20) {
+      escape[1] = 'u';
+      escape[2] = '0';
+      escape[3] = '0';
+      escape[4] = hex[c >> 4];
+      escape[5] = hex[c & 15];
+      escapeLength = 6;
+    }
+    this->out->write(escape, escapeLength);
+    start = i + 1;
+  }
+  this->out->write(s + start, len - start);
+  this->out->write("\"", 1);
+}
+
+
+/* Writes a text record, unless the line is blank. */
+void JsonOutput::writeText(const char *s, int len) {
+  while (len > 0 && (s[len - 1] == '\r' || s[len - 1] == ' ')) {
+    len--;
+  }
+  if (len == 0) {
+    return;
+  }
+  this->out->printf("{\"id\":%s,\"type\":\"text\",\"text\":", this->id);
+  this->writeString(s, len);
+  this->out->write("}\n", 2);
+}
+
+
+JsonOutput::~JsonOutput() {
+  this->flush();
+}
+
+
+int JsonOutput::printf(const char *msg, ...) {
+  char buffer[JSON_LINE_SIZE];
+
+  va_list argList;
+  va_start(argList, msg);
+  va_list retryList;
+  va_copy(retryList, argList);
+
+  int len = vsnprintf(buffer, sizeof(buffer), msg, argList);
+  if (len >= (int) sizeof(buffer)) {
+    char *large = (char *) malloc(len + 1);
+    if (large != NULL) {
+      vsnprintf(large, len + 1, msg, retryList);
+      this->write(large, len);
+      free(large);
+    } else {
+      this->write(buffer, sizeof(buffer) - 1);
+    }
+  } else if (len > 0) {
+    this->write(buffer, len);
+  }
+
+  va_end(retryList);
+  va_end(argList);
+  return len;
+}
+
+
+int JsonOutput::write(const char *data, int len) {
+  for (int i = 0; i < len; i++) {
+    if (data[i] == '\n') {
+      this->writeText(this->line, this->used);
+      this->used = 0;
+    } else {
+      if (this->used == JSON_LINE_SIZE) {
+        this->writeText(this->line, this->used);
+        this->used = 0;
+      }
+      this->line[this->used++] = data[i];
+    }
+  }
+  return len;
+}
+
+
+/* Sends the records completed so far.  A partial line stays buffered until its newline. */
+void JsonOutput::flush() {
+  this->out->flush();
+}
+
+
+void JsonOutput::setColumnNames(const char *const *names) {
+  this->columns = names;
+}
+
+
+int JsonOutput::printColumns(const long *values, int count, int width, const char *text) {
+  if (this->columns == NULL) {
+    return Output::printColumns(values, count, width, text);
+  }
+
+  this->out->printf("{\"id\":%s,\"type\":\"row\"", this->id);
+  for (int i = 0; i < count; i++) {
+    this->out->printf(",\"%s\":%ld", this->columns[i], values[i]);
+  }
+  if (text != NULL) {
+    this->out->printf(",\"%s\":", this->columns[count]);
+    this->writeString(text, strlen(text));
+  }
+  this->out->write("}\n", 2);
+  return 0;
+}
+
+
+int JsonOutput::printRecord(const char *type, const RecordField *fields, int count, const char *text) {
+  this->out->printf("{\"id\":%s,\"type\":\"%s\"", this->id, type);
+  for (int i = 0; i < count; i++) {
+    if (fields[i].name == NULL) {
+      continue;
+    }
+    if (fields[i].text != NULL) {
+      this->out->printf(",\"%s\":", fields[i].name);
+      this->writeString(fields[i].text, strlen(fields[i].text));
+    } else {
+      this->out->printf(",\"%s\":%ld", fields[i].name, fields[i].value);
+    }
+  }
+  this->out->write("}\n", 2);
+  return 0;
+}
+
+
+void JsonOutput::end(const char *status, const char *error, jlong millis) {
+  if (this->used) {
+    this->writeText(this->line, this->used);
+    this->used = 0;
+  }
+  this->out->printf("{\"id\":%s,\"type\":\"end\",\"status\":\"%s\"", this->id, status);
+  if (error != NULL) {
+    this->out->printf(",\"error\":");
+    this->writeString(error, strlen(error));
+  }
+  this->out->printf(",\"ms\":%ld}\n", (long) millis);
+  this->out->flush();
+}
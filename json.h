@@ -0,0 +1,94 @@
+/*
+ * json.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_JSON_H
+#define POLARBEAR_JSON_H
+
+
+#include "jni.h"
+
+#include "io.h"
+
+
+/* Longest request id echoed back, including the quotes of a string id. */
+#define JSON_MAX_ID 64
+
+/* Longest command, with its arguments.  The same as a shell line. */
+#define JSON_MAX_COMMAND 1000
+
+/* Longest text line sent as one record.  Longer lines are split. */
+#define JSON_LINE_SIZE 1024
+
+
+/* A shell request in the JSON protocol, one object per line:
+ *
+ *   {"id": 7, "command": "histogram"}
+ *   {"id": "q2", "command": "stats", "args": "Ljava/lang/String;"}
+ *
+ * The id may be a number or a string, and is sent back as it was written, or as null if there is
+ * none.  args, if given, is appended to the command after a space. */
+typedef struct {
+  char id[JSON_MAX_ID];
+  char command[JSON_MAX_COMMAND];
+} JsonRequest;
+
+
+/* Parses a request line into request.  Returns NULL on success, or a description of the problem.
+ * The id is filled in as soon as it is read, so errors can still be matched to their request. */
+const char *parseJsonRequest(const char *line, JsonRequest *request);
+
+
+/* Output that frames a command's results as newline-delimited JSON records for one request:
+ *
+ *   {"id":7,"type":"row","space":31692904,"count":396154,...,"class":"[C"}
+ *   {"id":7,"type":"stats","count":396154,"space":31692904}
+ *   {"id":7,"type":"text","text":"Heap View, Total of 799172 objects found."}
+ *   {"id":7,"type":"end","status":"ok","ms":812}
+ *
+ * Table rows become row records labelled by setColumnNames, printRecord calls records of their own
+ * type, and every other non-empty line a text record.  Records are passed to out as they are
+ * completed, so results stream. */
+class JsonOutput : public Output {
+  private:
+    Output *out;
+    const char *id;
+    const char *const *columns;
+    char line[JSON_LINE_SIZE];
+    int used;
+
+    void writeString(const char *s, int len);
+    void writeText(const char *s, int len);
+
+  public:
+    JsonOutput(Output *_out, const char *_id) : out(_out), id(_id), columns(0), used(0) {}
+    virtual ~JsonOutput();
+
+    virtual int printf(const char *msg, ...);
+    virtual int write(const char *data, int len);
+    virtual void flush();
+    virtual void setColumnNames(const char *const *names);
+    virtual int printColumns(const long *values, int count, int width, const char *text);
+    virtual int printRecord(const char *type, const RecordField *fields, int count, const char *text);
+
+    /* Writes the end record of the request.  status is "ok", "error" or "cancelled", and error, if
+     * not NULL, says what went wrong. */
+    void end(const char *status, const char *error, jlong millis);
+};
+
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * jvmtiheap.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "base.h"
+#include "classes.h"
+#include "jvmtiheap.h"
+#include "progress.h"
+
+
+#if MAX_HEAP_MARK > MAX_SCRATCH_TAG
+#error "Heap marks must fit below the ClassDetails tags"
+#endif
+
+
+/* State shared by the callbacks of one walk. */
+typedef struct {
+  HeapVisitor *visitor;
+  bool stopped;
+} Walk;
+
+
+/* Class objects are permanently tagged with their ClassDetails, so their mark is kept in their
+ * ClassDetails instead. */
+static inline jlong *markOf(jlong *tag_ptr, jlong class_tag) {
+  if (isClassObject(class_tag) && isClassDetailsTag(*tag_ptr)) {
+    return &((ClassDetails*)(void*)(ptrdiff_t)*tag_ptr)->objectTag;
+  }
+  return tag_ptr;
+}
+
+
+static inline jint classIndexOf(jlong class_tag) {
+  return isClassDetailsTag(class_tag) ? ((ClassDetails*)(void*)(ptrdiff_t)class_tag)->index : -1;
+}
+
+
+/* IterateOverHeap callback. */
+static jvmtiIterationControl JNICALL overHeapObject(jlong class_tag, jlong size, jlong* tag_ptr, void* user_data) {
+  Walk *walk = (Walk *) user_data;
+  if (heapWalkStep() || !walk->visitor->object(classIndexOf(class_tag), size, markOf(tag_ptr, class_tag))) {
+    walk->stopped = true;
+    return JVMTI_ITERATION_ABORT;
+  }
+  return JVMTI_ITERATION_CONTINUE;
+}
+
+
+/* IterateThroughHeap callback. */
+static jint JNICALL throughHeapObject(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
+  Walk *walk = (Walk *) user_data;
+  if (heapWalkStep() || !walk->visitor->object(classIndexOf(class_tag), size, markOf(tag_ptr, class_tag))) {
+    walk->stopped = true;
+    return JVMTI_VISIT_ABORT;
+  }
+  return JVMTI_VISIT_OBJECTS;
+}
+
+
+/* FollowReferences callback. */
+static jint JNICALL reference(
+    jvmtiHeapReferenceKind reference_kind,
+    const jvmtiHeapReferenceInfo* reference_info,
+    jlong class_tag,
+    jlong referrer_class_tag,
+    jlong size,
+    jlong* tag_ptr,
+    jlong* referrer_tag_ptr,
+    jint length,
+    void* user_data) {
+  Walk *walk = (Walk *) user_data;
+  if (heapWalkStep()) {
+    walk->stopped = true;
+    return JVMTI_VISIT_ABORT;
+  }
+
+  jlong *referrerMark = NULL;
+  jint referrerClassIndex = -1;
+  HeapReference ref = { HEAP_REFERENCE_OTHER, 0, -1 };
+  if (referrer_tag_ptr) {
+    referrerMark = markOf(referrer_tag_ptr, referrer_class_tag);
+    referrerClassIndex = classIndexOf(referrer_class_tag);
+
+    if (reference_kind == JVMTI_HEAP_REFERENCE_FIELD) {
+      ref.kind = HEAP_REFERENCE_FIELD;
+      ref.index = reference_info->field.index;
+    } else if (reference_kind == JVMTI_HEAP_REFERENCE_STATIC_FIELD) {
+      /* The referrer is the class object, tagged with the ClassDetails of the class. */
+      ref.kind = HEAP_REFERENCE_STATIC_FIELD;
+      ref.index = reference_info->field.index;
+      ref.holder = classIndexOf(*referrer_tag_ptr);
+    } else if (reference_kind == JVMTI_HEAP_REFERENCE_ARRAY_ELEMENT) {
+      ref.kind = HEAP_REFERENCE_ARRAY_ELEMENT;
+    }
+  } else {
+    switch (reference_kind) {
+      case JVMTI_HEAP_REFERENCE_SYSTEM_CLASS: ref.kind = HEAP_REFERENCE_ROOT_SYSTEM_CLASS; break;
+      case JVMTI_HEAP_REFERENCE_JNI_GLOBAL: ref.kind = HEAP_REFERENCE_ROOT_JNI_GLOBAL; break;
+      case JVMTI_HEAP_REFERENCE_THREAD: ref.kind = HEAP_REFERENCE_ROOT_THREAD; break;
+      case JVMTI_HEAP_REFERENCE_STACK_LOCAL: ref.kind = HEAP_REFERENCE_ROOT_STACK_LOCAL; break;
+      case JVMTI_HEAP_REFERENCE_JNI_LOCAL: ref.kind = HEAP_REFERENCE_ROOT_JNI_LOCAL; break;
+      case JVMTI_HEAP_REFERENCE_MONITOR: ref.kind = HEAP_REFERENCE_ROOT_MONITOR; break;
+      default: ref.kind = HEAP_REFERENCE_ROOT_OTHER; break;
+    }
+  }
+  if (!walk->visitor->reference(classIndexOf(class_tag), size, markOf(tag_ptr, class_tag), referrerClassIndex, referrerMark, &ref)) {
+    walk->stopped = true;
+    return JVMTI_VISIT_ABORT;
+  }
+  return JVMTI_VISIT_OBJECTS;
+}
+
+
+/* IterateThroughHeap callback that clears marks. */
+static jint JNICALL clearMark(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
+  *markOf(tag_ptr, class_tag) = 0;
+  return JVMTI_VISIT_OBJECTS;
+}
+
+
+bool JvmtiHeapSource::iterateObjects(HeapVisitor *visitor, jint classIndex, bool markedOnly) {
+  Walk walk = { visitor, false };
+
+  if (classIndex < 0 && !markedOnly) {
+    CHECK(this->jvmti->IterateOverHeap(JVMTI_HEAP_OBJECT_EITHER, &overHeapObject, &walk));
+  } else {
+    jvmtiHeapCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.heap_iteration_callback = throughHeapObject;
+    jclass klass = classIndex >= 0 ? getClassDetails(classIndex)->klass : (jclass) 0;
+    CHECK(this->jvmti->IterateThroughHeap(markedOnly ? JVMTI_HEAP_FILTER_UNTAGGED : 0, klass, &callbacks, &walk));
+  }
+  return !walk.stopped;
+}
+
+
+bool JvmtiHeapSource::followReferences(HeapVisitor *visitor) {
+  Walk walk = { visitor, false };
+
+  jvmtiHeapCallbacks callbacks;
+  memset(&callbacks, 0, sizeof(callbacks));
+  callbacks.heap_reference_callback = reference;
+  CHECK(this->jvmti->FollowReferences(0, NULL, NULL, &callbacks, &walk));
+  return !walk.stopped;
+}
+
+
+/* Only tagged objects can have a mark, and class objects are always tagged. */
+void JvmtiHeapSource::clearMarks() {
+  jvmtiHeapCallbacks callbacks;
+  memset(&callbacks, 0, sizeof(callbacks));
+  callbacks.heap_iteration_callback = clearMark;
+  CHECK(this->jvmti->IterateThroughHeap(JVMTI_HEAP_FILTER_UNTAGGED, (jclass) 0, &callbacks, NULL));
+}
+
+
+bool JvmtiHeapSource::cancelled() {
+  return heapWalkCancelled();
+}
@@ -0,0 +1,47 @@
+/*
+ * jvmtiheap.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_JVMTI_HEAP_H
+#define POLARBEAR_JVMTI_HEAP_H
+
+
+#include "jni.h"
+#include "jvmti.h"
+
+#include "heapsource.h"
+
+
+/* The live heap, walked through JVMTI.  Class indexes are registry indexes.  Marks are kept in
+ * object tags, except for class objects, which are permanently tagged with their ClassDetails and
+ * keep their mark in it instead.  Every object visited is a step of the HeapWalkScope in progress,
+ * and walks stop when it is cancelled.  The caller must hold the agent monitor. */
+class JvmtiHeapSource : public HeapSource {
+  private:
+    jvmtiEnv *jvmti;
+
+  public:
+    JvmtiHeapSource(jvmtiEnv *_jvmti) : jvmti(_jvmti) {}
+
+    virtual bool iterateObjects(HeapVisitor *visitor, jint classIndex, bool markedOnly);
+    virtual bool followReferences(HeapVisitor *visitor);
+    virtual void clearMarks();
+    virtual bool cancelled();
+};
+
+
+#endif
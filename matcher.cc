@@ -0,0 +1,236 @@
+/*
+ * matcher.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "base.h"
+#include "matcher.h"
+
+
+/* Returns the child of parent labelled c, or -1. */
+static jint findChild(const MatcherNode *nodes, jint parent, char c) {
+  for (jint child = nodes[parent].firstChild; child != -1; child = nodes[child].nextSibling) {
+    if (nodes[child].c == c) {
+      return child;
+    }
+  }
+  return -1;
+}
+
+
+/* Returns the child of parent labelled c, creating it if needed. */
+static jint addChild(MatcherNode *nodes, jint *count, jint parent, char c) {
+  jint child = findChild(nodes, parent, c);
+  if (child != -1) {
+    return child;
+  }
+
+  child = (*count)++;
+  nodes[child].c = c;
+  nodes[child].firstChild = -1;
+  nodes[child].nextSibling = nodes[parent].firstChild;
+  nodes[child].pattern = -1;
+  nodes[child].firstGlob = -1;
+  nodes[parent].firstChild = child;
+  return child;
+}
+
+
+/* Sets up the root of an empty trie. */
+static void initTrie(MatcherNode *nodes, jint *count) {
+  nodes[0].c = 0;
+  nodes[0].firstChild = -1;
+  nodes[0].nextSibling = -1;
+  nodes[0].pattern = -1;
+  nodes[0].firstGlob = -1;
+  *count = 1;
+}
+
+
+/* Copies a pattern, using '/' as the package separator and stripping signature decoration. */
+static char *normalizePattern(const char *pattern) {
+  char *copy = strdup(pattern);
+  CHECK_FOR_NULL(copy);
+
+  int len = strlen(copy);
+  if (len > 2 && copy[0] == 'L' && copy[len - 1] == ';') {
+    memmove(copy, copy + 1, len - 2);
+    copy[len - 2] = 0;
+  }
+  for (char *p = copy; *p; p++) {
+    if (*p == '.') {
+      *p = '/';
+    }
+  }
+  return copy;
+}
+
+
+ClassMatcher::ClassMatcher(char **patterns, int count) {
+  int totalLength = 0;
+  for (int i = 0; i < count; i++) {
+    totalLength += strlen(patterns[i]);
+  }
+
+  this->forward = (MatcherNode *) calloc(sizeof(MatcherNode), totalLength + 1);
+  this->reverse = (MatcherNode *) calloc(sizeof(MatcherNode), totalLength + 1);
+  this->globs = (MatcherGlob *) calloc(sizeof(MatcherGlob), count ? count : 1);
+  this->patterns = (char **) calloc(sizeof(char *), count ? count : 1);
+  CHECK_FOR_NULL(this->forward);
+  CHECK_FOR_NULL(this->reverse);
+  CHECK_FOR_NULL(this->globs);
+  CHECK_FOR_NULL(this->patterns);
+  initTrie(this->forward, &this->forwardCount);
+  initTrie(this->reverse, &this->reverseCount);
+  this->globCount = 0;
+  this->patternCount = count;
+
+  for (int i = 0; i < count; i++) {
+    char *pattern = normalizePattern(patterns[i]);
+    int len = strlen(pattern);
+    this->patterns[i] = pattern;
+
+    int wildcard = strcspn(pattern, "*?");
+    if (pattern[wildcard]) {
+      /* Glob: index by its literal prefix. */
+      jint node = 0;
+      for (int j = 0; j < wildcard; j++) {
+        node = addChild(this->forward, &this->forwardCount, node, pattern[j]);
+      }
+      MatcherGlob *glob = &this->globs[this->globCount];
+      glob->pattern = i;
+      glob->rest = pattern + wildcard;
+      glob->next = this->forward[node].firstGlob;
+      this->forward[node].firstGlob = this->globCount++;
+
+    } else if (len > 0 && pattern[len - 1] == '/') {
+      /* Package prefix. */
+      jint node = 0;
+      for (int j = 0; j < len; j++) {
+        node = addChild(this->forward, &this->forwardCount, node, pattern[j]);
+      }
+      if (this->forward[node].pattern == -1) {
+        this->forward[node].pattern = i;
+      }
+
+    } else if (len > 0) {
+      /* Name suffix. */
+      jint node = 0;
+      for (int j = len - 1; j >= 0; j--) {
+        node = addChild(this->reverse, &this->reverseCount, node, pattern[j]);
+      }
+      if (this->reverse[node].pattern == -1) {
+        this->reverse[node].pattern = i;
+      }
+    }
+  }
+}
+
+
+/* Matches a glob against name[0..end).  '*' and '?' do not match '/', while '**' matches anything. */
+static bool globMatch(const char *p, const char *s, const char *end) {
+  while (*p) {
+    if (p[0] == '*' && p[1] == '*') {
+      while (*p == '*') {
+        p++;
+      }
+      for (const char *t = s; t <= end; t++) {
+        if (globMatch(p, t, end)) {
+          return true;
+        }
+      }
+      return false;
+    }
+    if (*p == '*') {
+      p++;
+      for (const char *t = s; t <= end; t++) {
+        if (globMatch(p, t, end)) {
+          return true;
+        }
+        if (t < end && *t == '/') {
+          break;
+        }
+      }
+      return false;
+    }
+    if (s == end || *s == '/' && *p == '?' || *p != '?' && *p != *s) {
+      return false;
+    }
+    p++;
+    s++;
+  }
+  return s == end;
+}
+
+
+int ClassMatcher::match(const char *signature) const {
+  /* Reduce the signature to the bare class name of the element type. */
+  const char *name = signature;
+  while (*name == '[') {
+    name++;
+  }
+  const char *end = name + strlen(name);
+  if (*name == 'L' && end > name + 1 && end[-1] == ';') {
+    name++;
+    end--;
+  }
+
+  jint node = 0;
+  for (const char *s = end; s > name; ) {
+    node = findChild(this->reverse, node, *--s);
+    if (node == -1) {
+      break;
+    }
+    if (this->reverse[node].pattern != -1) {
+      return this->reverse[node].pattern;
+    }
+  }
+
+  node = 0;
+  for (const char *s = name; ; s++) {
+    if (this->forward[node].pattern != -1) {
+      return this->forward[node].pattern;
+    }
+    for (jint g = this->forward[node].firstGlob; g != -1; g = this->globs[g].next) {
+      if (globMatch(this->globs[g].rest, s, end)) {
+        return this->globs[g].pattern;
+      }
+    }
+    if (s == end) {
+      break;
+    }
+    node = findChild(this->forward, node, *s);
+    if (node == -1) {
+      break;
+    }
+  }
+
+  return -1;
+}
+
+
+ClassMatcher::~ClassMatcher() {
+  for (int i = 0; i < this->patternCount; i++) {
+    free(this->patterns[i]);
+  }
+  free(this->patterns);
+  free(this->forward);
+  free(this->reverse);
+  free(this->globs);
+}
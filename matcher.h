@@ -0,0 +1,73 @@
+/*
+ * matcher.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_MATCHER_H
+#define POLARBEAR_MATCHER_H
+
+
+#include "jni.h"
+
+
+/* Trie node.  Children are kept as sibling lists since only a handful of patterns share a prefix. */
+typedef struct {
+  char c;
+  jint firstChild;
+  jint nextSibling;
+  jint pattern;
+  jint firstGlob;
+} MatcherNode;
+
+
+/* A glob hung off the forward trie node that matches its literal prefix. */
+typedef struct {
+  jint pattern;
+  const char *rest;
+  jint next;
+} MatcherGlob;
+
+
+/* A compiled set of class name patterns.  Patterns may use '.' or '/' as the package separator
+ * and take one of three forms:
+ *
+ *   HashMap, java/util/HashMap   the class name ends with the pattern
+ *   com/acme/cache/              any class in the package or its subpackages
+ *   com.acme.cache.*Entry        glob over the whole class name: '*' and '?' stop at '/', '**' does not
+ *
+ * Suffix patterns are compiled into a reversed trie and the others into a forward trie, so a
+ * signature is matched against every pattern in a single pass over each direction. */
+struct ClassMatcher {
+  MatcherNode *forward;
+  jint forwardCount;
+  MatcherNode *reverse;
+  jint reverseCount;
+  MatcherGlob *globs;
+  jint globCount;
+  char **patterns;
+  jint patternCount;
+
+  ClassMatcher(char **patterns, int count);
+
+  /* Returns the index of a pattern matching the given class signature, or -1.  Array signatures
+   * match the patterns for their element class. */
+  int match(const char *signature) const;
+
+  ~ClassMatcher();
+};
+
+
+#endif
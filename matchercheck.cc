@@ -0,0 +1,148 @@
+/*
+ * matchercheck.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Checks the class name patterns against signatures whose matches are known. */
+
+#include <stdio.h>
+
+#include "matcher.h"
+
+
+static const char *patternSet;
+static int failures;
+
+
+/* Reports a signature that matched a different pattern than the one expected, -1 being none. */
+static void expectMatch(const ClassMatcher *matcher, const char *signature, int expected) {
+  int actual = matcher->match(signature);
+  if (actual != expected) {
+    fprintf(stderr, "%s: %s matched pattern %d, expected %d.\n", patternSet, signature, actual, expected);
+    failures++;
+  }
+}
+
+
+/* Suffix patterns match the end of the class name, in either separator or as a signature. */
+static void checkSuffixes() {
+  patternSet = "suffixes";
+  char *patterns[] = { (char *) "HashMap", (char *) "java.util.TreeMap", (char *) "Ljava/lang/String;" };
+  ClassMatcher matcher(patterns, 3);
+
+  expectMatch(&matcher, "Ljava/util/HashMap;", 0);
+  expectMatch(&matcher, "Lcom/acme/LinkedHashMap;", 0);
+  expectMatch(&matcher, "Ljava/util/TreeMap;", 1);
+  expectMatch(&matcher, "Lcom/acme/TreeMap;", -1);
+  expectMatch(&matcher, "Ljava/lang/String;", 2);
+  expectMatch(&matcher, "Ljava/lang/StringBuilder;", -1);
+  expectMatch(&matcher, "Ljava/util/HashMap$Entry;", -1);
+
+  /* Arrays match the patterns for their element class, primitive arrays nothing. */
+  expectMatch(&matcher, "[Ljava/util/HashMap;", 0);
+  expectMatch(&matcher, "[[Ljava/lang/String;", 2);
+  expectMatch(&matcher, "[I", -1);
+}
+
+
+/* Package prefixes match every class in the package and its subpackages. */
+static void checkPackages() {
+  patternSet = "packages";
+  char *patterns[] = { (char *) "com.acme.cache.", (char *) "com/acme/" };
+  ClassMatcher matcher(patterns, 2);
+
+  /* The longer prefix is met first along the trie, but the shorter one matches first. */
+  expectMatch(&matcher, "Lcom/acme/cache/Entry;", 1);
+  expectMatch(&matcher, "Lcom/acme/Widget;", 1);
+  expectMatch(&matcher, "[Lcom/acme/util/Pool;", 1);
+  expectMatch(&matcher, "Lcom/acmeco/Widget;", -1);
+  expectMatch(&matcher, "Lorg/acme/Widget;", -1);
+
+  char *cachePatterns[] = { (char *) "com.acme.cache." };
+  ClassMatcher cache(cachePatterns, 1);
+  patternSet = "cache package";
+  expectMatch(&cache, "Lcom/acme/cache/Entry;", 0);
+  expectMatch(&cache, "Lcom/acme/cache/disk/Block;", 0);
+  expectMatch(&cache, "Lcom/acme/cached/Entry;", -1);
+  expectMatch(&cache, "Lcom/acme/Cache;", -1);
+}
+
+
+/* '*' and '?' stay within one package level, while '**' crosses them. */
+static void checkGlobs() {
+  patternSet = "globs";
+  char *patterns[] = {
+    (char *) "com.acme.*Entry",
+    (char *) "org/**/Node",
+    (char *) "net.acme.Ca?he",
+    (char *) "Lio/acme/*;",
+  };
+  ClassMatcher matcher(patterns, 4);
+
+  expectMatch(&matcher, "Lcom/acme/CacheEntry;", 0);
+  expectMatch(&matcher, "Lcom/acme/Entry;", 0);
+  expectMatch(&matcher, "Lcom/acme/cache/CacheEntry;", -1);
+  expectMatch(&matcher, "Lcom/acme/CacheEntryList;", -1);
+  expectMatch(&matcher, "[[Lcom/acme/CacheEntry;", 0);
+
+  expectMatch(&matcher, "Lorg/acme/tree/Node;", 1);
+  expectMatch(&matcher, "Lorg/a/b/c/Node;", 1);
+  expectMatch(&matcher, "Lorg/Node;", -1);
+  expectMatch(&matcher, "Lorg/acme/TreeNode;", -1);
+
+  expectMatch(&matcher, "Lnet/acme/Cache;", 2);
+  expectMatch(&matcher, "Lnet/acme/Cashe;", 2);
+  expectMatch(&matcher, "Lnet/acme/Cahe;", -1);
+  expectMatch(&matcher, "Lnet/acme/Ca/he;", -1);
+
+  /* A pattern written as a signature loses its L and ; before it is compiled. */
+  expectMatch(&matcher, "Lio/acme/Widget;", 3);
+  expectMatch(&matcher, "Lio/acme/ui/Widget;", -1);
+}
+
+
+/* Each kind of pattern is tried, and a class that no pattern names matches nothing. */
+static void checkMixed() {
+  patternSet = "mixed";
+  char *patterns[] = { (char *) "Widget", (char *) "com.acme.", (char *) "org.*.Widget" };
+  ClassMatcher matcher(patterns, 3);
+
+  expectMatch(&matcher, "Lnet/Widget;", 0);
+  expectMatch(&matcher, "Lcom/acme/Pool;", 1);
+  expectMatch(&matcher, "Lorg/acme/Gadget;", -1);
+  expectMatch(&matcher, "Ljava/lang/Object;", -1);
+
+  char **none = NULL;
+  ClassMatcher empty(none, 0);
+  patternSet = "empty";
+  expectMatch(&empty, "Ljava/lang/Object;", -1);
+  expectMatch(&empty, "[I", -1);
+}
+
+
+int main(int argc, char **argv) {
+  checkSuffixes();
+  checkPackages();
+  checkGlobs();
+  checkMixed();
+
+  if (failures) {
+    fprintf(stderr, "%d checks failed.\n", failures);
+    return 1;
+  }
+  printf("All class matcher checks passed.\n");
+  return 0;
+}
@@ -46,401 +46,758 @@
 #include "jni.h"
 #include "jvmti.h"
 
+#include "arena.h"
 #include "base.h"
+#include "classes.h"
+#include "dominators.h"
+#include "heapgraph.h"
+#include "heapsource.h"
 #include "io.h"
+#include "jvmtiheap.h"
+#include "matcher.h"
 #include "memory.h"
+#include "perf.h"
+#include "progress.h"
+
+
+/* Resets the analysis scratch space of the first classCount classes. */
+static void resetClassDetails(jint classCount) {
+  for (jint i = 0; i < classCount; i++) {
+    ClassDetails *d = getClassDetails(i);
+    d->count = 0;
+    d->space = 0;
+    memset(d->referLevelCount, 0, sizeof(d->referLevelCount));
+    d->objectTag = 0;
+    d->retained = 0;
+    d->reachSlot = -1;
+    d->reachable = 0;
+  }
+}
 
 
-/* Typedef to hold class details */
-typedef struct {
-  jclass klass;
-  char *signature;
-  int count;
-  int referLevelCount[4];
-  int space;
-} ClassDetails;
+/* Marks the classes whose reachable size was requested on the command line, giving each one a
+ * slot for computeReachableSizes.  Returns the number of slots used. */
+static int selectReachableClasses(jint classCount) {
+  int slotCount = 0;
+  for (jint i = 0; i < classCount; i++) {
+    ClassDetails *d = getClassDetails(i);
+    if (!d->unloaded && gdata->retainedSizeMatcher->match(d->signature) >= 0) {
+      d->reachSlot = slotCount++;
+    } else {
+      d->reachSlot = -1;
+    }
+  }
+  return slotCount;
+}
 
-#define REFER_DEPTH 3
 
+bool captureLiveHeapGraph(jvmtiEnv *jvmti, jint classCount, HeapGraphBuilder *builder, HeapGraph *graph) {
+  PerfTimer timer(PERF_CAPTURE_GRAPH);
+  JvmtiHeapSource heap(jvmti);
+  setHeapWalkPhase("capturing the object graph");
+  return captureHeapGraph(&heap, classCount, builder, graph);
+}
 
-struct AllClassDetails {
-  jvmtiEnv *jvmti;
-  ClassDetails *details;
-  jclass *classes;
-  jint count;
 
-  AllClassDetails(jvmtiEnv *_jvmti) : jvmti(_jvmti) {
-    /* Get all the loaded classes */
-    CHECK(_jvmti->GetLoadedClasses(&this->count, &this->classes));
+bool walkLiveHeapGraph(jvmtiEnv *jvmti, jint classCount, HeapGraphBuilder *builder) {
+  PerfTimer timer(PERF_CAPTURE_GRAPH);
+  JvmtiHeapSource heap(jvmti);
+  setHeapWalkPhase("capturing the object graph");
+  return walkHeapGraph(&heap, classCount, builder);
+}
 
-    /* Setup an area to hold details about these classes */
-    this->details = (ClassDetails*)calloc(sizeof(ClassDetails), this->count);
-    CHECK_FOR_NULL(this->details);
 
-    jint i;
-    for (i = 0 ; i < this->count ; i++) {
-      char *sig;
+/* Caps the native memory of a command's object graph at gdata->graphLimitMb.  Without a cap the
+ * graph of a large heap takes tens of GB, and under overcommit the JVM is killed before any
+ * allocation fails. */
+static void limitGraph(HeapGraphBuilder *builder) {
+  builder->memoryLimit = (jlong) gdata->graphLimitMb * 1024 * 1024;
+}
 
-      /* Get and save the class signature */
-      CHECK(_jvmti->GetClassSignature(this->classes[i], &sig, NULL));
-      CHECK_FOR_NULL(sig);
-      this->details[i].signature = strdup(sig);
-      deallocate(_jvmti, sig);
 
-      this->details[i].klass = this->classes[i];
+/* Returns true if the dominator tree and retained sizes of a captured graph fit in the graph
+ * limit along with the graph.  They take about 64 bytes an object and 4 a reference at the peak. */
+static bool analysisFits(const HeapGraph *graph) {
+  jlong graphBytes = graph->nodeCount * (jlong) (sizeof(jlong) + sizeof(jint) + sizeof(jlong)) +
+      graph->edgeCount * (jlong) (sizeof(jint) + (graph->edgeLabel != NULL ? sizeof(jlong) : 0));
+  jlong analysisBytes = graph->nodeCount * (jlong) 64 + graph->edgeCount * (jlong) 4;
+  return graphBytes + analysisBytes <= (jlong) gdata->graphLimitMb * 1024 * 1024;
+}
 
-      /* Tag this jclass */
-      CHECK(_jvmti->SetTag(this->classes[i], (jlong)(ptrdiff_t)(void*)(&this->details[i])));
-    }
+
+/* Says why a command left out what needs the object graph. */
+static void printGraphLimit(Output *out, const char *omitted) {
+  out->printf("%s: the object graph would take more than %d MB.  Start the agent with graph=MB to allow more.\n",
+      omitted, gdata->graphLimitMb);
+}
+
+
+/* Fills in the retained size of every class, and the reachable size of every class with a
+ * reachSlot, from one capture of the live heap.  Marks must be clear, and are clear after.  Sets
+ * overLimit if the graph would take more than gdata->graphLimitMb. */
+static bool analyzeHeapGraph(jvmtiEnv *jvmti, jint classCount, int slotCount, bool *overLimit) {
+  HeapGraph graph;
+
+  for (jint i = 0; i < classCount; i++) {
+    ClassDetails *d = getClassDetails(i);
+    d->retained = 0;
+    d->reachable = 0;
   }
 
-  ~AllClassDetails() {
-    jint i;
+  HeapGraphBuilder builder;
+  limitGraph(&builder);
+  *overLimit = false;
+  if (!captureLiveHeapGraph(jvmti, classCount, &builder, &graph)) {
+    *overLimit = builder.overLimit;
+    return false;
+  }
+  if (!analysisFits(&graph)) {
+    *overLimit = true;
+    return false;
+  }
 
-    deallocate(this->jvmti, this->classes);
-    for (i = 0 ; i < this->count ; i++) {
-      if (this->details[i].signature != NULL) {
-        free(this->details[i].signature);
+  jint *classSlot = (jint *) scratchAllocate(sizeof(jint) * (classCount ? classCount : 1));
+  jlong *slotReachable = (jlong *) scratchAllocate(sizeof(jlong) * (slotCount ? slotCount : 1));
+  bool ok = classSlot != NULL && slotReachable != NULL;
+  if (ok) {
+    PerfTimer timer(PERF_REACHABLE_SIZES);
+    setHeapWalkPhase("computing reachable sizes");
+    for (jint i = 0; i < classCount; i++) {
+      classSlot[i] = getClassDetails(i)->reachSlot;
+    }
+    ok = computeReachableSizes(&graph, classSlot, classCount, slotCount, slotReachable);
+  }
+  if (ok) {
+    for (jint i = 0; i < classCount; i++) {
+      ClassDetails *d = getClassDetails(i);
+      if (d->reachSlot >= 0) {
+        d->reachable = slotReachable[d->reachSlot];
       }
     }
-    free(this->details);
+  }
+  scratchFree(classSlot);
+  scratchFree(slotReachable);
+  if (!ok) {
+    return false;
   }
 
-  jint getSignatureOffset(const char * signature) {
-    for (jint offset = 0 ; offset < this->count; offset++) {
-      ClassDetails d = this->details[offset];
-      if (d.signature != 0 && strcmp(d.signature, signature) == 0) {
-        return offset;
-      }
+  DominatorTree tree;
+  setHeapWalkPhase("computing dominators");
+  {
+    PerfTimer timer(PERF_DOMINATORS);
+    if (heapWalkCancelled() || !computeDominatorTree(&graph, &tree)) {
+      return false;
     }
-    return -1;
   }
-};
 
+  jlong *retained = (jlong *) scratchAllocate(sizeof(jlong) * graph.nodeCount);
+  jlong *classRetained = (jlong *) scratchAllocate(sizeof(jlong) * (classCount ? classCount : 1));
+  ok = retained != NULL && classRetained != NULL;
+  if (ok) {
+    PerfTimer timer(PERF_RETAINED_SIZES);
+    computeRetainedSizes(&graph, &tree, retained);
+    ok = computeClassRetainedSizes(&graph, &tree, retained, classCount, classRetained);
+  }
+  if (ok) {
+    for (jint i = 0; i < classCount; i++) {
+      getClassDetails(i)->retained = classRetained[i];
+    }
+  }
+
+  scratchFree(retained);
+  scratchFree(classRetained);
+  return ok;
+}
 
-/* Test if the given haystack ends with the given needle + skipHaystackChars ignored characters. */
-static bool endswith(char *haystack, char *needle, int skipHaystackChars) {
-  int hLen = strlen(haystack);
-  int nLen = strlen(needle);
 
-  int offset = hLen - nLen - skipHaystackChars;
-  if (offset < 0) {
+bool computeReferrers(jvmtiEnv *jvmti, ClassDetails *target) {
+  PerfTimer timer(PERF_FIND_REFERRERS);
+  jint classCount = getClassCount();
+  jint *levelCounts = (jint *) scratchAllocate(sizeof(jint) * REFER_DEPTH * (classCount ? classCount : 1));
+  if (levelCounts == NULL) {
     return false;
   }
+  memset(levelCounts, 0, sizeof(jint) * REFER_DEPTH * classCount);
 
-  for (int i = nLen - 1; i >= 0; i--) {
-    if (haystack[i + offset] != needle[i]) {
-      return false;
+  JvmtiHeapSource heap(jvmti);
+  setHeapWalkPhase("finding referrers");
+  countReferrerLevels(&heap, target->index, REFER_DEPTH, classCount, levelCounts);
+
+  for (jint i = 0; i < classCount; i++) {
+    ClassDetails *d = getClassDetails(i);
+    for (int level = 0; level < REFER_DEPTH; level++) {
+      d->referLevelCount[level] = levelCounts[i * REFER_DEPTH + level];
     }
   }
-
+  scratchFree(levelCounts);
   return true;
 }
 
 
-/* IterateThroughHeap callback that finds referrers to a given class. */
-static jint JNICALL referenceFinder(
-    jvmtiHeapReferenceKind reference_kind,
-    const jvmtiHeapReferenceInfo* reference_info,
-    jlong class_tag,
-    jlong referrer_class_tag,
-    jlong size,
-    jlong* tag_ptr,
-    jlong* referrer_tag_ptr,
-    jint length,
-    void* user_data) {
-  if (referrer_tag_ptr) {
-    if (class_tag == (jlong) user_data) {
-      *referrer_tag_ptr = 1;
+/* Prints a referrer summary. */
+static void printRefererSummary(jvmtiEnv *jvmti, Output *out, jint classCount, ClassDetails *target) {
+  if (!computeReferrers(jvmti, target)) {
+    printOmitted(out, "Referrer summary");
+    return;
+  }
+  if (heapWalkCancelled()) {
+    return;
+  }
+
+  out->printf("\n");
+  for (int level = 0; level < REFER_DEPTH; level++) {
+    out->printf("\t\tLevel %d referrers:\n", level + 1);
+    for (jint j = 0 ; j < classCount; j++) {
+      ClassDetails *d = getClassDetails(j);
+      int count = d->referLevelCount[level];
+      if (count) {
+        out->printf("\t\t%10d %s\n", count, d->signature);
+        d->referLevelCount[level] = 0;
+      }
     }
+    out->printf("\n");
   }
-  return JVMTI_VISIT_OBJECTS;
 }
 
 
-/* IterateThroughHeap callback that finds shortest path from an object to an object of the given class. */
-static jint JNICALL referenceDepthCounter(
-    jvmtiHeapReferenceKind reference_kind,
-    const jvmtiHeapReferenceInfo* reference_info,
-    jlong class_tag,
-    jlong referrer_class_tag,
-    jlong size,
-    jlong* tag_ptr,
-    jlong* referrer_tag_ptr,
-    jint length,
-    void* user_data) {
-  if (referrer_tag_ptr) {
-    if (*tag_ptr) {
-      if (*referrer_tag_ptr == 0 || (*tag_ptr + 1) < *referrer_tag_ptr) {
-        *referrer_tag_ptr = *tag_ptr + 1;
+/* Describes what holds a row of references: the class, then the field, [] for array elements, or
+ * (other) for the references a class object holds to its loader, superclass and so on. */
+static void describeReferrerField(jvmtiEnv *jvmti, JNIEnv *jni, jint classCount, const ReferrerField *row, char *text, size_t length) {
+  ClassDetails *d = row->holder >= 0 && row->holder < classCount ? getClassDetails(row->holder) : NULL;
+  const char *signature = d != NULL ? d->signature : "<unknown class>";
+  char field[256];
+
+  switch (row->kind) {
+    case HEAP_REFERENCE_FIELD:
+    case HEAP_REFERENCE_STATIC_FIELD:
+      if (d == NULL || !getFieldName(jvmti, jni, d, row->index, field, sizeof(field))) {
+        snprintf(field, sizeof(field), "#%d", (int) row->index);
       }
-    }
+      snprintf(text, length, "%s %s%s", signature, row->kind == HEAP_REFERENCE_STATIC_FIELD ? "static " : "", field);
+      break;
+    case HEAP_REFERENCE_ARRAY_ELEMENT:
+      snprintf(text, length, "%s []", signature);
+      break;
+    case HEAP_REFERENCE_UNKNOWN:
+      snprintf(text, length, "%s", signature);
+      break;
+    default:
+      snprintf(text, length, "%s (other)", signature);
+      break;
   }
-  return JVMTI_VISIT_OBJECTS;
 }
 
 
-/* Aggregates reference depth tags by class. */
-static jint JNICALL referenceDepthAggregator(
-    jlong class_tag,
-    jlong size,
-    jlong* tag_ptr,
-    jint length,
-    void* user_data) {
-  if (tag_ptr && *tag_ptr && *tag_ptr <= REFER_DEPTH) {
-    ClassDetails *d = (ClassDetails*)(void*)(ptrdiff_t)class_tag;
-    d->referLevelCount[*tag_ptr - 1] += 1;
+bool printReferrerFields(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, const HeapGraph *graph, jint classCount, ClassDetails *target, jint depth) {
+  jint rowCount;
+  ReferrerField *rows;
+  {
+    PerfTimer timer(PERF_FIND_REFERRERS);
+    setHeapWalkPhase("finding referrers");
+    rows = countReferrerFields(graph, target->index, depth, &rowCount);
+    if (rows == NULL) {
+      return false;
+    }
   }
 
-  return JVMTI_VISIT_OBJECTS;
+  PerfTimer timer(PERF_FORMAT);
+  static const char *const columns[] = { "level", "references", "bytes", "referrer" };
+  out->setColumnNames(columns);
+  out->printf("Level      References Bytes      Referrer\n");
+  out->printf("---------- ---------- ---------- ----------------------\n");
+  char text[1024];
+  jint printed = 0;
+  for (jint i = 0; i < rowCount; i++) {
+    printed = i > 0 && rows[i].level == rows[i - 1].level ? printed + 1 : 0;
+    if (printed < REFERRER_FIELD_ROWS) {
+      describeReferrerField(jvmti, jni, classCount, &rows[i], text, sizeof(text));
+      long values[] = { rows[i].level, (long) rows[i].references, (long) rows[i].bytes };
+      out->printColumns(values, 3, 10, text);
+    }
+  }
+  out->printf("---------- ---------- ---------- ----------------------\n\n");
+  out->flush();
+
+  free(rows);
+  return true;
 }
 
 
-/* Set up pointers / tag relationships for the given ClassDetails objects. */
-static void setTagPointers(jvmtiEnv *jvmti, ClassDetails *details, int classCount) {
-  /* Ensure classes are tagged correctly. */
-  for (int i = 0 ; i < classCount; i++) {
-    /* Tag this jclass */
-    CHECK(jvmti->SetTag(details[i].klass, (jlong)(ptrdiff_t)(void *)(&details[i])));
+static const char *rootKindName(jint kind) {
+  switch (kind) {
+    case HEAP_REFERENCE_ROOT_SYSTEM_CLASS: return "a system class";
+    case HEAP_REFERENCE_ROOT_JNI_GLOBAL: return "a JNI global reference";
+    case HEAP_REFERENCE_ROOT_THREAD: return "a thread";
+    case HEAP_REFERENCE_ROOT_STACK_LOCAL: return "a thread stack";
+    case HEAP_REFERENCE_ROOT_JNI_LOCAL: return "a JNI local reference";
+    case HEAP_REFERENCE_ROOT_MONITOR: return "a monitor";
+    case HEAP_REFERENCE_UNKNOWN: return "a GC root";
+    default: return "another GC root";
   }
 }
 
 
-/* IterateThroughHeap callback that clears tags. */
-static jint JNICALL clearTag(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
-  *tag_ptr = 0;
-  return JVMTI_VISIT_OBJECTS;
+/* Fills largest with up to count instances of target, largest first by retained size, or by their
+ * own size if retained is NULL.  Returns how many there are. */
+static jint selectLargestInstances(const HeapGraph *graph, jint target, const jlong *retained, jint count, jint *largest) {
+  const jlong *sizes = retained != NULL ? retained : graph->size;
+  jint found = 0;
+  for (jint v = HEAP_GRAPH_ROOT + 1; v < graph->nodeCount; v++) {
+    if (graph->classIndex[v] != target || (found == count && sizes[v] <= sizes[largest[found - 1]])) {
+      continue;
+    }
+    jint i = found < count ? found++ : found - 1;
+    for (; i > 0 && sizes[largest[i - 1]] < sizes[v]; i--) {
+      largest[i] = largest[i - 1];
+    }
+    largest[i] = v;
+  }
+  return found;
 }
 
 
-/* Clear all tags. */
-static void clearTags(jvmtiEnv *jvmti) {
-  jvmtiHeapCallbacks callbacks;
-  memset(&callbacks, 0, sizeof(callbacks));
-
-  callbacks.heap_iteration_callback = clearTag;
-  CHECK(jvmti->IterateThroughHeap((jint) 0, (jclass) 0, &callbacks, (void *) NULL));
+/* Says how an edge of the graph is held, if the graph knows. */
+static void edgeReference(const HeapGraph *graph, jint from, jint to, HeapReference *ref) {
+  jlong e = findEdge(graph, from, to);
+  ref->kind = HEAP_REFERENCE_UNKNOWN;
+  ref->index = 0;
+  ref->holder = -1;
+  if (graph->edgeLabel != NULL && e >= 0) {
+    unpackHeapReference(graph->edgeLabel[e], ref);
+  }
 }
 
 
-/* IterateThroughHeap callback that sets a tag to 1. */
-static jint JNICALL setTag(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
-  *tag_ptr = 1;
-  return JVMTI_VISIT_OBJECTS;
-}
-
+bool printInstancePaths(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, const HeapGraph *graph, jint classCount,
+    ClassDetails *target, jint count, bool rankByRetained) {
+  jint *parent = (jint *) malloc(sizeof(jint) * graph->nodeCount);
+  jint *path = (jint *) malloc(sizeof(jint) * graph->nodeCount);
+  jint *largest = (jint *) scratchAllocate(sizeof(jint) * count);
+  bool ok = parent != NULL && path != NULL && largest != NULL;
+  if (ok) {
+    PerfTimer timer(PERF_ROOT_PATHS);
+    setHeapWalkPhase("finding paths from the roots");
+    ok = computeRootPaths(graph, parent);
+  }
 
-/* IterateThroughHeap callback that marks all elements of the given class. */
-static void mark(jvmtiEnv *jvmti, jclass klass) {
-  jvmtiHeapCallbacks callbacks;
-  memset(&callbacks, 0, sizeof(callbacks));
-  callbacks.heap_iteration_callback = setTag;
-  CHECK(jvmti->IterateThroughHeap((jint) 0, klass, &callbacks, (void *) NULL));
-}
+  /* Retained sizes rank the instances by what they hold, but are not essential. */
+  jlong *retained = NULL;
+  if (ok && rankByRetained) {
+    DominatorTree tree;
+    PerfTimer timer(PERF_DOMINATORS);
+    retained = (jlong *) malloc(sizeof(jlong) * graph->nodeCount);
+    if (retained != NULL && computeDominatorTree(graph, &tree)) {
+      computeRetainedSizes(graph, &tree, retained);
+    } else {
+      free(retained);
+      retained = NULL;
+    }
+  }
 
+  if (ok) {
+    PerfTimer timer(PERF_FORMAT);
+    jint found = selectLargestInstances(graph, target->index, retained, count, largest);
+    out->printf("Shortest paths from the GC roots to the %d largest instances of %s, by %s size.\n\n",
+        (int) found, target->signature, retained != NULL ? "retained" : "shallow");
+
+    char text[1024];
+    HeapReference ref;
+    for (jint i = 0; i < found; i++) {
+      jint length = 0;
+      for (jint v = largest[i]; v > HEAP_GRAPH_ROOT; v = parent[v]) {
+        path[length++] = v;
+      }
+      edgeReference(graph, HEAP_GRAPH_ROOT, path[length - 1], &ref);
+      out->printf("Instance %d: %ld bytes, %ld retained, %d references from %s\n", (int) i + 1,
+          (long) graph->size[largest[i]], retained != NULL ? (long) retained[largest[i]] : 0L, (int) length, rootKindName(ref.kind));
+
+      /* Each line is the field of one object along the path that holds the next. */
+      for (jint j = length - 1; j > 0; j--) {
+        jint from = path[j], to = path[j - 1];
+        edgeReference(graph, from, to, &ref);
+        ReferrerField row = { 0, ref.kind == HEAP_REFERENCE_STATIC_FIELD ? ref.holder : graph->classIndex[from], ref.kind, ref.index, 1, graph->size[to] };
+        describeReferrerField(jvmti, jni, classCount, &row, text, sizeof(text));
+        out->printf("\t%s\n", text);
+      }
+      out->printf("\n");
+    }
+    out->flush();
+  }
 
-/* IterateThroughHeap callback that propogates marking from one set of objects to all referenced objects. */
-static jint JNICALL markReferences(
-    jvmtiHeapReferenceKind reference_kind,
-    const jvmtiHeapReferenceInfo* reference_info,
-    jlong class_tag,
-    jlong referrer_class_tag,
-    jlong size,
-    jlong* tag_ptr,
-    jlong* referrer_tag_ptr,
-    jint length,
-    void* user_data) {
-  if (referrer_tag_ptr && *referrer_tag_ptr && *tag_ptr == 0) {
-    *tag_ptr = 1;
-  }
-  return JVMTI_VISIT_OBJECTS;
+  free(parent);
+  free(path);
+  free(retained);
+  scratchFree(largest);
+  return ok;
 }
 
 
-/* IterateThroughHeap callback that accumulates sizes of marked objects. */
-static jint JNICALL addSizes(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
-  *((long *) user_data) += size;
-  return JVMTI_VISIT_OBJECTS;
+/* Captures the live heap with labels for printInstancePaths.  A graph over the limit is reported
+ * here, and counts as done. */
+static bool printLiveInstancePaths(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, jint classCount, ClassDetails *target, jint count) {
+  HeapGraph graph;
+  HeapGraphBuilder builder(true);
+  limitGraph(&builder);
+  if (!captureLiveHeapGraph(jvmti, classCount, &builder, &graph)) {
+    if (builder.overLimit && !heapWalkCancelled()) {
+      printGraphLimit(out, "Paths from the GC roots are not found");
+      out->printf("\n");
+      return true;
+    }
+    return false;
+  }
+  return printInstancePaths(jvmti, jni, out, &graph, classCount, target, count, analysisFits(&graph));
 }
 
 
-/* Gets the retained size across all instances of a given class and all objects referenced by those objects. */
-static long getRetainedSize(jvmtiEnv *jvmti, jclass klass) {
-  clearTags(jvmti);
+/* Counts the instances of classIndex, or of every class if it is -1, into the ClassDetails of the
+ * first classCount classes.  Returns the number of objects of other classes, or -1 if there was
+ * not enough memory to count. */
+static jint countClassInstances(jvmtiEnv *jvmti, jint classIndex, jint classCount) {
+  jint *counts = (jint *) scratchAllocate(sizeof(jint) * (classCount ? classCount : 1));
+  jlong *space = (jlong *) scratchAllocate(sizeof(jlong) * (classCount ? classCount : 1));
+  if (counts == NULL || space == NULL) {
+    scratchFree(counts);
+    scratchFree(space);
+    return -1;
+  }
+  memset(counts, 0, sizeof(jint) * classCount);
+  memset(space, 0, sizeof(jlong) * classCount);
+
+  JvmtiHeapSource heap(jvmti);
+  jint unknown;
+  {
+    PerfTimer timer(PERF_COUNT_INSTANCES);
+    unknown = countObjects(&heap, classIndex, classCount, counts, space);
+  }
 
-  mark(jvmti, klass);
+  for (jint i = 0; i < classCount; i++) {
+    ClassDetails *d = getClassDetails(i);
+    d->count = counts[i];
+    d->space = space[i];
+  }
+  scratchFree(counts);
+  scratchFree(space);
+  return unknown;
+}
 
-  jvmtiHeapCallbacks callbacks;
-  memset(&callbacks, 0, sizeof(callbacks));
-  callbacks.heap_reference_callback = markReferences;
 
-  CHECK(jvmti->FollowReferences(0, NULL, NULL, &callbacks, 0));
+/* Objects of classes created since the last look, which can only be array classes, trigger one
+ * recount. */
+jint countInstances(jvmtiEnv *jvmti, JNIEnv *jni) {
+  for (int attempt = 0; ; attempt++) {
+    jint classCount = getClassCount();
 
-  long result = 0;
-  callbacks.heap_iteration_callback = addSizes;
-  CHECK(jvmti->IterateThroughHeap(JVMTI_HEAP_FILTER_UNTAGGED, 0, &callbacks, (void *)(&result)));
+    resetClassDetails(classCount);
+    setHeapWalkPhase("counting instances");
+    jint unregistered = countClassInstances(jvmti, -1, classCount);
+    if (unregistered < 0) {
+      return -1;
+    }
+    gdata->totalCount = 0;
+    for (jint i = 0; i < classCount; i++) {
+      gdata->totalCount += getClassDetails(i)->count;
+    }
 
-  return result;
+    /* Registering classes allocates, which the out of memory dump must not do. */
+    if (unregistered == 0 || attempt > 0 || gdata->emergencyDump || heapWalkCancelled()) {
+      return classCount;
+    }
+    registerLoadedClasses(jvmti, jni);
+  }
 }
 
 
-/* Prints a referrer summary. */
-static void printRefererSummary(jvmtiEnv *jvmti, Output *out, ClassDetails* details, int classCount, int offset) {
-  jvmtiHeapCallbacks callbacks;
-  memset(&callbacks, 0, sizeof(callbacks));
+/* Comparison function for two ClassDetails - used to sort largest size first. */
+static int compareDetails(const void *p1, const void *p2) {
+  jlong s1 = (*(ClassDetails**)p1)->space;
+  jlong s2 = (*(ClassDetails**)p2)->space;
+  return s1 < s2 ? 1 : s1 > s2 ? -1 : 0;
+}
 
-  clearTags(jvmti);
-  setTagPointers(jvmti, details, classCount);
 
-  callbacks.heap_reference_callback = referenceFinder;
-  CHECK(jvmti->FollowReferences(0, NULL, NULL, &callbacks, (void *)(&details[offset])));
+bool computeHistogram(jvmtiEnv *jvmti, JNIEnv *jni, Histogram *histogram) {
+  histogram->classCount = 0;
+  histogram->sorted = NULL;
+  histogram->sortedCount = 0;
+  histogram->haveGraphSizes = false;
+  histogram->graphOverLimit = false;
 
-  callbacks.heap_reference_callback = referenceDepthCounter;
-  for (int i = 0; i < REFER_DEPTH - 1; i++) {
-    CHECK(jvmti->FollowReferences(0, NULL, NULL, &callbacks, 0));
+  /* Iterate over the heap and count up uses of jclass */
+  jint classCount = countInstances(jvmti, jni);
+  if (classCount < 0) {
+    return false;
   }
 
-  setTagPointers(jvmti, details, classCount);
-  callbacks.heap_iteration_callback = referenceDepthAggregator;
-  CHECK(jvmti->IterateThroughHeap((jint) 0, (jclass) 0, &callbacks, (void *) NULL));
+  /* Analyze the object graph in the same state, for the retained size of every class and the
+   * reachable size of the classes named on the command line.  The graph needs native memory in
+   * proportion to the heap, so the out of memory dump only computes reachable sizes, by marking. */
+  bool haveGraphSizes = false;
+  bool graphOverLimit = false;
+  int slotCount = 0;
+  if (!heapWalkCancelled()) {
+    slotCount = gdata->retainedSizeClassCount ? selectReachableClasses(classCount) : 0;
+    if (!gdata->emergencyDump) {
+      haveGraphSizes = analyzeHeapGraph(jvmti, classCount, slotCount, &graphOverLimit);
+    }
+  }
 
-  out->printf("\n");
-  for (int level = 0; level < REFER_DEPTH; level++) {
-    out->printf("\t\tLevel %d referrers:\n", level + 1);
-    for (int j = 0 ; j < classCount; j++) {
-      int count = details[j].referLevelCount[level];
-      if (count) {
-        out->printf("\t\t%10d %s\n", count, details[j].signature);
-        details[j].referLevelCount[level] = 0;
+  /* Sort details by space used */
+  ClassDetails **sorted = (ClassDetails **) scratchAllocate(sizeof(ClassDetails *) * (classCount ? classCount : 1));
+  if (sorted == NULL) {
+    return false;
+  }
+  jint sortedCount = 0;
+  for (jint i = 0 ; i < classCount ; i++) {
+    ClassDetails *d = getClassDetails(i);
+    if (!d->unloaded && d->space != 0) {
+      sorted[sortedCount++] = d;
+    }
+  }
+  {
+    PerfTimer timer(PERF_SORT);
+    qsort(sorted, sortedCount, sizeof(ClassDetails *), &compareDetails);
+  }
+
+  if (!haveGraphSizes && slotCount > 0 && !heapWalkCancelled()) {
+    /* Fall back to marking, which needs memory only for the slots.  The watched classes are marked
+     * from a dozen at a time, so the dump does not take a set of walks for each of them. */
+    jint *classSlot = (jint *) scratchAllocate(sizeof(jint) * (classCount ? classCount : 1));
+    jlong *slotReachable = (jlong *) scratchAllocate(sizeof(jlong) * slotCount);
+    if (classSlot != NULL && slotReachable != NULL) {
+      PerfTimer timer(PERF_MARK_REACHABLE);
+      setHeapWalkPhase("marking reachable objects");
+      for (jint i = 0; i < classCount; i++) {
+        classSlot[i] = getClassDetails(i)->reachSlot;
+      }
+      JvmtiHeapSource heap(jvmti);
+      markReachableSizes(&heap, classSlot, classCount, slotCount, slotReachable);
+      for (jint i = 0 ; i < sortedCount; i++) {
+        if (sorted[i]->reachSlot >= 0) {
+          sorted[i]->reachable = slotReachable[sorted[i]->reachSlot];
+        }
       }
     }
-    out->printf("\n");
+    scratchFree(classSlot);
+    scratchFree(slotReachable);
   }
 
-  clearTags(jvmti);
+  histogram->classCount = classCount;
+  histogram->sorted = sorted;
+  histogram->sortedCount = sortedCount;
+  histogram->haveGraphSizes = haveGraphSizes;
+  histogram->graphOverLimit = graphOverLimit;
+  return true;
 }
 
 
-/* IterateThroughHeap callback that aggregates counts and sizes by class. */
-static jvmtiIterationControl JNICALL heapObject(jlong class_tag, jlong size, jlong* tag_ptr, void* user_data) {
-  if (class_tag != (jlong)0) {
-    ClassDetails *d = (ClassDetails*)(void*)(ptrdiff_t)class_tag;
-    gdata->totalCount++;
-    d->count++;
-    d->space += size;
+/* Prints the line above and below the histogram, with one dash run for each integer column. */
+static void printHistogramRule(Output *out, int columnCount) {
+  for (int i = 0; i < columnCount; i++) {
+    out->printf("---------- ");
   }
-  return JVMTI_ITERATION_CONTINUE;
-}
-
-
-/* Comparison function for two ClassDetails - used to sort largest size first. */
-static int compareDetails(const void *p1, const void *p2) {
-  return ((ClassDetails*)p2)->space - ((ClassDetails*)p1)->space;
+  out->printf("----------------------\n");
 }
 
 
 /* Prints a heap histogram. */
-void JNICALL printHistogram(jvmtiEnv *jvmti, Output *out, bool includeReferrers) {
+void JNICALL printHistogram(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, bool includeReferrers) {
   if (!gdata->vmDeathCalled && !gdata->dumpInProgress) {
-    jint i;
-
     gdata->dumpInProgress = JNI_TRUE;
-    gdata->totalCount = 0;
-
-    AllClassDetails classes(jvmti);
-
-    /* Iterate over the heap and count up uses of jclass */
-    CHECK(jvmti->IterateOverHeap(JVMTI_HEAP_OBJECT_EITHER, &heapObject, NULL));
 
-    /* Remove tags */
-    for (i = 0 ; i < classes.count ; i++) {
-      /* Un-Tag this jclass */
-      CHECK(jvmti->SetTag(classes.classes[i], (jlong)0));
+    Histogram histogram;
+    bool counted = computeHistogram(jvmti, jni, &histogram);
+    if (!counted || heapWalkCancelled()) {
+      if (!counted && !heapWalkCancelled()) {
+        printOmitted(out, "Heap histogram");
+      }
+      scratchFree(histogram.sorted);
+      gdata->dumpInProgress = JNI_FALSE;
+      return;
     }
 
-    /* Sort details by space used */
-    qsort(classes.details, classes.count, sizeof(ClassDetails), &compareDetails);
-
     /* Print out sorted table */
+    PerfTimer timer(PERF_FORMAT);
     out->printf("Heap View, Total of %d objects found.\n\n", gdata->totalCount);
 
-    out->printf("Space      Count      Retained   Class Signature\n");
-    out->printf("---------- ---------- ---------- ----------------------\n");
+    if (gdata->emergencyDump) {
+      out->printf("Retained sizes are not computed while memory is exhausted.\n\n");
+    } else if (histogram.graphOverLimit) {
+      printGraphLimit(out, "Retained sizes are not computed");
+      out->printf("\n");
+    } else if (!histogram.haveGraphSizes) {
+      out->printf("Not enough native memory to compute retained sizes.\n\n");
+    }
 
-    for (i = 0 ; i < classes.count ; i++) {
-      if (classes.details[i].space == 0) {
-        break;
+    /* Sizes that were not computed are left out rather than shown as zero: retained sizes when the
+     * graph was not analyzed, and reachable sizes when no classes were named on the command line. */
+    bool showRetained = histogram.haveGraphSizes;
+    bool showReachable = gdata->retainedSizeClassCount != 0;
+    int columnCount = 2 + showRetained + showReachable;
+    const char *columns[5] = { "space", "count" };
+    int named = 2;
+    if (showRetained) {
+      columns[named++] = "retained";
+    }
+    if (showReachable) {
+      columns[named++] = "reachable";
+    }
+    columns[named] = "class";
+    out->setColumnNames(columns);
+    out->printf("Space      Count      %s%sClass Signature\n", showRetained ? "Retained   " : "", showReachable ? "Reachable  " : "");
+    printHistogramRule(out, columnCount);
+
+    for (jint i = 0 ; i < histogram.sortedCount ; i++) {
+      ClassDetails *d = histogram.sorted[i];
+      long values[4] = { (long) d->space, d->count };
+      int filled = 2;
+      if (showRetained) {
+        values[filled++] = (long) d->retained;
       }
-      long retainedSize = 0;
-      for (int j = 0; j < gdata->retainedSizeClassCount; j++) {
-        if (endswith(classes.details[i].signature, gdata->retainedSizeClasses[j], 1)) {
-          retainedSize = getRetainedSize(jvmti, classes.details[i].klass);
-          break;
-        }
+      if (showReachable) {
+        values[filled++] = (long) d->reachable;
       }
-      out->printf("%10d %10d %10ld %s\n",
-          classes.details[i].space, classes.details[i].count, retainedSize, classes.details[i].signature);
+      out->printColumns(values, columnCount, 10, d->signature);
       if (i == 0 && includeReferrers) {
-        printRefererSummary(jvmti, out, classes.details, classes.count, i);
+        printRefererSummary(jvmti, out, histogram.classCount, d);
       }
-      out->flush();
     }
-    out->printf("---------- ---------- ----------------------\n\n");
+    printHistogramRule(out, columnCount);
+    out->printf("\n");
     out->flush();
 
+    /* Asked for with paths=N, since the object graph needs native memory during the dump. */
+    if (includeReferrers && gdata->oomPathCount > 0 && histogram.sortedCount > 0 && !heapWalkCancelled()) {
+      if (!printLiveInstancePaths(jvmti, jni, out, histogram.classCount, histogram.sorted[0], gdata->oomPathCount) &&
+          !heapWalkCancelled()) {
+        out->printf("Not enough native memory to find paths from the GC roots.\n\n");
+      }
+    }
+
+    scratchFree(histogram.sorted);
+
     gdata->dumpInProgress = JNI_FALSE;
   }
 }
 
 
-void printClassStats(jvmtiEnv *jvmti, const char *signature, Output *out, bool details) {
+void printClassStats(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, Output *out, bool retainedSize) {
   if (gdata->vmDeathCalled || gdata->dumpInProgress) {
     return;
   }
 
   gdata->dumpInProgress = JNI_TRUE;
 
-  /* Get all the loaded classes */
-  AllClassDetails classes(jvmti);
-  jint offset = classes.getSignatureOffset(signature);
+  ClassDetails *d = findClass(jvmti, jni, signature);
 
-  if (offset == -1) {
+  if (d == NULL) {
     out->printf("No class found with signature: '%s'\n", signature);
 
   } else {
-    /* Iterate over the heap and count up uses of the desired class */
-    CHECK(jvmti->IterateOverHeap(JVMTI_HEAP_OBJECT_EITHER, &heapObject, NULL));
-
-    ClassDetails d = classes.details[offset];
-    out->printf("Count: %d\n", d.count);
-    out->printf("Space: %d\n", d.space);
-    if (details) {
-      out->printf("Retained: %d\n", getRetainedSize(jvmti, d.klass));
+    jint classCount = getClassCount();
+    resetClassDetails(classCount);
+
+    /* Iterate over the instances of the desired class */
+    setHeapWalkPhase("counting instances");
+    if (countClassInstances(jvmti, d->index, classCount) < 0 || heapWalkCancelled()) {
+      if (!heapWalkCancelled()) {
+        printOmitted(out, "Class statistics");
+      }
+      gdata->dumpInProgress = JNI_FALSE;
+      return;
     }
 
-    CHECK(jvmti->SetTag(d.klass, (jlong)0));
+    /* A size that was not asked for, or could not be found, is left out of the record. */
+    char text[256];
+    int len = snprintf(text, sizeof(text), "Count: %d\nSpace: %ld\n", d->count, (long) d->space);
+    RecordField fields[] = {
+      { "count", d->count, NULL },
+      { "space", (long) d->space, NULL },
+      { NULL, 0, NULL },
+      { NULL, 0, NULL },
+    };
+    if (retainedSize) {
+      d->reachSlot = 0;
+      bool overLimit;
+      if (analyzeHeapGraph(jvmti, classCount, 1, &overLimit)) {
+        fields[2].name = "retained";
+        fields[2].value = (long) d->retained;
+        fields[3].name = "reachable";
+        fields[3].value = (long) d->reachable;
+        snprintf(text + len, sizeof(text) - len, "Retained: %ld\nReachable: %ld\n", fields[2].value, fields[3].value);
+      } else if (!heapWalkCancelled()) {
+        if (overLimit) {
+          len += snprintf(text + len, sizeof(text) - len, "Retained: over the %d MB graph limit\n", gdata->graphLimitMb);
+        } else {
+          len += snprintf(text + len, sizeof(text) - len, "Retained: not enough native memory\n");
+        }
+        PerfTimer timer(PERF_MARK_REACHABLE);
+        JvmtiHeapSource heap(jvmti);
+        setHeapWalkPhase("marking reachable objects");
+        fields[3].name = "reachable";
+        fields[3].value = (long) markReachableSize(&heap, d->index);
+        snprintf(text + len, sizeof(text) - len, "Reachable: %ld\n", fields[3].value);
+      }
+    }
+    out->printRecord("stats", fields, sizeof(fields) / sizeof(fields[0]), text);
   }
 
   gdata->dumpInProgress = JNI_FALSE;
 }
 
 
-void printReferrers(jvmtiEnv *jvmti, const char *signature, Output *out) {
+void printReferrers(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, jint depth, Output *out) {
   if (gdata->vmDeathCalled || gdata->dumpInProgress) {
     return;
   }
 
   gdata->dumpInProgress = JNI_TRUE;
 
-  /* Get all the loaded classes */
-  AllClassDetails classes(jvmti);
-  jint offset = classes.getSignatureOffset(signature);
+  ClassDetails *d = findClass(jvmti, jni, signature);
 
-  if (offset == -1) {
+  if (d == NULL) {
     out->printf("No class found with signature: '%s'\n", signature);
   } else {
-    printRefererSummary(jvmti, out, classes.details, classes.count, offset);
+    jint classCount = getClassCount();
+    resetClassDetails(classCount);
+    bool attributed;
+    bool overLimit;
+    {
+      HeapGraph graph;
+      HeapGraphBuilder builder(true);
+      limitGraph(&builder);
+      attributed = captureLiveHeapGraph(jvmti, classCount, &builder, &graph) &&
+          printReferrerFields(jvmti, jni, out, &graph, classCount, d, depth);
+      overLimit = builder.overLimit;
+    }
+    if (!attributed && !heapWalkCancelled()) {
+      if (overLimit) {
+        printGraphLimit(out, "Referrers are not attributed to fields");
+      } else {
+        out->printf("Not enough native memory to attribute referrers to fields.\n");
+      }
+      printRefererSummary(jvmti, out, classCount, d);
+    }
+  }
+
+  gdata->dumpInProgress = JNI_FALSE;
+}
+
+
+void printRootPaths(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, jint count, Output *out) {
+  if (gdata->vmDeathCalled || gdata->dumpInProgress) {
+    return;
+  }
+
+  gdata->dumpInProgress = JNI_TRUE;
+
+  ClassDetails *d = findClass(jvmti, jni, signature);
+
+  if (d == NULL) {
+    out->printf("No class found with signature: '%s'\n", signature);
+  } else if (!printLiveInstancePaths(jvmti, jni, out, getClassCount(), d, count) && !heapWalkCancelled()) {
+    out->printf("Not enough native memory to find paths from the GC roots.\n");
   }
 
   gdata->dumpInProgress = JNI_FALSE;
-}
\ No newline at end of file
+}
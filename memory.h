@@ -46,12 +46,84 @@
 #include "jni.h"
 #include "jvmti.h"
 
+#include "classes.h"
+#include "heapgraph.h"
 #include "io.h"
 
-void printHistogram(jvmtiEnv *jvmti, Output *out, bool includeReferrers);
 
-void printClassStats(jvmtiEnv *jvmti, const char *signature, Output *out, bool retainedSize);
+/* Native memory in MB that the object graph of a histogram, stats, referrers or path command may
+ * take, with its analyses, unless the graph option says otherwise. */
+#define GRAPH_LIMIT_MB 2048
 
-void printReferrers(jvmtiEnv *jvmti, const char *signature, Output *out);
+/* Number of reference levels the referrer summary looks back through. */
+#define REFER_DEPTH 3
+
+/* Most fields printed for each level of the referrers command, and the most levels it looks back
+ * through. */
+#define REFERRER_FIELD_ROWS 20
+#define MAX_REFER_DEPTH 1000
+
+/* Instances the path command follows back to the GC roots by default, and at most. */
+#define PATH_COUNT 5
+#define MAX_PATH_COUNT 100
+
+
+/* The classes with live instances, largest first, with counts and sizes in their ClassDetails. */
+typedef struct {
+  jint classCount;
+  ClassDetails **sorted;
+  jint sortedCount;
+  bool haveGraphSizes;
+  /* The graph was not analyzed because it would have taken more than gdata->graphLimitMb. */
+  bool graphOverLimit;
+} Histogram;
+
+
+/* Counts instances of every class and computes the retained and reachable sizes asked for on the
+ * command line.  The caller must set dumpInProgress, and give sorted back with scratchFree.
+ * Returns false if there was not enough memory to count. */
+bool computeHistogram(jvmtiEnv *jvmti, JNIEnv *jni, Histogram *histogram);
+
+/* Resets the scratch space of every registered class and counts instances into count and space.
+ * The caller must set dumpInProgress.  Returns the number of registry slots covered, or -1 if there
+ * was not enough memory to count. */
+jint countInstances(jvmtiEnv *jvmti, JNIEnv *jni);
+
+/* Captures every reachable object of the live heap into graph through builder.  The caller must
+ * hold the agent monitor and set dumpInProgress.  Returns false if the builder failed or the walk
+ * was cancelled. */
+bool captureLiveHeapGraph(jvmtiEnv *jvmti, jint classCount, HeapGraphBuilder *builder, HeapGraph *graph);
+
+/* The walk of captureLiveHeapGraph, leaving the graph to be packed with builder->build once the
+ * threads are resumed. */
+bool walkLiveHeapGraph(jvmtiEnv *jvmti, jint classCount, HeapGraphBuilder *builder);
+
+/* Prints the references up to depth away from instances of target in a captured graph, by the
+ * field or array class holding them, or by class alone if the graph has no labels.  Returns false
+ * if there was not enough native memory. */
+bool printReferrerFields(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, const HeapGraph *graph, jint classCount, ClassDetails *target, jint depth);
+
+/* Prints the shortest path from the GC roots to each of the largest count instances of target in a
+ * captured graph, one line for each field along the way.  Instances are ranked by retained size if
+ * rankByRetained is set and there is memory for the dominator tree, and by their own size
+ * otherwise.  Returns false if there was not enough native memory. */
+bool printInstancePaths(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, const HeapGraph *graph, jint classCount,
+    ClassDetails *target, jint count, bool rankByRetained);
+
+/* Counts, by class, the objects up to REFER_DEPTH references away from an instance of target, into
+ * referLevelCount.  Returns false if there was not enough memory to count. */
+bool computeReferrers(jvmtiEnv *jvmti, ClassDetails *target);
+
+void printHistogram(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, bool includeReferrers);
+
+void printClassStats(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, Output *out, bool retainedSize);
+
+/* Prints the references up to depth away from instances of the class, by the field holding them.
+ * Falls back to the class summary when there is not enough native memory for the object graph. */
+void printReferrers(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, jint depth, Output *out);
+
+/* Prints the shortest path from the GC roots to each of the largest count instances of the class,
+ * by retained size, from one capture of the heap. */
+void printRootPaths(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, jint count, Output *out);
 
 #endif
\ No newline at end of file
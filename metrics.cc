@@ -0,0 +1,249 @@
+/*
+ * metrics.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "classes.h"
+#include "gchistory.h"
+#include "io.h"
+#include "metrics.h"
+
+
+#define METRICS_BACKLOG 8
+#define MAX_REQUEST 4096
+
+/* How long a scraper may take to send its request. */
+#define REQUEST_TIMEOUT_SECONDS 2
+
+/* How often the thread counts are refreshed. */
+#define THREAD_SAMPLE_SECONDS 5
+
+
+static int metricsSocket = -1;
+
+
+/* Names of the java.lang.Thread.State values, as label values. */
+static const struct {
+  jint state;
+  const char *name;
+} threadStates[] = {
+  { JVMTI_JAVA_LANG_THREAD_STATE_NEW, "new" },
+  { JVMTI_JAVA_LANG_THREAD_STATE_RUNNABLE, "runnable" },
+  { JVMTI_JAVA_LANG_THREAD_STATE_BLOCKED, "blocked" },
+  { JVMTI_JAVA_LANG_THREAD_STATE_WAITING, "waiting" },
+  { JVMTI_JAVA_LANG_THREAD_STATE_TIMED_WAITING, "timed_waiting" },
+  { JVMTI_JAVA_LANG_THREAD_STATE_TERMINATED, "terminated" },
+};
+
+#define THREAD_STATE_COUNT ((int) (sizeof(threadStates) / sizeof(threadStates[0])))
+
+
+/* Thread counts from the last sample.  The sampler thread writes them and scrapes only read them. */
+static volatile jint threadCounts[THREAD_STATE_COUNT];
+static volatile bool haveThreadCounts;
+
+
+static void printMetric(Output *out, const char *name, const char *type, const char *help, jlong value) {
+  out->printf("# HELP %s %s\n# TYPE %s %s\n%s %ld\n", name, help, name, type, name, (long) value);
+}
+
+
+static void printSeconds(Output *out, const char *name, const char *type, const char *help, jlong micros) {
+  out->printf("# HELP %s %s\n# TYPE %s %s\n%s %ld.%06ld\n",
+      name, help, name, type, name, (long) (micros / 1000000), (long) (micros % 1000000));
+}
+
+
+static void printMetrics(Output *out) {
+  printMetric(out, "polarbear_up", "gauge", "Always 1 while the agent is running.", 1);
+  printMetric(out, "polarbear_loaded_classes", "gauge", "Classes loaded and not unloaded.", getLoadedClassCount());
+
+  if (haveThreadCounts) {
+    out->printf("# HELP polarbear_threads Live threads by java.lang.Thread.State.\n");
+    out->printf("# TYPE polarbear_threads gauge\n");
+    for (int s = 0; s < THREAD_STATE_COUNT; s++) {
+      out->printf("polarbear_threads{state=\"%s\"} %d\n", threadStates[s].name, (int) threadCounts[s]);
+    }
+  }
+
+  GcTotals gc;
+  getGcTotals(&gc);
+  printMetric(out, "polarbear_gc_collections_total", "counter", "Garbage collections since startup.", gc.collections);
+  printSeconds(out, "polarbear_gc_pause_seconds_total", "counter",
+      "Time spent in garbage collection pauses.", gc.totalPause);
+  printSeconds(out, "polarbear_gc_pause_seconds_max", "gauge", "Longest garbage collection pause.", gc.longestPause);
+  printSeconds(out, "polarbear_gc_last_pause_seconds", "gauge", "Pause of the last garbage collection.", gc.lastPause);
+  if (gc.lastUsed >= 0) {
+    printMetric(out, "polarbear_heap_used_after_gc_bytes", "gauge",
+        "Heap in use after the last garbage collection.", gc.lastUsed);
+    printMetric(out, "polarbear_heap_committed_bytes", "gauge",
+        "Heap committed after the last garbage collection.", gc.lastCommitted);
+  }
+
+  printMetric(out, "polarbear_oom_events_total", "counter", "Out of memory errors the agent has dumped.", gdata->oomEvents);
+  printMetric(out, "polarbear_objects_visited_total", "counter", "Objects visited by heap walks.", gdata->objectsVisited);
+  printMetric(out, "polarbear_bytes_written_total", "counter",
+      "Bytes the agent has written to files and sockets.", gdata->bytesWritten);
+  printMetric(out, "polarbear_heap_walk_in_progress", "gauge",
+      "1 while a heap command or dump is walking the heap.", gdata->dumpInProgress ? 1 : 0);
+  out->printf("# HELP polarbear_last_dump_seconds Duration of the last out of memory dump and heap command.\n");
+  out->printf("# TYPE polarbear_last_dump_seconds gauge\n");
+  out->printf("polarbear_last_dump_seconds{kind=\"oom\"} %ld.%03ld\n",
+      (long) (gdata->lastOomDumpMillis / 1000), (long) (gdata->lastOomDumpMillis % 1000));
+  out->printf("polarbear_last_dump_seconds{kind=\"command\"} %ld.%03ld\n",
+      (long) (gdata->lastHeapCommandMillis / 1000), (long) (gdata->lastHeapCommandMillis % 1000));
+}
+
+
+/* Reads the request line and headers, returning false if the client gave up or sent too much. */
+static bool readRequest(int client, char *request, int size) {
+  int used = 0;
+  while (used < size - 1) {
+    ssize_t n = read(client, request + used, size - 1 - used);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    used += n;
+    request[used] = 0;
+    if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+static void serve(int client) {
+  char request[MAX_REQUEST];
+  if (!readRequest(client, request, sizeof(request))) {
+    return;
+  }
+
+  SocketOutput out(client);
+  if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+    out.printf("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    printMetrics(&out);
+  } else if (strncmp(request, "GET ", 4) == 0) {
+    out.printf("HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nNot found.\n");
+  } else {
+    out.printf("HTTP/1.0 405 Method Not Allowed\r\nAllow: GET\r\nConnection: close\r\n\r\n");
+  }
+  out.flush();
+}
+
+
+void JNICALL metricsServer(jvmtiEnv *jvmti, JNIEnv *jni, void *arg) {
+  int listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listener == -1) {
+    fprintf(stderr, "WARNING: Could not create the metrics socket.\n");
+    return;
+  }
+
+  int optval = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons((unsigned short) gdata->metricsPort);
+  if (bind(listener, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(listener, METRICS_BACKLOG) == -1) {
+    fprintf(stderr, "WARNING: Could not serve metrics on port %d: %s\n", gdata->metricsPort, strerror(errno));
+    close(listener);
+    return;
+  }
+  metricsSocket = listener;
+
+  /* Scrapes are small, so they are answered one at a time. */
+  while (!gdata->vmDeathCalled) {
+    int client = accept(listener, NULL, NULL);
+    if (client == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break;
+    }
+
+    struct timeval timeout = { REQUEST_TIMEOUT_SECONDS, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    serve(client);
+    close(client);
+  }
+
+  metricsSocket = -1;
+  close(listener);
+}
+
+
+/* Counts live threads by state, returning false if the threads could not be listed. */
+static bool countThreads(jvmtiEnv *jvmti, JNIEnv *jni, jint *counts) {
+  jint count;
+  jthread *threads;
+  if (jvmti->GetAllThreads(&count, &threads) != JVMTI_ERROR_NONE) {
+    return false;
+  }
+
+  memset(counts, 0, THREAD_STATE_COUNT * sizeof(jint));
+  for (jint i = 0; i < count; i++) {
+    jint state;
+    if (jvmti->GetThreadState(threads[i], &state) == JVMTI_ERROR_NONE) {
+      for (int s = 0; s < THREAD_STATE_COUNT; s++) {
+        if ((state & JVMTI_JAVA_LANG_THREAD_STATE_MASK) == threadStates[s].state) {
+          counts[s]++;
+        }
+      }
+    }
+    jni->DeleteLocalRef(threads[i]);
+  }
+  deallocate(jvmti, threads);
+  return true;
+}
+
+
+void JNICALL threadCountSampler(jvmtiEnv *jvmti, JNIEnv *jni, void *arg) {
+  while (!gdata->vmDeathCalled) {
+    /* JVMTI calls wait for a safepoint to end, so no sample is taken while a heap walk holds one. */
+    jint counts[THREAD_STATE_COUNT];
+    if (!gdata->dumpInProgress && countThreads(jvmti, jni, counts)) {
+      for (int s = 0; s < THREAD_STATE_COUNT; s++) {
+        threadCounts[s] = counts[s];
+      }
+      __sync_synchronize();
+      haveThreadCounts = true;
+    }
+
+    sleep(THREAD_SAMPLE_SECONDS);
+  }
+}
+
+
+void closeMetricsServer() {
+  if (metricsSocket != -1) {
+    shutdown(metricsSocket, SHUT_RDWR);
+  }
+}
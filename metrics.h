@@ -0,0 +1,42 @@
+/*
+ * metrics.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_METRICS_H
+#define POLARBEAR_METRICS_H
+
+
+#include "jni.h"
+#include "jvmti.h"
+
+
+/* Agent thread that serves metrics in the Prometheus text format over HTTP, on the loopback
+ * interface at gdata->metricsPort.  Every value comes from counters the agent keeps anyway, so a
+ * scrape never takes the agent lock, suspends a thread or walks the heap. */
+void JNICALL metricsServer(jvmtiEnv *jvmti, JNIEnv *jni, void *arg);
+
+
+/* Agent thread that counts live threads by state every few seconds for the metrics server, so a
+ * scrape only reads the last counts. */
+void JNICALL threadCountSampler(jvmtiEnv *jvmti, JNIEnv *jni, void *arg);
+
+
+/* Stops the metrics server.  Called at VM death. */
+void closeMetricsServer();
+
+
+#endif
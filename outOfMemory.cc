@@ -38,51 +38,239 @@
  * nuclear facility.
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "jni.h"
 #include "jvmti.h"
 
 #include "agentthread.h"
+#include "allocations.h"
+#include "arena.h"
 #include "base.h"
+#include "classes.h"
+#include "gchistory.h"
+#include "hprof.h"
 #include "io.h"
+#include "matcher.h"
 #include "memory.h"
+#include "metrics.h"
+#include "perf.h"
 #include "shell.h"
+#include "snapshot.h"
+#include "summary.h"
+#include "symbols.h"
 #include "threads.h"
+#include "trend.h"
 
 
-/* Called when memory is exhausted. */
+#define OOM_LOG_PATH "/tmp/oom.log"
+
+/* Native memory set aside for the out of memory dump, before the part that grows with the number
+ * of classes and threads.  A binary summary is gathered in memory before it is written, so it
+ * needs more. */
+#define EMERGENCY_ARENA_SIZE (4 * 1024 * 1024)
+#define SUMMARY_ARENA_SIZE (32 * 1024 * 1024)
+
+/* Reserve memory the dump needs for each registered class (counts, sort and referrer tables) and
+ * for each thread (stack grouping, suspension and summary rows). */
+#define EMERGENCY_BYTES_PER_CLASS 256
+#define EMERGENCY_BYTES_PER_THREAD (4 * 1024)
+
+/* Seconds between checks that the reserve still fits the class and thread counts. */
+#define EMERGENCY_RESIZE_INTERVAL 5
+
+/* Extra native memory for the heap dump's stream blocks, compressor and class table. */
+#define HPROF_ARENA_SIZE (32 * 1024 * 1024)
+
+/* Disk space set aside at startup for the out of memory dump. */
+#define EMERGENCY_LOG_RESERVE (16 * 1024 * 1024)
+
+#define EMERGENCY_OUTPUT_SIZE (256 * 1024)
+
+/* Chunk size of the arena commands allocate their scratch state from, and how much of it is kept
+ * mapped between commands. */
+#define COMMAND_ARENA_CHUNK_SIZE (1024 * 1024)
+#define COMMAND_ARENA_RETAIN_SIZE (8 * 1024 * 1024)
+
+
+/* Opens a file the out of memory dump appends to and reserves room in it, so the dump does not
+ * need to open a file or find free disk space. */
+static int openOomFile(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (fd >= 0) {
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end >= 0) {
+      fallocate(fd, FALLOC_FL_KEEP_SIZE, end, EMERGENCY_LOG_RESERVE);
+    }
+  }
+#endif
+  return fd;
+}
+
+
+/* Opens the file for the out of memory heap dump.  A file that already holds a dump is left alone,
+ * since it is most likely the dump from a previous run that the user has yet to look at. */
+static int openHprofFile(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT, 0644);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+    fprintf(stderr, "WARNING: %s already exists, so no heap dump will be written to it.\n", path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+/* Native memory the out of memory dump needs with classCount classes registered and threadCount
+ * threads running. */
+static size_t emergencyReserveSize(jint classCount, jint threadCount) {
+  size_t size = gdata->summaryPath ? SUMMARY_ARENA_SIZE : EMERGENCY_ARENA_SIZE;
+  if (gdata->hprofPath) {
+    size += HPROF_ARENA_SIZE;
+  }
+  return size + (size_t) classCount * EMERGENCY_BYTES_PER_CLASS + (size_t) threadCount * EMERGENCY_BYTES_PER_THREAD;
+}
+
+
+/* Reserves more memory for the out of memory dump if the classes and threads have outgrown it,
+ * with a quarter again as much room to grow.  The caller must hold the agent monitor, so no dump
+ * is using the reserve. */
+static void resizeEmergencyReserve(jvmtiEnv *jvmti, JNIEnv *jni) {
+  jint threadCount;
+  jthread *threads;
+  if (jvmti->GetAllThreads(&threadCount, &threads) != JVMTI_ERROR_NONE) {
+    return;
+  }
+  for (jint i = 0; i < threadCount; i++) {
+    jni->DeleteLocalRef(threads[i]);
+  }
+  deallocate(jvmti, threads);
+
+  size_t size = emergencyReserveSize(getClassCount(), threadCount);
+  if (size > gdata->emergencyArena->mapped && !gdata->emergencyArena->reserve(size + size / 4)) {
+    gdata->emergencyArena->reserve(size);
+  }
+}
+
+
+/* Agent thread that keeps the out of memory reserve in step with the class registry as classes
+ * are registered, and with the number of threads.  It also registers array classes, which get no
+ * ClassPrepare event, but only once allocation samples have run into one, so the full scan of
+ * the loaded classes is rare. */
+static void JNICALL emergencyReserveKeeper(jvmtiEnv *jvmti, JNIEnv *jni, void *arg) {
+  while (!gdata->vmDeathCalled) {
+    sleep(EMERGENCY_RESIZE_INTERVAL);
+    enterAgentMonitor(jvmti); {
+      if (!gdata->vmDeathCalled) {
+        if (gdata->allocInterval > 0 && takeUnregisteredSampleCount() > 0) {
+          registerLoadedClasses(jvmti, jni);
+        }
+        resizeEmergencyReserve(jvmti, jni);
+      }
+    } exitAgentMonitor(jvmti);
+  }
+}
+
+
+/* Called when memory is exhausted.  Everything the dump needs was set aside at startup, since
+ * native memory may be exhausted as well. */
 static void JNICALL resourceExhausted(
     jvmtiEnv *jvmti, JNIEnv* jni, jint flags, const void* reserved, const char* description) {
   if (flags & 0x0003) {
+    __sync_fetch_and_add(&gdata->oomEvents, 1);
+    jlong start = monotonicMicros();
+
     enterAgentMonitor(jvmti); {
-      FILE * out = fopen("/tmp/oom.log", "a");
-      FileOutput output(out);
+      if (gdata->emergencyLog < 0) {
+        gdata->emergencyLog = openOomFile(OOM_LOG_PATH);
+      }
+
+      ArenaScope scope(gdata->emergencyArena->base ? gdata->emergencyArena : gdata->commandArena);
+      gdata->emergencyDump = JNI_TRUE;
+
+      char fallbackBuffer[4096];
+      char *buffer = (char *) scratchAllocate(EMERGENCY_OUTPUT_SIZE);
+      FdOutput output(gdata->emergencyLog,
+          buffer ? buffer : fallbackBuffer, buffer ? EMERGENCY_OUTPUT_SIZE : sizeof(fallbackBuffer));
 
       output.printf("About to throw an OutOfMemory error.\n");
 
-      output.printf("Suspending all threads except the current one.\n");
+      if (gdata->summaryFd >= 0) {
+        output.printf("Writing a heap summary to %s.\n", gdata->summaryPath);
+        output.flush();
 
-      ThreadSuspension threads(jvmti, jni);
+        ThreadSuspension threads(jvmti, jni);
+        if (!writeHeapSummary(jvmti, jni, gdata->summaryFd, threads.current, gdata->oomThreadDepth)) {
+          output.printf("Could not write the heap summary.\n");
+        }
+        threads.resume();
 
-      output.printf("Printing a heap histogram.\n");
+      } else {
+        output.printf("Suspending all threads except the current one.\n");
 
-      printHistogram(jvmti, &output, true);
+        ThreadSuspension threads(jvmti, jni);
 
-      output.printf("Resuming threads.\n");
+        output.printf("Printing a heap histogram.\n");
 
-      threads.resume();
+        printHistogram(jvmti, jni, &output, true);
 
-      output.printf("Printing thread dump.\n");
+        output.printf("Resuming threads.\n");
 
-      if (!gdata->vmDeathCalled) {
-        printThreadDump(jvmti, jni, &output, threads.current);
+        threads.resume();
+
+        output.printf("Printing thread dump.\n");
+
+        if (!gdata->vmDeathCalled) {
+          printThreadDump(jvmti, jni, &output, threads.current, gdata->groupedOomThreads, gdata->oomThreadDepth);
+        }
+      }
+
+      if (gdata->trendInterval > 0) {
+        output.printf("Printing the classes that grew fastest before the error.\n");
+        printTrend(&output, TREND_OOM_CLASSES);
       }
+
+      if (gdata->allocInterval > 0) {
+        output.printf("Printing the allocation sites with the highest recent rate.\n");
+        printAllocationSites(jvmti, jni, &output, ALLOC_OOM_SITES, true);
+      }
+
+      output.printf("Printing the most recent garbage collections.\n");
+      printGcHistory(&output, GC_OOM_RECORDS);
+
+      /* The heap dump is written once, for the first error. */
+      if (gdata->hprofFd >= 0) {
+        output.printf("Writing a heap dump to %s.\n", gdata->hprofPath);
+        output.flush();
+
+        ThreadSuspension threads(jvmti, jni);
+        HprofStats stats;
+        if (!writeHprofDump(jvmti, jni, gdata->hprofFd, isGzipPath(gdata->hprofPath), &stats)) {
+          output.printf("Could not write the heap dump.\n");
+        }
+        threads.resume();
+
+        close(gdata->hprofFd);
+        gdata->hprofFd = -1;
+      }
+
+      output.printf("Printing the time the agent has spent in each phase.\n");
+      printPerf(&output);
       output.printf("\n\n");
-      fclose(out);
+      output.flush();
+
+      gdata->emergencyDump = JNI_FALSE;
+      jlong elapsed = monotonicMicros() - start;
+      recordPhase(PERF_OOM_DUMP, elapsed);
+      gdata->lastOomDumpMillis = elapsed / 1000;
     } exitAgentMonitor(jvmti);
   }
 }
@@ -94,9 +282,30 @@ static void JNICALL vmInit(jvmtiEnv *jvmti, JNIEnv *env, jthread thread)
   enterAgentMonitor(jvmti); {
     jvmtiError err;
 
+    /* Register the classes loaded so far; ClassPrepare events keep the registry current after. */
+    CHECK(jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, NULL));
+    CHECK(jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_OBJECT_FREE, NULL));
+    registerLoadedClasses(jvmti, env);
+    resizeEmergencyReserve(jvmti, env);
+
     createAgentThread(jvmti, env, shellServer, NULL);
+    createAgentThread(jvmti, env, gcMonitor, NULL);
+    createAgentThread(jvmti, env, emergencyReserveKeeper, NULL);
+    if (gdata->trendInterval > 0) {
+      createAgentThread(jvmti, env, trendSampler, NULL);
+    }
+    if (gdata->metricsPort > 0) {
+      createAgentThread(jvmti, env, metricsServer, NULL);
+      createAgentThread(jvmti, env, threadCountSampler, NULL);
+    }
 
     CHECK(jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_DATA_DUMP_REQUEST, NULL));
+    CHECK(jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, NULL));
+    CHECK(jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, NULL));
+    if (gdata->allocInterval > 0) {
+      CHECK(jvmti->SetHeapSamplingInterval(gdata->allocInterval));
+      CHECK(jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, NULL));
+    }
   } exitAgentMonitor(jvmti);
 }
 
@@ -110,12 +319,43 @@ static void JNICALL vmDeath(jvmtiEnv *jvmti, JNIEnv *env) {
     CHECK(jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_RESOURCE_EXHAUSTED, NULL));
 
     closeShellServer();
+    closeMetricsServer();
 
     gdata->vmDeathCalled = JNI_TRUE;
   } exitAgentMonitor(jvmti);
 }
 
 
+/* Applies an agent option of the form name=value. */
+static void parseSetting(const char *setting) {
+  if (strcmp(setting, "threads=grouped") == 0) {
+    gdata->groupedOomThreads = JNI_TRUE;
+  } else if (strcmp(setting, "threads=full") == 0) {
+    gdata->groupedOomThreads = JNI_FALSE;
+  } else if (strncmp(setting, "summary=", 8) == 0 && setting[8]) {
+    gdata->summaryPath = setting + 8;
+  } else if (strncmp(setting, "hprof=", 6) == 0 && setting[6]) {
+    gdata->hprofPath = setting + 6;
+  } else if (strncmp(setting, "trend=", 6) == 0 && atoi(setting + 6) > 0) {
+    gdata->trendInterval = atoi(setting + 6);
+  } else if (strncmp(setting, "alloc=", 6) == 0 && atoi(setting + 6) > 0) {
+    gdata->allocInterval = atoi(setting + 6);
+  } else if (strncmp(setting, "metrics=", 8) == 0 && atoi(setting + 8) > 0 && atoi(setting + 8) < 65536) {
+    gdata->metricsPort = atoi(setting + 8);
+  } else if (strncmp(setting, "paths=", 6) == 0 && atoi(setting + 6) > 0) {
+    gdata->oomPathCount = atoi(setting + 6) < MAX_PATH_COUNT ? atoi(setting + 6) : MAX_PATH_COUNT;
+  } else if (strncmp(setting, "snapshot=", 9) == 0 && atoi(setting + 9) > 0) {
+    gdata->snapshotLimitMb = atoi(setting + 9);
+  } else if (strncmp(setting, "graph=", 6) == 0 && atoi(setting + 6) > 0) {
+    gdata->graphLimitMb = atoi(setting + 6);
+  } else if (strncmp(setting, "depth=", 6) == 0 && atoi(setting + 6) > 0) {
+    gdata->oomThreadDepth = atoi(setting + 6);
+  } else {
+    fprintf(stderr, "WARNING: Ignoring unknown option '%s'\n", setting);
+  }
+}
+
+
 /* Called by the JVM to load the module. */
 JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
   jint rc;
@@ -123,7 +363,6 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
   jvmtiCapabilities capabilities;
   jvmtiEventCallbacks callbacks;
   jvmtiEnv *jvmti;
-  FILE *log;
 
   /* Build list of filter classes. */
   if (options && options[0]) {
@@ -156,16 +395,44 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
     gdata->retainedSizeClassCount = 0;
   }
 
-  log = fopen("/tmp/oom.log", "a");
-  fprintf(log, "Initializing polarbear.\n\n");
+  /* Options of the form name=value are settings rather than classes. */
+  gdata->oomThreadDepth = THREAD_DUMP_DEPTH;
+  gdata->snapshotLimitMb = SNAPSHOT_LIMIT_MB;
+  gdata->graphLimitMb = GRAPH_LIMIT_MB;
+  int classCount = 0;
+  for (int i = 0; i < gdata->retainedSizeClassCount; i++) {
+    char *option = gdata->retainedSizeClasses[i];
+    if (strchr(option, '=') != NULL) {
+      parseSetting(option);
+    } else {
+      gdata->retainedSizeClasses[classCount++] = option;
+    }
+  }
+  gdata->retainedSizeClassCount = classCount;
+  gdata->retainedSizeMatcher = new ClassMatcher(gdata->retainedSizeClasses, gdata->retainedSizeClassCount);
+
+  /* Set aside what the out of memory dump needs. */
+  gdata->commandArena = new Arena("command", COMMAND_ARENA_CHUNK_SIZE, COMMAND_ARENA_RETAIN_SIZE);
+  gdata->emergencyArena = new Arena("emergency");
+  if (!gdata->emergencyArena->reserve(emergencyReserveSize(0, 0))) {
+    fprintf(stderr, "WARNING: Unable to reserve memory for the out of memory dump.\n");
+  }
+  gdata->emergencyLog = openOomFile(OOM_LOG_PATH);
+  gdata->summaryFd = gdata->summaryPath ? openOomFile(gdata->summaryPath) : -1;
+  gdata->hprofFd = gdata->hprofPath ? openHprofFile(gdata->hprofPath) : -1;
+
+  char logBuffer[4096];
+  FdOutput log(gdata->emergencyLog, logBuffer, sizeof(logBuffer));
+  log.printf("Initializing polarbear.\n\n");
 
   if (gdata->retainedSizeClassCount) {
-    fprintf(log, "Performing retained size analysis for %d classes:\n", gdata->retainedSizeClassCount);
+    log.printf("Performing retained size analysis for %d classes:\n", gdata->retainedSizeClassCount);
     for (int i = 0; i < gdata->retainedSizeClassCount; i++) {
-      fprintf(log, "%s\n", gdata->retainedSizeClasses[i]);
+      log.printf("%s\n", gdata->retainedSizeClasses[i]);
     }
-    fprintf(log, "\n");
+    log.printf("\n");
   }
+  log.flush();
 
   /* Get JVMTI environment */
   jvmti = NULL;
@@ -183,23 +450,42 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
   capabilities.can_get_source_file_name = 1;
   capabilities.can_get_line_numbers = 1;
   capabilities.can_suspend = 1;
+  capabilities.can_generate_object_free_events = 1;
+  if (gdata->allocInterval > 0) {
+    /* Allocation sampling needs a Java 11 VM. */
+    jvmtiCapabilities potential;
+    CHECK(jvmti->GetPotentialCapabilities(&potential));
+    if (potential.can_generate_sampled_object_alloc_events && initAllocationProfiler()) {
+      capabilities.can_generate_sampled_object_alloc_events = 1;
+    } else {
+      fprintf(stderr, "WARNING: Allocation sampling is not available.\n");
+      gdata->allocInterval = 0;
+    }
+  }
   CHECK(jvmti->AddCapabilities(&capabilities));
 
   /* Create the raw monitor */
   CHECK(jvmti->CreateRawMonitor("agent lock", &(gdata->lock)));
 
+  initClassRegistry(jvmti);
+  initSymbolCache(jvmti);
+  initGcHistory();
+
   /* Set callbacks and enable event notifications */
   memset(&callbacks, 0, sizeof(callbacks));
   callbacks.VMInit = &vmInit;
   callbacks.VMDeath = &vmDeath;
   callbacks.ResourceExhausted = resourceExhausted;
+  callbacks.ClassPrepare = &classPrepare;
+  callbacks.ObjectFree = &objectFree;
+  callbacks.GarbageCollectionStart = &gcStart;
+  callbacks.GarbageCollectionFinish = &gcFinish;
+  callbacks.SampledObjectAlloc = &sampledObjectAlloc;
   CHECK(jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks)));
   CHECK(jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, NULL));
   CHECK(jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, NULL));
   CHECK(jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_RESOURCE_EXHAUSTED, NULL));
 
-  fclose(log);
-
   return 0;
 }
 
@@ -0,0 +1,505 @@
+/*
+ * pbdecode.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Offline reader for the binary heap summaries written by the agent.
+ *
+ *   pbdecode show <file> [-n rows] [-f pattern]...
+ *   pbdecode diff <before> <after> [-n rows] [-f pattern]...
+ *
+ * A file written by the out of memory handler may hold several summaries back to back; show prints
+ * each of them and diff compares the last summary of each file. */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base.h"
+#include "matcher.h"
+#include "summaryformat.h"
+#include "threads.h"
+
+
+#define MAX_PATTERNS 64
+
+
+/* A summary mapped from a file, with its columns located. */
+typedef struct {
+  const SummaryHeader *header;
+
+  uint32_t stringCount;
+  const uint32_t *stringOffset;
+  const char *chars;
+  uint64_t charCount;
+
+  uint32_t classCount;
+  const uint32_t *className;
+  const int64_t *objects;
+  const int64_t *space;
+  const int64_t *retained;
+  const int64_t *reachable;
+
+  uint32_t referrerCount;
+  const uint32_t *level;
+  const uint32_t *referrer;
+  const int64_t *referrerObjects;
+
+  uint32_t frameCount;
+  const uint32_t *framePrefix;
+  const int32_t *frameLine;
+
+  uint32_t threadCount;
+  const uint32_t *threadName;
+  const int32_t *threadState;
+  const uint32_t *threadFlags;
+  const uint32_t *frameStart;
+  const uint32_t *frames;
+} Summary;
+
+
+typedef struct {
+  int rows;
+  ClassMatcher *matcher;
+} Options;
+
+
+/* Walks the columns of a section payload. */
+typedef struct {
+  const char *p;
+  uint64_t left;
+} Cursor;
+
+
+/* Returns the next column of a section, or NULL if the payload is too short. */
+static const void *column(Cursor *cursor, uint64_t length) {
+  uint64_t aligned = summaryAlign(length);
+  if (aligned > cursor->left) {
+    return NULL;
+  }
+  const void *start = cursor->p;
+  cursor->p += aligned;
+  cursor->left -= aligned;
+  return start;
+}
+
+
+/* Returns string i, or a placeholder if the file refers to a string it does not have. */
+static const char *string(const Summary *s, uint32_t i) {
+  if (i >= s->stringCount || s->stringOffset[i + 1] <= s->stringOffset[i] ||
+      s->stringOffset[i + 1] > s->charCount || s->chars[s->stringOffset[i + 1] - 1] != 0) {
+    return "<bad string>";
+  }
+  return s->chars + s->stringOffset[i];
+}
+
+
+/* Locates the columns of one section.  Returns false if the section is malformed. */
+static bool parseSection(Summary *s, const SummarySection *section, Cursor *cursor) {
+  uint64_t n = section->count;
+  switch (section->type) {
+    case SUMMARY_STRINGS:
+      s->stringCount = section->count;
+      s->stringOffset = (const uint32_t *) column(cursor, sizeof(uint32_t) * (n + 1));
+      if (s->stringOffset == NULL) {
+        return false;
+      }
+      s->charCount = s->stringOffset[n];
+      s->chars = (const char *) column(cursor, s->charCount);
+      return s->chars != NULL;
+
+    case SUMMARY_CLASSES:
+      s->classCount = section->count;
+      s->className = (const uint32_t *) column(cursor, sizeof(uint32_t) * n);
+      s->objects = (const int64_t *) column(cursor, sizeof(int64_t) * n);
+      s->space = (const int64_t *) column(cursor, sizeof(int64_t) * n);
+      s->retained = (const int64_t *) column(cursor, sizeof(int64_t) * n);
+      s->reachable = (const int64_t *) column(cursor, sizeof(int64_t) * n);
+      return s->className && s->objects && s->space && s->retained && s->reachable;
+
+    case SUMMARY_REFERRERS:
+      s->referrerCount = section->count;
+      s->level = (const uint32_t *) column(cursor, sizeof(uint32_t) * n);
+      s->referrer = (const uint32_t *) column(cursor, sizeof(uint32_t) * n);
+      s->referrerObjects = (const int64_t *) column(cursor, sizeof(int64_t) * n);
+      return s->level && s->referrer && s->referrerObjects;
+
+    case SUMMARY_FRAMES:
+      s->frameCount = section->count;
+      s->framePrefix = (const uint32_t *) column(cursor, sizeof(uint32_t) * n);
+      s->frameLine = (const int32_t *) column(cursor, sizeof(int32_t) * n);
+      return s->framePrefix && s->frameLine;
+
+    case SUMMARY_THREADS:
+      s->threadCount = section->count;
+      s->threadName = (const uint32_t *) column(cursor, sizeof(uint32_t) * n);
+      s->threadState = (const int32_t *) column(cursor, sizeof(int32_t) * n);
+      s->threadFlags = (const uint32_t *) column(cursor, sizeof(uint32_t) * n);
+      s->frameStart = (const uint32_t *) column(cursor, sizeof(uint32_t) * (n + 1));
+      if (!s->threadName || !s->threadState || !s->threadFlags || !s->frameStart) {
+        return false;
+      }
+      s->frames = (const uint32_t *) column(cursor, sizeof(uint32_t) * s->frameStart[n]);
+      return s->frames != NULL;
+
+    default:
+      /* Sections added by later versions are skipped. */
+      return true;
+  }
+}
+
+
+/* Parses the summary starting at data.  Returns its length, or 0 if it is not a valid summary. */
+static uint64_t parseSummary(const char *data, uint64_t length, Summary *s, const char *path) {
+  memset(s, 0, sizeof(Summary));
+  const SummaryHeader *header = (const SummaryHeader *) data;
+  if (length < sizeof(SummaryHeader) || memcmp(header->magic, SUMMARY_MAGIC, sizeof(header->magic)) != 0) {
+    fprintf(stderr, "%s: not a heap summary\n", path);
+    return 0;
+  }
+  if (header->byteOrder != SUMMARY_BYTE_ORDER) {
+    fprintf(stderr, "%s: written on a machine with a different byte order\n", path);
+    return 0;
+  }
+  if (header->version != SUMMARY_VERSION) {
+    fprintf(stderr, "%s: unsupported version %u\n", path, header->version);
+    return 0;
+  }
+  s->header = header;
+
+  uint64_t offset = sizeof(SummaryHeader);
+  for (uint32_t i = 0; i < header->sectionCount; i++) {
+    if (length - offset < sizeof(SummarySection)) {
+      fprintf(stderr, "%s: truncated\n", path);
+      return 0;
+    }
+    const SummarySection *section = (const SummarySection *) (data + offset);
+    offset += sizeof(SummarySection);
+    if (section->length > length - offset) {
+      fprintf(stderr, "%s: truncated\n", path);
+      return 0;
+    }
+    Cursor cursor = { data + offset, section->length };
+    if (!parseSection(s, section, &cursor)) {
+      fprintf(stderr, "%s: malformed section %u\n", path, section->type);
+      return 0;
+    }
+    offset += summaryAlign(section->length);
+  }
+
+  /* Check the cross references once, so the printers can trust them. */
+  for (uint32_t i = 0; i < s->referrerCount; i++) {
+    if (s->referrer[i] >= s->classCount) {
+      fprintf(stderr, "%s: bad referrer\n", path);
+      return 0;
+    }
+  }
+  for (uint32_t t = 0; t < s->threadCount; t++) {
+    if (s->frameStart[t] > s->frameStart[t + 1]) {
+      fprintf(stderr, "%s: bad thread\n", path);
+      return 0;
+    }
+  }
+  for (uint32_t f = 0; s->threadCount && f < s->frameStart[s->threadCount]; f++) {
+    if (s->frames[f] >= s->frameCount) {
+      fprintf(stderr, "%s: bad frame\n", path);
+      return 0;
+    }
+  }
+  return offset;
+}
+
+
+/* Maps a whole file.  Returns NULL on failure. */
+static const char *mapFile(const char *path, uint64_t *length) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    fprintf(stderr, "%s: empty\n", path);
+    close(fd);
+    return NULL;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(path);
+    return NULL;
+  }
+  *length = st.st_size;
+  return (const char *) data;
+}
+
+
+/* Parses the last summary in a mapped file. */
+static bool lastSummary(const char *data, uint64_t length, Summary *s, const char *path) {
+  uint64_t offset = 0;
+  Summary next;
+  bool found = false;
+  while (offset < length) {
+    uint64_t used = parseSummary(data + offset, length - offset, &next, path);
+    if (used == 0) {
+      break;
+    }
+    *s = next;
+    found = true;
+    offset += used;
+  }
+  return found;
+}
+
+
+static bool selected(const Options *options, const char *signature) {
+  return options->matcher == NULL || options->matcher->match(signature) != -1;
+}
+
+
+static void printHeader(const Summary *s) {
+  char when[64];
+  time_t seconds = (time_t) (s->header->timestamp / 1000);
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+  printf("Heap summary taken %s%s\n", when,
+      s->header->flags & SUMMARY_OUT_OF_MEMORY ? " on OutOfMemoryError" : "");
+  printf("Heap View, Total of %lld objects found.\n\n", (long long) s->header->totalObjects);
+}
+
+
+static void printClasses(const Summary *s, const Options *options) {
+  bool haveRetained = s->header->flags & SUMMARY_HAS_RETAINED_SIZES;
+  printf("Space      Count      Retained   Reachable  Class Signature\n");
+  printf("---------- ---------- ---------- ---------- ----------------------\n");
+  int printed = 0;
+  for (uint32_t i = 0; i < s->classCount && printed < options->rows; i++) {
+    const char *signature = string(s, s->className[i]);
+    if (selected(options, signature)) {
+      /* Retained sizes are not in summaries taken while memory was exhausted. */
+      char retained[32] = "n/a";
+      if (haveRetained) {
+        snprintf(retained, sizeof(retained), "%lld", (long long) s->retained[i]);
+      }
+      printf("%10lld %10lld %10s %10lld %s\n", (long long) s->space[i], (long long) s->objects[i],
+          retained, (long long) s->reachable[i], signature);
+      printed++;
+    }
+  }
+  printf("---------- ---------- ---------- ---------- ----------------------\n\n");
+}
+
+
+static void printReferrers(const Summary *s) {
+  if (s->classCount == 0 || s->referrerCount == 0) {
+    return;
+  }
+  printf("Referrers of %s\n\n", string(s, s->className[0]));
+  uint32_t lastLevel = 0;
+  for (uint32_t i = 0; i < s->referrerCount; i++) {
+    if (s->level[i] != lastLevel) {
+      printf(lastLevel ? "\n\t\tLevel %u referrers:\n" : "\t\tLevel %u referrers:\n", s->level[i]);
+      lastLevel = s->level[i];
+    }
+    printf("\t\t%10lld %s\n", (long long) s->referrerObjects[i], string(s, s->className[s->referrer[i]]));
+  }
+  printf("\n");
+}
+
+
+static void printThreads(const Summary *s) {
+  for (uint32_t t = 0; t < s->threadCount; t++) {
+    printf("#%u - %s - %s", t + 1, string(s, s->threadName[t]), threadStateName(s->threadState[t]));
+    if (s->threadFlags[t] & SUMMARY_THREAD_OOM_THROWER) {
+      printf(" - [OOM thrower]");
+    }
+    printf("\n");
+    for (uint32_t f = s->frameStart[t]; f < s->frameStart[t + 1]; f++) {
+      uint32_t frame = s->frames[f];
+      if (s->frameLine[frame] > 0) {
+        printf("\tat %s:%d)\n", string(s, s->framePrefix[frame]), s->frameLine[frame]);
+      } else {
+        printf("\tat %s)\n", string(s, s->framePrefix[frame]));
+      }
+    }
+    printf("\n");
+  }
+}
+
+
+static int show(const char *path, const Options *options) {
+  uint64_t length;
+  const char *data = mapFile(path, &length);
+  if (data == NULL) {
+    return 1;
+  }
+
+  uint64_t offset = 0;
+  int count = 0;
+  while (offset < length) {
+    Summary s;
+    uint64_t used = parseSummary(data + offset, length - offset, &s, path);
+    if (used == 0) {
+      break;
+    }
+    printHeader(&s);
+    printClasses(&s, options);
+    printReferrers(&s);
+    printThreads(&s);
+    offset += used;
+    count++;
+  }
+  munmap((void *) data, length);
+  return count > 0 && offset == length ? 0 : 1;
+}
+
+
+/* One row of a diff. */
+typedef struct {
+  const char *signature;
+  int64_t objects[2];
+  int64_t space[2];
+} DiffRow;
+
+
+static int compareSignatures(const void *p1, const void *p2) {
+  return strcmp(((const DiffRow *) p1)->signature, ((const DiffRow *) p2)->signature);
+}
+
+
+/* Comparison function for diff rows - used to sort the largest change in space first. */
+static int compareChange(const void *p1, const void *p2) {
+  const DiffRow *a = (const DiffRow *) p1, *b = (const DiffRow *) p2;
+  int64_t changeA = llabs(a->space[1] - a->space[0]);
+  int64_t changeB = llabs(b->space[1] - b->space[0]);
+  return changeA < changeB ? 1 : changeA > changeB ? -1 : strcmp(a->signature, b->signature);
+}
+
+
+static int diff(const char *before, const char *after, const Options *options) {
+  const char *paths[2] = { before, after };
+  const char *data[2] = { NULL, NULL };
+  uint64_t length[2];
+  Summary s[2];
+  int rc = 1;
+
+  for (int k = 0; k < 2; k++) {
+    data[k] = mapFile(paths[k], &length[k]);
+    if (data[k] == NULL || !lastSummary(data[k], length[k], &s[k], paths[k])) {
+      goto done;
+    }
+  }
+
+  {
+    /* Merge the two histograms by signature: collect every row, sort by name, then fold
+     * neighbours together. */
+    uint32_t total = s[0].classCount + s[1].classCount;
+    DiffRow *rows = (DiffRow *) calloc(sizeof(DiffRow), total ? total : 1);
+    CHECK_FOR_NULL(rows);
+    uint32_t n = 0;
+    for (int k = 0; k < 2; k++) {
+      for (uint32_t i = 0; i < s[k].classCount; i++) {
+        DiffRow *row = &rows[n++];
+        row->signature = string(&s[k], s[k].className[i]);
+        row->objects[k] = s[k].objects[i];
+        row->space[k] = s[k].space[i];
+      }
+    }
+    qsort(rows, n, sizeof(DiffRow), &compareSignatures);
+    uint32_t merged = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      if (merged > 0 && strcmp(rows[merged - 1].signature, rows[i].signature) == 0) {
+        for (int k = 0; k < 2; k++) {
+          rows[merged - 1].objects[k] += rows[i].objects[k];
+          rows[merged - 1].space[k] += rows[i].space[k];
+        }
+      } else {
+        rows[merged++] = rows[i];
+      }
+    }
+    qsort(rows, merged, sizeof(DiffRow), &compareChange);
+
+    printf("Objects: %lld -> %lld\n\n", (long long) s[0].header->totalObjects, (long long) s[1].header->totalObjects);
+    printf("Space      Change     Count      Change     Class Signature\n");
+    printf("---------- ---------- ---------- ---------- ----------------------\n");
+    int printed = 0;
+    for (uint32_t i = 0; i < merged && printed < options->rows; i++) {
+      DiffRow *row = &rows[i];
+      if (row->space[0] == row->space[1] && row->objects[0] == row->objects[1] ||
+          !selected(options, row->signature)) {
+        continue;
+      }
+      printf("%10lld %+10lld %10lld %+10lld %s\n", (long long) row->space[1],
+          (long long) (row->space[1] - row->space[0]), (long long) row->objects[1],
+          (long long) (row->objects[1] - row->objects[0]), row->signature);
+      printed++;
+    }
+    printf("---------- ---------- ---------- ---------- ----------------------\n");
+    free(rows);
+    rc = 0;
+  }
+
+done:
+  for (int k = 0; k < 2; k++) {
+    if (data[k] != NULL) {
+      munmap((void *) data[k], length[k]);
+    }
+  }
+  return rc;
+}
+
+
+static void usage() {
+  fprintf(stderr, "Usage: pbdecode show <file> [-n rows] [-f pattern]...\n");
+  fprintf(stderr, "       pbdecode diff <before> <after> [-n rows] [-f pattern]...\n");
+  exit(2);
+}
+
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    usage();
+  }
+  const char *command = argv[1];
+  int files = strcmp(command, "diff") == 0 ? 2 : 1;
+  if (files == 1 && strcmp(command, "show") != 0 || argc < 2 + files) {
+    usage();
+  }
+
+  Options options = { 0x7fffffff, NULL };
+  char *patterns[MAX_PATTERNS];
+  int patternCount = 0;
+  for (int i = 2 + files; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+      options.rows = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc && patternCount < MAX_PATTERNS) {
+      patterns[patternCount++] = argv[++i];
+    } else {
+      usage();
+    }
+  }
+  if (patternCount > 0) {
+    options.matcher = new ClassMatcher(patterns, patternCount);
+  }
+
+  int rc = files == 1 ? show(argv[2], &options) : diff(argv[2], argv[3], &options);
+  delete options.matcher;
+  return rc;
+}
@@ -0,0 +1,144 @@
+/*
+ * perf.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "base.h"
+#include "perf.h"
+
+
+static const char *phaseNames[PERF_PHASE_COUNT] = {
+  "suspend threads",
+  "resume threads",
+  "count instances",
+  "capture graph",
+  "reachable sizes",
+  "dominators",
+  "retained sizes",
+  "mark reachable",
+  "find referrers",
+  "root paths",
+  "sort",
+  "format",
+  "thread dump",
+  "heap summary",
+  "hprof dump",
+  "oom dump",
+};
+
+
+typedef struct {
+  volatile jlong total;
+  volatile jlong longest;
+  volatile jlong buckets[PERF_BUCKETS];
+} PhaseStats;
+
+
+/* Updated with atomic adds, so phases that run on several threads at once are all counted.  A
+ * reader may see a run in one field before another, which only matters to the run in flight. */
+static PhaseStats phases[PERF_PHASE_COUNT];
+
+
+PerfTimer::PerfTimer(PerfPhase _phase) : phase(_phase), start(monotonicMicros()) {
+}
+
+
+PerfTimer::~PerfTimer() {
+  recordPhase(this->phase, monotonicMicros() - this->start);
+}
+
+
+/* Returns the bucket of a duration: the number of bits needed to hold it. */
+static int bucketOf(jlong micros) {
+  int bucket = 0;
+  while (micros > 0 && bucket < PERF_BUCKETS - 1) {
+    micros >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+
+void recordPhase(PerfPhase phase, jlong micros) {
+  PhaseStats *stats = &phases[phase];
+  __sync_fetch_and_add(&stats->total, micros);
+  __sync_fetch_and_add(&stats->buckets[bucketOf(micros)], 1);
+
+  jlong longest = stats->longest;
+  while (micros > longest && !__sync_bool_compare_and_swap(&stats->longest, longest, micros)) {
+    longest = stats->longest;
+  }
+}
+
+
+/* Returns the upper bound of the bucket holding the given fraction of the runs, or the longest
+ * run if that is less. */
+static jlong percentile(const jlong *buckets, jlong runs, jlong longest, int percent) {
+  jlong wanted = (runs * percent + 99) / 100;
+  jlong seen = 0;
+  for (int i = 0; i < PERF_BUCKETS - 1; i++) {
+    seen += buckets[i];
+    if (seen >= wanted) {
+      jlong bound = (jlong) 1 << i;
+      return bound < longest ? bound : longest;
+    }
+  }
+  return longest;
+}
+
+
+void printPerf(Output *out) {
+  out->printf("Objects visited: %ld.  Bytes written: %ld.\n", (long) gdata->objectsVisited, (long) gdata->bytesWritten);
+  out->printf("Times are in microseconds.  Percentiles are bucket bounds, so within a factor of two.\n\n");
+
+  static const char *const columns[] = { "runs", "totalMicros", "meanMicros", "p50Micros", "p99Micros", "maxMicros", "phase" };
+  out->setColumnNames(columns);
+  out->printf("Runs       Total      Mean       P50        P99        Max        Phase\n");
+  out->printf("---------- ---------- ---------- ---------- ---------- ---------- ----------------------\n");
+  for (int p = 0; p < PERF_PHASE_COUNT; p++) {
+    /* Work from a copy, so the columns of a row agree with each other. */
+    jlong buckets[PERF_BUCKETS];
+    jlong runs = 0;
+    for (int i = 0; i < PERF_BUCKETS; i++) {
+      buckets[i] = phases[p].buckets[i];
+      runs += buckets[i];
+    }
+    if (runs == 0) {
+      continue;
+    }
+    jlong total = phases[p].total;
+    jlong longest = phases[p].longest;
+
+    long values[] = {
+      (long) runs,
+      (long) total,
+      (long) (total / runs),
+      (long) percentile(buckets, runs, longest, 50),
+      (long) percentile(buckets, runs, longest, 99),
+      (long) longest,
+    };
+    out->printColumns(values, 6, 10, phaseNames[p]);
+  }
+  out->printf("---------- ---------- ---------- ---------- ---------- ---------- ----------------------\n\n");
+  out->flush();
+}
+
+
+void resetPerf() {
+  memset((void *) phases, 0, sizeof(phases));
+}
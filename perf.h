@@ -0,0 +1,78 @@
+/*
+ * perf.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_PERF_H
+#define POLARBEAR_PERF_H
+
+
+#include "jni.h"
+
+#include "io.h"
+
+
+/* Phases of the agent's own work that are timed. */
+typedef enum {
+  PERF_SUSPEND_THREADS,
+  PERF_RESUME_THREADS,
+  PERF_COUNT_INSTANCES,
+  PERF_CAPTURE_GRAPH,
+  PERF_REACHABLE_SIZES,
+  PERF_DOMINATORS,
+  PERF_RETAINED_SIZES,
+  PERF_MARK_REACHABLE,
+  PERF_FIND_REFERRERS,
+  PERF_ROOT_PATHS,
+  PERF_SORT,
+  PERF_FORMAT,
+  PERF_THREAD_DUMP,
+  PERF_HEAP_SUMMARY,
+  PERF_HPROF_DUMP,
+  PERF_OOM_DUMP,
+  PERF_PHASE_COUNT
+} PerfPhase;
+
+
+/* Latency buckets.  Bucket i counts durations of at least 2^(i-1) and below 2^i microseconds,
+ * and the last bucket everything longer. */
+#define PERF_BUCKETS 32
+
+
+/* Times a phase from construction to destruction on the monotonic clock.  Phases may nest, and
+ * each is recorded on its own, so a phase's time includes the phases inside it. */
+class PerfTimer {
+  private:
+    PerfPhase phase;
+    jlong start;
+
+  public:
+    PerfTimer(PerfPhase _phase);
+    ~PerfTimer();
+};
+
+
+/* Records one run of a phase.  Safe to call from any thread. */
+void recordPhase(PerfPhase phase, jlong micros);
+
+/* Prints the latency of each phase that has run, and the objects visited and bytes written. */
+void printPerf(Output *out);
+
+/* Forgets the latencies recorded so far.  The object and byte counters keep counting. */
+void resetPerf();
+
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * progress.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "base.h"
+#include "progress.h"
+
+
+static struct {
+  volatile bool active;
+  volatile bool cancelled;
+  volatile bool *stop;
+  Output *out;
+  const char *phase;
+  jlong visited;
+  jlong start;
+  jlong lastReport;
+} walk;
+
+
+/* True once the walk in the scope has been asked to stop. */
+static inline bool stopRequested() {
+  return walk.cancelled || (walk.stop != NULL && *walk.stop);
+}
+
+
+HeapWalkScope::HeapWalkScope(Output *out, volatile bool *stop) {
+  walk.out = out;
+  walk.stop = stop;
+  walk.phase = "starting";
+  walk.visited = 0;
+  walk.start = walk.lastReport = monotonicMillis();
+  walk.cancelled = false;
+  __sync_synchronize();
+  walk.active = true;
+}
+
+
+HeapWalkScope::~HeapWalkScope() {
+  walk.active = false;
+  if (stopRequested()) {
+    if (walk.stop != NULL) {
+      *walk.stop = true;
+    }
+    jlong elapsed = monotonicMillis() - walk.start;
+    walk.out->printf("Cancelled during %s after %ld objects, %ld.%03lds.\n",
+        walk.phase, (long) walk.visited, (long) (elapsed / 1000), (long) (elapsed % 1000));
+    walk.out->flush();
+  }
+  walk.out = NULL;
+  walk.stop = NULL;
+  walk.cancelled = false;
+}
+
+
+void setHeapWalkPhase(const char *phase) {
+  walk.phase = phase;
+}
+
+
+bool heapWalkStep() {
+  /* Heap walks hold the agent monitor, so the count needs no atomic add. */
+  gdata->objectsVisited++;
+  if (!walk.active) {
+    return false;
+  }
+  if ((++walk.visited & (PROGRESS_CHECK_INTERVAL - 1)) == 0) {
+    jlong now = monotonicMillis();
+    if (now - walk.lastReport >= PROGRESS_REPORT_SECONDS * 1000 && !stopRequested()) {
+      jlong elapsed = now - walk.start;
+      walk.out->printf("... %s: %ld objects visited, %ld.%03lds\n",
+          walk.phase, (long) walk.visited, (long) (elapsed / 1000), (long) (elapsed % 1000));
+      walk.out->flush();
+      walk.lastReport = now;
+    }
+  }
+  return stopRequested();
+}
+
+
+bool heapWalkCancelled() {
+  return walk.active && stopRequested();
+}
+
+
+bool cancelHeapWalk() {
+  if (!walk.active) {
+    return false;
+  }
+  walk.cancelled = true;
+  return true;
+}
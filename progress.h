@@ -0,0 +1,61 @@
+/*
+ * progress.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_PROGRESS_H
+#define POLARBEAR_PROGRESS_H
+
+
+#include "jni.h"
+
+#include "io.h"
+
+
+/* Objects visited between looks at the clock. */
+#define PROGRESS_CHECK_INTERVAL 65536
+
+/* Seconds between progress lines. */
+#define PROGRESS_REPORT_SECONDS 2
+
+
+/* Makes the heap walks of a shell command cancellable, and reports their progress to out every
+ * PROGRESS_REPORT_SECONDS.  The walks stop when cancelHeapWalk is called or *stop becomes true.
+ * Heap walks are serialized by the agent monitor, so there is at most one scope at a time; walks
+ * outside a scope, like the out of memory dump and trend samples, are never cancelled.  If the
+ * command was cancelled, prints a note on exit and sets *stop, so the caller can tell. */
+class HeapWalkScope {
+  public:
+    HeapWalkScope(Output *out, volatile bool *stop);
+    ~HeapWalkScope();
+};
+
+
+/* Names the phase of the walk in progress lines.  The name must outlive the walk. */
+void setHeapWalkPhase(const char *phase);
+
+/* Called by heap callbacks for every object visited.  Returns true if the walk has been cancelled,
+ * in which case the callback should abort. */
+bool heapWalkStep();
+
+/* Returns true if the walk in progress has been cancelled.  Its results are incomplete. */
+bool heapWalkCancelled();
+
+/* Cancels the walk in progress, from any thread.  Returns false if there is none to cancel. */
+bool cancelHeapWalk();
+
+
+#endif
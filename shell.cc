@@ -18,234 +18,960 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
-
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "agentthread.h"
+#include "allocations.h"
+#include "arena.h"
 #include "base.h"
+#include "gchistory.h"
+#include "hprof.h"
 #include "io.h"
+#include "json.h"
 #include "memory.h"
+#include "perf.h"
+#include "progress.h"
 #include "shell.h"
+#include "snapshot.h"
+#include "summary.h"
 #include "threads.h"
+#include "trend.h"
 
 
-static void interact(jvmtiEnv* jvmti, JNIEnv* jni, int socket);
+#define SHELL_PORT 8787
+#define SHELL_BACKLOG 16
+#define MAX_SESSIONS 64
+#define MAX_LINE 1000
 
+/* How long a send may wait for a client that does not read.  The client is dropped after that, so
+ * it cannot hold up the event loop or a worker. */
+#define SEND_TIMEOUT_SECONDS 5
+
+/* Workers for commands that do not walk the heap.  Heap commands share one more worker, since the
+ * agent lock lets only one of them run at a time anyway. */
+#define QUICK_WORKERS 2
+#define QUICK_ARENA_CHUNK_SIZE (256 * 1024)
+#define QUICK_ARENA_RETAIN_SIZE (1024 * 1024)
+
+#define MAX_EVENTS 64
+
+
+/* A client connection.  While one of its commands is queued or running the session is busy, and
+ * further lines wait their turn in the input buffer, except for "cancel". */
+typedef struct ShellSession {
+  int socket;
+  SocketOutput *out;
+  char input[MAX_LINE];
+  int used;
+  char line[MAX_LINE];
+  bool busy;
+  bool watched;
+  /* The client hung up while the session was busy. */
+  bool closed;
+  /* Set when the client cancels the command in progress or hangs up.  Stops its heap walk. */
+  volatile bool cancelled;
+  /* A JSON cancel took effect while the session was busy, and is still to be answered. */
+  bool cancelPending;
+  /* The last thing sent was a prompt. */
+  bool prompted;
+  /* Closed by the event loop, and freed once the rest of the ready events are handled. */
+  bool dead;
+  /* The id of the JSON request in line, or empty for a plain command. */
+  char requestId[JSON_MAX_ID];
+  struct ShellSession *next;
+} ShellSession;
+
+
+typedef struct {
+  ShellSession *head;
+  ShellSession *tail;
+} SessionQueue;
+
+
+typedef struct {
+  SessionQueue *queue;
+  Arena *arena;
+} ShellWorker;
+
+
+/* The queues are shared by the event loop and the workers under the queue lock.  Everything else
+ * belongs to the event loop thread. */
+static struct {
+  jrawMonitorID lock;
+  SessionQueue heapQueue;
+  SessionQueue quickQueue;
+  SessionQueue doneQueue;
+  volatile bool stopping;
+
+  int wake[2];
+  int poller;
+  ShellSession *sessions[MAX_SESSIONS];
+  ShellSession *deadSessions;
+  ShellWorker workers[1 + QUICK_WORKERS];
+} shell;
+
+
+/* Commands that walk the heap, or wait for the agent lock that heap walks hold. */
+static const char *heapCommands[] = {
+  "histogram", "count", "stats", "referrers", "path", "snapshot", "summary", "hprof", "trend", "gc", NULL
+};
+
+
+static void push(SessionQueue *queue, ShellSession *session) {
+  session->next = NULL;
+  if (queue->tail != NULL) {
+    queue->tail->next = session;
+  } else {
+    queue->head = session;
+  }
+  queue->tail = session;
+}
 
-// Starts the shell server.
-void JNICALL shellServer(jvmtiEnv* jvmti, JNIEnv* jni, void *pData) {
-  struct sockaddr_in serverInfo;
 
-  // TCP stream oriented socket.
-  gdata->activeShellSocket = -1;
-  gdata->shellSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+static ShellSession *pop(SessionQueue *queue) {
+  ShellSession *session = queue->head;
+  if (session != NULL) {
+    queue->head = session->next;
+    if (queue->head == NULL) {
+      queue->tail = NULL;
+    }
+  }
+  return session;
+}
 
-  if (gdata->shellSocket == -1) {
-    fprintf(stderr, "Could not create a socket for listening");
-    return;
+
+/* Wakes the event loop. */
+static void wakeEventLoop() {
+  char c = 0;
+  ssize_t ignored = write(shell.wake[1], &c, 1);
+  (void) ignored;
+}
+
+
+#ifdef __linux__
+
+static void watch(int fd, void *key) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = key;
+  epoll_ctl(shell.poller, EPOLL_CTL_ADD, fd, &event);
+}
+
+
+static void unwatch(int fd) {
+  struct epoll_event event;
+  epoll_ctl(shell.poller, EPOLL_CTL_DEL, fd, &event);
+}
+
+
+/* Waits until at least one watched descriptor is readable, and returns their keys. */
+static int waitForEvents(void **ready) {
+  struct epoll_event events[MAX_EVENTS];
+  int count = epoll_wait(shell.poller, events, MAX_EVENTS, -1);
+  for (int i = 0; i < count; i++) {
+    ready[i] = events[i].data.ptr;
   }
+  return count;
+}
 
-  int optval = 1;
-  setsockopt(gdata->shellSocket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+#else
 
-  serverInfo.sin_family = AF_INET;
-  serverInfo.sin_addr.s_addr = INADDR_ANY;
-  serverInfo.sin_port = htons((short) 8787);
+/* Without epoll the poll set is rebuilt from the listening socket, the wake pipe and the watched
+ * sessions on every pass. */
+static void watch(int fd, void *key) {
+}
 
-  // Bind the socket to our local server address
-  int nret = bind(gdata->shellSocket, (struct sockaddr *)&serverInfo, sizeof(serverInfo));
 
-  if (nret == -1) {
-    fprintf(stderr, "Could not bind the control socket on port 8787.");
-    return;
+static void unwatch(int fd) {
+}
+
+
+static int waitForEvents(void **ready) {
+  struct pollfd fds[2 + MAX_SESSIONS];
+  void *keys[2 + MAX_SESSIONS];
+  int count = 0;
+
+  fds[count].fd = gdata->shellSocket;
+  keys[count++] = &gdata->shellSocket;
+  fds[count].fd = shell.wake[0];
+  keys[count++] = &shell.wake;
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (shell.sessions[i] != NULL && shell.sessions[i]->watched) {
+      fds[count].fd = shell.sessions[i]->socket;
+      keys[count++] = shell.sessions[i];
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
   }
 
-  // Make the socket listen
-  nret = listen(gdata->shellSocket, 1);
-  if (nret == -1) {
-    fprintf(stderr, "Error listening on socket on port 8787.");
-    return;
+  int result = poll(fds, count, -1);
+  int readyCount = 0;
+  for (int i = 0; i < count && result > 0 && readyCount < MAX_EVENTS; i++) {
+    if (fds[i].revents) {
+      ready[readyCount++] = keys[i];
+    }
   }
+  return result < 0 ? result : readyCount;
+}
 
-  int sockd = 0;
-  while ((sockd = accept(gdata->shellSocket, NULL, NULL)) != -1) {
-    interact(jvmti, jni, sockd);
+#endif
+
+
+/* Starts or stops reading from a session. */
+static void watchSession(ShellSession *session, bool watched) {
+  if (session->watched != watched) {
+    if (watched) {
+      watch(session->socket, session);
+    } else {
+      unwatch(session->socket);
+    }
+    session->watched = watched;
   }
+}
 
-  enterAgentMonitor(jvmti); {
-    closeShellServer();
-  } exitAgentMonitor(jvmti);
+
+/* Parses the arguments of "threads [grouped] [depth]", in place. */
+static bool parseThreadsArguments(char *args, bool *grouped, jint *depth) {
+  char *saveptr;
+
+  *grouped = false;
+  *depth = THREAD_DUMP_DEPTH;
+  for (char *arg = strtok_r(args, " ", &saveptr); arg != NULL; arg = strtok_r(NULL, " ", &saveptr)) {
+    if (strcmp(arg, "grouped") == 0) {
+      *grouped = true;
+    } else if (atoi(arg) > 0) {
+      *depth = atoi(arg);
+    } else {
+      return false;
+    }
+  }
+  return true;
 }
 
 
-void closeShellSession() {
-  if (gdata->activeShellSocket != -1) {
-    if (close(gdata->activeShellSocket) == -1) {
-    fprintf(stderr, "Error closing active session.");
+/* Parses the arguments of "alloc [rate] [count]", in place. */
+static bool parseAllocArguments(char *args, bool *byRate, int *limit) {
+  char *saveptr;
+
+  *byRate = false;
+  *limit = 20;
+  for (char *arg = strtok_r(args, " ", &saveptr); arg != NULL; arg = strtok_r(NULL, " ", &saveptr)) {
+    if (strcmp(arg, "rate") == 0) {
+      *byRate = true;
+    } else if (atoi(arg) > 0) {
+      *limit = atoi(arg);
+    } else {
+      return false;
     }
-    gdata->activeShellSocket = -1;
   }
+  return true;
 }
 
 
-void closeShellServer() {
-  closeShellSession();
-  if (gdata->shellSocket != -1) {
-    if (close(gdata->shellSocket) == -1) {
-    fprintf(stderr, "Error closing socket.");
+/* Parses the arguments of "<cls-signature> [n]", in place, leaving *value alone if n is not given.
+ * Returns false unless n is between 1 and max. */
+static bool parseSignatureArguments(char *args, jint max, jint *value) {
+  char *space = strchr(args, ' ');
+  if (space != NULL) {
+    *space = '\0';
+    *value = atoi(space + 1);
+    return *value > 0 && *value <= max;
+  }
+  return true;
+}
+
+
+/* Returns true if the command has to wait for the agent lock. */
+static bool isHeapCommand(const char *line) {
+  size_t length = strcspn(line, " ");
+  for (int i = 0; heapCommands[i] != NULL; i++) {
+    if (strlen(heapCommands[i]) == length && strncmp(heapCommands[i], line, length) == 0) {
+      return true;
     }
-    gdata->shellSocket = -1;
   }
+  return false;
 }
 
 
+/* Runs a command line on a worker thread.  Heap walks stop once *cancelled is set.  Returns false
+ * if the command could not be run. */
+static bool runCommand(jvmtiEnv* jvmti, JNIEnv* jni, Arena *arena, Output &out, char *buffer, volatile bool *cancelled) {
+  if (strcmp("help", buffer) == 0) {
+    out.printf("Try any of the following:\n\n");
+    out.printf("threads [grouped] [depth]\n");
+    out.printf("histogram\n");
+    out.printf("trend [count]\n");
+    out.printf("alloc [rate] [count]\n");
+    out.printf("gclog [count]\n");
+    out.printf("gc\n");
+    out.printf("stats <cls-signature>\n");
+    out.printf("count <cls-signature>\n");
+    out.printf("referrers <cls-signature> [depth]\n");
+    out.printf("path <cls-signature> [count]\n");
+    out.printf("snapshot [fields|drop]\n");
+    out.printf("snapshot histogram\n");
+    out.printf("snapshot stats <cls-signature>\n");
+    out.printf("snapshot referrers <cls-signature> [depth]\n");
+    out.printf("snapshot path <cls-signature> [count]\n");
+    out.printf("summary <file>\n");
+    out.printf("hprof <file>[.gz]\n");
+    out.printf("arena\n");
+    out.printf("perf [reset]\n");
+    out.printf("cancel\n");
+    out.printf("quit\n");
+
+  } else if (strcmp("threads", buffer) == 0 || strncmp("threads ", buffer, 8) == 0) {
+    bool grouped;
+    jint depth;
+    if (!parseThreadsArguments(buffer + 7, &grouped, &depth)) {
+      out.printf("Usage: threads [grouped] [depth]\n");
+      return false;
+    }
 
-#define MAX_LINE 1000
+    ArenaScope scope(arena);
 
+    printThreadDump(jvmti, jni, &out, (jthread) 0, grouped, depth);
 
-ssize_t readline(int sockd, char *vptr, int maxlen) {
-  int rc;
-  char c, *buffer;
+  } else if (strcmp("histogram", buffer) == 0) {
+    enterAgentMonitor(jvmti); {
+      ArenaScope scope(arena);
+      HeapWalkScope walk(&out, cancelled);
 
-  buffer = vptr;
+      printHistogram(jvmti, jni, &out, false);
 
-  int n;
-  for (n = 1; n < maxlen; n++) {
-    if ((rc = read(sockd, &c, 1)) == 1) {
-      if (c == '\r') {
-        n -= 1;
-        continue;
-      }
-      if (c == '\n') {
-        break;
-      }
-      *buffer++ = c;
+    } exitAgentMonitor(jvmti);
 
-    } else if (rc == 0) {
-      if (n == 1) {
-        return 0;
-      } else {
-        break;
+  } else if (strcmp("trend", buffer) == 0 || strncmp("trend ", buffer, 6) == 0) {
+    int limit = buffer[5] ? atoi(buffer + 6) : 20;
+    if (limit <= 0) {
+      out.printf("Usage: trend [count]\n");
+      return false;
+    }
+
+    enterAgentMonitor(jvmti); {
+      ArenaScope scope(arena);
+
+      printTrend(&out, limit);
+
+    } exitAgentMonitor(jvmti);
+
+  } else if (strcmp("alloc", buffer) == 0 || strncmp("alloc ", buffer, 6) == 0) {
+    bool byRate;
+    int limit;
+    if (!parseAllocArguments(buffer + 5, &byRate, &limit)) {
+      out.printf("Usage: alloc [rate] [count]\n");
+      return false;
+    }
+
+    ArenaScope scope(arena);
+
+    printAllocationSites(jvmti, jni, &out, limit, byRate);
+
+  } else if (strcmp("gclog", buffer) == 0 || strncmp("gclog ", buffer, 6) == 0) {
+    int limit = buffer[5] ? atoi(buffer + 6) : GC_HISTORY_SIZE;
+    if (limit <= 0) {
+      out.printf("Usage: gclog [count]\n");
+      return false;
+    }
+
+    printGcHistory(&out, limit);
+
+  } else if (strncmp("count ", buffer, 6) == 0) {
+    enterAgentMonitor(jvmti); {
+      ArenaScope scope(arena);
+      ThreadSuspension threads(jvmti, jni);
+      HeapWalkScope walk(&out, cancelled);
+
+      out.printf("Computing count of '%s'\n\n", buffer + 6);
+      printClassStats(jvmti, jni, buffer + 6, &out, false);
+
+    } exitAgentMonitor(jvmti);
+
+  } else if (strncmp("stats ", buffer, 6) == 0) {
+    enterAgentMonitor(jvmti); {
+      ArenaScope scope(arena);
+      ThreadSuspension threads(jvmti, jni);
+      HeapWalkScope walk(&out, cancelled);
+
+      out.printf("Computing stats for '%s'\n\n", buffer + 6);
+      printClassStats(jvmti, jni, buffer + 6, &out, true);
+
+    } exitAgentMonitor(jvmti);
+
+  } else if (strncmp("referrers ", buffer, 10) == 0) {
+    jint depth = REFER_DEPTH;
+    if (!parseSignatureArguments(buffer + 10, MAX_REFER_DEPTH, &depth)) {
+      out.printf("Usage: referrers <cls-signature> [depth], with a depth up to %d\n", MAX_REFER_DEPTH);
+      return false;
+    }
+
+    enterAgentMonitor(jvmti); {
+      ArenaScope scope(arena);
+      ThreadSuspension threads(jvmti, jni);
+      HeapWalkScope walk(&out, cancelled);
+
+      out.printf("Computing stats for '%s'\n\n", buffer + 10);
+      printReferrers(jvmti, jni, buffer + 10, depth, &out);
+
+    } exitAgentMonitor(jvmti);
+
+  } else if (strncmp("path ", buffer, 5) == 0) {
+    jint count = PATH_COUNT;
+    if (!parseSignatureArguments(buffer + 5, MAX_PATH_COUNT, &count)) {
+      out.printf("Usage: path <cls-signature> [count], with a count up to %d\n", MAX_PATH_COUNT);
+      return false;
+    }
+
+    enterAgentMonitor(jvmti); {
+      ArenaScope scope(arena);
+      ThreadSuspension threads(jvmti, jni);
+      HeapWalkScope walk(&out, cancelled);
+
+      out.printf("Finding paths to '%s'\n\n", buffer + 5);
+      printRootPaths(jvmti, jni, buffer + 5, count, &out);
+
+    } exitAgentMonitor(jvmti);
+
+  } else if (strcmp("snapshot", buffer) == 0 || strcmp("snapshot fields", buffer) == 0) {
+    enterAgentMonitor(jvmti); {
+      ArenaScope scope(arena);
+      ThreadSuspension threads(jvmti, jni);
+      HeapWalkScope walk(&out, cancelled);
+
+      out.printf("Taking a snapshot of the heap\n\n");
+      takeSnapshot(jvmti, jni, &threads, buffer[8] != '\0', &out);
+
+    } exitAgentMonitor(jvmti);
+
+  } else if (strcmp("snapshot drop", buffer) == 0) {
+    dropSnapshot(&out);
+
+  /* Snapshot queries walk no heap, so they neither take the agent lock nor suspend threads. */
+  } else if (strcmp("snapshot histogram", buffer) == 0) {
+    ArenaScope scope(arena);
+
+    printSnapshotHistogram(&out);
+
+  } else if (strncmp("snapshot stats ", buffer, 15) == 0) {
+    ArenaScope scope(arena);
+
+    printSnapshotStats(jvmti, jni, buffer + 15, &out);
+
+  } else if (strncmp("snapshot referrers ", buffer, 19) == 0) {
+    jint depth = REFER_DEPTH;
+    if (!parseSignatureArguments(buffer + 19, MAX_REFER_DEPTH, &depth)) {
+      out.printf("Usage: snapshot referrers <cls-signature> [depth], with a depth up to %d\n", MAX_REFER_DEPTH);
+      return false;
+    }
+    ArenaScope scope(arena);
+
+    printSnapshotReferrers(jvmti, jni, buffer + 19, depth, &out);
+
+  } else if (strncmp("snapshot path ", buffer, 14) == 0) {
+    jint count = PATH_COUNT;
+    if (!parseSignatureArguments(buffer + 14, MAX_PATH_COUNT, &count)) {
+      out.printf("Usage: snapshot path <cls-signature> [count], with a count up to %d\n", MAX_PATH_COUNT);
+      return false;
+    }
+    ArenaScope scope(arena);
+
+    printSnapshotPaths(jvmti, jni, buffer + 14, count, &out);
+
+  } else if (strncmp("summary ", buffer, 8) == 0) {
+    int fd = open(buffer + 8, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      out.printf("Could not open '%s': %s\n", buffer + 8, strerror(errno));
+      return false;
+    }
+
+    enterAgentMonitor(jvmti); {
+      ArenaScope scope(arena);
+      ThreadSuspension threads(jvmti, jni);
+      HeapWalkScope walk(&out, cancelled);
+
+      out.printf("Writing a heap summary to '%s'\n\n", buffer + 8);
+      if (writeHeapSummary(jvmti, jni, fd, (jthread) 0, THREAD_DUMP_DEPTH)) {
+        out.printf("Done.  Read it with: pbdecode show %s\n", buffer + 8);
+      } else if (!heapWalkCancelled()) {
+        out.printf("Could not write the heap summary.\n");
       }
 
-    } else {
-      if (errno == EINTR) {
-        continue;
+    } exitAgentMonitor(jvmti);
+    close(fd);
+
+  } else if (strncmp("hprof ", buffer, 6) == 0) {
+    const char *path = buffer + 6;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      out.printf("Could not open '%s': %s\n", path, strerror(errno));
+      return false;
+    }
+
+    enterAgentMonitor(jvmti); {
+      ArenaScope scope(arena);
+      ThreadSuspension threads(jvmti, jni);
+      HeapWalkScope walk(&out, cancelled);
+
+      out.printf("Writing a heap dump to '%s'\n\n", path);
+      out.flush();
+      HprofStats stats;
+      if (writeHprofDump(jvmti, jni, fd, isGzipPath(path), &stats)) {
+        out.printf("Wrote %ld objects of %ld classes: %ld bytes, %ld on disk.\n",
+            (long) stats.objects, (long) stats.classes, (long) stats.bytes, (long) stats.compressedBytes);
+      } else if (!heapWalkCancelled()) {
+        out.printf("Could not write the heap dump.\n");
       }
-      return -1;
+
+    } exitAgentMonitor(jvmti);
+    close(fd);
+
+  } else if (strcmp("arena", buffer) == 0) {
+    for (int i = 0; i < 1 + QUICK_WORKERS; i++) {
+      printArenaStats(shell.workers[i].arena, &out);
     }
+    printArenaStats(gdata->emergencyArena, &out);
+
+  } else if (strcmp("perf", buffer) == 0) {
+    printPerf(&out);
+
+  } else if (strcmp("perf reset", buffer) == 0) {
+    resetPerf();
+    out.printf("Phase times cleared.\n");
+
+  } else if (strcmp("gc", buffer) == 0) {
+    enterAgentMonitor(jvmti); {
+      out.printf("Forcing garbage collection.\n");
+      CHECK(jvmti->ForceGarbageCollection());
+    } exitAgentMonitor(jvmti);
+
+  } else {
+    out.printf("Unknown command: '%s'\n", buffer);
+    return false;
   }
+  return true;
+}
 
-  *buffer = 0;
-  return n;
+
+/* Returns the session's output, ready for JSON records.  The first record after a prompt starts on
+ * a new line, so every record line starts with '{'. */
+static Output *startJson(ShellSession *session) {
+  if (session->prompted) {
+    session->out->write("\n", 1);
+    session->prompted = false;
+  }
+  return session->out;
 }
 
 
-ssize_t writestring(int sockd, const char *vptr, size_t n) {
-  int nwritten;
-  const char *buffer = vptr;
-  int nleft = n;
+/* Worker thread: runs the commands of one queue, one at a time. */
+static void JNICALL shellWorker(jvmtiEnv* jvmti, JNIEnv* jni, void *pData) {
+  ShellWorker *worker = (ShellWorker *) pData;
 
-  while (nleft > 0) {
-    if ((nwritten = write(sockd, buffer, nleft)) <= 0) {
-      if (errno == EINTR) {
-        nwritten = 0;
+  while (1) {
+    ShellSession *session;
+    CHECK(jvmti->RawMonitorEnter(shell.lock));
+    while ((session = pop(worker->queue)) == NULL && !shell.stopping) {
+      CHECK(jvmti->RawMonitorWait(shell.lock, 0));
+    }
+    CHECK(jvmti->RawMonitorExit(shell.lock));
+    if (session == NULL) {
+      return;
+    }
+
+    jlong start = monotonicMillis();
+    if (session->requestId[0]) {
+      JsonOutput json(startJson(session), session->requestId);
+      bool ok = !session->cancelled &&
+          runCommand(jvmti, jni, worker->arena, json, session->line, &session->cancelled);
+      json.end(session->cancelled ? "cancelled" : ok ? "ok" : "error", NULL, monotonicMillis() - start);
+    } else {
+      if (session->cancelled) {
+        session->out->printf("Cancelled.\n");
       } else {
-        return -1;
+        runCommand(jvmti, jni, worker->arena, *session->out, session->line, &session->cancelled);
       }
+      session->out->printf("> ");
+      session->prompted = true;
+    }
+    session->out->flush();
+    if (worker->queue == &shell.heapQueue && !session->cancelled) {
+      gdata->lastHeapCommandMillis = monotonicMillis() - start;
     }
-    nleft  -= nwritten;
-    buffer += nwritten;
+
+    CHECK(jvmti->RawMonitorEnter(shell.lock));
+    push(&shell.doneQueue, session);
+    CHECK(jvmti->RawMonitorExit(shell.lock));
+    wakeEventLoop();
   }
+}
 
-  return n;
+
+/* Closes a session that no worker holds.  Events for it may still be among the ready ones, so it
+ * is only marked dead here, and freed by freeDeadSessions. */
+static void closeSession(ShellSession *session) {
+  watchSession(session, false);
+  delete session->out;
+  session->out = NULL;
+  if (close(session->socket) == -1) {
+    fprintf(stderr, "Error closing active session.");
+  }
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (shell.sessions[i] == session) {
+      shell.sessions[i] = NULL;
+    }
+  }
+  session->dead = true;
+  session->next = shell.deadSessions;
+  shell.deadSessions = session;
 }
 
 
-static void interact(jvmtiEnv* jvmti, JNIEnv* jni, int socket) {
-  char buffer[1000];
-  SocketOutput out(socket);
-  out.printf("Type 'help' to see a list of commands.\n");
+static void freeDeadSessions() {
+  while (shell.deadSessions != NULL) {
+    ShellSession *session = shell.deadSessions;
+    shell.deadSessions = session->next;
+    free(session);
+  }
+}
 
-  gdata->activeShellSocket = socket;
 
-  while (1) {
-    out.printf("> ");
+/* Finds the end of the first buffered line.  Sets length to the length of the line and consumed to
+ * the bytes to drop with it, or returns false if there is no complete line yet. */
+static bool findLine(ShellSession *session, int *length, int *consumed) {
+  char *newline = (char *) memchr(session->input, '\n', session->used);
+  if (newline != NULL) {
+    *length = newline - session->input;
+    *consumed = *length + 1;
+  } else if (session->used == MAX_LINE - 1) {
+    /* Overlong lines are cut, and the rest read as the next line. */
+    *length = *consumed = session->used;
+  } else {
+    return false;
+  }
+  return true;
+}
 
-    int length = readline(socket, buffer, MAX_LINE - 1);
-    if (length < 0) {
-      break;
+
+static void dropInput(ShellSession *session, int consumed) {
+  memmove(session->input, session->input + consumed, session->used - consumed);
+  session->used -= consumed;
+}
+
+
+/* Copies the first length bytes of input to line, without carriage returns. */
+static void copyLine(ShellSession *session, int length, char *line) {
+  int j = 0;
+  for (int i = 0; i < length; i++) {
+    if (session->input[i] != '\r') {
+      line[j++] = session->input[i];
     }
-    if (strcmp("quit", buffer) == 0) {
-      out.printf("Goodbye\n");
-      break;
+  }
+  line[j] = 0;
+}
+
+
+/* Answers a command that the event loop runs itself. */
+static void reply(ShellSession *session, const char *text, bool prompt) {
+  if (session->requestId[0]) {
+    JsonOutput json(startJson(session), session->requestId);
+    json.printf("%s", text);
+    json.end("ok", NULL, 0);
+  } else {
+    session->out->printf("%s", text);
+    if (prompt) {
+      session->out->printf("> ");
+      session->prompted = true;
     }
-    if (strcmp("help", buffer) == 0) {
-      out.printf("Try any of the following:\n\n");
-      out.printf("threads");
-      out.printf("histogram");
-      out.printf("gc");
-      out.printf("stats <cls-signature>");
-      out.printf("count <cls-signature>");
-      out.printf("referrers <cls-signature>");
+    session->out->flush();
+  }
+}
 
-    } else if (strcmp("threads", buffer) == 0) {
-      enterAgentMonitor(jvmti); {
 
-        printThreadDump(jvmti, jni, &out, (jthread) 0);
+/* Runs the buffered lines of a session until one has to go to a worker.  While the session is busy
+ * with a heap command, a cancel on the next line stops it. */
+static void processInput(jvmtiEnv* jvmti, ShellSession *session) {
+  char line[MAX_LINE];
+  int length, consumed;
+  while (!session->closed && !session->out->hasFailed() && findLine(session, &length, &consumed)) {
+    copyLine(session, length, line);
 
-      } exitAgentMonitor(jvmti);
+    if (session->busy) {
+      /* Other lines, and a cancel behind a quick command, wait for the command to finish. */
+      JsonRequest request;
+      if (!isHeapCommand(session->line)) {
+        break;
+      }
+      if (strcmp("cancel", line) == 0) {
+        session->cancelled = true;
+        dropInput(session, consumed);
+        continue;
+      }
+      if (line[0] == '{' && parseJsonRequest(line, &request) == NULL && strcmp("cancel", request.command) == 0) {
+        /* Stays buffered, so it is answered once the session is free. */
+        session->cancelled = true;
+        session->cancelPending = true;
+      }
+      break;
+    }
+    dropInput(session, consumed);
+
+    session->requestId[0] = 0;
+    if (line[0] == '{') {
+      JsonRequest request;
+      const char *error = parseJsonRequest(line, &request);
+      if (error != NULL) {
+        JsonOutput json(startJson(session), request.id);
+        json.end("error", error, 0);
+        continue;
+      }
+      strcpy(session->requestId, request.id);
+      strcpy(session->line, request.command);
+    } else {
+      strcpy(session->line, line);
+    }
 
-    } else if (strcmp("histogram", buffer) == 0) {
-      enterAgentMonitor(jvmti); {
+    if (strcmp("quit", session->line) == 0) {
+      reply(session, "Goodbye\n", false);
+      closeSession(session);
+      return;
+    }
 
-        printHistogram(jvmti, &out, false);
+    if (strcmp("cancel", session->line) == 0) {
+      /* Stops whichever heap command is running, from any session. */
+      if (session->cancelPending) {
+        session->cancelPending = false;
+        reply(session, "Cancelled.\n", true);
+      } else if (cancelHeapWalk()) {
+        reply(session, "Cancelling the heap command in progress.\n", true);
+      } else {
+        reply(session, "No heap command is running.\n", true);
+      }
+      continue;
+    }
 
-      } exitAgentMonitor(jvmti);
+    session->busy = true;
+    session->cancelled = false;
+    CHECK(jvmti->RawMonitorEnter(shell.lock));
+    push(isHeapCommand(session->line) ? &shell.heapQueue : &shell.quickQueue, session);
+    CHECK(jvmti->RawMonitorNotifyAll(shell.lock));
+    CHECK(jvmti->RawMonitorExit(shell.lock));
+  }
 
-    } else if (strncmp("count ", buffer, 6) == 0) {
-      enterAgentMonitor(jvmti); {
-        ThreadSuspension threads(jvmti, jni);
+  /* A client that stopped reading its answers is dropped.  A busy session's output belongs to its
+   * worker, so it is checked once the worker hands it back. */
+  if (!session->busy && session->out->hasFailed()) {
+    closeSession(session);
+    return;
+  }
 
-        out.printf("Computing count of '%s'\n\n", buffer + 6);
-        printClassStats(jvmti, buffer + 6, &out, false);
+  /* Busy sessions are still read, to see cancel and hangups, unless their buffer is full. */
+  watchSession(session, !session->closed && session->used < MAX_LINE - 1);
+}
 
-      } exitAgentMonitor(jvmti);
 
-    } else if (strncmp("stats ", buffer, 6) == 0) {
-      enterAgentMonitor(jvmti); {
-        ThreadSuspension threads(jvmti, jni);
+static void readSession(jvmtiEnv* jvmti, ShellSession *session) {
+  ssize_t n = read(session->socket, session->input + session->used, MAX_LINE - 1 - session->used);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return;
+  }
+  if (n <= 0 && session->busy) {
+    /* The worker still has the session, so stop its command and close it when it comes back. */
+    session->closed = true;
+    session->cancelled = true;
+    watchSession(session, false);
+    return;
+  }
+  if (n <= 0) {
+    closeSession(session);
+    return;
+  }
+  session->used += n;
+  processInput(jvmti, session);
+}
 
-        out.printf("Computing stats for '%s'\n\n", buffer + 6);
-        printClassStats(jvmti, buffer + 6, &out, true);
 
-      } exitAgentMonitor(jvmti);
+static void acceptSession() {
+  int socket = accept(gdata->shellSocket, NULL, NULL);
+  if (socket == -1) {
+    return;
+  }
 
-    } else if (strncmp("referrers ", buffer, 10) == 0) {
-      enterAgentMonitor(jvmti); {
-        ThreadSuspension threads(jvmti, jni);
+  int slot = 0;
+  while (slot < MAX_SESSIONS && shell.sessions[slot] != NULL) {
+    slot++;
+  }
+  ShellSession *session = slot < MAX_SESSIONS ? (ShellSession *) calloc(1, sizeof(ShellSession)) : NULL;
+  if (session == NULL) {
+    const char *message = "Too many sessions.\n";
+    ssize_t ignored = write(socket, message, strlen(message));
+    (void) ignored;
+    close(socket);
+    return;
+  }
 
-        out.printf("Computing stats for '%s'\n\n", buffer + 10);
-        printReferrers(jvmti, buffer + 10, &out);
+  struct timeval timeout = { SEND_TIMEOUT_SECONDS, 0 };
+  setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  session->socket = socket;
+  session->out = new SocketOutput(socket);
+  shell.sessions[slot] = session;
+  session->out->printf("Type 'help' to see a list of commands.\n");
+  session->out->printf("> ");
+  session->out->flush();
+  session->prompted = true;
+  watchSession(session, true);
+}
 
-      } exitAgentMonitor(jvmti);
 
+/* Takes back the sessions whose commands are done, and runs their next buffered line. */
+static void finishCommands(jvmtiEnv* jvmti) {
+  char drain[64];
+  while (read(shell.wake[0], drain, sizeof(drain)) > 0) {
+  }
 
-    } else if (strcmp("gc", buffer) == 0) {
-      enterAgentMonitor(jvmti); {
-        out.printf("Forcing garbage collection.\n");
-        CHECK(jvmti->ForceGarbageCollection());
-      } exitAgentMonitor(jvmti);
+  while (1) {
+    CHECK(jvmti->RawMonitorEnter(shell.lock));
+    ShellSession *session = pop(&shell.doneQueue);
+    CHECK(jvmti->RawMonitorExit(shell.lock));
+    if (session == NULL) {
+      break;
+    }
 
+    session->busy = false;
+    if (session->closed) {
+      closeSession(session);
     } else {
-      out.printf("Unknown command: '%s'\n", buffer);
+      processInput(jvmti, session);
     }
   }
+}
+
+
+// Starts the shell server.
+void JNICALL shellServer(jvmtiEnv* jvmti, JNIEnv* jni, void *pData) {
+  struct sockaddr_in serverInfo;
+
+  // TCP stream oriented socket.
+  gdata->shellSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+  if (gdata->shellSocket == -1) {
+    fprintf(stderr, "Could not create a socket for listening");
+    return;
+  }
+
+  int optval = 1;
+  setsockopt(gdata->shellSocket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+
+  serverInfo.sin_family = AF_INET;
+  serverInfo.sin_addr.s_addr = INADDR_ANY;
+  serverInfo.sin_port = htons((short) SHELL_PORT);
+
+  // Bind the socket to our local server address
+  int nret = bind(gdata->shellSocket, (struct sockaddr *)&serverInfo, sizeof(serverInfo));
+
+  if (nret == -1) {
+    fprintf(stderr, "Could not bind the control socket on port 8787.");
+    return;
+  }
+
+  // Make the socket listen
+  nret = listen(gdata->shellSocket, SHELL_BACKLOG);
+  if (nret == -1) {
+    fprintf(stderr, "Error listening on socket on port 8787.");
+    return;
+  }
+
+  // Workers get commands from the event loop through the queues, and hand sessions back through
+  // the wake pipe.
+  CHECK(jvmti->CreateRawMonitor("shell queue", &shell.lock));
+  if (pipe(shell.wake) == -1) {
+    fprintf(stderr, "Could not create the shell wake pipe.");
+    return;
+  }
+  fcntl(shell.wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(shell.wake[1], F_SETFL, O_NONBLOCK);
+#ifdef __linux__
+  shell.poller = epoll_create(MAX_SESSIONS + 2);
+  if (shell.poller == -1) {
+    fprintf(stderr, "Could not create the shell event loop.");
+    return;
+  }
+#endif
+  watch(gdata->shellSocket, &gdata->shellSocket);
+  watch(shell.wake[0], &shell.wake);
+
+  shell.workers[0].queue = &shell.heapQueue;
+  shell.workers[0].arena = gdata->commandArena;
+  for (int i = 1; i < 1 + QUICK_WORKERS; i++) {
+    shell.workers[i].queue = &shell.quickQueue;
+    shell.workers[i].arena = new Arena("quick command", QUICK_ARENA_CHUNK_SIZE, QUICK_ARENA_RETAIN_SIZE);
+  }
+  for (int i = 0; i < 1 + QUICK_WORKERS; i++) {
+    createAgentThread(jvmti, jni, shellWorker, &shell.workers[i]);
+  }
+
+  void *ready[MAX_EVENTS];
+  while (!shell.stopping) {
+    int count = waitForEvents(ready);
+    if (count < 0 && errno != EINTR) {
+      break;
+    }
+    for (int i = 0; i < count; i++) {
+      if (ready[i] == &gdata->shellSocket) {
+        acceptSession();
+      } else if (ready[i] == &shell.wake) {
+        finishCommands(jvmti);
+      } else if (!((ShellSession *) ready[i])->dead) {
+        readSession(jvmti, (ShellSession *) ready[i]);
+      }
+    }
+    freeDeadSessions();
+  }
+
+  // Sessions with a command in progress are left to their worker, which finds the socket shut.
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    ShellSession *session = shell.sessions[i];
+    if (session != NULL && session->busy) {
+      session->cancelled = true;
+      shutdown(session->socket, SHUT_RDWR);
+    } else if (session != NULL) {
+      closeSession(session);
+    }
+  }
+  freeDeadSessions();
+  CHECK(jvmti->RawMonitorEnter(shell.lock));
+  shell.stopping = true;
+  CHECK(jvmti->RawMonitorNotifyAll(shell.lock));
+  CHECK(jvmti->RawMonitorExit(shell.lock));
 
   enterAgentMonitor(jvmti); {
-    closeShellSession();
+    if (gdata->shellSocket != -1) {
+      close(gdata->shellSocket);
+      gdata->shellSocket = -1;
+    }
   } exitAgentMonitor(jvmti);
 }
+
+
+void closeShellServer() {
+  shell.stopping = true;
+  if (gdata->shellSocket != -1) {
+    shutdown(gdata->shellSocket, SHUT_RDWR);
+  }
+  wakeEventLoop();
+}
@@ -0,0 +1,335 @@
+/*
+ * snapshot.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "base.h"
+#include "classes.h"
+#include "dominators.h"
+#include "heapgraph.h"
+#include "memory.h"
+#include "perf.h"
+#include "progress.h"
+#include "snapshot.h"
+
+
+/* The snapshot.  Class indexes in the graph are registry slots, which can be reused once a class is
+ * unloaded, so the generation of each slot is kept to tell. */
+static struct {
+  HeapGraph *graph;
+  jint classCount;
+  jint *generations;
+  jlong takenMillis;
+} snapshot;
+
+
+/* One histogram row. */
+typedef struct {
+  jlong space;
+  jlong count;
+  jlong retained;
+  jint index;
+} SnapshotClass;
+
+
+/* Native memory the graph holds. */
+static jlong snapshotBytes(const HeapGraph *graph) {
+  return graph->nodeCount * (jlong) (sizeof(jlong) + sizeof(jint) + sizeof(jlong)) +
+      graph->edgeCount * (jlong) (sizeof(jint) + (graph->edgeLabel != NULL ? sizeof(jlong) : 0));
+}
+
+
+/* Returns the class in a registry slot if it is still the one the snapshot saw, or NULL. */
+static ClassDetails *snapshotClass(jint index) {
+  if (index < 0 || index >= snapshot.classCount) {
+    return NULL;
+  }
+  ClassDetails *d = getClassDetails(index);
+  return !d->unloaded && d->generation == snapshot.generations[index] ? d : NULL;
+}
+
+
+static bool haveSnapshot(Output *out) {
+  if (snapshot.graph == NULL) {
+    out->printf("No snapshot.  Take one with: snapshot [fields]\n");
+    return false;
+  }
+  out->printf("Snapshot of %d objects taken %ld seconds ago.\n\n", (int) snapshot.graph->nodeCount - 1,
+      (long) ((monotonicMillis() - snapshot.takenMillis) / 1000));
+  return true;
+}
+
+
+/* Finds a class of the snapshot by signature, or says why not. */
+static ClassDetails *findSnapshotClass(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, Output *out) {
+  ClassDetails *d = findClass(jvmti, jni, signature);
+  if (d == NULL || snapshotClass(d->index) == NULL) {
+    out->printf("No class found with signature in the snapshot: '%s'\n", signature);
+    return NULL;
+  }
+  return d;
+}
+
+
+/* Computes the retained size of every class of the snapshot.  Returns false if there was not
+ * enough native memory. */
+static bool computeSnapshotRetainedSizes(jlong *classRetained) {
+  const HeapGraph *graph = snapshot.graph;
+  DominatorTree tree;
+  {
+    PerfTimer timer(PERF_DOMINATORS);
+    if (!computeDominatorTree(graph, &tree)) {
+      return false;
+    }
+  }
+
+  PerfTimer timer(PERF_RETAINED_SIZES);
+  jlong *retained = (jlong *) malloc(sizeof(jlong) * graph->nodeCount);
+  if (retained == NULL) {
+    return false;
+  }
+  computeRetainedSizes(graph, &tree, retained);
+  bool ok = computeClassRetainedSizes(graph, &tree, retained, snapshot.classCount, classRetained);
+  free(retained);
+  return ok;
+}
+
+
+void takeSnapshot(jvmtiEnv *jvmti, JNIEnv *jni, ThreadSuspension *threads, bool fields, Output *out) {
+  if (gdata->vmDeathCalled || gdata->dumpInProgress) {
+    return;
+  }
+
+  gdata->dumpInProgress = JNI_TRUE;
+
+  /* The old snapshot goes first, so it does not count against the new one. */
+  delete snapshot.graph;
+  free(snapshot.generations);
+  snapshot.graph = NULL;
+  snapshot.generations = NULL;
+
+  registerLoadedClasses(jvmti, jni);
+  jint classCount = getClassCount();
+  HeapGraph *graph = new HeapGraph();
+  HeapGraphBuilder builder(fields);
+  builder.memoryLimit = (jlong) gdata->snapshotLimitMb * 1024 * 1024;
+  jint *generations = (jint *) malloc(sizeof(jint) * (classCount ? classCount : 1));
+
+  bool walked = generations != NULL && walkLiveHeapGraph(jvmti, classCount, &builder);
+  if (walked) {
+    /* Taken before the threads run again, so a class unloaded from here on is seen as such. */
+    for (jint i = 0; i < classCount; i++) {
+      generations[i] = getClassDetails(i)->generation;
+    }
+  }
+
+  /* Packing the graph sorts every reference, and needs the heap no more. */
+  threads->resume();
+  if (walked) {
+    setHeapWalkPhase("packing the object graph");
+  }
+
+  if (!walked || !builder.build(graph)) {
+    if (builder.overLimit) {
+      out->printf("The snapshot would take more than %d MB.  Start the agent with snapshot=MB to allow more.\n",
+          gdata->snapshotLimitMb);
+    } else if (!heapWalkCancelled()) {
+      out->printf("Not enough native memory for the snapshot.\n");
+    }
+    delete graph;
+    free(generations);
+
+  } else {
+    snapshot.graph = graph;
+    snapshot.classCount = classCount;
+    snapshot.generations = generations;
+    snapshot.takenMillis = monotonicMillis();
+    out->printf("Captured %d objects and %ld references in %ld MB%s.\n", (int) graph->nodeCount - 1,
+        (long) graph->edgeCount, (long) (snapshotBytes(graph) >> 20), fields ? ", with fields" : "");
+  }
+
+  gdata->dumpInProgress = JNI_FALSE;
+}
+
+
+void dropSnapshot(Output *out) {
+  if (snapshot.graph != NULL) {
+    out->printf("Dropped the snapshot of %d objects.\n", (int) snapshot.graph->nodeCount - 1);
+  }
+  delete snapshot.graph;
+  free(snapshot.generations);
+  snapshot.graph = NULL;
+  snapshot.generations = NULL;
+}
+
+
+static int compareSnapshotClasses(const void *p1, const void *p2) {
+  const SnapshotClass *a = (const SnapshotClass *) p1;
+  const SnapshotClass *b = (const SnapshotClass *) p2;
+  return a->space > b->space ? -1 : a->space < b->space;
+}
+
+
+void printSnapshotHistogram(Output *out) {
+  if (!haveSnapshot(out)) {
+    return;
+  }
+
+  const HeapGraph *graph = snapshot.graph;
+  jint classCount = snapshot.classCount;
+  SnapshotClass *classes = (SnapshotClass *) scratchAllocate(sizeof(SnapshotClass) * (classCount ? classCount : 1));
+  jlong *classRetained = (jlong *) scratchAllocate(sizeof(jlong) * (classCount ? classCount : 1));
+  if (classes == NULL || classRetained == NULL) {
+    printOmitted(out, "Snapshot histogram");
+    scratchFree(classes);
+    scratchFree(classRetained);
+    return;
+  }
+  memset(classes, 0, sizeof(SnapshotClass) * classCount);
+
+  for (jint v = HEAP_GRAPH_ROOT + 1; v < graph->nodeCount; v++) {
+    jint k = graph->classIndex[v];
+    if (k >= 0) {
+      classes[k].count++;
+      classes[k].space += graph->size[v];
+    }
+  }
+  bool haveRetained = computeSnapshotRetainedSizes(classRetained);
+
+  jint sortedCount = 0;
+  for (jint i = 0; i < classCount; i++) {
+    if (classes[i].count > 0) {
+      classes[sortedCount] = classes[i];
+      classes[sortedCount].index = i;
+      classes[sortedCount].retained = haveRetained ? classRetained[i] : 0;
+      sortedCount++;
+    }
+  }
+  {
+    PerfTimer timer(PERF_SORT);
+    qsort(classes, sortedCount, sizeof(SnapshotClass), compareSnapshotClasses);
+  }
+
+  PerfTimer timer(PERF_FORMAT);
+  if (!haveRetained) {
+    out->printf("Not enough native memory to compute retained sizes.\n\n");
+  }
+  static const char *const columns[] = { "space", "count", "retained", "class" };
+  out->setColumnNames(columns);
+  out->printf("Space      Count      Retained   Class Signature\n");
+  out->printf("---------- ---------- ---------- ----------------------\n");
+  for (jint i = 0; i < sortedCount; i++) {
+    ClassDetails *d = snapshotClass(classes[i].index);
+    long values[] = { (long) classes[i].space, (long) classes[i].count, (long) classes[i].retained };
+    out->printColumns(values, 3, 10, d != NULL ? d->signature : "<unloaded class>");
+  }
+  out->printf("---------- ---------- ---------- ----------------------\n\n");
+  out->flush();
+
+  scratchFree(classes);
+  scratchFree(classRetained);
+}
+
+
+void printSnapshotStats(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, Output *out) {
+  if (!haveSnapshot(out)) {
+    return;
+  }
+  ClassDetails *d = findSnapshotClass(jvmti, jni, signature, out);
+  if (d == NULL) {
+    return;
+  }
+
+  const HeapGraph *graph = snapshot.graph;
+  jlong count = 0, space = 0;
+  for (jint v = HEAP_GRAPH_ROOT + 1; v < graph->nodeCount; v++) {
+    if (graph->classIndex[v] == d->index) {
+      count++;
+      space += graph->size[v];
+    }
+  }
+  char text[256];
+  int len = snprintf(text, sizeof(text), "Count: %ld\nSpace: %ld\n", (long) count, (long) space);
+  RecordField fields[] = {
+    { "count", (long) count, NULL },
+    { "space", (long) space, NULL },
+    { NULL, 0, NULL },
+    { NULL, 0, NULL },
+  };
+
+  jint classCount = snapshot.classCount;
+  jlong *classRetained = (jlong *) scratchAllocate(sizeof(jlong) * (classCount ? classCount : 1));
+  jint *classSlot = (jint *) scratchAllocate(sizeof(jint) * (classCount ? classCount : 1));
+  if (classRetained == NULL || classSlot == NULL) {
+    snprintf(text + len, sizeof(text) - len, "Retained: not enough native memory\nReachable: not enough native memory\n");
+    out->printRecord("stats", fields, sizeof(fields) / sizeof(fields[0]), text);
+    scratchFree(classRetained);
+    scratchFree(classSlot);
+    return;
+  }
+
+  if (computeSnapshotRetainedSizes(classRetained)) {
+    fields[2].name = "retained";
+    fields[2].value = (long) classRetained[d->index];
+    len += snprintf(text + len, sizeof(text) - len, "Retained: %ld\n", fields[2].value);
+  } else {
+    len += snprintf(text + len, sizeof(text) - len, "Retained: not enough native memory\n");
+  }
+
+  for (jint i = 0; i < classCount; i++) {
+    classSlot[i] = i == d->index ? 0 : -1;
+  }
+  jlong reachable;
+  PerfTimer timer(PERF_REACHABLE_SIZES);
+  if (computeReachableSizes(graph, classSlot, classCount, 1, &reachable)) {
+    fields[3].name = "reachable";
+    fields[3].value = (long) reachable;
+    snprintf(text + len, sizeof(text) - len, "Reachable: %ld\n", fields[3].value);
+  } else {
+    snprintf(text + len, sizeof(text) - len, "Reachable: not enough native memory\n");
+  }
+  out->printRecord("stats", fields, sizeof(fields) / sizeof(fields[0]), text);
+
+  scratchFree(classRetained);
+  scratchFree(classSlot);
+}
+
+
+void printSnapshotReferrers(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, jint depth, Output *out) {
+  if (!haveSnapshot(out)) {
+    return;
+  }
+  ClassDetails *d = findSnapshotClass(jvmti, jni, signature, out);
+  if (d != NULL && !printReferrerFields(jvmti, jni, out, snapshot.graph, snapshot.classCount, d, depth)) {
+    out->printf("Not enough native memory to find referrers.\n");
+  }
+}
+
+
+void printSnapshotPaths(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, jint count, Output *out) {
+  if (!haveSnapshot(out)) {
+    return;
+  }
+  ClassDetails *d = findSnapshotClass(jvmti, jni, signature, out);
+  if (d != NULL && !printInstancePaths(jvmti, jni, out, snapshot.graph, snapshot.classCount, d, count, true)) {
+    out->printf("Not enough native memory to find paths from the GC roots.\n");
+  }
+}
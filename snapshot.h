@@ -0,0 +1,63 @@
+/*
+ * snapshot.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_SNAPSHOT_H
+#define POLARBEAR_SNAPSHOT_H
+
+
+#include "jni.h"
+#include "jvmti.h"
+
+#include "io.h"
+#include "threads.h"
+
+
+/* Native memory a snapshot may take while it is captured, in megabytes, unless set with
+ * snapshot=MB. */
+#define SNAPSHOT_LIMIT_MB 1024
+
+
+/* Captures the object graph of the live heap into the snapshot, replacing the one before, so
+ * later queries need no heap walk and no suspended threads.  With fields it also keeps how each
+ * reference is held, at 8 more bytes a reference, so referrers and paths can name fields.  Refuses
+ * a snapshot that would take more than gdata->snapshotLimitMb.  The caller must hold the agent
+ * monitor with the other threads suspended by threads, which are resumed as soon as the walk is
+ * done, before the graph is packed. */
+void takeSnapshot(jvmtiEnv *jvmti, JNIEnv *jni, ThreadSuspension *threads, bool fields, Output *out);
+
+/* Frees the snapshot. */
+void dropSnapshot(Output *out);
+
+
+/* The queries below answer from the snapshot, and only run on the shell's heap worker, which
+ * takes and drops it. */
+
+/* Prints a histogram with retained sizes. */
+void printSnapshotHistogram(Output *out);
+
+/* Prints the count, space, retained and reachable size of a class. */
+void printSnapshotStats(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, Output *out);
+
+/* As the referrers command. */
+void printSnapshotReferrers(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, jint depth, Output *out);
+
+/* As the path command. */
+void printSnapshotPaths(jvmtiEnv *jvmti, JNIEnv *jni, const char *signature, jint count, Output *out);
+
+
+#endif
@@ -0,0 +1,439 @@
+/*
+ * summary.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "arena.h"
+#include "base.h"
+#include "classes.h"
+#include "io.h"
+#include "memory.h"
+#include "perf.h"
+#include "progress.h"
+#include "summary.h"
+#include "summaryformat.h"
+#include "symbols.h"
+
+
+#define STRING_CHUNK_SIZE (256 * 1024)
+#define MAX_STRING_CHUNKS 4096
+/* The header and strings section come first, then up to 64 buffers for the other sections. */
+#define SUMMARY_FRONT_IOVECS (8 + MAX_STRING_CHUNKS)
+#define MAX_SUMMARY_IOVECS (SUMMARY_FRONT_IOVECS + 64)
+
+
+static const char padding[8] = { 0 };
+
+
+/* Strings of the summary.  Characters are kept in chunks that are written out as they are. */
+typedef struct {
+  uint32_t *offsets;
+  jint count;
+  jint capacity;
+  char *chunks[MAX_STRING_CHUNKS];
+  size_t chunkUsed[MAX_STRING_CHUNKS];
+  jint chunkCount;
+  size_t chunkCapacity;
+} StringTable;
+
+
+/* Everything a summary is written from. */
+typedef struct {
+  StringTable strings;
+
+  /* Distinct frames, found through an open addressed table keyed by method and location. */
+  jvmtiFrameInfo *frameKeys;
+  uint32_t *framePrefix;
+  int32_t *frameLine;
+  jint frameCount;
+  jint *frameTable;
+  jint frameTableCapacity;
+
+  /* Prefix string of each method seen, keyed the same way by method alone. */
+  jmethodID *methodKeys;
+  uint32_t *methodPrefix;
+  jint *methodTable;
+
+  struct iovec *iov;
+  int iovCount;
+} SummaryBuilder;
+
+
+static jint tableCapacityFor(jint count) {
+  jint capacity = 16;
+  while (capacity < count * 2) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+
+static unsigned int hashPointer(const void *p) {
+  uint64_t x = (uint64_t)(uintptr_t) p;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return (unsigned int) x;
+}
+
+
+/* Adds a string.  Returns its index, or -1 when out of memory. */
+static jint addString(StringTable *strings, const char *text) {
+  size_t len = strlen(text) + 1;
+  jint chunk = strings->chunkCount - 1;
+  if (chunk < 0 || strings->chunkUsed[chunk] + len > STRING_CHUNK_SIZE) {
+    if (strings->chunkCount == MAX_STRING_CHUNKS || len > STRING_CHUNK_SIZE) {
+      return -1;
+    }
+    chunk = strings->chunkCount;
+    strings->chunks[chunk] = (char *) scratchAllocate(STRING_CHUNK_SIZE);
+    if (strings->chunks[chunk] == NULL) {
+      return -1;
+    }
+    strings->chunkUsed[chunk] = 0;
+    strings->chunkCount++;
+  }
+  if (strings->count == strings->capacity) {
+    return -1;
+  }
+
+  memcpy(strings->chunks[chunk] + strings->chunkUsed[chunk], text, len);
+  strings->chunkUsed[chunk] += len;
+  strings->offsets[strings->count + 1] = strings->offsets[strings->count] + len;
+  return strings->count++;
+}
+
+
+/* Returns the id of a frame, adding it to the frame table the first time it is seen, or -1 when
+ * out of memory. */
+static jint addFrame(jvmtiEnv *jvmti, SummaryBuilder *builder, jvmtiFrameInfo frame) {
+  jint mask = builder->frameTableCapacity - 1;
+
+  jint slot = (hashPointer(frame.method) ^ (unsigned int) frame.location) & mask;
+  while (builder->frameTable[slot] != -1) {
+    jvmtiFrameInfo *key = &builder->frameKeys[builder->frameTable[slot]];
+    if (key->method == frame.method && key->location == frame.location) {
+      return builder->frameTable[slot];
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  char text[MAX_FRAME_TEXT];
+  jint line = describeFrame(jvmti, frame, text, sizeof(text));
+
+  jint methodSlot = hashPointer(frame.method) & mask;
+  while (builder->methodTable[methodSlot] != -1 && builder->methodKeys[builder->methodTable[methodSlot]] != frame.method) {
+    methodSlot = (methodSlot + 1) & mask;
+  }
+  jint id = builder->frameCount;
+  if (builder->methodTable[methodSlot] == -1) {
+    jint prefix = addString(&builder->strings, text);
+    if (prefix < 0) {
+      return -1;
+    }
+    builder->methodTable[methodSlot] = id;
+    builder->methodKeys[id] = frame.method;
+    builder->methodPrefix[id] = prefix;
+  }
+
+  builder->frameKeys[id] = frame;
+  builder->framePrefix[id] = builder->methodPrefix[builder->methodTable[methodSlot]];
+  builder->frameLine[id] = line;
+  builder->frameTable[slot] = id;
+  builder->frameCount++;
+  return id;
+}
+
+
+/* Appends a buffer to the output, padded to the alignment of the format, and returns its padded
+ * length. */
+static uint64_t addColumn(SummaryBuilder *builder, const void *data, uint64_t length) {
+  if (length > 0) {
+    builder->iov[builder->iovCount].iov_base = (void *) data;
+    builder->iov[builder->iovCount].iov_len = length;
+    builder->iovCount++;
+  }
+  if (summaryAlign(length) != length) {
+    builder->iov[builder->iovCount].iov_base = (void *) padding;
+    builder->iov[builder->iovCount].iov_len = summaryAlign(length) - length;
+    builder->iovCount++;
+  }
+  return summaryAlign(length);
+}
+
+
+/* Starts a section.  Its length is filled in by the caller as the columns are added. */
+static SummarySection *addSection(SummaryBuilder *builder, uint32_t type, uint32_t count) {
+  SummarySection *section = (SummarySection *) scratchAllocate(sizeof(SummarySection));
+  if (section != NULL) {
+    section->type = type;
+    section->count = count;
+    section->length = 0;
+    addColumn(builder, section, sizeof(SummarySection));
+  }
+  return section;
+}
+
+
+/* Allocates the tables for up to frameCount frames and stringCount strings. */
+static bool initBuilder(SummaryBuilder *builder, jint frameCount, jint stringCount) {
+  memset(builder, 0, sizeof(SummaryBuilder));
+
+  builder->strings.capacity = stringCount;
+  builder->strings.offsets = (uint32_t *) scratchAllocate(sizeof(uint32_t) * (stringCount + 1));
+  builder->frameTableCapacity = tableCapacityFor(frameCount);
+  builder->frameKeys = (jvmtiFrameInfo *) scratchAllocate(sizeof(jvmtiFrameInfo) * (frameCount + 1));
+  builder->framePrefix = (uint32_t *) scratchAllocate(sizeof(uint32_t) * (frameCount + 1));
+  builder->frameLine = (int32_t *) scratchAllocate(sizeof(int32_t) * (frameCount + 1));
+  builder->frameTable = (jint *) scratchAllocate(sizeof(jint) * builder->frameTableCapacity);
+  builder->methodKeys = (jmethodID *) scratchAllocate(sizeof(jmethodID) * (frameCount + 1));
+  builder->methodPrefix = (uint32_t *) scratchAllocate(sizeof(uint32_t) * (frameCount + 1));
+  builder->methodTable = (jint *) scratchAllocate(sizeof(jint) * builder->frameTableCapacity);
+  builder->iov = (struct iovec *) scratchAllocate(sizeof(struct iovec) * MAX_SUMMARY_IOVECS);
+  if (builder->strings.offsets == NULL || builder->frameKeys == NULL || builder->framePrefix == NULL ||
+      builder->frameLine == NULL || builder->frameTable == NULL || builder->methodKeys == NULL ||
+      builder->methodPrefix == NULL || builder->methodTable == NULL || builder->iov == NULL) {
+    return false;
+  }
+
+  builder->strings.offsets[0] = 0;
+  memset(builder->frameTable, -1, sizeof(jint) * builder->frameTableCapacity);
+  memset(builder->methodTable, -1, sizeof(jint) * builder->frameTableCapacity);
+  return true;
+}
+
+
+/* Gathers the class, referrer, frame and thread sections.  The strings section goes first in the
+ * file, so its place is left empty here and filled by the caller. */
+static bool buildSections(jvmtiEnv *jvmti, JNIEnv *jni, SummaryBuilder *builder, Histogram *histogram,
+    jvmtiStackInfo *stacks, jint threadCount, jthread current) {
+  jint n = histogram->sortedCount;
+
+  /* Classes. */
+  uint32_t *className = (uint32_t *) scratchAllocate(sizeof(uint32_t) * (n + 1));
+  int64_t *objects = (int64_t *) scratchAllocate(sizeof(int64_t) * (n + 1));
+  int64_t *space = (int64_t *) scratchAllocate(sizeof(int64_t) * (n + 1));
+  int64_t *retained = (int64_t *) scratchAllocate(sizeof(int64_t) * (n + 1));
+  int64_t *reachable = (int64_t *) scratchAllocate(sizeof(int64_t) * (n + 1));
+  if (className == NULL || objects == NULL || space == NULL || retained == NULL || reachable == NULL) {
+    return false;
+  }
+  for (jint i = 0; i < n; i++) {
+    ClassDetails *d = histogram->sorted[i];
+    jint name = addString(&builder->strings, d->signature);
+    if (name < 0) {
+      return false;
+    }
+    className[i] = name;
+    objects[i] = d->count;
+    space[i] = d->space;
+    retained[i] = d->retained;
+    reachable[i] = d->reachable;
+  }
+
+  /* Referrers of the largest class. */
+  jint referrerCount = 0;
+  uint32_t *level = (uint32_t *) scratchAllocate(sizeof(uint32_t) * (REFER_DEPTH * n + 1));
+  uint32_t *referrer = (uint32_t *) scratchAllocate(sizeof(uint32_t) * (REFER_DEPTH * n + 1));
+  int64_t *referrerObjects = (int64_t *) scratchAllocate(sizeof(int64_t) * (REFER_DEPTH * n + 1));
+  if (level == NULL || referrer == NULL || referrerObjects == NULL) {
+    return false;
+  }
+  /* Without memory to count them the referrer section is left empty. */
+  if (n > 0 && computeReferrers(jvmti, histogram->sorted[0])) {
+    if (heapWalkCancelled()) {
+      return false;
+    }
+    for (int l = 0; l < REFER_DEPTH; l++) {
+      for (jint i = 0; i < n; i++) {
+        ClassDetails *d = histogram->sorted[i];
+        if (d->referLevelCount[l]) {
+          level[referrerCount] = l + 1;
+          referrer[referrerCount] = i;
+          referrerObjects[referrerCount] = d->referLevelCount[l];
+          referrerCount++;
+          d->referLevelCount[l] = 0;
+        }
+      }
+    }
+  }
+
+  /* Threads, with their frames interned in the frame table. */
+  jint frameTotal = 0;
+  for (jint t = 0; t < threadCount; t++) {
+    frameTotal += stacks[t].frame_count;
+  }
+  uint32_t *threadName = (uint32_t *) scratchAllocate(sizeof(uint32_t) * (threadCount + 1));
+  int32_t *threadState = (int32_t *) scratchAllocate(sizeof(int32_t) * (threadCount + 1));
+  uint32_t *threadFlags = (uint32_t *) scratchAllocate(sizeof(uint32_t) * (threadCount + 1));
+  uint32_t *frameStart = (uint32_t *) scratchAllocate(sizeof(uint32_t) * (threadCount + 1));
+  uint32_t *frames = (uint32_t *) scratchAllocate(sizeof(uint32_t) * (frameTotal + 1));
+  if (threadName == NULL || threadState == NULL || threadFlags == NULL || frameStart == NULL || frames == NULL) {
+    return false;
+  }
+  frameStart[0] = 0;
+  for (jint t = 0; t < threadCount; t++) {
+    jvmtiThreadInfo threadInfo;
+    CHECK(jvmti->GetThreadInfo(stacks[t].thread, &threadInfo));
+    jint name = addString(&builder->strings, threadInfo.name);
+    deallocate(jvmti, threadInfo.name);
+    if (name < 0) {
+      return false;
+    }
+    threadName[t] = name;
+    threadState[t] = stacks[t].state;
+    threadFlags[t] = stacks[t].thread == current || jni->IsSameObject(stacks[t].thread, current)
+        ? SUMMARY_THREAD_OOM_THROWER : 0;
+
+    uint32_t next = frameStart[t];
+    for (jint f = 0; f < stacks[t].frame_count; f++) {
+      jint id = addFrame(jvmti, builder, stacks[t].frame_buffer[f]);
+      if (id < 0) {
+        return false;
+      }
+      frames[next++] = id;
+    }
+    frameStart[t + 1] = next;
+  }
+
+  SummarySection *section = addSection(builder, SUMMARY_CLASSES, n);
+  if (section == NULL) {
+    return false;
+  }
+  section->length += addColumn(builder, className, sizeof(uint32_t) * n);
+  section->length += addColumn(builder, objects, sizeof(int64_t) * n);
+  section->length += addColumn(builder, space, sizeof(int64_t) * n);
+  section->length += addColumn(builder, retained, sizeof(int64_t) * n);
+  section->length += addColumn(builder, reachable, sizeof(int64_t) * n);
+
+  section = addSection(builder, SUMMARY_REFERRERS, referrerCount);
+  if (section == NULL) {
+    return false;
+  }
+  section->length += addColumn(builder, level, sizeof(uint32_t) * referrerCount);
+  section->length += addColumn(builder, referrer, sizeof(uint32_t) * referrerCount);
+  section->length += addColumn(builder, referrerObjects, sizeof(int64_t) * referrerCount);
+
+  section = addSection(builder, SUMMARY_FRAMES, builder->frameCount);
+  if (section == NULL) {
+    return false;
+  }
+  section->length += addColumn(builder, builder->framePrefix, sizeof(uint32_t) * builder->frameCount);
+  section->length += addColumn(builder, builder->frameLine, sizeof(int32_t) * builder->frameCount);
+
+  section = addSection(builder, SUMMARY_THREADS, threadCount);
+  if (section == NULL) {
+    return false;
+  }
+  section->length += addColumn(builder, threadName, sizeof(uint32_t) * threadCount);
+  section->length += addColumn(builder, threadState, sizeof(int32_t) * threadCount);
+  section->length += addColumn(builder, threadFlags, sizeof(uint32_t) * threadCount);
+  section->length += addColumn(builder, frameStart, sizeof(uint32_t) * (threadCount + 1));
+  section->length += addColumn(builder, frames, sizeof(uint32_t) * frameStart[threadCount]);
+  return true;
+}
+
+
+bool writeHeapSummary(jvmtiEnv *jvmti, JNIEnv *jni, int fd, jthread current, jint depth) {
+  if (gdata->vmDeathCalled || gdata->dumpInProgress) {
+    return false;
+  }
+  gdata->dumpInProgress = JNI_TRUE;
+  PerfTimer timer(PERF_HEAP_SUMMARY);
+
+  Histogram histogram;
+  bool counted = computeHistogram(jvmti, jni, &histogram);
+
+  jvmtiStackInfo *stacks;
+  jint threadCount;
+  CHECK(jvmti->GetAllStackTraces(depth, &stacks, &threadCount));
+
+  jint frameTotal = 0;
+  for (jint t = 0; t < threadCount; t++) {
+    frameTotal += stacks[t].frame_count;
+  }
+
+  /* The strings section comes first, ahead of the sections that refer to it, but is only complete
+   * once they are built, so its header and columns are spliced in front afterwards. */
+  SummaryBuilder builder;
+  bool ok = counted && !heapWalkCancelled() && initBuilder(&builder, frameTotal, histogram.sortedCount + threadCount + frameTotal);
+  SummaryHeader *header = ok ? (SummaryHeader *) scratchAllocate(sizeof(SummaryHeader)) : NULL;
+  const int reserved = SUMMARY_FRONT_IOVECS;
+  if (header != NULL) {
+    builder.iovCount = reserved;
+    ok = buildSections(jvmti, jni, &builder, &histogram, stacks, threadCount, current);
+  } else {
+    ok = false;
+  }
+
+  if (ok) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    memset(header, 0, sizeof(SummaryHeader));
+    memcpy(header->magic, SUMMARY_MAGIC, sizeof(header->magic));
+    header->version = SUMMARY_VERSION;
+    header->byteOrder = SUMMARY_BYTE_ORDER;
+    header->timestamp = (int64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+    header->sectionCount = 5;
+    header->flags = (histogram.haveGraphSizes ? SUMMARY_HAS_RETAINED_SIZES : 0) |
+        (gdata->emergencyDump ? SUMMARY_OUT_OF_MEMORY : 0);
+    header->totalObjects = gdata->totalCount;
+
+    /* Build the front of the file in its own list, then move it into the reserved slots. */
+    struct iovec *sections = builder.iov;
+    int sectionsEnd = builder.iovCount;
+    builder.iov = (struct iovec *) scratchAllocate(sizeof(struct iovec) * reserved);
+    builder.iovCount = 0;
+    SummarySection *strings = NULL;
+    if (builder.iov != NULL) {
+      addColumn(&builder, header, sizeof(SummaryHeader));
+      strings = addSection(&builder, SUMMARY_STRINGS, builder.strings.count);
+    }
+    if (strings != NULL) {
+      uint64_t chars = builder.strings.offsets[builder.strings.count];
+      strings->length += addColumn(&builder, builder.strings.offsets, sizeof(uint32_t) * (builder.strings.count + 1));
+      for (jint c = 0; c < builder.strings.chunkCount; c++) {
+        builder.iov[builder.iovCount].iov_base = builder.strings.chunks[c];
+        builder.iov[builder.iovCount].iov_len = builder.strings.chunkUsed[c];
+        builder.iovCount++;
+      }
+      if (summaryAlign(chars) != chars) {
+        builder.iov[builder.iovCount].iov_base = (void *) padding;
+        builder.iov[builder.iovCount].iov_len = summaryAlign(chars) - chars;
+        builder.iovCount++;
+      }
+      strings->length += summaryAlign(chars);
+
+      int front = builder.iovCount;
+      memcpy(sections + reserved - front, builder.iov, sizeof(struct iovec) * front);
+      ok = writeFully(fd, sections + reserved - front, sectionsEnd - (reserved - front));
+    } else {
+      ok = false;
+    }
+  }
+
+  /* this one Deallocate call frees all data allocated by GetAllStackTraces */
+  deallocate(jvmti, stacks);
+  scratchFree(histogram.sorted);
+
+  gdata->dumpInProgress = JNI_FALSE;
+  return ok;
+}
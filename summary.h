@@ -0,0 +1,34 @@
+/*
+ * summary.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_SUMMARY_H
+#define POLARBEAR_SUMMARY_H
+
+
+#include "jni.h"
+#include "jvmti.h"
+
+
+/* Writes a binary heap summary to fd: the histogram, the referrers of the largest class and up to
+ * depth frames of every thread, in the format of summaryformat.h.  Everything is gathered in
+ * scratch memory first and written with one writev, so it must be called inside an ArenaScope.
+ * Returns false if the summary could not be gathered or written. */
+bool writeHeapSummary(jvmtiEnv *jvmti, JNIEnv *jni, int fd, jthread current, jint depth);
+
+
+#endif
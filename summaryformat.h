@@ -0,0 +1,90 @@
+/*
+ * summaryformat.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_SUMMARYFORMAT_H
+#define POLARBEAR_SUMMARYFORMAT_H
+
+
+#include <stdint.h>
+
+
+/* Layout of a binary heap summary, shared by the agent and the pbdecode tool.
+ *
+ * A summary is a SummaryHeader followed by sections.  Each section is a SummarySection followed by
+ * length bytes of payload, padded to a multiple of 8.  Payloads are columnar: every column of a
+ * table is stored whole before the next, each column starting 8 byte aligned.  Integers are in the
+ * byte order of the machine that wrote the file, which byteOrder records.  Strings are referred to
+ * by their index in the strings section.
+ *
+ *   SUMMARY_STRINGS    count strings:  uint32 offset[count + 1], then the characters, each string
+ *                      NUL terminated.  String i runs from offset[i] to offset[i + 1] - 1.
+ *   SUMMARY_CLASSES    count classes, largest space first:  uint32 name[count], int64 objects[count],
+ *                      int64 space[count], int64 retained[count], int64 reachable[count].
+ *   SUMMARY_REFERRERS  count rows:  uint32 level[count], uint32 referrer[count] (class row),
+ *                      int64 objects[count].  The referred class is class row 0.
+ *   SUMMARY_FRAMES     count distinct frames:  uint32 prefix[count] ("pkg.Class.method(File"),
+ *                      int32 line[count], 0 when unknown.
+ *   SUMMARY_THREADS    count threads:  uint32 name[count], int32 state[count] (JVMTI thread state),
+ *                      uint32 flags[count], uint32 frameStart[count + 1], then uint32 frame[] with
+ *                      the frames of thread i, innermost first, at frameStart[i] to frameStart[i + 1].
+ */
+
+#define SUMMARY_MAGIC "PBSUMMRY"
+#define SUMMARY_VERSION 1
+#define SUMMARY_BYTE_ORDER 0x01020304
+
+/* SummaryHeader flags. */
+#define SUMMARY_HAS_RETAINED_SIZES 0x1
+#define SUMMARY_OUT_OF_MEMORY 0x2
+
+/* Section types. */
+#define SUMMARY_STRINGS 1
+#define SUMMARY_CLASSES 2
+#define SUMMARY_REFERRERS 3
+#define SUMMARY_FRAMES 4
+#define SUMMARY_THREADS 5
+
+/* Thread flags. */
+#define SUMMARY_THREAD_OOM_THROWER 0x1
+
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  int64_t timestamp;
+  uint32_t sectionCount;
+  uint32_t flags;
+  int64_t totalObjects;
+} SummaryHeader;
+
+
+typedef struct {
+  uint32_t type;
+  uint32_t count;
+  uint64_t length;
+} SummarySection;
+
+
+/* Rounds a payload or column length up to the 8 byte alignment of the format. */
+static inline uint64_t summaryAlign(uint64_t length) {
+  return (length + 7) & ~(uint64_t) 7;
+}
+
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * symbols.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base.h"
+#include "classes.h"
+#include "symbols.h"
+
+
+#define INITIAL_SYMBOL_CAPACITY 4096
+
+
+/* What a thread dump prints for a method: the "pkg.Class.method(File.java" prefix of a frame and
+ * the method's line table, sorted by location. */
+typedef struct {
+  jmethodID method;
+  ClassDetails *owner;
+  jint ownerGeneration;
+
+  char *prefix;
+  jint lineCount;
+  jlocation *starts;
+  jint *lines;
+} MethodSymbol;
+
+
+/* Open addressed table of symbols keyed by jmethodID.  Symbols are freed when their class is
+ * unloaded, so they are only used while holding the cache lock. */
+static struct {
+  jrawMonitorID lock;
+  MethodSymbol **slots;
+  jint capacity;
+  jint count;
+} cache;
+
+
+static unsigned int hashMethod(jmethodID method) {
+  uint64_t x = (uint64_t)(uintptr_t) method;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return (unsigned int) x;
+}
+
+
+/* Returns true if the class the symbol was built from is still loaded. */
+static bool isCurrent(const MethodSymbol *symbol) {
+  return !symbol->owner->unloaded && symbol->owner->generation == symbol->ownerGeneration;
+}
+
+
+/* Returns the slot holding method, or the empty slot where it belongs. */
+static MethodSymbol **findSlot(MethodSymbol **slots, jint capacity, jmethodID method) {
+  jint i = hashMethod(method) & (capacity - 1);
+  while (slots[i] != NULL && slots[i]->method != method) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &slots[i];
+}
+
+
+/* Rebuilds the table with room to spare, dropping symbols of unloaded classes. */
+static bool growCache() {
+  jint live = 0;
+  for (jint i = 0; i < cache.capacity; i++) {
+    if (cache.slots[i] != NULL && isCurrent(cache.slots[i])) {
+      live++;
+    }
+  }
+  jint capacity = INITIAL_SYMBOL_CAPACITY;
+  while (capacity <= live * 4) {
+    capacity *= 2;
+  }
+
+  MethodSymbol **slots = (MethodSymbol **) calloc(sizeof(MethodSymbol *), capacity);
+  if (slots == NULL) {
+    return false;
+  }
+  for (jint i = 0; i < cache.capacity; i++) {
+    MethodSymbol *symbol = cache.slots[i];
+    if (symbol != NULL) {
+      if (isCurrent(symbol)) {
+        *findSlot(slots, capacity, symbol->method) = symbol;
+      } else {
+        free(symbol);
+      }
+    }
+  }
+
+  free(cache.slots);
+  cache.slots = slots;
+  cache.capacity = capacity;
+  cache.count = live;
+  return true;
+}
+
+
+/* Sorts the line table by location.  Tables come from the class file and are nearly always in
+ * order already, so insertion sort is enough.  It is stable, so ties resolve as a linear scan
+ * would. */
+static void sortLines(jlocation *starts, jint *lines, jint count) {
+  for (jint i = 1; i < count; i++) {
+    jlocation start = starts[i];
+    jint line = lines[i];
+    jint j = i;
+    while (j > 0 && starts[j - 1] > start) {
+      starts[j] = starts[j - 1];
+      lines[j] = lines[j - 1];
+      j--;
+    }
+    starts[j] = start;
+    lines[j] = line;
+  }
+}
+
+
+/* Appends text to buffer, keeping it terminated and within size. */
+static void appendText(char *buffer, size_t size, size_t *used, const char *text, bool rewriteSeparators) {
+  for (; *text && *used + 1 < size; text++) {
+    buffer[(*used)++] = rewriteSeparators && (*text == '/' || *text == ';') ? '.' : *text;
+  }
+  buffer[*used] = 0;
+}
+
+
+/* Appends the "pkg.Class.method(File.java" prefix of a frame, given the class signature without
+ * its leading 'L'.  A NULL fileName is printed as Unknown. */
+static void appendFramePrefix(char *buffer, size_t size, size_t *used,
+    const char *className, const char *methodName, const char *fileName) {
+  appendText(buffer, size, used, className, true);
+  appendText(buffer, size, used, methodName, false);
+  appendText(buffer, size, used, "(", false);
+  appendText(buffer, size, used, fileName ? fileName : "Unknown", false);
+}
+
+
+/* Builds the symbol for a method of the given class in one malloc'd block. */
+static MethodSymbol *buildSymbol(jvmtiEnv *jvmti, jmethodID method, jclass declaringClass, ClassDetails *owner) {
+  jvmtiError err;
+  char *methodName, *fileName;
+  jint locationCount = 0;
+  jvmtiLineNumberEntry *locationTable = NULL;
+
+  CHECK(jvmti->GetMethodName(method, &methodName, NULL, NULL));
+  err = jvmti->GetSourceFileName(declaringClass, &fileName);
+  if (err == JVMTI_ERROR_NATIVE_METHOD || err == JVMTI_ERROR_ABSENT_INFORMATION) {
+    fileName = NULL;
+  } else {
+    CHECK(err);
+  }
+  err = jvmti->GetLineNumberTable(method, &locationCount, &locationTable);
+  if (err == JVMTI_ERROR_NATIVE_METHOD || err == JVMTI_ERROR_ABSENT_INFORMATION) {
+    locationCount = 0;
+    locationTable = NULL;
+  } else {
+    CHECK(err);
+  }
+
+  const char *className = owner->signature + 1;
+  size_t prefixSize = strlen(className) + strlen(methodName) + strlen(fileName ? fileName : "Unknown") + 2;
+  size_t size = sizeof(MethodSymbol) + (sizeof(jlocation) + sizeof(jint)) * locationCount + prefixSize;
+  MethodSymbol *symbol = (MethodSymbol *) malloc(size);
+  if (symbol != NULL) {
+    symbol->method = method;
+    symbol->owner = owner;
+    symbol->ownerGeneration = owner->generation;
+    symbol->lineCount = locationCount;
+    symbol->starts = (jlocation *) (symbol + 1);
+    symbol->lines = (jint *) (symbol->starts + locationCount);
+    symbol->prefix = (char *) (symbol->lines + locationCount);
+
+    for (jint i = 0; i < locationCount; i++) {
+      symbol->starts[i] = locationTable[i].start_location;
+      symbol->lines[i] = locationTable[i].line_number;
+    }
+    sortLines(symbol->starts, symbol->lines, locationCount);
+
+    size_t used = 0;
+    appendFramePrefix(symbol->prefix, prefixSize, &used, className, methodName, fileName);
+  }
+
+  deallocate(jvmti, methodName);
+  if (fileName != NULL) {
+    deallocate(jvmti, fileName);
+  }
+  if (locationTable != NULL) {
+    deallocate(jvmti, locationTable);
+  }
+  return symbol;
+}
+
+
+void initSymbolCache(jvmtiEnv *jvmti) {
+  CHECK(jvmti->CreateRawMonitor("symbol cache", &cache.lock));
+}
+
+
+/* Returns the cached symbol for a method, building it on the first call and again after its class
+ * is unloaded.  Returns NULL if the symbol cannot be cached, which is always the case in the out
+ * of memory dump.  Must hold the cache lock. */
+static const MethodSymbol *getMethodSymbol(jvmtiEnv *jvmti, jmethodID method) {
+  if (cache.slots != NULL) {
+    MethodSymbol *symbol = *findSlot(cache.slots, cache.capacity, method);
+    if (symbol != NULL && isCurrent(symbol)) {
+      return symbol;
+    }
+  }
+
+  /* Filling the cache allocates, which the out of memory dump must not do. */
+  if (gdata->emergencyDump) {
+    return NULL;
+  }
+
+  jclass declaringClass;
+  jlong tag;
+  CHECK(jvmti->GetMethodDeclaringClass(method, &declaringClass));
+  CHECK(jvmti->GetTag(declaringClass, &tag));
+  if (!isClassDetailsTag(tag)) {
+    return NULL;
+  }
+  ClassDetails *owner = (ClassDetails *)(void *)(ptrdiff_t) tag;
+
+  if ((cache.count + 1) * 2 > cache.capacity && !growCache()) {
+    return NULL;
+  }
+  MethodSymbol *symbol = buildSymbol(jvmti, method, declaringClass, owner);
+  if (symbol == NULL) {
+    return NULL;
+  }
+
+  MethodSymbol **slot = findSlot(cache.slots, cache.capacity, method);
+  if (*slot != NULL) {
+    free(*slot);
+  } else {
+    cache.count++;
+  }
+  *slot = symbol;
+  return symbol;
+}
+
+
+/* Returns the line number of a location in the method, or 0 if unknown. */
+static jint getLineNumber(const MethodSymbol *symbol, jlocation location) {
+  /* Find the last entry starting at or before the location. */
+  jint lo = 0, hi = symbol->lineCount;
+  while (lo < hi) {
+    jint mid = (lo + hi) >> 1;
+    if (symbol->starts[mid] <= location) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo > 0 ? symbol->lines[lo - 1] : 0;
+}
+
+
+jint describeFrame(jvmtiEnv *jvmti, jvmtiFrameInfo frame, char *buffer, size_t size) {
+  size_t used = 0;
+  CHECK(jvmti->RawMonitorEnter(cache.lock));
+  const MethodSymbol *symbol = getMethodSymbol(jvmti, frame.method);
+  if (symbol != NULL) {
+    appendText(buffer, size, &used, symbol->prefix, false);
+    jint lineNumber = getLineNumber(symbol, frame.location);
+    CHECK(jvmti->RawMonitorExit(cache.lock));
+    return lineNumber;
+  }
+  CHECK(jvmti->RawMonitorExit(cache.lock));
+
+  jvmtiError err;
+  char *methodName, *className, *fileName;
+  jclass declaringClass;
+  jint locationCount;
+  jvmtiLineNumberEntry *locationTable;
+  jint lineNumber = 0;
+
+  CHECK(jvmti->GetMethodName(frame.method, &methodName, NULL, NULL));
+  CHECK(jvmti->GetMethodDeclaringClass(frame.method, &declaringClass));
+  CHECK(jvmti->GetClassSignature(declaringClass, &className, NULL));
+  err = jvmti->GetSourceFileName(declaringClass, &fileName);
+  if (err == JVMTI_ERROR_NATIVE_METHOD || err == JVMTI_ERROR_ABSENT_INFORMATION) {
+    fileName = NULL;
+  } else {
+    CHECK(err);
+  }
+  err = jvmti->GetLineNumberTable(frame.method, &locationCount, &locationTable);
+  if (err != JVMTI_ERROR_NATIVE_METHOD && err != JVMTI_ERROR_ABSENT_INFORMATION) {
+    CHECK(err);
+    for (jint li = 0; li < locationCount; li++) {
+      if (locationTable[li].start_location > frame.location) {
+        break;
+      }
+      lineNumber = locationTable[li].line_number;
+    }
+    deallocate(jvmti, locationTable);
+  }
+
+  appendFramePrefix(buffer, size, &used, className + 1, methodName, fileName);
+
+  deallocate(jvmti, methodName);
+  deallocate(jvmti, className);
+  if (fileName != NULL) {
+    deallocate(jvmti, fileName);
+  }
+  return lineNumber;
+}
@@ -0,0 +1,43 @@
+/*
+ * symbols.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_SYMBOLS_H
+#define POLARBEAR_SYMBOLS_H
+
+
+#include "jni.h"
+#include "jvmti.h"
+
+#include "classes.h"
+
+
+/* Longest frame description callers need to make room for. */
+#define MAX_FRAME_TEXT 1024
+
+
+/* Sets up the method symbol cache.  Called from Agent_OnLoad. */
+void initSymbolCache(jvmtiEnv *jvmti);
+
+
+/* Writes the "pkg.Class.method(File.java" prefix of a frame into buffer, cut to fit size, and
+ * returns its line number or 0.  Uses the cache when it can and asks JVMTI otherwise, so it works
+ * in the out of memory dump.  Safe to call from several threads at once. */
+jint describeFrame(jvmtiEnv *jvmti, jvmtiFrameInfo frame, char *buffer, size_t size);
+
+
+#endif
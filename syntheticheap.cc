@@ -0,0 +1,157 @@
+/*
+ * syntheticheap.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "syntheticheap.h"
+
+
+/* Share of objects referred to directly by a GC root, as one in ROOT_SHARE. */
+#define ROOT_SHARE 64
+
+
+SyntheticHeapSource::SyntheticHeapSource() : marks(0) {
+}
+
+
+SyntheticHeapSource::~SyntheticHeapSource() {
+  free(this->marks);
+}
+
+
+bool SyntheticHeapSource::build(HeapGraphBuilder *builder) {
+  jint nodeCount = builder->nodeCount;
+  if (!builder->build(&this->graph)) {
+    return false;
+  }
+  free(this->marks);
+  this->marks = (jlong *) calloc(nodeCount, sizeof(jlong));
+  return this->marks != NULL;
+}
+
+
+bool SyntheticHeapSource::iterateObjects(HeapVisitor *visitor, jint classIndex, bool markedOnly) {
+  for (jint v = HEAP_GRAPH_ROOT + 1; v < this->graph.nodeCount; v++) {
+    if ((classIndex >= 0 && this->graph.classIndex[v] != classIndex) || (markedOnly && this->marks[v] == 0)) {
+      continue;
+    }
+    if (!visitor->object(this->graph.classIndex[v], this->graph.size[v], &this->marks[v])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool SyntheticHeapSource::followReferences(HeapVisitor *visitor) {
+  const HeapGraph *g = &this->graph;
+  jint *queue = (jint *) malloc(sizeof(jint) * g->nodeCount);
+  char *seen = (char *) calloc(g->nodeCount, 1);
+  if (queue == NULL || seen == NULL) {
+    free(queue);
+    free(seen);
+    return false;
+  }
+
+  bool ok = true;
+  jint head = 0, tail = 0;
+  queue[tail++] = HEAP_GRAPH_ROOT;
+  seen[HEAP_GRAPH_ROOT] = 1;
+  while (ok && head < tail) {
+    jint u = queue[head++];
+    jlong *referrerMark = u == HEAP_GRAPH_ROOT ? NULL : &this->marks[u];
+    for (jlong e = g->edgeStart[u]; ok && e < g->edgeStart[u + 1]; e++) {
+      jint w = g->edges[e];
+      HeapReference ref = { HEAP_REFERENCE_OTHER, 0, -1 };
+      if (g->edgeLabel != NULL) {
+        unpackHeapReference(g->edgeLabel[e], &ref);
+      }
+      ok = visitor->reference(g->classIndex[w], g->size[w], &this->marks[w], g->classIndex[u], referrerMark, &ref);
+      if (!seen[w]) {
+        seen[w] = 1;
+        queue[tail++] = w;
+      }
+    }
+  }
+
+  free(queue);
+  free(seen);
+  return ok;
+}
+
+
+void SyntheticHeapSource::clearMarks() {
+  memset(this->marks, 0, sizeof(jlong) * this->graph.nodeCount);
+}
+
+
+/* xorshift32: small, fast and the same everywhere. */
+static inline unsigned int nextRandom(unsigned int *state) {
+  unsigned int x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+
+/* Labels a reference held in the given slot of an object: an element if the object stands for an
+ * array, otherwise one of a few fields. */
+static jlong syntheticLabel(HeapGraphBuilder *builder, jint from, jint slot) {
+  HeapReference ref = { HEAP_REFERENCE_ROOT_OTHER, 0, -1 };
+  if (from != HEAP_GRAPH_ROOT) {
+    ref.kind = builder->classIndex[from] % 16 == 15 ? HEAP_REFERENCE_ARRAY_ELEMENT : HEAP_REFERENCE_FIELD;
+    ref.index = slot % 4;
+  }
+  return packHeapReference(&ref);
+}
+
+
+bool generateHeap(HeapGraphBuilder *builder, jint objectCount, jint classCount, jint degree, unsigned int seed) {
+  unsigned int state = seed ? seed : 1;
+
+  for (jint i = 0; i < objectCount; i++) {
+    /* The smaller of two draws, so class k is about twice as common as class 2k. */
+    jint a = nextRandom(&state) % classCount;
+    jint b = nextRandom(&state) % classCount;
+    jint classIndex = a < b ? a : b;
+    jlong size = 16 + 8 * (classIndex % 8);
+    if (classIndex % 16 == 15) {
+      /* Some classes stand for arrays, with sizes to match. */
+      size += 8 * (nextRandom(&state) % 1024);
+    }
+    if (builder->addNode(size, classIndex) < 0) {
+      return false;
+    }
+  }
+
+  for (jint v = HEAP_GRAPH_ROOT + 1; v <= objectCount; v++) {
+    /* Each object is held by an earlier one, or by a root, so all are reachable. */
+    jint parent = v == 1 || nextRandom(&state) % ROOT_SHARE == 0 ? HEAP_GRAPH_ROOT : 1 + nextRandom(&state) % (v - 1);
+    if (!builder->addEdge(parent, v, syntheticLabel(builder, parent, v))) {
+      return false;
+    }
+    for (jint e = 1; e < degree; e++) {
+      if (!builder->addEdge(v, 1 + nextRandom(&state) % objectCount, syntheticLabel(builder, v, e))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
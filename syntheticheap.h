@@ -0,0 +1,61 @@
+/*
+ * syntheticheap.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_SYNTHETIC_HEAP_H
+#define POLARBEAR_SYNTHETIC_HEAP_H
+
+
+#include "jni.h"
+
+#include "heapgraph.h"
+#include "heapsource.h"
+
+
+/* A heap held in memory as a HeapGraph, for running the analyses without a JVM.  Node
+ * HEAP_GRAPH_ROOT stands for the GC roots; every other node is an object.  References are followed
+ * breadth first from the roots, and each reachable object's references are reported once, as
+ * FollowReferences does. */
+class SyntheticHeapSource : public HeapSource {
+  private:
+    jlong *marks;
+
+  public:
+    HeapGraph graph;
+
+    SyntheticHeapSource();
+    virtual ~SyntheticHeapSource();
+
+    /* Takes over the nodes and edges of a builder.  Returns false if memory ran out. */
+    bool build(HeapGraphBuilder *builder);
+
+    virtual bool iterateObjects(HeapVisitor *visitor, jint classIndex, bool markedOnly);
+    virtual bool followReferences(HeapVisitor *visitor);
+    virtual void clearMarks();
+};
+
+
+/* Fills a builder with a pseudo-random heap that is the same for the same arguments.  Every object
+ * hangs off a spanning tree from the roots, so all are reachable, and has degree - 1
+ * more references to random objects.  Class indexes are skewed, so low classes have many more
+ * instances, as on a real heap.  Every sixteenth class stands for an array, and a labelled builder
+ * gets references labelled as elements of those and as fields of the rest.  Returns false if
+ * memory ran out. */
+bool generateHeap(HeapGraphBuilder *builder, jint objectCount, jint classCount, jint degree, unsigned int seed);
+
+
+#endif
@@ -38,135 +38,277 @@
  * nuclear facility.
  */
 
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "agentthread.h"
+#include "arena.h"
 #include "base.h"
+#include "perf.h"
+#include "symbols.h"
 #include "threads.h"
 
 
-/* Prints a thread frame. */
-static void JNICALL printFrame(jvmtiEnv* jvmti, jvmtiFrameInfo frame, Output *out) {
-  jvmtiError err;
-  char *methodName, *className, *cleanClassName;
-  char *fileName;
-  int si, li, lineNumber;
-  jclass declaringClass;
-  jint locationCount;
-  jvmtiLineNumberEntry* locationTable;
-
-  CHECK(jvmti->GetMethodName(frame.method, &methodName, NULL, NULL));
-  CHECK(jvmti->GetMethodDeclaringClass(frame.method, &declaringClass));
-  CHECK(jvmti->GetClassSignature(declaringClass, &className, NULL));
-  err = jvmti->GetSourceFileName(declaringClass, &fileName);
-  if (err == JVMTI_ERROR_NATIVE_METHOD || err == JVMTI_ERROR_ABSENT_INFORMATION) {
-    fileName = strdup("Unknown");
+/* Number of threads whose stacks are fetched at once by an ungrouped thread dump. */
+#define THREAD_DUMP_BATCH_SIZE 64
 
-  } else {
-    char *temp;
 
-    CHECK(err);
-    temp = strdup(fileName);
-    deallocate(jvmti, fileName);
-    fileName = temp;
-  }
-  err = jvmti->GetLineNumberTable(frame.method, &locationCount, &locationTable);
-  if (err == JVMTI_ERROR_NATIVE_METHOD || err == JVMTI_ERROR_ABSENT_INFORMATION) {
-    lineNumber = 0;
+/* Prints a thread frame. */
+static void JNICALL printFrame(jvmtiEnv* jvmti, jvmtiFrameInfo frame, Output *out) {
+  char text[MAX_FRAME_TEXT];
+  jint lineNumber = describeFrame(jvmti, frame, text, sizeof(text));
+  char line[MAX_FRAME_TEXT + 32];
+  if (lineNumber) {
+    snprintf(line, sizeof(line), "\tat %s:%d)\n", text, lineNumber);
   } else {
-    CHECK(err);
-    lineNumber = 0;
-    for (li = 0; li < locationCount; li++) {
-      if (locationTable[li].start_location > frame.location) {
-        break;
-      }
-      lineNumber = locationTable[li].line_number;
-    }
-    deallocate(jvmti, locationTable);
+    snprintf(line, sizeof(line), "\tat %s)\n", text);
   }
 
-  cleanClassName = strdup(className + 1);
-  si = 0;
-  while (cleanClassName[si]) {
-    if (cleanClassName[si] == '/') {
-      cleanClassName[si] = '.';
-    } else if (cleanClassName[si] == ';') {
-      cleanClassName[si] = '.';
-    }
-    si++;
+  /* The described frame is "method(file"; a record has the two apart. */
+  char *paren = strchr(text, '(');
+  if (paren != NULL) {
+    *paren = '\0';
   }
+  RecordField fields[] = {
+    { "method", 0, text },
+    { paren != NULL ? "file" : NULL, 0, paren != NULL ? paren + 1 : NULL },
+    { lineNumber ? "line" : NULL, lineNumber, NULL },
+  };
+  out->printRecord("frame", fields, sizeof(fields) / sizeof(fields[0]), line);
+}
 
-  if (lineNumber) {
-    out->printf( "\tat %s%s(%s:%d)\n", cleanClassName, methodName, fileName, lineNumber);
+
+/* Prints the header of a thread dump. */
+static void printDumpHeader(Output *out, jint threadCount, jint stackCount) {
+  char text[128];
+  if (stackCount >= 0) {
+    snprintf(text, sizeof(text), "Dumping thread state for %d threads, %d distinct stacks\n\n", threadCount, stackCount);
   } else {
-    out->printf( "\tat %s%s(%s)\n", cleanClassName, methodName, fileName);
+    snprintf(text, sizeof(text), "Dumping thread state for %d threads\n\n", threadCount);
   }
-  deallocate(jvmti, methodName);
-  deallocate(jvmti, className);
-  free(fileName);
-  free(cleanClassName);
+  RecordField fields[] = {
+    { "threads", threadCount, NULL },
+    { stackCount >= 0 ? "stacks" : NULL, stackCount, NULL },
+  };
+  out->printRecord("threadDump", fields, sizeof(fields) / sizeof(fields[0]), text);
 }
 
 
-/* Prints a thread dump. */
-void JNICALL printThreadDump(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, jthread current) {
-  jvmtiStackInfo *stack_info;
-  jint thread_count;
-  int ti;
-  jvmtiError err;
+/* Prints one thread and its stack. */
+static void printThread(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, int number, jvmtiStackInfo *infop, jthread current) {
   jvmtiThreadInfo threadInfo;
 
+  jvmti->GetThreadInfo(infop->thread, &threadInfo);
+  bool thrower = infop->thread == current || jni->IsSameObject(infop->thread, current);
+  char text[512];
+  snprintf(text, sizeof(text), "#%d - %s - %s%s\n", number, threadInfo.name, threadStateName(infop->state),
+      thrower ? " - [OOM thrower]" : "");
+  RecordField fields[] = {
+    { "number", number, NULL },
+    { "name", 0, threadInfo.name },
+    { "state", 0, threadStateName(infop->state) },
+    { "oomThrower", thrower, NULL },
+  };
+  out->printRecord("thread", fields, sizeof(fields) / sizeof(fields[0]), text);
+  deallocate(jvmti, threadInfo.name);
+
+  for (int fi = 0; fi < infop->frame_count; fi++) {
+    printFrame(jvmti, infop->frame_buffer[fi], out);
+  }
   out->printf( "\n");
-  CHECK(jvmti->GetAllStackTraces(150, &stack_info, &thread_count));
-  out->printf( "Dumping thread state for %d threads\n\n", thread_count);
-  for (ti = 0; ti < thread_count; ++ti) {
+}
+
+
+/* Hash of what makes two threads print the same: their state and their frames. */
+static unsigned int hashStack(const jvmtiStackInfo *infop) {
+  unsigned int hash = 2166136261u ^ (unsigned int) infop->frame_count;
+  hash = (hash ^ (unsigned int) (ptrdiff_t) threadStateName(infop->state)) * 16777619u;
+  for (jint fi = 0; fi < infop->frame_count; fi++) {
+    hash = (hash ^ (unsigned int) (ptrdiff_t) infop->frame_buffer[fi].method) * 16777619u;
+    hash = (hash ^ (unsigned int) infop->frame_buffer[fi].location) * 16777619u;
+  }
+  return hash;
+}
+
+
+static bool sameStack(const jvmtiStackInfo *a, const jvmtiStackInfo *b) {
+  if (a->frame_count != b->frame_count || threadStateName(a->state) != threadStateName(b->state)) {
+    return false;
+  }
+  for (jint fi = 0; fi < a->frame_count; fi++) {
+    if (a->frame_buffer[fi].method != b->frame_buffer[fi].method ||
+        a->frame_buffer[fi].location != b->frame_buffer[fi].location) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+/* A set of threads with identical stacks, linked through the next array. */
+typedef struct {
+  jint first;
+  jint last;
+  jint count;
+} StackGroup;
+
+
+/* Comparison function for two StackGroups - used to sort the most common stacks first. */
+static int compareGroups(const void *p1, const void *p2) {
+  const StackGroup *g1 = (const StackGroup *) p1, *g2 = (const StackGroup *) p2;
+  return g1->count != g2->count ? g2->count - g1->count : g1->first - g2->first;
+}
+
+
+/* Prints the threads grouped by stack, each distinct stack once.  The current thread is printed
+ * on its own first, so the thread that ran out of memory stands out.  Returns false, having
+ * printed nothing, if there was not enough memory to group them. */
+static bool printGroupedThreads(
+    jvmtiEnv *jvmti, JNIEnv *jni, Output *out, jvmtiStackInfo *stack_info, jint thread_count, jthread current) {
+  jint capacity = 16;
+  while (capacity < thread_count * 2) {
+    capacity *= 2;
+  }
+  jint *table = (jint *) scratchAllocate(sizeof(jint) * capacity);
+  jint *next = (jint *) scratchAllocate(sizeof(jint) * (thread_count ? thread_count : 1));
+  StackGroup *groups = (StackGroup *) scratchAllocate(sizeof(StackGroup) * (thread_count ? thread_count : 1));
+  if (table == NULL || next == NULL || groups == NULL) {
+    scratchFree(table);
+    scratchFree(next);
+    scratchFree(groups);
+    return false;
+  }
+  memset(table, -1, sizeof(jint) * capacity);
+
+  jint groupCount = 0;
+  jint thrower = -1;
+  for (jint ti = 0; ti < thread_count; ti++) {
     jvmtiStackInfo *infop = &stack_info[ti];
-    jthread thread = infop->thread;
-    jint state = infop->state;
-    jvmtiFrameInfo *frames = infop->frame_buffer;
-    int fi;
-    const char *threadState;
-
-    if (state & JVMTI_THREAD_STATE_SUSPENDED) {
-      threadState = "SUSPENDED";
-    } else if (state & JVMTI_THREAD_STATE_INTERRUPTED) {
-      threadState = "INTERRUPTED";
-    } else if (state & JVMTI_THREAD_STATE_IN_NATIVE) {
-      threadState = "NATIVE";
-    } else if (state & JVMTI_THREAD_STATE_RUNNABLE) {
-      threadState = "RUNNABLE";
-    } else if (state & JVMTI_THREAD_STATE_BLOCKED_ON_MONITOR_ENTER) {
-      threadState = "BLOCKED";
-    } else if (state & JVMTI_THREAD_STATE_IN_OBJECT_WAIT) {
-      threadState = "WAITING";
-    } else if (state & JVMTI_THREAD_STATE_PARKED) {
-      threadState = "PARKED";
-    } else if (state & JVMTI_THREAD_STATE_SLEEPING) {
-      threadState = "SLEEPING";
+    if (current != NULL && thrower == -1 && (infop->thread == current || jni->IsSameObject(infop->thread, current))) {
+      thrower = ti;
+      continue;
+    }
+
+    /* The table maps a stack to its group. */
+    jint slot = hashStack(infop) & (capacity - 1);
+    while (table[slot] != -1 && !sameStack(&stack_info[groups[table[slot]].first], infop)) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    next[ti] = -1;
+    if (table[slot] == -1) {
+      table[slot] = groupCount;
+      groups[groupCount].first = groups[groupCount].last = ti;
+      groups[groupCount].count = 1;
+      groupCount++;
     } else {
-      threadState = "UNKNOWN";
+      StackGroup *group = &groups[table[slot]];
+      next[group->last] = ti;
+      group->last = ti;
+      group->count++;
     }
+  }
+  qsort(groups, groupCount, sizeof(StackGroup), &compareGroups);
+
+  printDumpHeader(out, thread_count, groupCount + (thrower != -1));
+
+  if (thrower != -1) {
+    printThread(jvmti, jni, out, thrower + 1, &stack_info[thrower], current);
+  }
 
-    jvmti->GetThreadInfo(thread, &threadInfo);
-    out->printf( "#%d - %s - %s", ti + 1, threadInfo.name, threadState);
-    if (thread == current || jni->IsSameObject(thread, current)) {
-      out->printf( " - [OOM thrower]");
+  for (jint g = 0; g < groupCount; g++) {
+    jvmtiStackInfo *infop = &stack_info[groups[g].first];
+    char text[512];
+    snprintf(text, sizeof(text), "%d %s - %s\n\t", groups[g].count, groups[g].count == 1 ? "thread" : "threads",
+        threadStateName(infop->state));
+    RecordField stack[] = {
+      { "threads", groups[g].count, NULL },
+      { "state", 0, threadStateName(infop->state) },
+    };
+    out->printRecord("stack", stack, sizeof(stack) / sizeof(stack[0]), text);
+
+    /* Each thread of the stack is a record with only its name, and the frames follow. */
+    for (jint ti = groups[g].first; ti != -1; ti = next[ti]) {
+      jvmtiThreadInfo threadInfo;
+      jvmti->GetThreadInfo(stack_info[ti].thread, &threadInfo);
+      snprintf(text, sizeof(text), ti == groups[g].first ? "%s" : ", %s", threadInfo.name);
+      RecordField name[] = { { "name", 0, threadInfo.name } };
+      out->printRecord("thread", name, 1, text);
+      deallocate(jvmti, threadInfo.name);
     }
     out->printf( "\n");
-    deallocate(jvmti, threadInfo.name);
 
-    for (fi = 0; fi < infop->frame_count; fi++) {
-      printFrame(jvmti, frames[fi], out);
+    for (jint fi = 0; fi < infop->frame_count; fi++) {
+      printFrame(jvmti, infop->frame_buffer[fi], out);
     }
     out->printf( "\n");
   }
+
+  scratchFree(table);
+  scratchFree(next);
+  scratchFree(groups);
+  return true;
+}
+
+
+/* Prints threads a batch at a time, so only one batch of stacks is held at once and output starts
+ * before every stack has been captured.  Threads that start after the dump begins are not shown. */
+static void printThreadsInBatches(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, jthread current, jint depth) {
+  jthread *threads;
+  jint thread_count;
+
+  CHECK(jvmti->GetAllThreads(&thread_count, &threads));
+  printDumpHeader(out, thread_count, -1);
+
+  for (jint start = 0; start < thread_count; start += THREAD_DUMP_BATCH_SIZE) {
+    jint batch = thread_count - start < THREAD_DUMP_BATCH_SIZE ? thread_count - start : THREAD_DUMP_BATCH_SIZE;
+    jvmtiStackInfo *stack_info;
+
+    CHECK(jvmti->GetThreadListStackTraces(batch, threads + start, depth, &stack_info));
+    for (jint ti = 0; ti < batch; ti++) {
+      printThread(jvmti, jni, out, start + ti + 1, &stack_info[ti], current);
+    }
+    /* this one Deallocate call frees all data allocated by GetThreadListStackTraces */
+    deallocate(jvmti, stack_info);
+    out->flush();
+  }
+
+  for (jint ti = 0; ti < thread_count; ti++) {
+    jni->DeleteLocalRef(threads[ti]);
+  }
+  deallocate(jvmti, threads);
+}
+
+
+/* Prints a thread dump. */
+void JNICALL printThreadDump(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, jthread current, bool grouped, jint depth) {
+  PerfTimer timer(PERF_THREAD_DUMP);
+  out->printf( "\n");
+  if (grouped) {
+    /* Grouping needs every stack at once. */
+    jvmtiStackInfo *stack_info;
+    jint thread_count;
+
+    CHECK(jvmti->GetAllStackTraces(depth, &stack_info, &thread_count));
+    if (!printGroupedThreads(jvmti, jni, out, stack_info, thread_count, current)) {
+      printOmitted(out, "Thread grouping");
+      printDumpHeader(out, thread_count, -1);
+      for (jint ti = 0; ti < thread_count; ti++) {
+        printThread(jvmti, jni, out, ti + 1, &stack_info[ti], current);
+      }
+    }
+    /* this one Deallocate call frees all data allocated by GetAllStackTraces */
+    deallocate(jvmti, stack_info);
+  } else {
+    printThreadsInBatches(jvmti, jni, out, current, depth);
+  }
   out->printf( "\n\n");
-  /* this one Deallocate call frees all data allocated by GetAllStackTraces */
-  deallocate(jvmti, stack_info);
 }
 
 
 ThreadSuspension::ThreadSuspension(jvmtiEnv *_jvmti, JNIEnv *jni) : jvmti(_jvmti) {
+  PerfTimer timer(PERF_SUSPEND_THREADS);
   CHECK(_jvmti->GetCurrentThread(&this->current));
 
   jint threadCount;
@@ -174,27 +316,45 @@ ThreadSuspension::ThreadSuspension(jvmtiEnv *_jvmti, JNIEnv *jni) : jvmti(_jvmti
 
   int j = 0;
   for (int i = 0; i < threadCount; i++) {
-    if (!jni->IsSameObject(this->threads[i], this->current)) {
+    if (!jni->IsSameObject(this->threads[i], this->current) && !isAgentThread(jni, this->threads[i])) {
       this->threads[j] = this->threads[i];
       j++;
     }
   }
 
-  this->errors = (jvmtiError *)calloc(sizeof(jvmtiError), j);
-  CHECK(_jvmti->SuspendThreadList(j, threads, this->errors));
-  this->changedCount = j;
+  this->errors = (jvmtiError *)scratchAllocate(sizeof(jvmtiError) * (j ? j : 1));
+  if (this->errors != NULL) {
+    memset(this->errors, 0, sizeof(jvmtiError) * j);
+    CHECK(_jvmti->SuspendThreadList(j, threads, this->errors));
+    this->changedCount = j;
+    return;
+  }
+
+  /* Without room for the error list, suspend one at a time and keep only the threads that were
+   * suspended, so resume() has nothing to look up. */
+  int suspended = 0;
+  for (int i = 0; i < j; i++) {
+    if (_jvmti->SuspendThread(this->threads[i]) == JVMTI_ERROR_NONE) {
+      jthread thread = this->threads[i];
+      this->threads[i] = this->threads[suspended];
+      this->threads[suspended] = thread;
+      suspended++;
+    }
+  }
+  this->changedCount = suspended;
 }
 
 
 void ThreadSuspension::resume() {
   int j;
   if (this->threads) {
+    PerfTimer timer(PERF_RESUME_THREADS);
     for (int i = 0; i < this->changedCount; i++) {
-      if (!this->errors[i]) {
+      if (this->errors == NULL || !this->errors[i]) {
         CHECK(this->jvmti->ResumeThread(threads[i]));
       }
     }
-    free(this->errors);
+    scratchFree(this->errors);
     deallocate(this->jvmti, this->threads);
     this->threads = 0;
   }
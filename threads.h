@@ -47,7 +47,37 @@
 
 #include "io.h"
 
-void JNICALL printThreadDump(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, jthread current);
+/* Default number of frames printed per thread. */
+#define THREAD_DUMP_DEPTH 150
+
+
+/* Returns the name of the most interesting bit of a thread state. */
+static inline const char *threadStateName(jint state) {
+  if (state & JVMTI_THREAD_STATE_SUSPENDED) {
+    return "SUSPENDED";
+  } else if (state & JVMTI_THREAD_STATE_INTERRUPTED) {
+    return "INTERRUPTED";
+  } else if (state & JVMTI_THREAD_STATE_IN_NATIVE) {
+    return "NATIVE";
+  } else if (state & JVMTI_THREAD_STATE_RUNNABLE) {
+    return "RUNNABLE";
+  } else if (state & JVMTI_THREAD_STATE_BLOCKED_ON_MONITOR_ENTER) {
+    return "BLOCKED";
+  } else if (state & JVMTI_THREAD_STATE_IN_OBJECT_WAIT) {
+    return "WAITING";
+  } else if (state & JVMTI_THREAD_STATE_PARKED) {
+    return "PARKED";
+  } else if (state & JVMTI_THREAD_STATE_SLEEPING) {
+    return "SLEEPING";
+  } else {
+    return "UNKNOWN";
+  }
+}
+
+
+/* Prints up to depth frames of every thread.  If grouped, threads with identical stacks are printed
+ * together, with the stack shown once. */
+void JNICALL printThreadDump(jvmtiEnv *jvmti, JNIEnv *jni, Output *out, jthread current, bool grouped, jint depth);
 
 struct ThreadSuspension {
   jvmtiEnv* jvmti;
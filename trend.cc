@@ -0,0 +1,353 @@
+/*
+ * trend.cc
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "base.h"
+#include "classes.h"
+#include "memory.h"
+#include "trend.h"
+
+
+/* Worst case size of one class's entry in a sample: three varints. */
+#define MAX_ENTRY_SIZE 30
+
+
+/* Where the series of one registry slot stands.  A series starts at the first sample its class
+ * was seen in, and starts over when the slot is reused by another class. */
+typedef struct {
+  jint generation;
+  jlong since;
+  jlong startCount;
+  jlong startSpace;
+  jlong lastCount;
+  jlong lastSpace;
+  jint grew;
+} ClassSeries;
+
+
+/* The time series.  Only the first and last value of each series is kept in full.  Each sample in
+ * between is a record in a byte ring holding, for the classes that changed, the change since the
+ * sample before it, so a quiet class costs nothing per sample.  When the ring fills up the oldest
+ * record is folded into the start values.
+ *
+ * Samples are numbered in sequence.  The start values of a series are its values at the later of
+ * its since sample and the oldest sample kept, and grew counts the intervals after that point in
+ * which the class's space went up. */
+static struct {
+  ClassSeries *series;
+  jint seriesCapacity;
+  char *staging;
+
+  jlong sampleCount;
+  jlong oldestSeq;
+  jlong lastSeq;
+  jlong times[TREND_MAX_SAMPLES];
+
+  char *buffer;
+  size_t head;
+  size_t used;
+} trend;
+
+
+static inline unsigned long long zigzag(jlong value) {
+  return ((unsigned long long) value << 1) ^ (unsigned long long) (value >> 63);
+}
+
+
+static inline jlong unzigzag(unsigned long long value) {
+  return (jlong) (value >> 1) ^ -(jlong) (value & 1);
+}
+
+
+static char *putVarint(char *p, unsigned long long value) {
+  while (value >= 0x80) {
+    *p++ = (char) (value | 0x80);
+    value >>= 7;
+  }
+  *p++ = (char) value;
+  return p;
+}
+
+
+/* Reads a varint from the ring, advancing *pos. */
+static unsigned long long getVarint(size_t *pos) {
+  unsigned long long value = 0;
+  for (int shift = 0; ; shift += 7) {
+    unsigned char c = (unsigned char) trend.buffer[*pos];
+    *pos = (*pos + 1) % TREND_BUFFER_SIZE;
+    value |= (unsigned long long) (c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      return value;
+    }
+  }
+}
+
+
+static void ringWrite(size_t pos, const char *data, size_t len) {
+  size_t first = TREND_BUFFER_SIZE - pos < len ? TREND_BUFFER_SIZE - pos : len;
+  memcpy(trend.buffer + pos, data, first);
+  memcpy(trend.buffer, data + first, len - first);
+}
+
+
+static void ringRead(size_t pos, char *data, size_t len) {
+  size_t first = TREND_BUFFER_SIZE - pos < len ? TREND_BUFFER_SIZE - pos : len;
+  memcpy(data, trend.buffer + pos, first);
+  memcpy(data + first, trend.buffer, len - first);
+}
+
+
+/* Grows the series and staging arrays to cover classCount slots.  New slots are untracked. */
+static bool growSeries(jint classCount) {
+  if (classCount <= trend.seriesCapacity) {
+    return true;
+  }
+  jint capacity = trend.seriesCapacity ? trend.seriesCapacity : 1024;
+  while (capacity < classCount) {
+    capacity *= 2;
+  }
+
+  ClassSeries *series = (ClassSeries *) realloc(trend.series, sizeof(ClassSeries) * capacity);
+  if (series == NULL) {
+    return false;
+  }
+  trend.series = series;
+  char *staging = (char *) realloc(trend.staging, 4 + (size_t) MAX_ENTRY_SIZE * capacity);
+  if (staging == NULL) {
+    return false;
+  }
+  trend.staging = staging;
+
+  for (jint i = trend.seriesCapacity; i < capacity; i++) {
+    trend.series[i].generation = -1;
+  }
+  trend.seriesCapacity = capacity;
+  return true;
+}
+
+
+/* Drops the oldest record, folding its changes into the start values of the series it covers. */
+static void evictOldest() {
+  jlong seq = trend.oldestSeq + 1;
+  unsigned int len;
+  ringRead(trend.head, (char *) &len, 4);
+
+  size_t pos = (trend.head + 4) % TREND_BUFFER_SIZE;
+  size_t end = (trend.head + 4 + len) % TREND_BUFFER_SIZE;
+  jint index = 0;
+  while (pos != end) {
+    index += (jint) getVarint(&pos);
+    jlong countDelta = unzigzag(getVarint(&pos));
+    jlong spaceDelta = unzigzag(getVarint(&pos));
+
+    ClassSeries *s = &trend.series[index];
+    if (s->generation != -1 && seq > s->since) {
+      s->startCount += countDelta;
+      s->startSpace += spaceDelta;
+      if (spaceDelta > 0) {
+        s->grew--;
+      }
+    }
+  }
+
+  trend.head = end;
+  trend.used -= 4 + len;
+  trend.oldestSeq = seq;
+}
+
+
+/* Records the counts left in the registry by countInstances as the next sample. */
+static void takeSample(jint classCount) {
+  if (!growSeries(classCount)) {
+    return;
+  }
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  jlong seq = trend.sampleCount ? trend.lastSeq + 1 : 0;
+
+  char *p = trend.staging + 4;
+  jint previous = 0;
+  for (jint i = 0; i < classCount; i++) {
+    ClassDetails *d = getClassDetails(i);
+    ClassSeries *s = &trend.series[i];
+    if (d->klass == NULL) {
+      s->generation = -1;
+      continue;
+    }
+
+    if (s->generation != d->generation) {
+      s->generation = d->generation;
+      s->since = seq;
+      s->startCount = s->lastCount = d->count;
+      s->startSpace = s->lastSpace = d->space;
+      s->grew = 0;
+      continue;
+    }
+
+    jlong countDelta = d->count - s->lastCount;
+    jlong spaceDelta = d->space - s->lastSpace;
+    if (countDelta != 0 || spaceDelta != 0) {
+      p = putVarint(p, (unsigned long long) (i - previous));
+      p = putVarint(p, zigzag(countDelta));
+      p = putVarint(p, zigzag(spaceDelta));
+      previous = i;
+      s->lastCount = d->count;
+      s->lastSpace = d->space;
+      if (spaceDelta > 0) {
+        s->grew++;
+      }
+    }
+  }
+
+  if (seq == 0) {
+    trend.oldestSeq = 0;
+  } else {
+    unsigned int len = (unsigned int) (p - trend.staging - 4);
+    memcpy(trend.staging, &len, 4);
+    if (4 + len > TREND_BUFFER_SIZE) {
+      /* The sample does not fit at all, so start every series over from here. */
+      for (jint i = 0; i < classCount; i++) {
+        ClassSeries *s = &trend.series[i];
+        s->since = seq;
+        s->startCount = s->lastCount;
+        s->startSpace = s->lastSpace;
+        s->grew = 0;
+      }
+      trend.head = trend.used = 0;
+      trend.oldestSeq = seq;
+    } else {
+      while (seq - trend.oldestSeq + 1 > TREND_MAX_SAMPLES || trend.used + 4 + len > TREND_BUFFER_SIZE) {
+        evictOldest();
+      }
+      ringWrite((trend.head + trend.used) % TREND_BUFFER_SIZE, trend.staging, 4 + len);
+      trend.used += 4 + len;
+    }
+  }
+
+  trend.times[seq % TREND_MAX_SAMPLES] = (jlong) now.tv_sec * 1000 + now.tv_usec / 1000;
+  trend.lastSeq = seq;
+  trend.sampleCount++;
+}
+
+
+void JNICALL trendSampler(jvmtiEnv *jvmti, JNIEnv *jni, void *arg) {
+  trend.buffer = (char *) malloc(TREND_BUFFER_SIZE);
+  if (trend.buffer == NULL) {
+    fprintf(stderr, "WARNING: Unable to allocate the histogram time series.\n");
+    return;
+  }
+
+  while (!gdata->vmDeathCalled) {
+    enterAgentMonitor(jvmti); {
+      if (!gdata->vmDeathCalled && !gdata->dumpInProgress) {
+        gdata->dumpInProgress = JNI_TRUE;
+        jint classCount = countInstances(jvmti, jni);
+        if (classCount >= 0) {
+          takeSample(classCount);
+        }
+        gdata->dumpInProgress = JNI_FALSE;
+      }
+    } exitAgentMonitor(jvmti);
+
+    sleep(gdata->trendInterval);
+  }
+}
+
+
+/* A class's rank in the growth report. */
+typedef struct {
+  jint index;
+  jlong spaceRate;
+} TrendRank;
+
+
+/* Comparison function for two TrendRanks - used to sort fastest growth first. */
+static int compareRanks(const void *p1, const void *p2) {
+  jlong r1 = ((const TrendRank *) p1)->spaceRate;
+  jlong r2 = ((const TrendRank *) p2)->spaceRate;
+  return r1 < r2 ? 1 : r1 > r2 ? -1 : 0;
+}
+
+
+void printTrend(Output *out, int limit) {
+  if (gdata->trendInterval <= 0) {
+    out->printf("Histogram sampling is off.  Start the agent with trend=<seconds> to turn it on.\n\n");
+    return;
+  }
+  if (trend.sampleCount < 2) {
+    out->printf("Not enough histogram samples yet.\n\n");
+    return;
+  }
+
+  jint classCount = trend.seriesCapacity < getClassCount() ? trend.seriesCapacity : getClassCount();
+  TrendRank *ranks = (TrendRank *) scratchAllocate(sizeof(TrendRank) * (classCount ? classCount : 1));
+  if (ranks == NULL) {
+    out->printf("Not enough native memory to rank classes by growth.\n\n");
+    return;
+  }
+
+  jlong lastTime = trend.times[trend.lastSeq % TREND_MAX_SAMPLES];
+  jint rankCount = 0;
+  for (jint i = 0; i < classCount; i++) {
+    ClassDetails *d = getClassDetails(i);
+    ClassSeries *s = &trend.series[i];
+    if (s->generation != d->generation || d->unloaded || d->klass == NULL) {
+      continue;
+    }
+    jlong startSeq = s->since > trend.oldestSeq ? s->since : trend.oldestSeq;
+    jlong elapsed = lastTime - trend.times[startSeq % TREND_MAX_SAMPLES];
+    if (startSeq < trend.lastSeq && elapsed > 0 && s->lastSpace > s->startSpace) {
+      ranks[rankCount].index = i;
+      ranks[rankCount].spaceRate = (s->lastSpace - s->startSpace) * 60000 / elapsed;
+      rankCount++;
+    }
+  }
+  qsort(ranks, rankCount, sizeof(TrendRank), &compareRanks);
+
+  jlong intervals = trend.lastSeq - trend.oldestSeq;
+  jlong minutes = (lastTime - trend.times[trend.oldestSeq % TREND_MAX_SAMPLES]) / 60000;
+  out->printf("Growth per minute over the last %ld samples (%ld minutes), fastest first.\n",
+      (long) (intervals + 1), (long) minutes);
+  out->printf("Grew is the number of the %ld intervals in which the class took more space.\n\n", (long) intervals);
+
+  static const char *const columns[] = {
+      "spacePerMinute", "countPerMinute", "space", "count", "grew", "class" };
+  out->setColumnNames(columns);
+  out->printf("Space/min  Count/min  Space      Count      Grew       Class Signature\n");
+  out->printf("---------- ---------- ---------- ---------- ---------- ----------------------\n");
+  for (jint r = 0; r < rankCount && r < limit; r++) {
+    ClassSeries *s = &trend.series[ranks[r].index];
+    jlong startSeq = s->since > trend.oldestSeq ? s->since : trend.oldestSeq;
+    jlong elapsed = lastTime - trend.times[startSeq % TREND_MAX_SAMPLES];
+    long values[] = {
+        (long) ranks[r].spaceRate, (long) ((s->lastCount - s->startCount) * 60000 / elapsed),
+        (long) s->lastSpace, (long) s->lastCount, (long) s->grew };
+    out->printColumns(values, 5, 10, getClassDetails(ranks[r].index)->signature);
+  }
+  out->printf("---------- ---------- ---------- ---------- ---------- ----------------------\n\n");
+  out->flush();
+
+  scratchFree(ranks);
+}
@@ -0,0 +1,48 @@
+/*
+ * trend.h
+ *
+ * Original source is Copyright (c) 2011 The PolarBear Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLARBEAR_TREND_H
+#define POLARBEAR_TREND_H
+
+
+#include "jni.h"
+#include "jvmti.h"
+
+#include "io.h"
+
+
+/* Samples kept at most, and the space their deltas may take up. */
+#define TREND_MAX_SAMPLES 1024
+#define TREND_BUFFER_SIZE (4 * 1024 * 1024)
+
+/* Classes the out of memory log lists by growth. */
+#define TREND_OOM_CLASSES 10
+
+
+/* Agent thread that takes a histogram every gdata->trendInterval seconds and records how each
+ * class changed since the last one. */
+void JNICALL trendSampler(jvmtiEnv *jvmti, JNIEnv *jni, void *arg);
+
+
+/* Prints the limit classes whose space grew fastest over the samples kept, with their growth per
+ * minute and the number of intervals in which they grew.  Must hold the agent monitor.  Allocates
+ * only a sort array, so it is safe to call from the out of memory dump. */
+void printTrend(Output *out, int limit);
+
+
+#endif